@@ -19,13 +19,17 @@
 #define LOG_TAG "StEse-SecureElement"
 #include <android_logmsg.h>
 
+#include <atomic>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "SecureElement.h"
+#include "CommandApdu.h"
 
 extern bool ese_debug_enabled;
-static bool OpenLogicalChannelProcessing = false;
-static bool OpenBasicChannelProcessing = false;
+/* Binder threads opening a channel, the eSE must not be closed under them */
+static std::atomic<int> OpenLogicalChannelProcessing(0);
+static std::atomic<int> OpenBasicChannelProcessing(0);
 
 namespace android {
 namespace hardware {
@@ -36,7 +40,10 @@ namespace implementation {
 sp<V1_0::ISecureElementHalCallback> SecureElement::mCallbackV1_0 = nullptr;
 
 SecureElement::SecureElement()
-    : mOpenedchannelCount(0), mOpenedChannels{false, false, false, false} {}
+    : mOpenedchannelCount(0),
+      mOpenedChannels{false, false, false, false},
+      mChannelMap{0, 1, 2, 3},
+      mChannelP2{0, 0, 0, 0} {}
 
 Return<void> SecureElement::init(
     const sp<
@@ -84,34 +91,40 @@ Return<void> SecureElement::getAtr(getAtr_cb _hidl_cb) {
   return Void();
 }
 
-Return<bool> SecureElement::isCardPresent() { return true; }
+Return<bool> SecureElement::isCardPresent() { return StEse_isAlive(); }
 
 Return<void> SecureElement::transmit(const hidl_vec<uint8_t>& data,
                                      transmit_cb _hidl_cb) {
   ESESTATUS status = ESESTATUS_FAILED;
   StEse_data cmdApdu;
   StEse_data rspApdu;
+  SeHalCommand command = {this, 0, NULL};
   memset(&cmdApdu, 0x00, sizeof(StEse_data));
   memset(&rspApdu, 0x00, sizeof(StEse_data));
 
   STLOG_HAL_D("%s: Enter", __func__);
   cmdApdu.len = data.size();
   if (cmdApdu.len >= MIN_APDU_LENGTH) {
-    cmdApdu.p_data = (uint8_t*)malloc(data.size() * sizeof(uint8_t));
-    memcpy(cmdApdu.p_data, data.data(), cmdApdu.len);
-    status = StEse_Transceive(&cmdApdu, &rspApdu);
+    /* The driver only reads the command: send it from the binder buffer,
+     * unless the mapper moves its CLA to a copy */
+    cmdApdu.p_data = const_cast<uint8_t*>(data.data());
+    status = StEse_TransceiveMapped(&cmdApdu, &rspApdu, seHalMapTransmit,
+                                    &command);
   }
 
   hidl_vec<uint8_t> result;
   if (status != ESESTATUS_SUCCESS) {
     STLOG_HAL_E("%s: transmit failed!!!", __func__);
-    seHalResetSe();
+    /* Unless dropped before reaching the eSE */
+    if (status != ESESTATUS_INVALID_PARAMETER) {
+      seHalResetSe();
+    }
   } else {
-    result.resize(rspApdu.len);
-    memcpy(&result[0], rspApdu.p_data, rspApdu.len);
+    /* Lent to the callback, which writes it straight into the reply */
+    result.setToExternal(rspApdu.p_data, rspApdu.len);
   }
   _hidl_cb(result);
-  free(cmdApdu.p_data);
+  free(command.copy);
   free(rspApdu.p_data);
   return Void();
 }
@@ -119,8 +132,8 @@ Return<void> SecureElement::transmit(const hidl_vec<uint8_t>& data,
 Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid,
                                                uint8_t p2,
                                                openLogicalChannel_cb _hidl_cb) {
-  hidl_vec<uint8_t> manageChannelCommand = {0x00, 0x70, 0x00, 0x00, 0x01};
-  OpenLogicalChannelProcessing = true;
+  auto manageChannelCommand = CommandApdu_manageChannelOpen();
+  OpenLogicalChannelProcessing++;
   LogicalChannelResponse resApduBuff;
   resApduBuff.channelNumber = 0xff;
   memset(&resApduBuff, 0x00, sizeof(resApduBuff));
@@ -132,7 +145,7 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid,
     if (status != ESESTATUS_SUCCESS) {
       STLOG_HAL_E("%s: seHalInit Failed!!!", __func__);
       _hidl_cb(resApduBuff, SecureElementStatus::IOERROR);
-      OpenLogicalChannelProcessing = false;
+      OpenLogicalChannelProcessing--;
       return Void();
     }
   }
@@ -141,27 +154,35 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid,
   ESESTATUS status = ESESTATUS_FAILED;
   StEse_data cmdApdu;
   StEse_data rspApdu;
+  uint8_t seChannel = 0;
 
   memset(&cmdApdu, 0x00, sizeof(StEse_data));
   memset(&rspApdu, 0x00, sizeof(StEse_data));
 
-  cmdApdu.len = manageChannelCommand.size();
-  cmdApdu.p_data =
-      (uint8_t*)malloc(manageChannelCommand.size() * sizeof(uint8_t));
-  if (cmdApdu.p_data != NULL) {
-    memcpy(cmdApdu.p_data, manageChannelCommand.data(), cmdApdu.len);
-    status = StEse_Transceive(&cmdApdu, &rspApdu);
-  }
+  cmdApdu.len = sizeof(manageChannelCommand.bytes);
+  cmdApdu.p_data = manageChannelCommand.bytes;
+  status = StEse_Transceive(&cmdApdu, &rspApdu);
   if (status != ESESTATUS_SUCCESS) {
     /*Transceive failed*/
     sestatus = SecureElementStatus::IOERROR;
   } else if (rspApdu.p_data[rspApdu.len - 2] == 0x90 &&
              rspApdu.p_data[rspApdu.len - 1] == 0x00) {
     /*ManageChannel successful*/
-    resApduBuff.channelNumber = rspApdu.p_data[0];
-    mOpenedchannelCount++;
-    mOpenedChannels[resApduBuff.channelNumber] = true;
-    sestatus = SecureElementStatus::SUCCESS;
+    seChannel = rspApdu.p_data[0];
+    {
+      std::lock_guard<std::mutex> lock(mChannelLock);
+      resApduBuff.channelNumber = seHalAllocChannel(seChannel);
+      if (resApduBuff.channelNumber < MAX_LOGICAL_CHANNELS) {
+        mChannelMap[resApduBuff.channelNumber] = seChannel;
+        mOpenedchannelCount++;
+        mOpenedChannels[resApduBuff.channelNumber] = true;
+        sestatus = SecureElementStatus::SUCCESS;
+      }
+    }
+    if (sestatus != SecureElementStatus::SUCCESS) {
+      seHalCloseSeChannel(seChannel);
+      sestatus = SecureElementStatus::CHANNEL_NOT_AVAILABLE;
+    }
   } else if (rspApdu.p_data[rspApdu.len - 2] == 0x6A &&
              rspApdu.p_data[rspApdu.len - 1] == 0x81) {
     sestatus = SecureElementStatus::CHANNEL_NOT_AVAILABLE;
@@ -171,8 +192,6 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid,
     sestatus = SecureElementStatus::UNSUPPORTED_OPERATION;
   }
   /*Free the allocations*/
-  free(cmdApdu.p_data);
-  cmdApdu.p_data = NULL;
   free(rspApdu.p_data);
   rspApdu.p_data = NULL;
   if (sestatus != SecureElementStatus::SUCCESS) {
@@ -185,7 +204,7 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid,
     send the callback and return*/
     _hidl_cb(resApduBuff, sestatus);
     STLOG_HAL_E("%s: Exit - manage channel failed!!", __func__);
-    OpenLogicalChannelProcessing = false;
+    OpenLogicalChannelProcessing--;
     return Void();
   }
 
@@ -197,17 +216,12 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid,
   memset(&cmdApdu, 0x00, sizeof(StEse_data));
   memset(&rspApdu, 0x00, sizeof(StEse_data));
 
-  cmdApdu.len = (int32_t)(6 + aid.size());
-  cmdApdu.p_data = (uint8_t*)malloc(cmdApdu.len * sizeof(uint8_t));
-  if (cmdApdu.p_data != NULL) {
-    uint8_t xx = 0;
-    cmdApdu.p_data[xx++] = resApduBuff.channelNumber;
-    cmdApdu.p_data[xx++] = 0xA4;        // INS
-    cmdApdu.p_data[xx++] = 0x04;        // P1
-    cmdApdu.p_data[xx++] = p2;          // P2
-    cmdApdu.p_data[xx++] = aid.size();  // Lc
-    memcpy(&cmdApdu.p_data[xx], aid.data(), aid.size());
-    cmdApdu.p_data[xx + aid.size()] = 0x00;  // Le
+  uint8_t selectCommand[CMD_APDU_SELECT_MAX_LENGTH];
+  int selectLength = CommandApdu_writeSelect(seChannel, p2, aid.data(),
+                                             aid.size(), selectCommand);
+  if (selectLength > 0) {
+    cmdApdu.len = selectLength;
+    cmdApdu.p_data = selectCommand;
     status = StEse_Transceive(&cmdApdu, &rspApdu);
   }
 
@@ -220,9 +234,12 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid,
     /*Return response on success, empty vector on failure*/
     /*Status is success*/
     if (sw1 == 0x90 && sw2 == 0x00) {
-      /*Copy the response including status word*/
-      resApduBuff.selectResponse.resize(rspApdu.len);
-      memcpy(&resApduBuff.selectResponse[0], rspApdu.p_data, rspApdu.len);
+      /*Lend the response including status word, freed after the callback*/
+      resApduBuff.selectResponse.setToExternal(rspApdu.p_data, rspApdu.len);
+      std::lock_guard<std::mutex> lock(mChannelLock);
+      mChannelAid[resApduBuff.channelNumber] = aid;
+      mChannelP2[resApduBuff.channelNumber] = p2;
+      seHalJournalChannel(resApduBuff.channelNumber);
       sestatus = SecureElementStatus::SUCCESS;
     }
     /*AID provided doesn't match any applet on the secure element*/
@@ -251,10 +268,9 @@ Return<void> SecureElement::openLogicalChannel(const hidl_vec<uint8_t>& aid,
     }
   }
   _hidl_cb(resApduBuff, sestatus);
-  free(cmdApdu.p_data);
   free(rspApdu.p_data);
   STLOG_HAL_V("%s: Exit", __func__);
-  OpenLogicalChannelProcessing = false;
+  OpenLogicalChannelProcessing--;
   return Void();
 }
 
@@ -262,7 +278,7 @@ Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid,
                                              uint8_t p2,
                                              openBasicChannel_cb _hidl_cb) {
   hidl_vec<uint8_t> result;
-  OpenBasicChannelProcessing = true;
+  OpenBasicChannelProcessing++;
   STLOG_HAL_D("%s: Enter", __func__);
 
   if (!isSeInitialized()) {
@@ -270,7 +286,7 @@ Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid,
     if (status != ESESTATUS_SUCCESS) {
       STLOG_HAL_E("%s: seHalInit Failed!!!", __func__);
       _hidl_cb(result, SecureElementStatus::IOERROR);
-      OpenBasicChannelProcessing = false;
+      OpenBasicChannelProcessing--;
       return Void();
     }
   }
@@ -283,18 +299,12 @@ Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid,
   memset(&cmdApdu, 0x00, sizeof(StEse_data));
   memset(&rspApdu, 0x00, sizeof(StEse_data));
 
-  cmdApdu.len = (int32_t)(6 + aid.size());
-  cmdApdu.p_data = (uint8_t*)malloc(cmdApdu.len * sizeof(uint8_t));
-  if (cmdApdu.p_data != NULL) {
-    uint8_t xx = 0;
-    cmdApdu.p_data[xx++] = 0x00;        // basic channel
-    cmdApdu.p_data[xx++] = 0xA4;        // INS
-    cmdApdu.p_data[xx++] = 0x04;        // P1
-    cmdApdu.p_data[xx++] = p2;          // P2
-    cmdApdu.p_data[xx++] = aid.size();  // Lc
-    memcpy(&cmdApdu.p_data[xx], aid.data(), aid.size());
-    cmdApdu.p_data[xx + aid.size()] = 0x00;  // Le
-
+  uint8_t selectCommand[CMD_APDU_SELECT_MAX_LENGTH];
+  int selectLength = CommandApdu_writeSelect(0x00, p2, aid.data(), aid.size(),
+                                             selectCommand);
+  if (selectLength > 0) {
+    cmdApdu.len = selectLength;
+    cmdApdu.p_data = selectCommand;
     status = StEse_Transceive(&cmdApdu, &rspApdu);
   }
 
@@ -307,14 +317,17 @@ Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid,
     /*Return response on success, empty vector on failure*/
     /*Status is success*/
     if ((sw1 == 0x90) && (sw2 == 0x00)) {
-      /*Copy the response including status word*/
-      result.resize(rspApdu.len);
-      memcpy(&result[0], rspApdu.p_data, rspApdu.len);
+      /*Lend the response including status word, freed after the callback*/
+      result.setToExternal(rspApdu.p_data, rspApdu.len);
+      std::lock_guard<std::mutex> lock(mChannelLock);
       /*Set basic channel reference if it is not set */
       if (!mOpenedChannels[0]) {
         mOpenedChannels[0] = true;
         mOpenedchannelCount++;
       }
+      mChannelAid[DEFAULT_BASIC_CHANNEL] = aid;
+      mChannelP2[DEFAULT_BASIC_CHANNEL] = p2;
+      seHalJournalChannel(DEFAULT_BASIC_CHANNEL);
       sestatus = SecureElementStatus::SUCCESS;
     }
     /*AID provided doesn't match any applet on the secure element*/
@@ -332,7 +345,8 @@ Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid,
     seHalResetSe();
   }
 
-  if ((sestatus != SecureElementStatus::SUCCESS) && mOpenedChannels[0]) {
+  if ((sestatus != SecureElementStatus::SUCCESS) &&
+      seHalIsChannelOpen(DEFAULT_BASIC_CHANNEL)) {
     SecureElementStatus closeChannelStatus =
         closeChannel(DEFAULT_BASIC_CHANNEL);
     if (closeChannelStatus != SecureElementStatus::SUCCESS) {
@@ -340,10 +354,9 @@ Return<void> SecureElement::openBasicChannel(const hidl_vec<uint8_t>& aid,
     }
   }
   _hidl_cb(result, sestatus);
-  free(cmdApdu.p_data);
   free(rspApdu.p_data);
   STLOG_HAL_V("%s: Exit", __func__);
-  OpenBasicChannelProcessing = false;
+  OpenBasicChannelProcessing--;
   return Void();
 }
 
@@ -359,25 +372,19 @@ SecureElement::closeChannel(uint8_t channelNumber) {
 
   if ((channelNumber < DEFAULT_BASIC_CHANNEL) ||
       (channelNumber >= MAX_LOGICAL_CHANNELS) ||
-      (mOpenedChannels[channelNumber] == false)) {
+      !seHalIsChannelOpen(channelNumber)) {
     STLOG_HAL_E("%s: invalid channel!!!", __func__);
     sestatus = SecureElementStatus::FAILED;
   } else if (channelNumber > DEFAULT_BASIC_CHANNEL) {
     memset(&cmdApdu, 0x00, sizeof(StEse_data));
     memset(&rspApdu, 0x00, sizeof(StEse_data));
-    cmdApdu.p_data = (uint8_t*)malloc(5 * sizeof(uint8_t));
-    if (cmdApdu.p_data != NULL) {
-      uint8_t xx = 0;
-
-      cmdApdu.p_data[xx++] = channelNumber;
-      cmdApdu.p_data[xx++] = 0x70;           // INS
-      cmdApdu.p_data[xx++] = 0x80;           // P1
-      cmdApdu.p_data[xx++] = channelNumber;  // P2
-      cmdApdu.p_data[xx++] = 0x00;           // Lc
-      cmdApdu.len = xx;
-
-      status = StEse_Transceive(&cmdApdu, &rspApdu);
-    }
+    SeHalCommand command = {this, channelNumber, NULL};
+    /* The eSE channel is set by the mapper */
+    auto closeChannelCommand = CommandApdu_manageChannelClose(channelNumber);
+    cmdApdu.len = sizeof(closeChannelCommand.bytes);
+    cmdApdu.p_data = closeChannelCommand.bytes;
+    status = StEse_TransceiveMapped(&cmdApdu, &rspApdu, seHalMapClose,
+                                    &command);
     if (status != ESESTATUS_SUCCESS) {
       sestatus = SecureElementStatus::FAILED;
     } else if ((rspApdu.p_data[rspApdu.len - 2] == 0x90) &&
@@ -386,17 +393,28 @@ SecureElement::closeChannel(uint8_t channelNumber) {
     } else {
       sestatus = SecureElementStatus::FAILED;
     }
-    free(cmdApdu.p_data);
     free(rspApdu.p_data);
   }
 
   if ((channelNumber == DEFAULT_BASIC_CHANNEL) ||
       (sestatus == SecureElementStatus::SUCCESS)) {
-    mOpenedChannels[channelNumber] = false;
-    mOpenedchannelCount--;
+    bool lastChannel;
+    {
+      std::lock_guard<std::mutex> lock(mChannelLock);
+      /* Unless another thread closed it meanwhile */
+      if (mOpenedChannels[channelNumber]) {
+        mOpenedChannels[channelNumber] = false;
+        mChannelMap[channelNumber] = channelNumber;
+        mChannelAid[channelNumber].resize(0);
+        seHalJournalChannel(channelNumber);
+        mOpenedchannelCount--;
+      }
+      lastChannel = (mOpenedchannelCount == 0) &&
+                    (OpenLogicalChannelProcessing == 0) &&
+                    (OpenBasicChannelProcessing == 0);
+    }
     /*If there are no channels remaining close secureElement*/
-    if ((mOpenedchannelCount == 0) && !OpenLogicalChannelProcessing &&
-        !OpenBasicChannelProcessing) {
+    if (lastChannel) {
       sestatus = seHalDeInit();
     } else {
       sestatus = SecureElementStatus::SUCCESS;
@@ -424,9 +442,16 @@ ESESTATUS SecureElement::seHalInit() {
   ESESTATUS status = ESESTATUS_SUCCESS;
 
   STLOG_HAL_D("%s: Enter", __func__);
+  std::lock_guard<std::mutex> lock(mInitLock);
+  /* Another binder thread may have opened it meanwhile */
+  if (isSeInitialized()) {
+    return ESESTATUS_SUCCESS;
+  }
   status = StEse_init();
   if (status != ESESTATUS_SUCCESS) {
     STLOG_HAL_E("%s: SecureElement open failed!!!", __func__);
+  } else {
+    seHalAdoptChannels();
   }
   STLOG_HAL_V("%s: Exit", __func__);
   return status;
@@ -444,37 +469,332 @@ void SecureElement::seHalResetSe() {
   }
 
   if (status == ESESTATUS_SUCCESS) {
-    mCallbackV1_0->onStateChange(false);
+    /* The caller gets its reply right away, the next APDUs wait for the
+     * recovery */
+    status = StEse_startRecovery(seHalRecoveryDone, this);
+    if (status == ESESTATUS_BUSY) {
+      STLOG_HAL_D("%s: SecureElement recovery already in progress", __func__);
+    } else if (status != ESESTATUS_SUCCESS) {
+      STLOG_HAL_E("%s: SecureElement recovery failed to start!!", __func__);
+    }
+  }
+  STLOG_HAL_V("%s: Exit", __func__);
+}
 
-    status = StEse_Reset();
-    if (status != ESESTATUS_SUCCESS) {
-      STLOG_HAL_E("%s: SecureElement reset failed!!", __func__);
-    } else {
-      for (uint8_t xx = 0; xx < MAX_LOGICAL_CHANNELS; xx++) {
-        mOpenedChannels[xx] = false;
-      }
-      mOpenedchannelCount = 0;
+void SecureElement::seHalRecoveryDone(StEse_recoveryLevel level,
+                                      ESESTATUS status, void* context) {
+  SecureElement* se = (SecureElement*)context;
+
+  STLOG_HAL_D("%s: Enter, level %d status %d", __func__, level, status);
+  if (status != ESESTATUS_SUCCESS) {
+    STLOG_HAL_E("%s: SecureElement reset failed!!", __func__);
+    if (mCallbackV1_0 != nullptr) {
+      mCallbackV1_0->onStateChange(false);
+    }
+    return;
+  }
+
+  /* A resync keeps the logical channels, any reset closes them: reopen them
+   * before the clients get the device back, they only see a delay. */
+  if ((level != ESE_RECOVERY_RESYNC) && !se->seHalRestoreChannels()) {
+    STLOG_HAL_E("%s: channels not restored, clients must reopen them",
+                __func__);
+    se->seHalClearChannels();
+    if (mCallbackV1_0 != nullptr) {
+      mCallbackV1_0->onStateChange(false);
       mCallbackV1_0->onStateChange(true);
     }
   }
   STLOG_HAL_V("%s: Exit", __func__);
 }
 
+void SecureElement::seHalClearChannels() {
+  std::lock_guard<std::mutex> lock(mChannelLock);
+  for (uint8_t xx = 0; xx < MAX_LOGICAL_CHANNELS; xx++) {
+    mOpenedChannels[xx] = false;
+    mChannelMap[xx] = xx;
+    mChannelAid[xx].resize(0);
+    seHalJournalChannel(xx);
+  }
+  mOpenedchannelCount = 0;
+}
+
+/* Keeps the channel in the state journal, for a restarted service to take
+ * it over. Called with mChannelLock held. */
+void SecureElement::seHalJournalChannel(uint8_t channel) {
+  StEse_channelState state;
+
+  if (!mOpenedChannels[channel] ||
+      (mChannelAid[channel].size() > ESE_JOURNAL_MAX_AID_LENGTH)) {
+    StEse_journalChannel(channel, NULL);
+    return;
+  }
+  state.seChannel = mChannelMap[channel];
+  state.p2 = mChannelP2[channel];
+  state.aidLength = mChannelAid[channel].size();
+  memcpy(state.aid, mChannelAid[channel].data(), state.aidLength);
+  StEse_journalChannel(channel, &state);
+}
+
+/* Takes over the channels a crashed service left open, when StEse_init()
+ * resumed its link instead of resetting the eSE. */
+void SecureElement::seHalAdoptChannels() {
+  StEse_channelState state;
+  std::lock_guard<std::mutex> lock(mChannelLock);
+
+  for (uint8_t xx = 0; xx < MAX_LOGICAL_CHANNELS; xx++) {
+    if (mOpenedChannels[xx] ||
+        (StEse_getJournaledChannel(xx, &state) != ESESTATUS_SUCCESS)) {
+      continue;
+    }
+    STLOG_HAL_D("%s: channel %d taken over (eSE channel %d)", __func__, xx,
+                state.seChannel);
+    mOpenedChannels[xx] = true;
+    mOpenedchannelCount++;
+    mChannelMap[xx] = state.seChannel;
+    mChannelP2[xx] = state.p2;
+    mChannelAid[xx].resize(state.aidLength);
+    memcpy(&mChannelAid[xx][0], state.aid, state.aidLength);
+  }
+}
+
+/* Channel number given to the client for a channel opened on the eSE: the
+ * same one, unless it is taken by a channel remapped after a reset. Called
+ * with mChannelLock held. */
+uint8_t SecureElement::seHalAllocChannel(uint8_t seChannel) {
+  if ((seChannel < MAX_LOGICAL_CHANNELS) && !mOpenedChannels[seChannel]) {
+    return seChannel;
+  }
+  for (uint8_t xx = DEFAULT_BASIC_CHANNEL + 1; xx < MAX_LOGICAL_CHANNELS;
+       xx++) {
+    if (!mOpenedChannels[xx]) {
+      return xx;
+    }
+  }
+  STLOG_HAL_E("%s: no channel number left for %d", __func__, seChannel);
+  return 0xff;
+}
+
+/* Class byte of a command moved to the eSE channel behind the channel number
+ * the client uses. */
+uint8_t SecureElement::seHalMapCla(uint8_t cla) {
+  uint8_t channel = cla & 0x03;
+  std::lock_guard<std::mutex> lock(mChannelLock);
+  /* Only the first interindustry class codes channels 0 to 3 */
+  if (((cla & 0x40) != 0) || (cla == 0xFF) || !mOpenedChannels[channel] ||
+      (mChannelMap[channel] == channel)) {
+    return cla;
+  }
+  uint8_t seChannel = mChannelMap[channel];
+  if (seChannel < 4) {
+    return (cla & 0xFC) | seChannel;
+  }
+  /* Further interindustry class, secure messaging kept */
+  return (cla & 0x80) | 0x40 | (((cla & 0x0C) != 0) ? 0x20 : 0x00) |
+         ((seChannel - 4) & 0x0F);
+}
+
+/* Called by the driver once the device is granted to a client command: the
+ * recovery that may have run while it was queued has restored the channels
+ * by then. The CLA is moved to a copy, the binder buffer being read-only. */
+bool SecureElement::seHalMapTransmit(StEse_data* cmd, void* context) {
+  SeHalCommand* command = (SeHalCommand*)context;
+  uint8_t cla = command->se->seHalMapCla(cmd->p_data[0]);
+
+  if (cla == cmd->p_data[0]) {
+    return true;
+  }
+  command->copy = (uint8_t*)malloc(cmd->len * sizeof(uint8_t));
+  if (command->copy == NULL) {
+    return false;
+  }
+  memcpy(command->copy, cmd->p_data, cmd->len);
+  command->copy[0] = cla;
+  cmd->p_data = command->copy;
+  return true;
+}
+
+/* Same for the MANAGE CHANNEL close of a client channel, dropped if the
+ * channel was closed meanwhile: its eSE channel may be another client's. */
+bool SecureElement::seHalMapClose(StEse_data* cmd, void* context) {
+  SeHalCommand* command = (SeHalCommand*)context;
+  SecureElement* se = command->se;
+  std::lock_guard<std::mutex> lock(se->mChannelLock);
+
+  if (!se->mOpenedChannels[command->channel]) {
+    return false;
+  }
+  auto closeChannelCommand =
+      CommandApdu_manageChannelClose(se->mChannelMap[command->channel]);
+  memcpy(cmd->p_data, closeChannelCommand.bytes,
+         sizeof(closeChannelCommand.bytes));
+  return true;
+}
+
+bool SecureElement::seHalIsChannelOpen(uint8_t channel) {
+  std::lock_guard<std::mutex> lock(mChannelLock);
+  return mOpenedChannels[channel];
+}
+
+static bool seHalIsSuccess(StEse_data* rspApdu) {
+  return (rspApdu->len >= 2) && (rspApdu->p_data[rspApdu->len - 2] == 0x90) &&
+         (rspApdu->p_data[rspApdu->len - 1] == 0x00);
+}
+
+bool SecureElement::seHalOpenSeChannel(uint8_t* seChannel) {
+  auto manageChannelCommand = CommandApdu_manageChannelOpen();
+  StEse_data cmdApdu;
+  StEse_data rspApdu;
+  bool opened = false;
+
+  memset(&rspApdu, 0x00, sizeof(StEse_data));
+  cmdApdu.len = sizeof(manageChannelCommand.bytes);
+  cmdApdu.p_data = manageChannelCommand.bytes;
+  if ((StEse_Transceive(&cmdApdu, &rspApdu) == ESESTATUS_SUCCESS) &&
+      (rspApdu.len == 3) && seHalIsSuccess(&rspApdu)) {
+    *seChannel = rspApdu.p_data[0];
+    opened = true;
+  }
+  free(rspApdu.p_data);
+  return opened;
+}
+
+bool SecureElement::seHalSelect(uint8_t seChannel,
+                                const hidl_vec<uint8_t>& aid, uint8_t p2) {
+  StEse_data cmdApdu;
+  StEse_data rspApdu;
+  bool selected = false;
+
+  memset(&rspApdu, 0x00, sizeof(StEse_data));
+  uint8_t selectCommand[CMD_APDU_SELECT_MAX_LENGTH];
+  int selectLength = CommandApdu_writeSelect(seChannel, p2, aid.data(),
+                                             aid.size(), selectCommand);
+  if (selectLength < 0) {
+    return false;
+  }
+  cmdApdu.len = selectLength;
+  cmdApdu.p_data = selectCommand;
+
+  if (StEse_Transceive(&cmdApdu, &rspApdu) == ESESTATUS_SUCCESS) {
+    selected = seHalIsSuccess(&rspApdu);
+  }
+  free(rspApdu.p_data);
+  return selected;
+}
+
+void SecureElement::seHalCloseSeChannel(uint8_t seChannel) {
+  auto closeChannelCommand = CommandApdu_manageChannelClose(seChannel);
+  StEse_data cmdApdu;
+  StEse_data rspApdu;
+
+  memset(&rspApdu, 0x00, sizeof(StEse_data));
+  cmdApdu.len = sizeof(closeChannelCommand.bytes);
+  cmdApdu.p_data = closeChannelCommand.bytes;
+  if ((StEse_Transceive(&cmdApdu, &rspApdu) != ESESTATUS_SUCCESS) ||
+      !seHalIsSuccess(&rspApdu)) {
+    STLOG_HAL_E("%s: channel %d not closed", __func__, seChannel);
+  }
+  free(rspApdu.p_data);
+}
+
+/* Reopens and reselects the channels the clients had opened, after the eSE
+ * was reset. Called while the recovery holds the device, so that no client
+ * APDU goes in between. All or nothing: on failure, the channels already
+ * reopened are closed again. */
+bool SecureElement::seHalRestoreChannels() {
+  bool opened[MAX_LOGICAL_CHANNELS];
+  hidl_vec<uint8_t> aids[MAX_LOGICAL_CHANNELS];
+  uint8_t p2s[MAX_LOGICAL_CHANNELS];
+  bool reopened[MAX_LOGICAL_CHANNELS] = {false};
+  uint8_t seChannels[MAX_LOGICAL_CHANNELS];
+  bool restored = true;
+
+  /* Not held during the APDUs */
+  {
+    std::lock_guard<std::mutex> lock(mChannelLock);
+    for (uint8_t xx = 0; xx < MAX_LOGICAL_CHANNELS; xx++) {
+      opened[xx] = mOpenedChannels[xx];
+      aids[xx] = mChannelAid[xx];
+      p2s[xx] = mChannelP2[xx];
+    }
+  }
+
+  for (uint8_t xx = 0; (xx < MAX_LOGICAL_CHANNELS) && restored; xx++) {
+    if (!opened[xx]) {
+      continue;
+    }
+    seChannels[xx] = DEFAULT_BASIC_CHANNEL;
+    if ((xx != DEFAULT_BASIC_CHANNEL) && !seHalOpenSeChannel(&seChannels[xx])) {
+      restored = false;
+      break;
+    }
+    reopened[xx] = true;
+    restored = seHalSelect(seChannels[xx], aids[xx], p2s[xx]);
+  }
+
+  for (uint8_t xx = DEFAULT_BASIC_CHANNEL + 1; xx < MAX_LOGICAL_CHANNELS;
+       xx++) {
+    if (!reopened[xx]) {
+      continue;
+    }
+    if (restored) {
+      STLOG_HAL_D("%s: channel %d restored on %d", __func__, xx,
+                  seChannels[xx]);
+      std::lock_guard<std::mutex> lock(mChannelLock);
+      mChannelMap[xx] = seChannels[xx];
+      seHalJournalChannel(xx);
+    } else {
+      seHalCloseSeChannel(seChannels[xx]);
+    }
+  }
+  return restored;
+}
+
+Return<void> SecureElement::debug(const hidl_handle& fd,
+                                  const hidl_vec<hidl_string>& options) {
+  const native_handle_t* handle = fd.getNativeHandle();
+  if ((handle == nullptr) || (handle->numFds < 1)) {
+    return Void();
+  }
+  int dumpFd = handle->data[0];
+
+  uint8_t openedCount;
+  {
+    std::lock_guard<std::mutex> lock(mChannelLock);
+    openedCount = mOpenedchannelCount;
+  }
+  dprintf(dumpFd, "ST eSE HAL, %d logical channels opened\n", openedCount);
+  StEse_dumpLatencyStats(dumpFd);
+  StEse_dumpBusCounters(dumpFd);
+  StEse_dumpStateStats(dumpFd);
+  StEse_dumpClockStats(dumpFd);
+
+  // "--reset" starts a new sampling period once the stats have been dumped.
+  for (size_t i = 0; i < options.size(); i++) {
+    if (strcmp(options[i].c_str(), "--reset") == 0) {
+      StEse_busCounters counters;
+      StEse_resetLatencyStats();
+      StEse_resetStateStats();
+      StEse_resetClockStats();
+      StEse_getBusCounters(&counters, true);
+      dprintf(dumpFd, "Statistics reset\n");
+    }
+  }
+  return Void();
+}
+
 Return<::android::hardware::secure_element::V1_0::SecureElementStatus>
 SecureElement::seHalDeInit() {
   STLOG_HAL_D("%s: Enter", __func__);
   ESESTATUS status = ESESTATUS_SUCCESS;
   SecureElementStatus sestatus = SecureElementStatus::FAILED;
+  std::lock_guard<std::mutex> lock(mInitLock);
   status = StEse_close();
   if (status != ESESTATUS_SUCCESS) {
     sestatus = SecureElementStatus::FAILED;
   } else {
     sestatus = SecureElementStatus::SUCCESS;
-
-    for (uint8_t xx = 0; xx < MAX_LOGICAL_CHANNELS; xx++) {
-      mOpenedChannels[xx] = false;
-    }
-    mOpenedchannelCount = 0;
+    seHalClearChannels();
   }
   STLOG_HAL_V("%s: Exit", __func__);
   return sestatus;
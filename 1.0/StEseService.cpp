@@ -23,6 +23,11 @@
 #include <log/log.h>
 
 #include "SecureElement.h"
+#include "ese_config.h"
+
+// Binder threads when the configuration does not set them
+#define DEFAULT_BINDER_THREADS 4
+
 typedef int (*STEsePreProcess)(void);
 
 // Generated HIDL files
@@ -46,7 +51,12 @@ int main() {
     }
   }
   sp<ISecureElement> se_service = new SecureElement();
-  configureRpcThreadpool(1, true /*callerWillJoin*/);
+  // The calls that do not need the bus are not held up by a slow APDU. The
+  // APDUs themselves are serialized by the driver.
+  unsigned int threads = EseConfig::getUnsigned(NAME_ST_ESE_BINDER_THREADS,
+                                                DEFAULT_BINDER_THREADS);
+  configureRpcThreadpool((threads > 0) ? threads : 1,
+                         true /*callerWillJoin*/);
   status_t status = se_service->registerAsService("eSE1");
   if (status != OK) {
     LOG_ALWAYS_FATAL(
@@ -23,6 +23,7 @@
 #include <android/hardware/secure_element/1.1/ISecureElement.h>
 #include <hidl/MQDescriptor.h>
 #include <hidl/Status.h>
+#include <mutex>
 #include "../ese-spi-driver/StEseApi.h"
 
 namespace android {
@@ -32,6 +33,8 @@ namespace V1_1 {
 namespace implementation {
 
 using ::android::sp;
+using ::android::hardware::hidl_handle;
+using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::Return;
 using ::android::hardware::Void;
@@ -70,10 +73,22 @@ struct SecureElement : public V1_1::ISecureElement,
   Return<::android::hardware::secure_element::V1_0::SecureElementStatus>
   closeChannel(uint8_t channelNumber) override;
   void serviceDied(uint64_t /*cookie*/, const wp<IBase>& /*who*/) override;
+  Return<void> debug(const hidl_handle& fd,
+                     const hidl_vec<hidl_string>& options) override;
 
  private:
+  /* Serializes StEse_init() and StEse_close() between the binder threads */
+  std::mutex mInitLock;
+  /* Guards the channel bookkeeping below. Never held during an APDU: the
+   * recovery callback reads it while the device is held. */
+  std::mutex mChannelLock;
   uint8_t mOpenedchannelCount = 0;
   bool mOpenedChannels[MAX_LOGICAL_CHANNELS];
+  /* eSE channel behind each channel number given to the clients, and how it
+   * was opened, to reopen it after a reset */
+  uint8_t mChannelMap[MAX_LOGICAL_CHANNELS];
+  hidl_vec<uint8_t> mChannelAid[MAX_LOGICAL_CHANNELS];
+  uint8_t mChannelP2[MAX_LOGICAL_CHANNELS];
   static sp<V1_0::ISecureElementHalCallback> mCallbackV1_0;
   static sp<V1_1::ISecureElementHalCallback> mCallbackV1_1;
   Return<::android::hardware::secure_element::V1_0::SecureElementStatus>
@@ -81,6 +96,28 @@ struct SecureElement : public V1_1::ISecureElement,
   ESESTATUS seHalInit();
   bool isSeInitialized();
   void seHalResetSe();
+  void seHalClearChannels();
+  void seHalJournalChannel(uint8_t channel);
+  void seHalAdoptChannels();
+  uint8_t seHalAllocChannel(uint8_t seChannel);
+  uint8_t seHalMapCla(uint8_t cla);
+  /* Context of the mappers, called by the driver once the device is granted
+   * to a command, so that a recovery queued before it cannot remap the
+   * channel behind its back */
+  struct SeHalCommand {
+    SecureElement* se;
+    uint8_t channel; /* channel number of the client */
+    uint8_t* copy;   /* command with its CLA remapped, to be freed */
+  };
+  static bool seHalMapTransmit(StEse_data* cmd, void* context);
+  static bool seHalMapClose(StEse_data* cmd, void* context);
+  bool seHalIsChannelOpen(uint8_t channel);
+  bool seHalOpenSeChannel(uint8_t* seChannel);
+  bool seHalSelect(uint8_t seChannel, const hidl_vec<uint8_t>& aid, uint8_t p2);
+  void seHalCloseSeChannel(uint8_t seChannel);
+  bool seHalRestoreChannels();
+  static void seHalRecoveryDone(StEse_recoveryLevel level, ESESTATUS status,
+                                void* context);
 };
 
 }  // namespace implementation
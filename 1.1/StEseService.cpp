@@ -22,6 +22,10 @@
 #include <log/log.h>
 
 #include "SecureElement.h"
+#include "ese_config.h"
+
+// Binder threads when the configuration does not set them
+#define DEFAULT_BINDER_THREADS 4
 
 // Generated HIDL files
 using android::OK;
@@ -35,7 +39,12 @@ using android::hardware::secure_element::V1_1::implementation::SecureElement;
 int main() {
   ALOGD("Secure Element HAL Service 1.1 is starting.");
   sp<ISecureElement> se_service = new SecureElement();
-  configureRpcThreadpool(1, true /*callerWillJoin*/);
+  // The calls that do not need the bus are not held up by a slow APDU. The
+  // APDUs themselves are serialized by the driver.
+  unsigned int threads = EseConfig::getUnsigned(NAME_ST_ESE_BINDER_THREADS,
+                                                DEFAULT_BINDER_THREADS);
+  configureRpcThreadpool((threads > 0) ? threads : 1,
+                         true /*callerWillJoin*/);
   status_t status = se_service->registerAsService("eSE1");
   if (status != OK) {
     LOG_ALWAYS_FATAL(
@@ -0,0 +1,287 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-SpiLayerClock"
+#include "SpiLayerClock.h"
+#include <atomic>
+#include "SpiLayerDriver.h"
+#include "android_logmsg.h"
+#include "utils-lib/BusCounters.h"
+
+// A burst: that many CRC errors within a window of frames received
+#define CLOCK_ERROR_BURST 3
+#define CLOCK_ERROR_WINDOW 32
+// Clean frames received in a row before the clock is raised again
+#define CLOCK_CLEAN_FRAMES 2000
+
+// Accessed by the thread the scheduler granted the device to only.
+static uint32_t boardMaxSpeed = 0;
+static uint32_t pollSpeed = 0;
+static bool adaptiveClock = false;
+// Frequency programmed in the bus, 0 if unknown
+static uint32_t currentSpeed = 0;
+static unsigned int windowFrames = 0;
+static unsigned int windowErrors = 0;
+static unsigned int cleanFrames = 0;
+
+// Also read by the dumps. maxSpeed is 0 until the ATP is applied.
+static std::atomic<uint32_t> maxSpeed(0);
+static std::atomic<int> currentStep(-1);
+static std::atomic<uint64_t> stepBytes[SPI_CLOCK_STEPS];
+static std::atomic<uint64_t> stepBusyNs[SPI_CLOCK_STEPS];
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_program
+**
+** Description      Programs a frequency in the bus, if it is not the one
+**                  already programmed.
+**
+** Parameters       speed - frequency in Hz.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void SpiLayerClock_program(uint32_t speed) {
+  if ((speed == 0) || (speed == currentSpeed)) {
+    return;
+  }
+  if (SpiLayerDriver_setSpeed(speed) != 0) {
+    STLOG_HAL_W("%s : SPI clock not set to %u Hz", __func__, speed);
+    currentSpeed = 0;
+    return;
+  }
+  STLOG_HAL_V("%s : SPI clock set to %u Hz", __func__, speed);
+  currentSpeed = speed;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_getDataSpeed
+**
+** Description      Gets the data frequency of the current step.
+**
+** Returns          The frequency in Hz, 0 if the ATP was not applied.
+**
+*******************************************************************************/
+static uint32_t SpiLayerClock_getDataSpeed() {
+  int step = currentStep.load(std::memory_order_relaxed);
+  return (step < 0) ? 0 : (maxSpeed.load(std::memory_order_relaxed) >> step);
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_init
+**
+** Description      Sets the limits of the clock, before the ATP is read.
+**
+** Parameters       devMaxFreq - maximum frequency of the board, 0 if none.
+**                  pollFreq   - frequency while polling, 0 for the data one.
+**                  adaptive   - true to lower the clock on CRC error bursts.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerClock_init(uint32_t devMaxFreq, uint32_t pollFreq,
+                        bool adaptive) {
+  boardMaxSpeed = devMaxFreq;
+  pollSpeed = pollFreq;
+  adaptiveClock = adaptive;
+  // The device was reopened: its frequency is the default one again.
+  currentSpeed = 0;
+  windowFrames = 0;
+  windowErrors = 0;
+  cleanFrames = 0;
+  maxSpeed = 0;
+  currentStep = -1;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_setMaxSpeed
+**
+** Description      Applies the maximum frequency read from the ATP, capped by
+**                  the one of the board. The step of the adaptive mode is
+**                  kept across the resets of the eSE.
+**
+** Parameters       atpFreq - frequency in Hz, 0 to leave the bus as it is.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerClock_setMaxSpeed(uint32_t atpFreq) {
+  if (atpFreq == 0) {
+    STLOG_HAL_W("%s : no frequency in the ATP, SPI clock left as is",
+                __func__);
+    return;
+  }
+
+  uint32_t speed = atpFreq;
+  if ((boardMaxSpeed != 0) && (speed > boardMaxSpeed)) {
+    speed = boardMaxSpeed;
+  }
+  maxSpeed = speed;
+  if (currentStep < 0) {
+    currentStep = 0;
+  }
+  SpiLayerClock_program(SpiLayerClock_getDataSpeed());
+
+  STLOG_HAL_D("%s : SPI clock %u Hz (ATP %u Hz, board %u Hz, polling %u Hz)",
+              __func__, SpiLayerClock_getDataSpeed(), atpFreq, boardMaxSpeed,
+              pollSpeed);
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_setPhase
+**
+** Description      Switches the bus to the frequency of a phase of the
+**                  exchange.
+**
+** Parameters       phase - the phase starting.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerClock_setPhase(SpiClockPhase phase) {
+  uint32_t speed = SpiLayerClock_getDataSpeed();
+
+  if ((phase == SPI_CLOCK_PHASE_POLL) && (pollSpeed != 0) && (speed != 0)) {
+    uint32_t max = maxSpeed.load(std::memory_order_relaxed);
+    speed = (pollSpeed < max) ? pollSpeed : max;
+  }
+  SpiLayerClock_program(speed);
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_recordFrame
+**
+** Description      Accounts the EDC check of a frame received. In adaptive
+**                  mode, a burst of errors halves the data frequency and a
+**                  long run of clean frames doubles it back. The new
+**                  frequency is programmed by the next phase.
+**
+** Parameters       checksumOk - true if the EDC of the frame was correct.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerClock_recordFrame(bool checksumOk) {
+  int step = currentStep.load(std::memory_order_relaxed);
+
+  if (!adaptiveClock || (step < 0)) {
+    return;
+  }
+
+  windowFrames++;
+  if (checksumOk) {
+    cleanFrames++;
+  } else {
+    windowErrors++;
+    cleanFrames = 0;
+  }
+
+  if (windowErrors >= CLOCK_ERROR_BURST) {
+    if (step < SPI_CLOCK_STEPS - 1) {
+      currentStep = step + 1;
+      BusCounters_add(BUS_COUNTER_CLOCK_STEPS_DOWN, 1);
+      STLOG_HAL_W("%s : %u CRC errors in %u frames, SPI clock lowered to %u Hz",
+                  __func__, windowErrors, windowFrames,
+                  SpiLayerClock_getDataSpeed());
+    }
+    windowFrames = 0;
+    windowErrors = 0;
+  } else if (windowFrames >= CLOCK_ERROR_WINDOW) {
+    windowFrames = 0;
+    windowErrors = 0;
+  }
+
+  if (cleanFrames >= CLOCK_CLEAN_FRAMES) {
+    cleanFrames = 0;
+    if (step > 0) {
+      currentStep = step - 1;
+      BusCounters_add(BUS_COUNTER_CLOCK_STEPS_UP, 1);
+      STLOG_HAL_D("%s : SPI clock raised to %u Hz", __func__,
+                  SpiLayerClock_getDataSpeed());
+    }
+  }
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_recordTransfer
+**
+** Description      Accounts the bytes of a frame clocked at the current data
+**                  frequency.
+**
+** Parameters       bytes  - number of bytes written or read.
+**                  busyNs - time the transfer took.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerClock_recordTransfer(unsigned int bytes, uint64_t busyNs) {
+  int step = currentStep.load(std::memory_order_relaxed);
+
+  if (step < 0) {
+    return;
+  }
+  stepBytes[step].fetch_add(bytes, std::memory_order_relaxed);
+  stepBusyNs[step].fetch_add(busyNs, std::memory_order_relaxed);
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_getStats
+**
+** Description      Gets the throughput statistics of each data frequency.
+**
+** Parameters       stats - array of SPI_CLOCK_STEPS elements.
+**
+** Returns          The current step, -1 if the clock was never set.
+**
+*******************************************************************************/
+int SpiLayerClock_getStats(SpiClockStats* stats) {
+  uint32_t max = maxSpeed.load(std::memory_order_relaxed);
+
+  for (int i = 0; i < SPI_CLOCK_STEPS; i++) {
+    stats[i].speedHz = max >> i;
+    stats[i].bytes = stepBytes[i].load(std::memory_order_relaxed);
+    stats[i].busyNs = stepBusyNs[i].load(std::memory_order_relaxed);
+  }
+  return currentStep.load(std::memory_order_relaxed);
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerClock_resetStats
+**
+** Description      Clears the throughput statistics.
+**
+** Parameters       none
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerClock_resetStats() {
+  for (int i = 0; i < SPI_CLOCK_STEPS; i++) {
+    stepBytes[i].store(0, std::memory_order_relaxed);
+    stepBusyNs[i].store(0, std::memory_order_relaxed);
+  }
+}
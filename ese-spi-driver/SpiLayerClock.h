@@ -0,0 +1,101 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef SPILAYERCLOCK_H_
+#define SPILAYERCLOCK_H_
+
+/*
+ * SPI clock control: runs the bus at the maximum frequency the eSE gives in
+ * its ATP, capped by the one of the board, with an optional lower frequency
+ * while polling for the NAD. In adaptive mode the data frequency is halved
+ * after a burst of CRC errors, and doubled again, up to the maximum, after
+ * sustained clean traffic. The bytes clocked and the time spent at each
+ * frequency are accounted, for the throughput to be tuned per board.
+ */
+
+#include <stdint.h>
+
+// Data frequencies the adaptive mode steps through: maximum >> step.
+#define SPI_CLOCK_STEPS 4
+
+typedef enum {
+  SPI_CLOCK_PHASE_POLL, /* polling for the NAD */
+  SPI_CLOCK_PHASE_DATA, /* writing a frame, or reading it after the NAD */
+} SpiClockPhase;
+
+typedef struct {
+  uint32_t speedHz; /* data frequency of the step */
+  uint64_t bytes;   /* bytes of the frames clocked at that frequency */
+  uint64_t busyNs;  /* time spent clocking them */
+} SpiClockStats;
+
+/**
+ * Sets the limits of the clock, before the ATP is read.
+ *
+ * @param devMaxFreq Maximum frequency of the board in Hz, 0 if none.
+ * @param pollFreq Frequency while polling in Hz, 0 to poll at the data one.
+ * @param adaptive true to lower the data frequency on CRC error bursts.
+ */
+void SpiLayerClock_init(uint32_t devMaxFreq, uint32_t pollFreq,
+                        bool adaptive);
+
+/**
+ * Applies the maximum frequency read from the ATP.
+ *
+ * @param atpFreq Frequency in Hz, 0 to leave the bus as it is.
+ */
+void SpiLayerClock_setMaxSpeed(uint32_t atpFreq);
+
+/**
+ * Switches the bus to the frequency of a phase of the exchange. Only
+ * reprograms the bus if the frequency changes.
+ *
+ * @param phase The phase starting.
+ */
+void SpiLayerClock_setPhase(SpiClockPhase phase);
+
+/**
+ * Accounts the EDC check of a frame received, for the adaptive mode.
+ *
+ * @param checksumOk true if the EDC of the frame was correct.
+ */
+void SpiLayerClock_recordFrame(bool checksumOk);
+
+/**
+ * Accounts the bytes of a frame clocked at the current data frequency.
+ *
+ * @param bytes Number of bytes written or read.
+ * @param busyNs Time the transfer took.
+ */
+void SpiLayerClock_recordTransfer(unsigned int bytes, uint64_t busyNs);
+
+/**
+ * Gets the throughput statistics of each data frequency.
+ *
+ * @param stats Array of SPI_CLOCK_STEPS elements where to store them.
+ *
+ * @return The current step, -1 if the clock was never set.
+ */
+int SpiLayerClock_getStats(SpiClockStats* stats);
+
+/**
+ * Clears the throughput statistics.
+ */
+void SpiLayerClock_resetStats();
+
+#endif /* SPILAYERCLOCK_H_ */
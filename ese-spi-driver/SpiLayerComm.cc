@@ -25,13 +25,22 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
+#include <atomic>
+#include "SpiLayerClock.h"
 #include "SpiLayerDriver.h"
+#include "SpiLayerFaults.h"
+#include "StEseLatency.h"
+#include "T1protocol.h"
 #include "android_logmsg.h"
 #include "utils-lib/Atp.h"
+#include "utils-lib/BusCounters.h"
 #include "utils-lib/Tpdu.h"
+#include "utils-lib/TpduTrace.h"
 #include "utils-lib/Utils.h"
 
 int pollInterval;
+// Cancel flag of the APDU holding the device: set and read by its thread only.
+static const std::atomic<bool>* cancelFlag = NULL;
 
 /*******************************************************************************
 **
@@ -116,7 +125,7 @@ int SpiLayerComm_readAtp() {
   }
   atpArray[LEN_OFFSET_IN_ATP] = ATP.len;
 
-  DispHal("Rx", atpArray, ATP.len);
+  STLOG_HAL_DUMP("Rx", atpArray, ATP.len);
 
   // Set-up the ATP into the corresponding struct
   if (Atp_setAtp(atpArray) != 0) {
@@ -174,28 +183,25 @@ void SpiLayerComm_readAtpFromFile() {
 **
 *******************************************************************************/
 
-int SpiLayerComm_writeTpdu(Tpdu* cmdTpdu) {
-  int txBufferLength;
-  uint8_t txBuffer[TPDU_MAX_LENGTH];
+int SpiLayerComm_writeTpdu(const Tpdu* cmdTpdu) {
   STLOG_HAL_D("%s : Enter ", __func__);
-  // Build the tx buffer to allocate the array of bytes to be sent
-  switch (ATP.checksumType) {
-    case LRC:
-      txBufferLength = TPDU_PROLOGUE_LENGTH + cmdTpdu->len + TPDU_LRC_LENGTH;
-      break;
-    case CRC:
-      txBufferLength = TPDU_PROLOGUE_LENGTH + cmdTpdu->len + TPDU_CRC_LENGTH;
-      break;
-  }
-
-  // Copy the array of bytes to be sent from the cmdTpdu struct
-  Tpdu_toByteArray(cmdTpdu, txBuffer);
-
-  // Send the txBuffer through SPI
-  if (SpiLayerDriver_write(txBuffer, txBufferLength) != txBufferLength) {
+  // The frame is sent straight from the cmdTpdu struct
+  int txBufferLength = Tpdu_getFrameLength(cmdTpdu);
+
+  // Send the frame through SPI
+  SpiLayerClock_setPhase(SPI_CLOCK_PHASE_DATA);
+  uint64_t startNs = StEseLatency_now();
+  if (SpiLayerFaults_write(Tpdu_getFrame(cmdTpdu), txBufferLength) !=
+      txBufferLength) {
     STLOG_HAL_E("Error writing a TPDU through the spi");
     return -1;
   }
+  SpiLayerClock_recordTransfer(txBufferLength, StEseLatency_now() - startNs);
+  StEseLatency_record(ESE_LATENCY_WRITE, startNs);
+  if (Tpdu_getType(cmdTpdu) == IBlock) {
+    BusCounters_add(BUS_COUNTER_PAYLOAD_WRITTEN, cmdTpdu->len);
+  }
+  TpduTrace_record(TPDU_TRACE_TX, T1protocol_getState(), cmdTpdu);
 
   return txBufferLength;
 }
@@ -209,18 +215,23 @@ int SpiLayerComm_writeTpdu(Tpdu* cmdTpdu) {
 **
 ** Parameters       respTpdu The buffer where to store the TDPU.
 **                  nBwt The maximum number of BWT to wait for the response.
+**                  deadline Absolute time after which the wait is given up,
+**                  NULL if the wait is only bounded by the BWT.
 **
 ** Returns          0 if the response is available and the header could be read
 **                  -2 if no response received before the timeout
+**                  -3 if the deadline expired or the exchange was cancelled
 **                  -1 otherwise.
 **
 *******************************************************************************/
-int SpiLayerComm_waitForResponse(Tpdu* respTpdu, int nBwt) {
+int SpiLayerComm_waitForResponse(Tpdu* respTpdu, int nBwt,
+                                 const struct timeval* deadline) {
   uint8_t pollingRxByte;
   struct timeval startTime;
   struct timeval currentTime;
 
   STLOG_HAL_D("Waiting for TPDU response (nBwt = %d).", nBwt);
+  uint64_t startNs = StEseLatency_now();
 
   // Initialize the timeout mechanism if the BWT is under a given threshold.
   bool isTimeoutRequired = false;
@@ -234,20 +245,32 @@ int SpiLayerComm_waitForResponse(Tpdu* respTpdu, int nBwt) {
   }
 
   // Start the polling mechanism
+  SpiLayerClock_setPhase(SPI_CLOCK_PHASE_POLL);
   while (true) {
     // Wait between each polling sequence
     usleep(1000);
     // Read the slave response by sending three null bytes
-    if (SpiLayerDriver_read(&pollingRxByte, 1) != 1) {
+    if (SpiLayerFaults_read(&pollingRxByte, 1) != 1) {
       STLOG_HAL_E("Error reading a valid NAD from the slave.");
       return -1;
     }
+    BusCounters_add(BUS_COUNTER_POLLS, 1);
 
     // Look for a start of valid frame
     if (pollingRxByte == NAD_SLAVE_TO_HOST) {
       STLOG_HAL_V("Start of valid frame detected");
+      StEseLatency_record(ESE_LATENCY_TIME_TO_NAD, startNs);
       break;
     }
+    BusCounters_add(BUS_COUNTER_WASTED_READS, 1);
+
+    // Check the caller deadline, enforced even if the BWT is not
+    if (((cancelFlag != NULL) && cancelFlag->load()) ||
+        Utils_isDeadlineExpired(deadline)) {
+      STLOG_HAL_W("Deadline expired or exchange cancelled before receiving a "
+                  "valid NAD");
+      return -3;
+    }
 
     // Check the timeout status (if required)
     if (isTimeoutRequired) {
@@ -264,8 +287,9 @@ int SpiLayerComm_waitForResponse(Tpdu* respTpdu, int nBwt) {
 
   // If the start of frame has been received continue reading the pending part
   // of the epilogue (PCB and LEN).
+  SpiLayerClock_setPhase(SPI_CLOCK_PHASE_DATA);
   uint8_t buffer[2];
-  if (SpiLayerDriver_read(buffer, 2) != 2) {
+  if (SpiLayerFaults_read(buffer, 2) != 2) {
     return -1;
   }
 
@@ -277,6 +301,22 @@ int SpiLayerComm_waitForResponse(Tpdu* respTpdu, int nBwt) {
   return 0;
 }
 
+/*******************************************************************************
+**
+** Function         SpiLayerComm_setCancelFlag
+**
+** Description      Sets the flag giving up the waits for a response once it
+**                  is raised. Called by the thread holding the device only.
+**
+** Parameters       cancelled Cancel flag of the exchange, NULL for none.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerComm_setCancelFlag(const std::atomic<bool>* cancelled) {
+  cancelFlag = cancelled;
+}
+
 /*******************************************************************************
 **
 ** Function         SpiLayerComm_readTpdu
@@ -291,23 +331,14 @@ int SpiLayerComm_waitForResponse(Tpdu* respTpdu, int nBwt) {
 *******************************************************************************/
 
 int SpiLayerComm_readTpdu(Tpdu* respTpdu) {
-  int pendingBytes;
-  unsigned int i;
   // Set the number of bytes to be read.
-  switch (ATP.checksumType) {
-    case LRC:
-      pendingBytes = respTpdu->len + TPDU_LRC_LENGTH;
-      break;
-    case CRC:
-      pendingBytes = respTpdu->len + TPDU_CRC_LENGTH;
-      break;
-  }
+  int pendingBytes = respTpdu->len + Tpdu_getChecksumLength();
 
-  // Read and store them in a buffer.
-  uint8_t rxBuffer[pendingBytes];
+  // Read them right after the prologue, where they belong in the frame.
   int bytesRead;
+  uint64_t startNs = StEseLatency_now();
 
-  bytesRead = SpiLayerDriver_read(rxBuffer, pendingBytes);
+  bytesRead = SpiLayerFaults_read(respTpdu->data, pendingBytes);
 
   // Check if the amount of bytesRead matches with the expected
   if (bytesRead != pendingBytes) {
@@ -315,21 +346,13 @@ int SpiLayerComm_readTpdu(Tpdu* respTpdu) {
                 pendingBytes);
     return -1;
   }
-
-  // Save data values in respTpdu
-  for (i = 0; i < respTpdu->len; i++) {
-    respTpdu->data[i] = rxBuffer[i];
+  SpiLayerClock_recordTransfer(bytesRead, StEseLatency_now() - startNs);
+  StEseLatency_record(ESE_LATENCY_BODY_READ, startNs);
+  if (Tpdu_getType(respTpdu) == IBlock) {
+    BusCounters_add(BUS_COUNTER_PAYLOAD_READ, respTpdu->len);
   }
+  TpduTrace_record(TPDU_TRACE_RX, T1protocol_getState(), respTpdu);
 
-  // Copy checksum read to its struct's position
-  switch (ATP.checksumType) {
-    case LRC:
-      respTpdu->checksum = Tpdu_getChecksumValue(rxBuffer, respTpdu->len, LRC);
-      break;
-    case CRC:
-      respTpdu->checksum = Tpdu_getChecksumValue(rxBuffer, respTpdu->len, CRC);
-      break;
-  }
   // Return the struct length
   // NAD + PCB + LEN + bytesRead (DATA + CHECKSUM).
   STLOG_HAL_V("%s : bytesRead = %d", __func__, bytesRead);
@@ -19,6 +19,8 @@
 #ifndef SPILAYERCOMM_H_
 #define SPILAYERCOMM_H_
 
+#include <sys/time.h>
+#include <atomic>
 #include "utils-lib/Tpdu.h"
 
 #define NAD_HOST_TO_SLAVE 0x21
@@ -50,18 +52,30 @@ int SpiLayerComm_readAtp();
  * @return The number of bytes written if everything went well, -1 if an error
  * 			occurred.
  */
-int SpiLayerComm_writeTpdu(Tpdu* cmdTpdu);
+int SpiLayerComm_writeTpdu(const Tpdu* cmdTpdu);
 
 /**
  * Waits for a TPDU response to be available on the SPI interface.
  *
  * @param respTpdu The buffer where to store the TDPU.
  * @param nBwt The maximum number of BWT to wait for the response.
+ * @param deadline Absolute time after which the wait is given up, NULL if
+ *        the wait is only bounded by the BWT.
  *
  * @return 0 if the response is available and the header could be read, -2
- *           if no response received before the timeout, -1 otherwise.
+ *           if no response received before the timeout, -3 if the deadline
+ *           expired or the exchange was cancelled, -1 otherwise.
  */
-int SpiLayerComm_waitForResponse(Tpdu* respTpdu, int nBwt);
+int SpiLayerComm_waitForResponse(Tpdu* respTpdu, int nBwt,
+                                 const struct timeval* deadline);
+
+/**
+ * Sets the flag giving up the waits for a response once it is raised, e.g.
+ * from another thread. Only the thread holding the device may set it.
+ *
+ * @param cancelled Cancel flag of the exchange, NULL for none.
+ */
+void SpiLayerComm_setCancelFlag(const std::atomic<bool>* cancelled);
 
 /**
  * Reads the pending bytes of the response (data information and crc fields).
@@ -21,7 +21,10 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/time.h>
+#include "StEseLatency.h"
 #include "android_logmsg.h"
+#include "utils-lib/BusCounters.h"
+#include "utils-lib/SpiCapture.h"
 #include "utils-lib/Utils.h"
 
 int spiDeviceId;
@@ -99,7 +102,11 @@ int SpiLayerDriver_read(uint8_t* rxBuffer, unsigned int bytesToRead) {
     if (elapsedTime < MIN_TIME_BETWEEN_MODE_SWITCH) {
       int waitTime = MIN_TIME_BETWEEN_MODE_SWITCH - elapsedTime;
       STLOG_HAL_V("Waiting %d ms to switch from TX to RX", waitTime);
+      uint64_t startNs = StEseLatency_now();
       usleep(waitTime * 1000);
+      StEseLatency_record(ESE_LATENCY_MODE_SWITCH, startNs);
+      BusCounters_add(BUS_COUNTER_MODE_SWITCH_WAITS, 1);
+      BusCounters_add(BUS_COUNTER_MODE_SWITCH_WAIT_US, waitTime * 1000);
     }
     gettimeofday(&currentTime, 0);
     STLOG_HAL_V("Start RX: %ld,%ld", currentTime.tv_sec, currentTime.tv_usec);
@@ -120,13 +127,17 @@ int SpiLayerDriver_read(uint8_t* rxBuffer, unsigned int bytesToRead) {
       int delay = delayTab[retries];
 
       retries++;
+      BusCounters_add(BUS_COUNTER_READ_RETRIES, 1);
       usleep(delay * 1000);
       STLOG_HAL_W("##  SpiRead retry %d/3 in %d milliseconds.", retries, delay);
     } else if (rc > 0) {
       gettimeofday(&lastRxTxTime, 0);
+      BusCounters_add(BUS_COUNTER_BYTES_READ, rc);
+      SpiCapture_record(SPI_CAPTURE_READ, rxBuffer, bytesToRead, rc);
       return rc;
     } else {
       STLOG_HAL_W("read on spi failed, retrying\n");
+      BusCounters_add(BUS_COUNTER_READ_RETRIES, 1);
       usleep(4000);
       retries++;
     }
@@ -137,6 +148,7 @@ int SpiLayerDriver_read(uint8_t* rxBuffer, unsigned int bytesToRead) {
       rxBuffer[0] != 0x25) {
     STLOG_HAL_D("Unexpected byte read from SPI: 0x%02X", rxBuffer[0]);
   }
+  SpiCapture_record(SPI_CAPTURE_READ, rxBuffer, bytesToRead, rc);
   return rc;
 }
 
@@ -153,7 +165,8 @@ int SpiLayerDriver_read(uint8_t* rxBuffer, unsigned int bytesToRead) {
 **                  failed.
 **
 *******************************************************************************/
-int SpiLayerDriver_write(uint8_t* txBuffer, unsigned int txBufferLength) {
+int SpiLayerDriver_write(const uint8_t* txBuffer,
+                         unsigned int txBufferLength) {
   int retries = 0;
   int rc = 0;
 
@@ -167,13 +180,17 @@ int SpiLayerDriver_write(uint8_t* txBuffer, unsigned int txBufferLength) {
     if (elapsedTime < MIN_TIME_BETWEEN_MODE_SWITCH) {
       int waitTime = MIN_TIME_BETWEEN_MODE_SWITCH - elapsedTime;
       STLOG_HAL_V("Waiting %d ms to switch from RX to TX", waitTime);
+      uint64_t startNs = StEseLatency_now();
       usleep(waitTime * 1000);
+      StEseLatency_record(ESE_LATENCY_MODE_SWITCH, startNs);
+      BusCounters_add(BUS_COUNTER_MODE_SWITCH_WAITS, 1);
+      BusCounters_add(BUS_COUNTER_MODE_SWITCH_WAIT_US, waitTime * 1000);
     }
     gettimeofday(&currentTime, 0);
     STLOG_HAL_V("Start TX: %ld,%ld", currentTime.tv_sec, currentTime.tv_usec);
   }
 
-  DispHal("Tx", txBuffer, txBufferLength);
+  STLOG_HAL_DUMP("Tx", txBuffer, txBufferLength);
 
   while (retries < 3) {
     rc = write(spiDeviceId, txBuffer, txBufferLength);
@@ -190,24 +207,52 @@ int SpiLayerDriver_write(uint8_t* txBuffer, unsigned int txBufferLength) {
       int delay = delayTab[retries];
 
       retries++;
+      BusCounters_add(BUS_COUNTER_WRITE_RETRIES, 1);
       usleep(delay * 1000);
       STLOG_HAL_W("##  SpiWrite retry %d/3 in %d milliseconds.", retries,
                   delay);
 
     } else if (rc > 0) {
       gettimeofday(&lastRxTxTime, 0);
+      BusCounters_add(BUS_COUNTER_BYTES_WRITTEN, rc);
+      SpiCapture_record(SPI_CAPTURE_WRITE, txBuffer, txBufferLength, rc);
       return rc;
     } else {
       STLOG_HAL_W("write on spi failed, retrying\n");
+      BusCounters_add(BUS_COUNTER_WRITE_RETRIES, 1);
       usleep(4000);
       retries++;
     }
   }
 
   gettimeofday(&lastRxTxTime, 0);
+  SpiCapture_record(SPI_CAPTURE_WRITE, txBuffer, txBufferLength, rc);
   return rc;
 }
 
+/*******************************************************************************
+**
+** Function         SpiLayerDriver_setSpeed
+**
+** Description      Sets the maximum frequency of the SPI clock for the
+**                  following transfers.
+**
+** Parameters       speedHz - frequency in Hz.
+**
+** Returns          0 if success, -1 otherwise
+**
+*******************************************************************************/
+int SpiLayerDriver_setSpeed(uint32_t speedHz) {
+  if (ioctl(spiDeviceId, SPI_IOC_WR_MAX_SPEED_HZ, &speedHz) < 0) {
+    char msg[LINUX_DBGBUFFER_SIZE];
+
+    strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
+    STLOG_HAL_E("! SPI speed %u Hz not set, errno is '%s'", speedHz, msg);
+    return -1;
+  }
+  return 0;
+}
+
 /*******************************************************************************
 **
 ** Function         SpiLayerDriver_reset
@@ -227,5 +272,6 @@ int SpiLayerDriver_reset() {
     strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
     STLOG_HAL_E("! Se reset!!, errno is '%s'", msg);
   }
+  SpiCapture_record(SPI_CAPTURE_RESET, NULL, 0, rc);
   return rc;
 }
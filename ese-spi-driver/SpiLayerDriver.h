@@ -65,7 +65,17 @@ int SpiLayerDriver_read(uint8_t *rxBuffer, unsigned int bytesToRead);
  *
  * @return The amount of bytes written to the slave, -1 if something failed.
  */
-int SpiLayerDriver_write(uint8_t *writeBuffer, unsigned int bytesToWrite);
+int SpiLayerDriver_write(const uint8_t *writeBuffer,
+                         unsigned int bytesToWrite);
+
+/**
+ * Sets the maximum frequency of the SPI clock for the following transfers.
+ *
+ * @param speedHz The frequency in Hz.
+ *
+ * @return 0 if success, -1 if something failed.
+ */
+int SpiLayerDriver_setSpeed(uint32_t speedHz);
 
 /**
  * Send a Reset pulse to the eSE.
@@ -0,0 +1,651 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-SpiLayerDriverReplay"
+#include "SpiLayerDriverReplay.h"
+#include <string.h>
+#include <time.h>
+#include "SpiLayerComm.h"
+#include "T1protocol.h"
+#include "android_logmsg.h"
+#include "utils-lib/SpiCapture.h"
+#include "utils-lib/Tpdu.h"
+
+// Byte returned while the eSE has nothing to send
+#define REPLAY_IDLE_BYTE 0x00
+// Handle returned by the open, there is no device behind it
+#define REPLAY_DEVICE_HANDLE 1
+// N(R) bit and error bits of the R-blocks
+#define REPLAY_RBLOCK_NR_BIT_MASK 0x10
+#define REPLAY_RBLOCK_ERROR_MASK 0x0F
+
+typedef struct {
+  SpiCaptureEvent event;
+  std::vector<uint8_t> data;
+} ReplayEvent;
+
+static std::vector<ReplayEvent> events;
+static bool replayTimed = false;
+// Next event of the capture to match a write or a reset against.
+static size_t nextEvent = 0;
+// Bytes sent by the eSE after the last write or reset, and how many of them
+// were read already.
+static std::vector<uint8_t> response;
+static size_t responseOffset = 0;
+// While polling for the NAD, the time the eSE took to answer in the capture
+// and the time the replayed write was done.
+static bool waitingForNad = false;
+static uint64_t responseDelayNs = 0;
+static uint64_t triggerNs = 0;
+static unsigned int divergences = 0;
+// Last write of the capture matched, events.size() if none.
+static size_t lastWrite = 0;
+// N(S) of the next I-block of the eSE, once known: a capture does not
+// necessarily start with a reset. Kept across captures, like the link.
+static bool eseSequenceKnown = false;
+static uint8_t eseSequence = 0;
+// Set once the replay answered a S(RESYNCH request): the host then sends
+// its I-block again, and the eSE answers it again.
+static bool resendExpected = false;
+// ATP of the last reset replayed, kept across captures like the eSE does.
+static std::vector<uint8_t> lastAtp;
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_now
+**
+** Description      Gets the monotonic time.
+**
+** Returns          Current time in ns.
+**
+*******************************************************************************/
+static uint64_t SpiLayerDriverReplay_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_load
+**
+** Description      Loads the capture to replay.
+**
+** Parameters       path  - the capture file.
+**                  timed - true to answer after the delay of the capture.
+**
+** Returns          0 if the capture could be loaded, -1 otherwise.
+**
+*******************************************************************************/
+int SpiLayerDriverReplay_load(const char* path, bool timed) {
+  SpiCaptureFileHeader header;
+  ReplayEvent replayEvent;
+
+  FILE* file = fopen(path, "rbe");
+  if (file == NULL) {
+    STLOG_HAL_E("%s : cannot open %s", __func__, path);
+    return -1;
+  }
+  if ((fread(&header, sizeof(header), 1, file) != 1) ||
+      (header.magic != SPI_CAPTURE_MAGIC) ||
+      (header.version != SPI_CAPTURE_VERSION)) {
+    STLOG_HAL_E("%s : %s is not a supported capture", __func__, path);
+    fclose(file);
+    return -1;
+  }
+
+  events.clear();
+  while (fread(&replayEvent.event, sizeof(SpiCaptureEvent), 1, file) == 1) {
+    int32_t result = replayEvent.event.result;
+    size_t length = (result > 0) ? result : 0;
+    replayEvent.data.resize(length);
+    if (fread(replayEvent.data.data(), 1, length, file) != length) {
+      STLOG_HAL_W("%s : capture truncated", __func__);
+      break;
+    }
+    events.push_back(replayEvent);
+  }
+  fclose(file);
+
+  replayTimed = timed;
+  divergences = 0;
+  STLOG_HAL_D("%s : %zu events loaded", __func__, events.size());
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_getApdus
+**
+** Description      Rebuilds the APDUs sent in the capture from the I-blocks
+**                  written.
+**
+** Parameters       apdus - where to store the APDUs.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerDriverReplay_getApdus(std::vector<std::vector<uint8_t>>* apdus) {
+  std::vector<uint8_t> apdu;
+  std::vector<uint8_t> lastIBlock;
+
+  apdus->clear();
+  for (const ReplayEvent& replayEvent : events) {
+    const std::vector<uint8_t>& frame = replayEvent.data;
+    if ((replayEvent.event.type != SPI_CAPTURE_WRITE) ||
+        (frame.size() < TPDU_PROLOGUE_LENGTH) || ((frame[1] & 0x80) != 0)) {
+      continue;
+    }
+    // A retransmitted I-block is identical to the previous one.
+    if (frame == lastIBlock) {
+      continue;
+    }
+    lastIBlock = frame;
+
+    size_t infLength = frame[2];
+    if (frame.size() < TPDU_PROLOGUE_LENGTH + infLength) {
+      continue;
+    }
+    apdu.insert(apdu.end(), frame.begin() + TPDU_PROLOGUE_LENGTH,
+                frame.begin() + TPDU_PROLOGUE_LENGTH + infLength);
+    if ((frame[1] & IBLOCK_M_BIT_MASK) == 0) {
+      apdus->push_back(apdu);
+      apdu.clear();
+    }
+  }
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_getDivergences
+**
+** Description      Gets the number of accesses that did not match the
+**                  capture.
+**
+** Returns          The number of divergences.
+**
+*******************************************************************************/
+unsigned int SpiLayerDriverReplay_getDivergences() { return divergences; }
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_startResponse
+**
+** Description      Collects the bytes the eSE sent after a write or a reset
+**                  of the capture. After a write, the polling reads before
+**                  the NAD are dropped: the replay answers them itself.
+**
+** Parameters       trigger   - index of the write or reset event.
+**                  skipToNad - true after a write.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void SpiLayerDriverReplay_startResponse(size_t trigger,
+                                               bool skipToNad) {
+  size_t i;
+  bool nadFound = !skipToNad;
+
+  response.clear();
+  responseOffset = 0;
+  responseDelayNs = 0;
+  for (i = trigger + 1;
+       (i < events.size()) && (events[i].event.type == SPI_CAPTURE_READ);
+       i++) {
+    const ReplayEvent& replayEvent = events[i];
+    if (!nadFound && (replayEvent.data.size() == 1) &&
+        (replayEvent.data[0] == NAD_SLAVE_TO_HOST)) {
+      nadFound = true;
+      responseDelayNs =
+          replayEvent.event.timestampNs - events[trigger].event.timestampNs;
+    }
+    if (nadFound) {
+      response.insert(response.end(), replayEvent.data.begin(),
+                      replayEvent.data.end());
+    }
+  }
+  nextEvent = i;
+  waitingForNad = skipToNad;
+  triggerNs = SpiLayerDriverReplay_now();
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_restartResponse
+**
+** Description      Serves the response again from its first byte, as the eSE
+**                  does when it sends its last block again.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void SpiLayerDriverReplay_restartResponse() {
+  responseOffset = 0;
+  waitingForNad = true;
+  triggerNs = SpiLayerDriverReplay_now();
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_setResponse
+**
+** Description      Replaces the response with a frame of the eSE.
+**
+** Parameters       pcb  - PCB of the frame.
+**                  len  - length of the INF field.
+**                  data - INF field.
+**
+** Returns          0 if the frame could be formed, -1 otherwise.
+**
+*******************************************************************************/
+static int SpiLayerDriverReplay_setResponse(uint8_t pcb, uint8_t len,
+                                            const uint8_t* data) {
+  Tpdu tpdu;
+
+  if (Tpdu_formTpdu(NAD_SLAVE_TO_HOST, pcb, len, data, &tpdu) != 0) {
+    return -1;
+  }
+  const uint8_t* frame = Tpdu_getFrame(&tpdu);
+  response.assign(frame, frame + Tpdu_getFrameLength(&tpdu));
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_sequenceResponse
+**
+** Description      Gives the response the sequence number the eSE uses at
+**                  this point of the replay, which differs from the capture
+**                  once a recovery resynchronized the link: an I-block takes
+**                  the N(S) asked by the R-block written, or the next one of
+**                  the eSE, and a R-block acknowledges the I-block written.
+**                  The EDC is computed again.
+**
+** Parameters       frame  - frame written by the host.
+**                  length - its length.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void SpiLayerDriverReplay_sequenceResponse(const uint8_t* frame,
+                                                  unsigned int length) {
+  if ((length < TPDU_PROLOGUE_LENGTH) ||
+      (response.size() < TPDU_PROLOGUE_LENGTH) ||
+      (response[NAD_OFFSET_IN_TPDU] != NAD_SLAVE_TO_HOST) ||
+      (response.size() <
+       (size_t)TPDU_PROLOGUE_LENGTH + response[LEN_OFFSET_IN_TPDU])) {
+    return;
+  }
+
+  uint8_t hostPcb = frame[PCB_OFFSET_IN_TPDU];
+  uint8_t pcb = response[PCB_OFFSET_IN_TPDU];
+  uint8_t sequencedPcb = pcb;
+  if ((pcb & 0x80) == 0) {
+    if ((hostPcb & 0xC0) == 0x80) {
+      eseSequence = ((hostPcb & REPLAY_RBLOCK_NR_BIT_MASK) != 0) ? 1 : 0;
+    } else if (!eseSequenceKnown) {
+      eseSequence = ((pcb & IBLOCK_NS_BIT_MASK) != 0) ? 1 : 0;
+    }
+    sequencedPcb = (pcb & ~IBLOCK_NS_BIT_MASK) |
+                   ((eseSequence != 0) ? IBLOCK_NS_BIT_MASK : 0);
+    eseSequence ^= 1;
+    eseSequenceKnown = true;
+  } else if (((pcb & 0xC0) == 0x80) && ((hostPcb & 0x80) == 0)) {
+    // An error free R-block asks for the next I-block, others for this one.
+    bool nr = ((hostPcb & IBLOCK_NS_BIT_MASK) != 0) ^
+              ((pcb & REPLAY_RBLOCK_ERROR_MASK) == 0);
+    sequencedPcb = (pcb & ~REPLAY_RBLOCK_NR_BIT_MASK) |
+                   (nr ? REPLAY_RBLOCK_NR_BIT_MASK : 0);
+  }
+
+  if (sequencedPcb != pcb) {
+    // The INF field is copied before the response is replaced.
+    SpiLayerDriverReplay_setResponse(sequencedPcb, response[LEN_OFFSET_IN_TPDU],
+                                     response.data() + TPDU_PROLOGUE_LENGTH);
+  }
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_isSameFrame
+**
+** Description      Compares a frame written with one of the capture, except
+**                  for the sequence number and the EDC that depends on it.
+**
+** Parameters       captured - write of the capture.
+**                  frame    - frame written.
+**                  length   - its length.
+**
+** Returns          true if the frames only differ by their sequence number.
+**
+*******************************************************************************/
+static bool SpiLayerDriverReplay_isSameFrame(
+    const std::vector<uint8_t>& captured, const uint8_t* frame,
+    unsigned int length) {
+  if ((captured.size() != length) || (length < TPDU_PROLOGUE_LENGTH) ||
+      (captured[NAD_OFFSET_IN_TPDU] != frame[NAD_OFFSET_IN_TPDU])) {
+    return false;
+  }
+
+  uint8_t pcb = frame[PCB_OFFSET_IN_TPDU];
+  uint8_t sequenceMask = 0;
+  if ((pcb & 0x80) == 0) {
+    sequenceMask = IBLOCK_NS_BIT_MASK;
+  } else if ((pcb & 0xC0) == 0x80) {
+    sequenceMask = REPLAY_RBLOCK_NR_BIT_MASK;
+  }
+  if ((captured[PCB_OFFSET_IN_TPDU] & ~sequenceMask) != (pcb & ~sequenceMask)) {
+    return false;
+  }
+
+  size_t end = TPDU_PROLOGUE_LENGTH + frame[LEN_OFFSET_IN_TPDU];
+  if (end > length) {
+    end = length;
+  }
+  return memcmp(captured.data() + LEN_OFFSET_IN_TPDU,
+                frame + LEN_OFFSET_IN_TPDU, end - LEN_OFFSET_IN_TPDU) == 0;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_findNext
+**
+** Description      Finds the next write or reset of the capture.
+**
+** Parameters       type - SPI_CAPTURE_WRITE or SPI_CAPTURE_RESET.
+**
+** Returns          Index of the event, events.size() if there is none.
+**
+*******************************************************************************/
+static size_t SpiLayerDriverReplay_findNext(SpiCaptureEventType type) {
+  size_t i = nextEvent;
+  while ((i < events.size()) && (events[i].event.type != type)) {
+    i++;
+  }
+  return i;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_findWrite
+**
+** Description      Finds the write of the capture the frame written matches:
+**                  the next one, the last one again when the host resends
+**                  its I-block after a resync, or for an I-block, a later one
+**                  when the capture went on with an APDU the stack gave up.
+**
+** Parameters       frame  - frame written.
+**                  length - its length.
+**
+** Returns          Index of the event, events.size() if there is none.
+**
+*******************************************************************************/
+static size_t SpiLayerDriverReplay_findWrite(const uint8_t* frame,
+                                             unsigned int length) {
+  if (resendExpected && (lastWrite < events.size()) &&
+      SpiLayerDriverReplay_isSameFrame(events[lastWrite].data, frame,
+                                       length)) {
+    return lastWrite;
+  }
+
+  size_t i = SpiLayerDriverReplay_findNext(SPI_CAPTURE_WRITE);
+  while (i < events.size()) {
+    if ((events[i].event.type == SPI_CAPTURE_WRITE) &&
+        SpiLayerDriverReplay_isSameFrame(events[i].data, frame, length)) {
+      return i;
+    }
+    if ((length < TPDU_PROLOGUE_LENGTH) ||
+        ((frame[PCB_OFFSET_IN_TPDU] & 0x80) != 0)) {
+      // Only the I-blocks are looked for further on.
+      break;
+    }
+    i++;
+  }
+  return events.size();
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriverReplay_answer
+**
+** Description      Answers a frame of the recovery the capture does not hold,
+**                  as the eSE would: the last block is sent again after a
+**                  R-block or a S(WTX response), and the S-block requests
+**                  get their response.
+**
+** Parameters       frame  - frame written.
+**                  length - its length.
+**
+** Returns          0 if the frame was answered, -1 otherwise.
+**
+*******************************************************************************/
+static int SpiLayerDriverReplay_answer(const uint8_t* frame,
+                                       unsigned int length) {
+  if (length < TPDU_PROLOGUE_LENGTH) {
+    return -1;
+  }
+
+  uint8_t pcb = frame[PCB_OFFSET_IN_TPDU];
+  if ((pcb & 0xC0) == 0x80) {
+    SpiLayerDriverReplay_restartResponse();
+    return 0;
+  }
+  switch (pcb) {
+    case SBLOCK_WTX_RESPONSE_MASK:
+      break;
+    case SBLOCK_RESYNCH_REQUEST_MASK:
+      SpiLayerDriverReplay_setResponse(SBLOCK_RESYNCH_RESPONSE_MASK, 0, NULL);
+      eseSequence = 0;
+      eseSequenceKnown = true;
+      resendExpected = true;
+      break;
+    case SBLOCK_IFS_REQUEST_MASK:
+    case SBLOCK_ABORT_REQUEST_MASK:
+      SpiLayerDriverReplay_setResponse(pcb | 0b00100000,
+                                       frame[LEN_OFFSET_IN_TPDU],
+                                       frame + TPDU_PROLOGUE_LENGTH);
+      break;
+    case SBLOCK_SWRESET_REQUEST_MASK:
+      if (lastAtp.empty()) {
+        // No ATP to answer with: let the stack time out.
+        response.clear();
+      } else {
+        SpiLayerDriverReplay_setResponse(SBLOCK_SWRESET_RESPONSE_MASK,
+                                         lastAtp.size(), lastAtp.data());
+      }
+      eseSequence = 0;
+      eseSequenceKnown = true;
+      break;
+    default:
+      return -1;
+  }
+  SpiLayerDriverReplay_restartResponse();
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriver_open
+**
+** Description      Starts the replay of the loaded capture.
+**
+** Parameters       spiDevPath - ignored.
+**
+** Returns          A dummy handle, -1 if no capture is loaded.
+**
+*******************************************************************************/
+int SpiLayerDriver_open(char* spiDevPath) {
+  STLOG_HAL_D("%s : replaying instead of opening %s", __func__, spiDevPath);
+  if (events.empty()) {
+    return -1;
+  }
+  nextEvent = 0;
+  lastWrite = events.size();
+  resendExpected = false;
+  response.clear();
+  responseOffset = 0;
+  waitingForNad = false;
+  return REPLAY_DEVICE_HANDLE;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriver_close
+**
+** Description      Ends the replay.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerDriver_close() {
+  STLOG_HAL_D("%s : %zu of %zu events replayed, %u divergences", __func__,
+              nextEvent, events.size(), divergences);
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriver_read
+**
+** Description      Serves the bytes the eSE sent in the capture. While
+**                  polling, the NAD is only returned once the eSE delay of
+**                  the capture elapsed, if the replay is timed.
+**
+** Parameters       rxBuffer    - Buffer to store recieved datas.
+**                  bytesToRead - Expected number of bytes to be read.
+**
+** Returns          bytesToRead.
+**
+*******************************************************************************/
+int SpiLayerDriver_read(uint8_t* rxBuffer, unsigned int bytesToRead) {
+  if (waitingForNad) {
+    if (response.empty() ||
+        (replayTimed &&
+         (SpiLayerDriverReplay_now() - triggerNs < responseDelayNs))) {
+      // No answer yet (or none in the capture: let the stack time out).
+      memset(rxBuffer, REPLAY_IDLE_BYTE, bytesToRead);
+      return bytesToRead;
+    }
+    waitingForNad = false;
+  }
+
+  size_t available = response.size() - responseOffset;
+  size_t length = (bytesToRead < available) ? bytesToRead : available;
+  memcpy(rxBuffer, response.data() + responseOffset, length);
+  responseOffset += length;
+  if (length < bytesToRead) {
+    STLOG_HAL_W("%s : %u bytes read, %zu left in the capture", __func__,
+                bytesToRead, length);
+    memset(rxBuffer + length, REPLAY_IDLE_BYTE, bytesToRead - length);
+    divergences++;
+  }
+  return bytesToRead;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriver_write
+**
+** Description      Matches the frame written with a write of the capture,
+**                  and prepares the answer of the eSE to it. The frames of a
+**                  recovery the capture does not hold are answered by the
+**                  replay.
+**
+** Parameters       txBuffer       - Buffer to transmit.
+**                  txBufferLength - Number of bytes to be written.
+**
+** Returns          txBufferLength, -1 if the capture is exhausted.
+**
+*******************************************************************************/
+int SpiLayerDriver_write(const uint8_t* txBuffer,
+                         unsigned int txBufferLength) {
+  size_t i = SpiLayerDriverReplay_findWrite(txBuffer, txBufferLength);
+  if (i == events.size()) {
+    divergences++;
+    if (SpiLayerDriverReplay_answer(txBuffer, txBufferLength) == 0) {
+      STLOG_HAL_D("%s : frame not in the capture, answered", __func__);
+      return txBufferLength;
+    }
+    i = SpiLayerDriverReplay_findNext(SPI_CAPTURE_WRITE);
+    if (i == events.size()) {
+      STLOG_HAL_E("%s : no more writes in the capture", __func__);
+      return -1;
+    }
+    STLOG_HAL_W("%s : frame differs from the capture (event %zu)", __func__,
+                i);
+  } else if ((events[i].data.size() != txBufferLength) ||
+             (memcmp(events[i].data.data(), txBuffer, txBufferLength) != 0) ||
+             (i != SpiLayerDriverReplay_findNext(SPI_CAPTURE_WRITE))) {
+    STLOG_HAL_W("%s : frame differs from the capture (event %zu)", __func__,
+                i);
+    divergences++;
+  }
+
+  lastWrite = i;
+  resendExpected = false;
+  SpiLayerDriverReplay_startResponse(i, true);
+  SpiLayerDriverReplay_sequenceResponse(txBuffer, txBufferLength);
+  if ((txBufferLength >= TPDU_PROLOGUE_LENGTH) &&
+      ((txBuffer[PCB_OFFSET_IN_TPDU] == SBLOCK_RESYNCH_REQUEST_MASK) ||
+       (txBuffer[PCB_OFFSET_IN_TPDU] == SBLOCK_SWRESET_REQUEST_MASK))) {
+    // A capture of a recovery: the eSE starts again from N(S) = 0.
+    eseSequence = 0;
+    eseSequenceKnown = true;
+  }
+  return txBufferLength;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriver_setSpeed
+**
+** Description      The clock frequency is not captured: nothing to match.
+**
+** Returns          0
+**
+*******************************************************************************/
+int SpiLayerDriver_setSpeed(uint32_t speedHz) {
+  (void)speedHz;
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerDriver_reset
+**
+** Description      Matches the next reset of the capture, and prepares the
+**                  ATP that follows it.
+**
+** Returns          The result of the reset in the capture, -1 if there is
+**                  none.
+**
+*******************************************************************************/
+int SpiLayerDriver_reset() {
+  size_t i = SpiLayerDriverReplay_findNext(SPI_CAPTURE_RESET);
+  if (i == events.size()) {
+    STLOG_HAL_E("%s : no more resets in the capture", __func__);
+    divergences++;
+    return -1;
+  }
+
+  SpiLayerDriverReplay_startResponse(i, false);
+  lastAtp = response;
+  eseSequence = 0;
+  eseSequenceKnown = true;
+  resendExpected = false;
+  return events[i].event.result;
+}
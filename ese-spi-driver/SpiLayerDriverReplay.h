@@ -0,0 +1,65 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef SPILAYERDRIVERREPLAY_H_
+#define SPILAYERDRIVERREPLAY_H_
+
+/*
+ * Replay transport: SpiLayerDriverReplay.cc implements the SpiLayerDriver.h
+ * API on top of a capture made with ST_ESE_SPI_CAPTURE_FILE, and is linked
+ * instead of SpiLayerDriver.cc. Each write or reset of the stack consumes
+ * the next one of the capture, and the reads are served the bytes the eSE
+ * sent after it. The frames of a recovery the capture does not hold, e.g.
+ * after faults injected with StEse_setFaultInjection(), are answered as the
+ * eSE would, and the eSE blocks follow the sequence numbers of the link.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <vector>
+#include "SpiLayerDriver.h"
+
+/**
+ * Loads the capture to replay. Must be called before the device is opened.
+ *
+ * @param path The capture file.
+ * @param timed true to answer after the delay the eSE took in the capture,
+ *        false to answer as fast as possible.
+ *
+ * @return 0 if the capture could be loaded, -1 otherwise.
+ */
+int SpiLayerDriverReplay_load(const char* path, bool timed);
+
+/**
+ * Gets the APDUs sent in the capture, rebuilt from the I-blocks written.
+ * Retransmitted blocks are only taken once.
+ *
+ * @param apdus Where to store the APDUs.
+ */
+void SpiLayerDriverReplay_getApdus(std::vector<std::vector<uint8_t>>* apdus);
+
+/**
+ * Gets the number of accesses of the stack that did not match the capture:
+ * frames written that differ, frames the replay answered itself, or reads
+ * beyond what the eSE sent.
+ *
+ * @return The number of divergences since the capture was loaded.
+ */
+unsigned int SpiLayerDriverReplay_getDivergences();
+
+#endif /* SPILAYERDRIVERREPLAY_H_ */
@@ -0,0 +1,302 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-SpiLayerFaults"
+#include "SpiLayerFaults.h"
+#include <string.h>
+#include <time.h>
+#include "SpiLayerComm.h"
+#include "SpiLayerDriver.h"
+#include "T1protocol.h"
+#include "android_logmsg.h"
+#include "utils-lib/Atp.h"
+#include "utils-lib/BusCounters.h"
+#include "utils-lib/Tpdu.h"
+
+// Byte read while the eSE has nothing to send
+#define FAULT_IDLE_BYTE 0x00
+// A delayed response arrives that long after the BWT
+#define FAULT_TIMEOUT_MARGIN_MS 10
+// Multiplier of the spurious S(WTX) requests
+#define FAULT_WTX_MULTIPLIER 1
+
+// Part of the response frame the next read is expected to get.
+typedef enum {
+  FAULT_STATE_IDLE,     /* nothing written yet, or frame fully read */
+  FAULT_STATE_POLL,     /* polling for the NAD */
+  FAULT_STATE_PROLOGUE, /* PCB and LEN */
+  FAULT_STATE_BODY,     /* INF and EDC */
+} FaultState;
+
+// Accessed by the thread the scheduler granted the device to only.
+static StEse_faultRates faultRates;
+static bool faultsEnabled = false;
+static uint32_t randomState = 1;
+static FaultState faultState = FAULT_STATE_IDLE;
+static bool firstPoll = false;
+// Polls are answered idle until then, while a response is delayed.
+static uint64_t mutedUntilNs = 0;
+// Spurious frame served instead of the eSE one.
+static uint8_t injectedFrame[TPDU_MAX_LENGTH];
+static unsigned int injectedLength = 0;
+static unsigned int injectedOffset = 0;
+
+/*******************************************************************************
+**
+** Function         SpiLayerFaults_now
+**
+** Description      Gets the monotonic time.
+**
+** Returns          Current time in ns.
+**
+*******************************************************************************/
+static uint64_t SpiLayerFaults_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerFaults_random
+**
+** Description      Gets the next number of the pseudo random sequence
+**                  (xorshift32), reproducible from its seed.
+**
+** Returns          The number.
+**
+*******************************************************************************/
+static uint32_t SpiLayerFaults_random() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerFaults_hit
+**
+** Description      Decides if a fault is injected, and accounts it.
+**
+** Parameters       rate    - faults per 1000 frames.
+**                  counter - counter of the fault.
+**
+** Returns          true if the fault must be injected.
+**
+*******************************************************************************/
+static bool SpiLayerFaults_hit(uint16_t rate, BusCounter counter) {
+  if ((rate == 0) || (SpiLayerFaults_random() % 1000 >= rate)) {
+    return false;
+  }
+  BusCounters_add(counter, 1);
+  return true;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerFaults_injectWtx
+**
+** Description      Prepares a S(WTX) request the eSE did not send, served by
+**                  the next reads.
+**
+** Returns          0 if the frame could be formed, -1 otherwise.
+**
+*******************************************************************************/
+static int SpiLayerFaults_injectWtx() {
+  Tpdu wtxTpdu;
+  uint8_t multiplier = FAULT_WTX_MULTIPLIER;
+
+  if (Tpdu_formTpdu(NAD_SLAVE_TO_HOST, SBLOCK_WTX_REQUEST_MASK, 1, &multiplier,
+                    &wtxTpdu) == -1) {
+    return -1;
+  }
+  injectedLength = Tpdu_getFrameLength(&wtxTpdu);
+  memcpy(injectedFrame, Tpdu_getFrame(&wtxTpdu), injectedLength);
+  injectedOffset = 0;
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerFaults_setRates
+**
+** Description      Sets the fault rates and the seed of the sequence.
+**
+** Parameters       rates - faults per 1000 frames received.
+**                  seed  - seed of the sequence.
+**
+** Returns          void
+**
+*******************************************************************************/
+void SpiLayerFaults_setRates(const StEse_faultRates* rates, uint32_t seed) {
+  faultRates = *rates;
+  faultsEnabled = (rates->crcError != 0) || (rates->droppedNad != 0) ||
+                  (rates->truncatedFrame != 0) || (rates->spuriousWtx != 0) ||
+                  (rates->timeout != 0);
+  // xorshift never leaves 0
+  randomState = (seed != 0) ? seed : 1;
+  faultState = FAULT_STATE_IDLE;
+  mutedUntilNs = 0;
+  injectedLength = 0;
+
+  if (faultsEnabled) {
+    STLOG_HAL_W("%s : injecting faults per 1000 frames: crc %u, nad %u, "
+                "truncation %u, wtx %u, timeout %u (seed %u)",
+                __func__, rates->crcError, rates->droppedNad,
+                rates->truncatedFrame, rates->spuriousWtx, rates->timeout,
+                seed);
+  }
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerFaults_poll
+**
+** Description      Reads a polling byte. The first poll of an exchange may
+**                  start a spurious S(WTX) or delay the response beyond the
+**                  BWT, and a NAD may be dropped.
+**
+** Parameters       rxBuffer    - Buffer to store recieved datas.
+**                  bytesToRead - Expected number of bytes to be read.
+**
+** Returns          The amount of bytes read, -1 if something failed.
+**
+*******************************************************************************/
+static int SpiLayerFaults_poll(uint8_t* rxBuffer, unsigned int bytesToRead) {
+  if (firstPoll) {
+    firstPoll = false;
+    if (SpiLayerFaults_hit(faultRates.timeout, BUS_COUNTER_FAULTS_TIMEOUT)) {
+      mutedUntilNs = SpiLayerFaults_now() +
+                     (uint64_t)(ATP.bwt + FAULT_TIMEOUT_MARGIN_MS) * 1000000;
+    } else if (SpiLayerFaults_hit(faultRates.spuriousWtx,
+                                  BUS_COUNTER_FAULTS_SPURIOUS_WTX) &&
+               (SpiLayerFaults_injectWtx() == 0)) {
+      // Served by SpiLayerFaults_read() from now on
+      return SpiLayerFaults_read(rxBuffer, bytesToRead);
+    }
+  }
+
+  // The response is held back: the bus is not even clocked.
+  if ((mutedUntilNs != 0) && (SpiLayerFaults_now() < mutedUntilNs)) {
+    memset(rxBuffer, FAULT_IDLE_BYTE, bytesToRead);
+    return bytesToRead;
+  }
+  mutedUntilNs = 0;
+
+  int rc = SpiLayerDriver_read(rxBuffer, bytesToRead);
+  if ((rc == 1) && (rxBuffer[0] == NAD_SLAVE_TO_HOST)) {
+    if (SpiLayerFaults_hit(faultRates.droppedNad,
+                           BUS_COUNTER_FAULTS_DROPPED_NAD)) {
+      // The rest of the frame is then taken for polling bytes.
+      rxBuffer[0] = FAULT_IDLE_BYTE;
+    } else {
+      faultState = FAULT_STATE_PROLOGUE;
+    }
+  }
+  return rc;
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerFaults_read
+**
+** Description      Reads from the SPI interface, injecting the faults of the
+**                  part of the response frame being read.
+**
+** Parameters       rxBuffer    - Buffer to store recieved datas.
+**                  bytesToRead - Expected number of bytes to be read.
+**
+** Returns          The amount of bytes read, -1 if something failed.
+**
+*******************************************************************************/
+int SpiLayerFaults_read(uint8_t* rxBuffer, unsigned int bytesToRead) {
+  int rc;
+
+  if (!faultsEnabled) {
+    return SpiLayerDriver_read(rxBuffer, bytesToRead);
+  }
+
+  // Serve the spurious frame first, the eSE response waits behind it.
+  if (injectedOffset < injectedLength) {
+    unsigned int available = injectedLength - injectedOffset;
+    unsigned int length = (bytesToRead < available) ? bytesToRead : available;
+    memcpy(rxBuffer, injectedFrame + injectedOffset, length);
+    memset(rxBuffer + length, FAULT_IDLE_BYTE, bytesToRead - length);
+    injectedOffset += length;
+    return bytesToRead;
+  }
+
+  switch (faultState) {
+    case FAULT_STATE_POLL:
+      if (bytesToRead == 1) {
+        return SpiLayerFaults_poll(rxBuffer, bytesToRead);
+      }
+      break;
+
+    case FAULT_STATE_PROLOGUE:
+      faultState = FAULT_STATE_BODY;
+      rc = SpiLayerDriver_read(rxBuffer, bytesToRead);
+      // Shorten LEN: the end of the frame is left unread, and the EDC is
+      // taken from the middle of the INF field.
+      if ((rc == 2) && (rxBuffer[1] > 1) &&
+          SpiLayerFaults_hit(faultRates.truncatedFrame,
+                             BUS_COUNTER_FAULTS_TRUNCATED)) {
+        rxBuffer[1] /= 2;
+      }
+      return rc;
+
+    case FAULT_STATE_BODY:
+      faultState = FAULT_STATE_IDLE;
+      rc = SpiLayerDriver_read(rxBuffer, bytesToRead);
+      if ((rc > 0) &&
+          SpiLayerFaults_hit(faultRates.crcError, BUS_COUNTER_FAULTS_CRC)) {
+        rxBuffer[SpiLayerFaults_random() % rc] ^=
+            1 << (SpiLayerFaults_random() % 8);
+      }
+      return rc;
+
+    case FAULT_STATE_IDLE:
+      break;
+  }
+  return SpiLayerDriver_read(rxBuffer, bytesToRead);
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerFaults_write
+**
+** Description      Writes to the SPI interface, and starts a new exchange for
+**                  the faults.
+**
+** Parameters       txBuffer       - Buffer to transmit.
+**                  txBufferLength - Number of bytes to be written.
+**
+** Returns          The amount of bytes written, -1 if something failed.
+**
+*******************************************************************************/
+int SpiLayerFaults_write(const uint8_t* txBuffer,
+                         unsigned int txBufferLength) {
+  if (faultsEnabled) {
+    faultState = FAULT_STATE_POLL;
+    firstPoll = true;
+    injectedLength = 0;
+    injectedOffset = 0;
+  }
+  return SpiLayerDriver_write(txBuffer, txBufferLength);
+}
@@ -0,0 +1,67 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef SPILAYERFAULTS_H_
+#define SPILAYERFAULTS_H_
+
+/*
+ * Fault injection transport: wraps the SpiLayerDriver.h reads and writes of
+ * the T=1 frames to corrupt them at configurable rates, so that the cost of
+ * the recovery paths can be measured. The faults are those of a noisy bus:
+ * CRC errors, dropped NADs, truncated frames, spurious S(WTX) requests and
+ * responses arriving after the BWT. With all the rates at 0 (the default),
+ * the accesses go straight to the driver.
+ */
+
+#include <stdint.h>
+#include "StEseApi.h"
+
+/**
+ * Sets the fault rates, and restarts the pseudo random sequence deciding
+ * which frames are hit.
+ *
+ * @param rates The rates, in faults per 1000 frames received.
+ * @param seed Seed of the sequence, the same seed hits the same frames.
+ */
+void SpiLayerFaults_setRates(const StEse_faultRates* rates, uint32_t seed);
+
+/**
+ * Reads from the SPI interface, see SpiLayerDriver_read(). A fault may
+ * alter the bytes returned, or replace the read altogether.
+ *
+ * @param rxBuffer The buffer where the received bytes are stored.
+ * @param bytesToRead The expected number of bytes to be read.
+ *
+ * @return The amount of bytes read from the slave, -1 if something failed.
+ */
+int SpiLayerFaults_read(uint8_t* rxBuffer, unsigned int bytesToRead);
+
+/**
+ * Writes to the SPI interface, see SpiLayerDriver_write(). The frames
+ * written are never altered, but each one starts a new exchange for the
+ * faults of the response.
+ *
+ * @param txBuffer The buffer where the bytes to write are placed.
+ * @param txBufferLength The number of bytes to be written.
+ *
+ * @return The amount of bytes written to the slave, -1 if something failed.
+ */
+int SpiLayerFaults_write(const uint8_t* txBuffer,
+                         unsigned int txBufferLength);
+
+#endif /* SPILAYERFAULTS_H_ */
@@ -21,17 +21,18 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/time.h>
+#include "SpiLayerClock.h"
 #include "SpiLayerComm.h"
 #include "SpiLayerDriver.h"
+#include "StEseJournal.h"
 #include "T1protocol.h"
 #include "android_logmsg.h"
 #include "utils-lib/Atp.h"
+#include "utils-lib/SpiCapture.h"
 
 #define SPI_BITS_PER_WORD 8
 #define SPI_MODE SPI_MODE_0
 
-#define KHZ_TO_HZ 1000
-
 static bool mFirstActivation = false;
 
 /*******************************************************************************
@@ -51,6 +52,11 @@ int SpiLayerInterface_init(SpiDriver_config_t* tSpiDriver) {
   // Configure the SPI before start the data exchange with the eSE
   char* spiDevPath = tSpiDriver->pDevName;
 
+  // Capture from the open on, the replay needs the ATP and IFS exchanges.
+  if (tSpiDriver->pCaptureFile != NULL) {
+    SpiCapture_start(tSpiDriver->pCaptureFile);
+  }
+
   int DevHandle = SpiLayerDriver_open(spiDevPath);
   tSpiDriver->pDevHandle = (void*)((intptr_t)DevHandle);
   if (DevHandle == -1) {
@@ -59,13 +65,23 @@ int SpiLayerInterface_init(SpiDriver_config_t* tSpiDriver) {
     return -1;
   }
 
+  if (tSpiDriver->pJournalFile != NULL) {
+    StEseJournal_open(tSpiDriver->pJournalFile);
+  }
+  SpiLayerClock_init(tSpiDriver->devMaxFreq, tSpiDriver->pollFreq,
+                     tSpiDriver->adaptiveClock);
+
   if (!mFirstActivation) {
-    if (SpiLayerInterface_setup() == -1) {
+    // A restarted service takes over the link left by the previous one, if
+    // the eSE still answers, rather than resetting it.
+    if ((StEseJournal_resume() != 0) && (SpiLayerInterface_setup() == -1)) {
       return -1;
     }
     mFirstActivation = true;
     STLOG_HAL_D("SPI bus working at ATP.msf =  %i KHz", ATP.msf);
   }
+  // Also when the link was resumed, or the device reopened, without a reset
+  SpiLayerClock_setMaxSpeed(ATP.msf * KHZ_TO_HZ);
 
   STLOG_HAL_D("SPI Driver interface initialized.");
   return 0;
@@ -81,24 +97,50 @@ int SpiLayerInterface_init(SpiDriver_config_t* tSpiDriver) {
 ** Parameters       cmdTpdu    -The TPDU to be sent.
 **                  respTpdu   -The memory position where to store the response.
 **                  numberOfBwt-The maximum number of BWT to wait.
+**                  deadline   -Absolute time after which the exchange is
+**                              given up, NULL if there is none.
 **
 ** Returns          bytesRead if data was read, 0 if timeout expired with
-**                  no response, -1 otherwise
+**                  no response, -2 if the deadline expired or the exchange
+**                  was cancelled, -1 otherwise
 **
 *******************************************************************************/
-int SpiLayerInterface_transcieveTpdu(Tpdu* cmdTpdu, Tpdu* respTpdu,
-                                     int numberOfBwt) {
+int SpiLayerInterface_transcieveTpdu(const Tpdu* cmdTpdu, Tpdu* respTpdu,
+                                     int numberOfBwt,
+                                     const struct timeval* deadline) {
   // Send the incoming Tpdu to the slave
   if (SpiLayerComm_writeTpdu(cmdTpdu) < 0) {
     return -1;
   }
 
+  return SpiLayerInterface_receiveTpdu(respTpdu, numberOfBwt, deadline);
+}
+
+/*******************************************************************************
+**
+** Function         SpiLayerInterface_receiveTpdu
+**
+** Description       Waits for the response to the TPDU already sent to the SE
+**                   and returns it.
+**
+** Parameters       respTpdu   -The memory position where to store the response.
+**                  numberOfBwt-The maximum number of BWT to wait.
+**                  deadline   -Absolute time after which the exchange is
+**                              given up, NULL if there is none.
+**
+** Returns          bytesRead if data was read, 0 if timeout expired with
+**                  no response, -2 if the deadline expired or the exchange
+**                  was cancelled, -1 otherwise
+**
+*******************************************************************************/
+int SpiLayerInterface_receiveTpdu(Tpdu* respTpdu, int numberOfBwt,
+                                  const struct timeval* deadline) {
   if (numberOfBwt <= 0) {
     STLOG_HAL_W("Buffer overflow happened, restoring numberOfBwt");
     numberOfBwt = DEFAULT_NBWT;
   }
   // Wait for response
-  int result = SpiLayerComm_waitForResponse(respTpdu, numberOfBwt);
+  int result = SpiLayerComm_waitForResponse(respTpdu, numberOfBwt, deadline);
 
   // Unable to receive the response from slave
   if (result == -1) {
@@ -106,6 +148,9 @@ int SpiLayerInterface_transcieveTpdu(Tpdu* cmdTpdu, Tpdu* respTpdu,
   } else if (result == -2) {
     // 0 bytes read
     return 0;
+  } else if (result == -3) {
+    // Deadline expired or exchange cancelled
+    return -2;
   }
 
   // Read the response
@@ -116,10 +161,8 @@ int SpiLayerInterface_transcieveTpdu(Tpdu* cmdTpdu, Tpdu* respTpdu,
   }
   STLOG_HAL_D("%d bytes read from SPI interface", bytesRead);
 
-  uint8_t buffer[(5 + respTpdu->len)];
-  uint16_t length = Tpdu_toByteArray(respTpdu, buffer);
-  if (length > 0) {
-    DispHal("Rx", buffer, length);
+  if (STLOG_HAL_ENABLED(STESE_TRACE_LEVEL_DEBUG)) {
+    DispHal("Rx", Tpdu_getFrame(respTpdu), Tpdu_getFrameLength(respTpdu));
   }
   return bytesRead;
 }
@@ -139,6 +182,7 @@ void SpiLayerInterface_close(void* pDevHandle) {
   if (NULL != pDevHandle) {
     STLOG_HAL_D("SpiLayerInterface_close");
     SpiLayerDriver_close();
+    SpiCapture_stop();
   }
 }
 /*******************************************************************************
@@ -159,10 +203,12 @@ int SpiLayerInterface_setup() {
     STLOG_HAL_E("Error reading the ATP.");
     return -1;
   }
+  SpiLayerClock_setMaxSpeed(ATP.msf * KHZ_TO_HZ);
   T1protocol_resetSequenceNumbers();
   // Negotiate IFS value
   if (T1protocol_doRequestIFS() != 0) {
     return -1;
   }
+  StEseJournal_recordReset();
   return 0;
 }
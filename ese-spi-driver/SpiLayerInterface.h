@@ -19,8 +19,11 @@
 #ifndef SPILAYERINTERFACE_H_
 #define SPILAYERINTERFACE_H_
 
+#include <sys/time.h>
 #include "utils-lib/Tpdu.h"
 
+#define KHZ_TO_HZ 1000
+
 typedef struct SpiDriver_config {
   char* pDevName;
   /*!< Port name connected to ESE
@@ -33,9 +36,26 @@ typedef struct SpiDriver_config {
   uint32_t devMaxFreq;
   /*!< Communication speed between DH and ESE
    *
-   * This is the baudrate of the bus for communication between DH and ESE
+   * This is the baudrate of the bus for communication between DH and ESE,
+   * in Hz. It caps the one of the ATP, 0 if the board has no limit.
    */
 
+  uint32_t pollFreq;
+  /*!< SPI clock while polling for the response in Hz, 0 for the data one */
+
+  bool adaptiveClock;
+  /*!< Lowers the SPI clock after CRC error bursts, raises it back after
+   * sustained clean traffic */
+
+  uint8_t ifsd;
+  /*!< IFSD to negotiate with the ESE, 0 for the maximum */
+
+  char* pCaptureFile;
+  /*!< File the SPI traffic is captured to, NULL if not captured */
+
+  char* pJournalFile;
+  /*!< State journal resumed by a restarted service, NULL if none */
+
   void* pDevHandle;
   /*!< Device handle output */
 } SpiDriver_config_t, *pSpiDriver_config_t; /* pointer to SpiDriver_config_t */
@@ -57,12 +77,29 @@ int SpiLayerInterface_init(SpiDriver_config_t* tSpiDriver);
  * @param cmdTpdu The TPDU to be sent.
  * @param respTpdu The memory position where to store the response.
  * @param numberOfBwt The maximum number of BWT to wait.
+ * @param deadline Absolute time after which the exchange is given up, NULL
+ * if there is none.
  *
  * @return 0 if everything went ok, -1 otherwise. If timeout expired with no
- * response, 0 will be returned and respTpdu will be NULL.
+ * response, 0 will be returned and respTpdu will be NULL. If the deadline
+ * expired or the exchange was cancelled, -2 will be returned.
+ */
+int SpiLayerInterface_transcieveTpdu(const Tpdu* cmdTpdu, Tpdu* respTpdu,
+                                     int numberOfBwt,
+                                     const struct timeval* deadline);
+
+/**
+ * Waits for the response to the TPDU already sent to the SE and returns it.
+ *
+ * @param respTpdu The memory position where to store the response.
+ * @param numberOfBwt The maximum number of BWT to wait.
+ * @param deadline Absolute time after which the exchange is given up, NULL
+ * if there is none.
+ *
+ * @return Same as SpiLayerInterface_transcieveTpdu.
  */
-int SpiLayerInterface_transcieveTpdu(Tpdu* cmdTpdu, Tpdu* respTpdu,
-                                     int numberOfBwt);
+int SpiLayerInterface_receiveTpdu(Tpdu* respTpdu, int numberOfBwt,
+                                  const struct timeval* deadline);
 
 void SpiLayerInterface_close(void* pDevHandle);
 
@@ -18,13 +18,22 @@
  ******************************************************************************/
 #define LOG_TAG "StEse_HalApi"
 
-#include <pthread.h>
 #include "StEseApi.h"
+#include "SpiLayerClock.h"
 #include "SpiLayerComm.h"
+#include "SpiLayerFaults.h"
+#include "StEseJournal.h"
+#include "StEseLatency.h"
+#include "StEseScheduler.h"
 #include <cutils/properties.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <ese_config.h>
 #include "T1protocol.h"
 #include "android_logmsg.h"
+#include "utils-lib/BusCounters.h"
+#include "utils-lib/TpduTrace.h"
+#include "utils-lib/Utils.h"
 
 /*********************** Global Variables *************************************/
 
@@ -33,7 +42,29 @@ ese_Context_t ese_ctxt;
 
 const char* halVersion = "ST54-SE HAL1.0 Version 1.0.20";
 
-pthread_mutex_t mutex;
+/* Time the liveness of the eSE is reused before probing it again */
+#define DEFAULT_LIVENESS_TTL_MS 5000
+
+/* Scheduling priority of each logical channel */
+static StEse_priority channelPriority[ESE_MAX_LOGICAL_CHANNELS];
+
+/* File the TPDU trace is dumped to when an APDU fails, empty if disabled */
+static std::string traceFilePath;
+
+/* Background recovery, at most one at a time */
+static pthread_mutex_t recoveryMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recoveryCond = PTHREAD_COND_INITIALIZER;
+static bool recoveryRunning = false;
+static StEse_recoveryCallback recoveryCallback = NULL;
+static void* recoveryContext = NULL;
+/* Set in the recovery thread while its callback holds the device */
+static thread_local bool recoveryOwnsDevice = false;
+
+/* Whether the eSE answered, when it was last known (0 if never) */
+static pthread_mutex_t livenessMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool livenessAlive = true;
+static uint64_t livenessCheckNs = 0;
+static uint64_t livenessTtlNs = (uint64_t)DEFAULT_LIVENESS_TTL_MS * 1000000;
 
 /******************************************************************************
  * Function         StEseLog_InitializeLogLevel
@@ -47,6 +78,92 @@ pthread_mutex_t mutex;
 
 void StEseLog_InitializeLogLevel() { InitializeSTLogLevel(); }
 
+/******************************************************************************
+ * Function         StEse_initChannelPriorities
+ *
+ * Description      This function is called during StEse_init to set the
+ *                  priority of each logical channel from the configuration
+ *                  file. Channels are given as bit masks, bit n standing for
+ *                  logical channel n.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+static void StEse_initChannelPriorities() {
+  unsigned highMask =
+      EseConfig::getUnsigned(NAME_ST_ESE_HIGH_PRIORITY_CHANNELS, 0);
+  unsigned lowMask =
+      EseConfig::getUnsigned(NAME_ST_ESE_LOW_PRIORITY_CHANNELS, 0);
+  uint8_t channel;
+
+  for (channel = 0; channel < ESE_MAX_LOGICAL_CHANNELS; channel++) {
+    if (highMask & (1u << channel)) {
+      channelPriority[channel] = ESE_PRIORITY_HIGH;
+    } else if (lowMask & (1u << channel)) {
+      channelPriority[channel] = ESE_PRIORITY_LOW;
+    } else {
+      channelPriority[channel] = ESE_PRIORITY_NORMAL;
+    }
+  }
+}
+
+/******************************************************************************
+ * Function         StEse_initFaultInjection
+ *
+ * Description      This function is called during StEse_init to set the
+ *                  rates of the faults injected on the bus from the
+ *                  configuration file. None by default.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+static void StEse_initFaultInjection() {
+  StEse_faultRates rates;
+
+  rates.crcError = EseConfig::getUnsigned(NAME_ST_ESE_FAULT_CRC_ERROR, 0);
+  rates.droppedNad = EseConfig::getUnsigned(NAME_ST_ESE_FAULT_DROPPED_NAD, 0);
+  rates.truncatedFrame =
+      EseConfig::getUnsigned(NAME_ST_ESE_FAULT_TRUNCATED_FRAME, 0);
+  rates.spuriousWtx = EseConfig::getUnsigned(NAME_ST_ESE_FAULT_SPURIOUS_WTX, 0);
+  rates.timeout = EseConfig::getUnsigned(NAME_ST_ESE_FAULT_TIMEOUT, 0);
+  SpiLayerFaults_setRates(&rates,
+                          EseConfig::getUnsigned(NAME_ST_ESE_FAULT_SEED, 1));
+}
+
+/******************************************************************************
+ * Function         StEse_getLogicalChannel
+ *
+ * Description      This function extracts the logical channel number from
+ *                  the class byte of a command APDU (ISO 7816-4).
+ *
+ * Returns          The logical channel number.
+ *
+ ******************************************************************************/
+static uint8_t StEse_getLogicalChannel(uint8_t cla) {
+  if ((cla & 0x40) == 0) {
+    // First interindustry values: channels 0 to 3
+    return cla & 0x03;
+  }
+  // Further interindustry values: channels 4 to 19
+  return 4 + (cla & 0x0F);
+}
+
+/******************************************************************************
+ * Function         StEse_setAlive
+ *
+ * Description      This function records whether the eSE answered, from an
+ *                  APDU, a recovery or a liveness probe.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+static void StEse_setAlive(bool alive) {
+  pthread_mutex_lock(&livenessMutex);
+  livenessAlive = alive;
+  livenessCheckNs = StEseLatency_now();
+  pthread_mutex_unlock(&livenessMutex);
+}
+
 /******************************************************************************
  * Function         StEse_init
  *
@@ -61,10 +178,10 @@ void StEseLog_InitializeLogLevel() { InitializeSTLogLevel(); }
 ESESTATUS StEse_init() {
   SpiDriver_config_t tSpiDriver;
   ESESTATUS wConfigStatus = ESESTATUS_SUCCESS;
-  int ret;
-
   char ese_dev_node[64];
   std::string ese_node;
+  std::string capture_file;
+  std::string journal_file;
 
   STLOG_HAL_D("%s : SteSE_open Enter halVersion = %s ", __func__, halVersion);
   /*When spi channel is already opened return status as FAILED*/
@@ -73,7 +190,7 @@ ESESTATUS StEse_init() {
     return ESESTATUS_BUSY;
   }
 
-  memset(&ese_ctxt, 0x00, sizeof(ese_ctxt));
+  ese_ctxt.pDevHandle = NULL;
   memset(&tSpiDriver, 0x00, sizeof(tSpiDriver));
 
   /* initialize trace level */
@@ -83,6 +200,22 @@ ESESTATUS StEse_init() {
   ese_node = EseConfig::getString(NAME_ST_ESE_DEV_NODE, "/dev/st54j");
   strcpy(ese_dev_node, ese_node.c_str());
   tSpiDriver.pDevName = ese_dev_node;
+  tSpiDriver.ifsd = EseConfig::getUnsigned(NAME_ST_ESE_IFSD, MAX_IFSD);
+  traceFilePath = EseConfig::getString(NAME_ST_ESE_TRACE_FILE, "");
+  capture_file = EseConfig::getString(NAME_ST_ESE_SPI_CAPTURE_FILE, "");
+  if (!capture_file.empty()) {
+    tSpiDriver.pCaptureFile = (char*)capture_file.c_str();
+  }
+  journal_file = EseConfig::getString(NAME_ST_ESE_STATE_JOURNAL, "");
+  if (!journal_file.empty()) {
+    tSpiDriver.pJournalFile = (char*)journal_file.c_str();
+  }
+  tSpiDriver.devMaxFreq =
+      EseConfig::getUnsigned(NAME_ST_ESE_SPI_MAX_FREQ_KHZ, 0) * KHZ_TO_HZ;
+  tSpiDriver.pollFreq =
+      EseConfig::getUnsigned(NAME_ST_ESE_SPI_POLL_FREQ_KHZ, 0) * KHZ_TO_HZ;
+  tSpiDriver.adaptiveClock =
+      EseConfig::getUnsigned(NAME_ST_ESE_SPI_ADAPTIVE_CLOCK, 0) != 0;
 
   /* Initialize SPI Driver layer */
   if (T1protocol_init(&tSpiDriver) != ESESTATUS_SUCCESS) {
@@ -92,10 +225,17 @@ ESESTATUS StEse_init() {
   /* Copying device handle to ESE Lib context*/
   ese_ctxt.pDevHandle = tSpiDriver.pDevHandle;
 
-  ret = pthread_mutex_init(&mutex, NULL);
-  if (ret != 0) {
-    STLOG_HAL_E("HAL: %s pthread_mutex_init failed", __func__);
+  StEse_initChannelPriorities();
+  // Only once initialized: the faults target the APDU exchanges.
+  StEse_initFaultInjection();
+  if (StEseScheduler_init(EseConfig::getUnsigned(
+          NAME_ST_ESE_STARVATION_LIMIT, DEFAULT_STARVATION_LIMIT)) != 0) {
+    STLOG_HAL_E("HAL: %s StEseScheduler_init failed", __func__);
   }
+  livenessTtlNs = (uint64_t)EseConfig::getUnsigned(NAME_ST_ESE_LIVENESS_TTL_MS,
+                                                   DEFAULT_LIVENESS_TTL_MS) *
+                  1000000;
+  StEse_setAlive(true);
 
   STLOG_HAL_D("wConfigStatus %x", wConfigStatus);
   ese_ctxt.EseLibStatus = ESE_STATUS_OPEN;
@@ -104,7 +244,7 @@ ESESTATUS StEse_init() {
 clean_and_return:
   if (NULL != ese_ctxt.pDevHandle) {
     SpiLayerInterface_close(ese_ctxt.pDevHandle);
-    memset(&ese_ctxt, 0x00, sizeof(ese_ctxt));
+    ese_ctxt.pDevHandle = NULL;
   }
   ese_ctxt.EseLibStatus = ESE_STATUS_CLOSE;
   return ESESTATUS_FAILED;
@@ -119,24 +259,106 @@ clean_and_return:
  *
  ******************************************************************************/
 bool StEseApi_isOpen() {
-  STLOG_HAL_D(" %s  status 0x%x \n", __FUNCTION__, ese_ctxt.EseLibStatus);
-  return ese_ctxt.EseLibStatus != ESE_STATUS_CLOSE;
+  SpiEse_status status = ese_ctxt.EseLibStatus;
+
+  STLOG_HAL_D(" %s  status 0x%x \n", __FUNCTION__, status);
+  return status != ESE_STATUS_CLOSE;
 }
 
 /******************************************************************************
- * Function         StEse_Transceive
+ * Function         StEse_getChannelPriority
  *
- * Description      This function update the len and provided buffer
+ * Description      This function gets the priority of the logical channel the
+ *                  command is sent on.
  *
- * Returns          On Success ESESTATUS_SUCCESS else proper error code
+ * Returns          Priority of the channel, ESE_PRIORITY_NORMAL if the command
+ *                  is empty.
  *
  ******************************************************************************/
-ESESTATUS StEse_Transceive(StEse_data* pCmd, StEse_data* pRsp) {
+static StEse_priority StEse_getChannelPriority(StEse_data* pCmd) {
+  if ((NULL == pCmd) || (NULL == pCmd->p_data) || (pCmd->len == 0)) {
+    return ESE_PRIORITY_NORMAL;
+  }
+  return channelPriority[StEse_getLogicalChannel(pCmd->p_data[0])];
+}
+
+/******************************************************************************
+ * Function         StEse_dumpTraceOnError
+ *
+ * Description      This function dumps the TPDU trace to the configured file
+ *                  after an APDU failed, so that the frames that led to the
+ *                  error can be decoded offline.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+static void StEse_dumpTraceOnError() {
+  if (!traceFilePath.empty()) {
+    TpduTrace_dump(traceFilePath.c_str());
+  }
+}
+
+/******************************************************************************
+ * Function         StEse_acquireDevice
+ *
+ * Description      This function waits until the scheduler grants the device,
+ *                  unless the caller is the recovery callback, which already
+ *                  holds it.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+static void StEse_acquireDevice(StEse_priority priority) {
+  if (!recoveryOwnsDevice) {
+    StEseScheduler_acquire(priority);
+  }
+}
+
+/******************************************************************************
+ * Function         StEse_releaseDevice
+ *
+ * Description      This function gives the device back to the scheduler,
+ *                  unless the caller is the recovery callback.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+static void StEse_releaseDevice() {
+  if (!recoveryOwnsDevice) {
+    StEseScheduler_release();
+  }
+}
+
+/******************************************************************************
+ * Function         StEse_doTransceive
+ *
+ * Description      This function update the len and provided buffer. The
+ *                  whole APDU (all its chained parts) is exchanged once the
+ *                  scheduler granted the device to the given priority. The
+ *                  exchange is aborted if the deadline expires or if its
+ *                  token is cancelled. If a sink is given, the response is
+ *                  streamed to it instead of being returned in pRsp. If a
+ *                  mapper is given, it completes the command once the device
+ *                  is granted.
+ *
+ * Returns          On Success ESESTATUS_SUCCESS, ESESTATUS_ABORTED if the
+ *                  deadline expired or the APDU was cancelled,
+ *                  ESESTATUS_INVALID_PARAMETER if the mapper dropped it, else
+ *                  proper error code
+ *
+ ******************************************************************************/
+static ESESTATUS StEse_doTransceive(StEse_data* pCmd, StEse_data* pRsp,
+                                    StEse_priority priority,
+                                    const struct timeval* deadline,
+                                    StEse_responseSink sink,
+                                    void* sinkContext,
+                                    StEse_commandMapper mapper,
+                                    void* mapperContext,
+                                    StEse_cancelToken* token) {
   ESESTATUS status = ESESTATUS_SUCCESS;
-  static int pTxBlock_len = 0;
-  uint16_t pCmdlen = pCmd->len;
 
-  STLOG_HAL_D("%s : Enter EseLibStatus = %d ", __func__, ese_ctxt.EseLibStatus);
+  STLOG_HAL_D("%s : Enter EseLibStatus = %d ", __func__,
+              ese_ctxt.EseLibStatus.load());
 
   if ((NULL == pCmd) || (NULL == pRsp)) return ESESTATUS_INVALID_PARAMETER;
 
@@ -148,49 +370,602 @@ ESESTATUS StEse_Transceive(StEse_data* pCmd, StEse_data* pRsp) {
     return ESESTATUS_NOT_INITIALISED;
   }
 
-  STLOG_HAL_D(" %s ESE - No access, waiting \n", __FUNCTION__);
-  pthread_mutex_lock(&mutex);
+  STLOG_HAL_D(" %s ESE - No access, waiting (priority %d)\n", __FUNCTION__,
+              priority);
+  StEse_acquireDevice(priority);
+  // Closed by another thread while this APDU was queued.
+  if (ESE_STATUS_CLOSE == ese_ctxt.EseLibStatus) {
+    STLOG_HAL_E(" %s ESE closed while queued \n", __FUNCTION__);
+    StEse_releaseDevice();
+    return ESESTATUS_NOT_INITIALISED;
+  }
+
+  // The deadline may have expired, or the APDU been cancelled, while queued:
+  // do not touch the eSE then.
+  if (Utils_isDeadlineExpired(deadline) ||
+      ((token != NULL) && token->cancelled.load())) {
+    STLOG_HAL_W(" %s ESE - Deadline expired or cancelled while queued \n",
+                __FUNCTION__);
+    StEse_releaseDevice();
+    return ESESTATUS_ABORTED;
+  }
+
+  // A recovery may have run while queued: what it changes, e.g. the eSE
+  // channel behind the CLA, is only resolved now.
+  if ((mapper != NULL) && !mapper(pCmd, mapperContext)) {
+    STLOG_HAL_W(" %s ESE - Command dropped by the mapper \n", __FUNCTION__);
+    StEse_releaseDevice();
+    return ESESTATUS_INVALID_PARAMETER;
+  }
+  uint32_t pCmdlen = pCmd->len;
 
   STLOG_HAL_D(" %s ESE - Access granted, processing \n", __FUNCTION__);
+  // Only the token of the APDU holding the device can give up the exchange.
+  SpiLayerComm_setCancelFlag((token != NULL) ? &token->cancelled : NULL);
+  T1protocol_setResponseSink(sink, sinkContext);
+  uint64_t startNs = StEseLatency_now();
+  StEseLatency_setApduClass(pCmd->p_data[0],
+                            (pCmd->len > 1) ? pCmd->p_data[1] : 0);
 
   uint8_t* CmdPart = pCmd->p_data;
+  int rc = 0;
 
   while (pCmdlen > ATP.ifsc) {
-    pTxBlock_len = ATP.ifsc;
+    int pTxBlock_len = ATP.ifsc;
 
-    int rc = T1protocol_transcieveApduPart(CmdPart, pTxBlock_len, false,
-                                           (StEse_data*) pRsp);
+    rc = T1protocol_transcieveApduPart(CmdPart, pTxBlock_len, false,
+                                       (StEse_data*) pRsp, deadline);
     if (rc < 0) {
-      STLOG_HAL_E(" %s ESE - Error, release access \n", __FUNCTION__);
-      status = ESESTATUS_FAILED;
-
-      pthread_mutex_unlock(&mutex);
-
-      return status;
+      // The failure goes through the same tail as the last part's.
+      break;
     }
     pCmdlen -= pTxBlock_len;
     CmdPart = CmdPart + pTxBlock_len;
-    if (ESESTATUS_SUCCESS != status) {
-      STLOG_HAL_E(" %s T1protocol_transcieveApduPart- Failed \n", __FUNCTION__);
-    }
   }
-  int rc = T1protocol_transcieveApduPart(CmdPart, pCmdlen, true,
-                                         (StEse_data*) pRsp);
-  if (rc < 0) status = ESESTATUS_FAILED;
+  if (rc >= 0) {
+    rc = T1protocol_transcieveApduPart(CmdPart, pCmdlen, true,
+                                       (StEse_data*) pRsp, deadline);
+  }
+  if (rc == -2) {
+    status = ESESTATUS_ABORTED;
+  } else if (rc < 0) {
+    status = ESESTATUS_FAILED;
+  }
 
   if (ESESTATUS_SUCCESS != status) {
     STLOG_HAL_E(" %s T1protocol_transcieveApduPart- Failed \n", __FUNCTION__);
+    StEse_dumpTraceOnError();
   }
+  StEseLatency_record(ESE_LATENCY_APDU, startNs);
 
   STLOG_HAL_D(" %s ESE - Processing complete, release access \n", __FUNCTION__);
 
-  pthread_mutex_unlock(&mutex);
+  if (ESESTATUS_SUCCESS == status) {
+    StEseJournal_recordLink();
+    StEse_setAlive(true);
+  } else if (ESESTATUS_FAILED == status) {
+    StEse_setAlive(false);
+  }
+  T1protocol_setResponseSink(NULL, NULL);
+  SpiLayerComm_setCancelFlag(NULL);
+  StEse_releaseDevice();
 
   STLOG_HAL_D(" %s Exit status 0x%x \n", __FUNCTION__, status);
 
   return status;
 }
 
+/******************************************************************************
+ * Function         StEse_Transceive
+ *
+ * Description      This function update the len and provided buffer. The
+ *                  APDU is scheduled with the priority of its logical
+ *                  channel.
+ *
+ * Returns          On Success ESESTATUS_SUCCESS else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_Transceive(StEse_data* pCmd, StEse_data* pRsp) {
+  return StEse_doTransceive(pCmd, pRsp, StEse_getChannelPriority(pCmd), NULL,
+                            NULL, NULL, NULL, NULL, NULL);
+}
+
+/******************************************************************************
+ * Function         StEse_TransceivePriority
+ *
+ * Description      This function update the len and provided buffer. The
+ *                  whole APDU (all its chained parts) is exchanged once the
+ *                  scheduler granted the device to the given priority.
+ *
+ * Returns          On Success ESESTATUS_SUCCESS else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_TransceivePriority(StEse_data* pCmd, StEse_data* pRsp,
+                                   StEse_priority priority) {
+  return StEse_doTransceive(pCmd, pRsp, priority, NULL, NULL, NULL, NULL,
+                            NULL, NULL);
+}
+
+/******************************************************************************
+ * Function         StEse_TransceiveWithDeadline
+ *
+ * Description      This function update the len and provided buffer. The
+ *                  time spent queued counts in the timeout. Once it expires,
+ *                  the exchange is aborted and the eSE is brought back in a
+ *                  known state before the device is released.
+ *
+ * Returns          On Success ESESTATUS_SUCCESS, ESESTATUS_ABORTED if the
+ *                  timeout expired, else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_TransceiveWithDeadline(StEse_data* pCmd, StEse_data* pRsp,
+                                       uint32_t timeoutMs) {
+  struct timeval deadline;
+
+  if (timeoutMs == 0) {
+    return StEse_doTransceive(pCmd, pRsp, StEse_getChannelPriority(pCmd),
+                              NULL, NULL, NULL, NULL, NULL, NULL);
+  }
+  Utils_setDeadline(&deadline, timeoutMs);
+  return StEse_doTransceive(pCmd, pRsp, StEse_getChannelPriority(pCmd),
+                            &deadline, NULL, NULL, NULL, NULL, NULL);
+}
+
+/******************************************************************************
+ * Function         StEse_TransceiveStreaming
+ *
+ * Description      This function sends the APDU and streams the response to
+ *                  the sink, one INF field at a time, instead of collecting
+ *                  it.
+ *
+ * Returns          On Success ESESTATUS_SUCCESS else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_TransceiveStreaming(StEse_data* pCmd, StEse_responseSink sink,
+                                    void* context) {
+  StEse_data rsp;
+
+  if (NULL == sink) return ESESTATUS_INVALID_PARAMETER;
+
+  memset(&rsp, 0x00, sizeof(StEse_data));
+  return StEse_doTransceive(pCmd, &rsp, StEse_getChannelPriority(pCmd), NULL,
+                            sink, context, NULL, NULL, NULL);
+}
+
+/******************************************************************************
+ * Function         StEse_TransceiveMapped
+ *
+ * Description      This function update the len and provided buffer. The
+ *                  command is given to the mapper once the scheduler granted
+ *                  the device, right before it is sent.
+ *
+ * Returns          On Success ESESTATUS_SUCCESS, ESESTATUS_INVALID_PARAMETER
+ *                  if the mapper dropped the APDU, else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_TransceiveMapped(StEse_data* pCmd, StEse_data* pRsp,
+                                 StEse_commandMapper mapper, void* context) {
+  if (NULL == mapper) return ESESTATUS_INVALID_PARAMETER;
+
+  return StEse_doTransceive(pCmd, pRsp, StEse_getChannelPriority(pCmd), NULL,
+                            NULL, NULL, mapper, context, NULL);
+}
+
+/******************************************************************************
+ * Function         StEse_TransceiveCancellable
+ *
+ * Description      This function update the len and provided buffer. The
+ *                  exchange is aborted if StEse_Cancel() is called on the
+ *                  token.
+ *
+ * Returns          On Success ESESTATUS_SUCCESS, ESESTATUS_ABORTED if the APDU
+ *                  was cancelled, else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_TransceiveCancellable(StEse_data* pCmd, StEse_data* pRsp,
+                                      StEse_cancelToken* token) {
+  if (NULL == token) return ESESTATUS_INVALID_PARAMETER;
+
+  return StEse_doTransceive(pCmd, pRsp, StEse_getChannelPriority(pCmd), NULL,
+                            NULL, NULL, NULL, NULL, token);
+}
+
+/******************************************************************************
+ * Function         StEse_Cancel
+ *
+ * Description      This function cancels the APDU sent with the token, queued
+ *                  or being exchanged. Its transceive call returns
+ *                  ESESTATUS_ABORTED. The APDUs of other clients are not
+ *                  affected.
+ *
+ * Returns          ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER
+ *                  otherwise.
+ *
+ ******************************************************************************/
+ESESTATUS StEse_Cancel(StEse_cancelToken* token) {
+  STLOG_HAL_D("%s : Enter", __func__);
+  if (NULL == token) return ESESTATUS_INVALID_PARAMETER;
+
+  token->cancelled = true;
+  return ESESTATUS_SUCCESS;
+}
+
+/******************************************************************************
+ * Function         StEse_setChannelPriority
+ *
+ * Description      This function sets the priority used to schedule the APDUs
+ *                  sent on a logical channel.
+ *
+ * Returns          ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER
+ *                  otherwise.
+ *
+ ******************************************************************************/
+ESESTATUS StEse_setChannelPriority(uint8_t channel, StEse_priority priority) {
+  if ((channel >= ESE_MAX_LOGICAL_CHANNELS) || (priority < 0) ||
+      (priority >= ESE_PRIORITY_COUNT)) {
+    return ESESTATUS_INVALID_PARAMETER;
+  }
+  STLOG_HAL_D("%s : channel %d -> priority %d", __func__, channel, priority);
+  channelPriority[channel] = priority;
+  return ESESTATUS_SUCCESS;
+}
+
+/******************************************************************************
+ * Function         StEse_setIfsd
+ *
+ * Description      This function renegotiates the IFSD with the eSE, e.g.
+ *                  before large responses are expected.
+ *
+ * Returns          ESESTATUS_SUCCESS On Success, else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_setIfsd(uint8_t ifsd) {
+  ESESTATUS status = ESESTATUS_SUCCESS;
+
+  if ((ifsd == 0) || (ifsd > MAX_IFSD)) {
+    return ESESTATUS_INVALID_PARAMETER;
+  } else if (ESE_STATUS_CLOSE == ese_ctxt.EseLibStatus) {
+    return ESESTATUS_NOT_INITIALISED;
+  }
+
+  StEseScheduler_acquire(ESE_PRIORITY_HIGH);
+  if (T1protocol_setIfsd(ifsd) != 0) {
+    status = ESESTATUS_FAILED;
+  }
+  StEseScheduler_release();
+  return status;
+}
+
+/******************************************************************************
+ * Function         StEse_dumpTrace
+ *
+ * Description      This function writes the last TPDUs exchanged with the eSE
+ *                  to a file, to be decoded by ese_st_tpdu_trace_decoder.
+ *
+ * Returns          ESESTATUS_SUCCESS On Success, else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_dumpTrace(const char* path) {
+  if (NULL == path) {
+    return ESESTATUS_INVALID_PARAMETER;
+  }
+  return (TpduTrace_dump(path) < 0) ? ESESTATUS_FAILED : ESESTATUS_SUCCESS;
+}
+
+/******************************************************************************
+ * Function         StEse_getQueueStats
+ *
+ * Description      This function gets the queueing delay statistics of each
+ *                  priority class.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+void StEse_getQueueStats(StEse_queueStats* stats, bool reset) {
+  StEseScheduler_getStats(stats);
+  if (reset) {
+    StEseScheduler_resetStats();
+  }
+}
+
+/******************************************************************************
+ * Function         StEse_getBusCounters
+ *
+ * Description      This function gets the bus efficiency counters.
+ *
+ * Returns          ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER
+ *                  otherwise
+ *
+ ******************************************************************************/
+ESESTATUS StEse_getBusCounters(StEse_busCounters* counters, bool reset) {
+  uint64_t values[BUS_COUNTER_COUNT];
+
+  if (NULL == counters) {
+    return ESESTATUS_INVALID_PARAMETER;
+  }
+
+  BusCounters_get(values);
+  if (reset) {
+    BusCounters_reset();
+  }
+  counters->polls = values[BUS_COUNTER_POLLS];
+  counters->wastedReads = values[BUS_COUNTER_WASTED_READS];
+  counters->readRetries = values[BUS_COUNTER_READ_RETRIES];
+  counters->writeRetries = values[BUS_COUNTER_WRITE_RETRIES];
+  counters->modeSwitchWaits = values[BUS_COUNTER_MODE_SWITCH_WAITS];
+  counters->modeSwitchWaitUs = values[BUS_COUNTER_MODE_SWITCH_WAIT_US];
+  counters->bytesRead = values[BUS_COUNTER_BYTES_READ];
+  counters->bytesWritten = values[BUS_COUNTER_BYTES_WRITTEN];
+  counters->payloadBytesRead = values[BUS_COUNTER_PAYLOAD_READ];
+  counters->payloadBytesWritten = values[BUS_COUNTER_PAYLOAD_WRITTEN];
+  counters->faultsInjected = 0;
+  for (int i = BUS_COUNTER_FAULTS_CRC; i <= BUS_COUNTER_FAULTS_TIMEOUT; i++) {
+    counters->faultsInjected += values[i];
+  }
+  counters->recoveries = values[BUS_COUNTER_RECOVERIES];
+  counters->recoveriesFailed = values[BUS_COUNTER_RECOVERIES_FAILED];
+  counters->recoveryResends = values[BUS_COUNTER_RECOVERY_RESENDS];
+  counters->recoveryResyncs = values[BUS_COUNTER_RECOVERY_RESYNCS];
+  counters->recoverySwResets = values[BUS_COUNTER_RECOVERY_SWRESETS];
+  counters->livenessProbes = values[BUS_COUNTER_LIVENESS_PROBES];
+  counters->livenessCached = values[BUS_COUNTER_LIVENESS_CACHED];
+  return ESESTATUS_SUCCESS;
+}
+
+/******************************************************************************
+ * Function         StEse_dumpBusCounters
+ *
+ * Description      This function writes the bus efficiency counters in text
+ *                  form, with the share of the bytes clocked that carried
+ *                  APDU data.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+void StEse_dumpBusCounters(int fd) {
+  uint64_t values[BUS_COUNTER_COUNT];
+
+  BusCounters_get(values);
+  dprintf(fd, "Bus counters:\n");
+  for (unsigned int i = 0; i < BUS_COUNTER_COUNT; i++) {
+    dprintf(fd, "  %-20s %llu\n", BusCounters_getName(i),
+            (unsigned long long)values[i]);
+  }
+
+  uint64_t clocked =
+      values[BUS_COUNTER_BYTES_READ] + values[BUS_COUNTER_BYTES_WRITTEN];
+  uint64_t payload =
+      values[BUS_COUNTER_PAYLOAD_READ] + values[BUS_COUNTER_PAYLOAD_WRITTEN];
+  if (clocked != 0) {
+    dprintf(fd, "  %-20s %.1f%%\n", "payload-efficiency",
+            100.0 * payload / clocked);
+  }
+  uint64_t recoveries = values[BUS_COUNTER_RECOVERIES];
+  if (recoveries != 0) {
+    dprintf(fd, "  %-20s %.1f%%\n", "recovery-success",
+            100.0 * (recoveries - values[BUS_COUNTER_RECOVERIES_FAILED]) /
+                recoveries);
+  }
+}
+
+/******************************************************************************
+ * Function         StEse_isAlive
+ *
+ * Description      This function tells whether the eSE answers, from the
+ *                  cached result while it is fresh, else from a S-block
+ *                  exchange if the bus is idle.
+ *
+ * Returns          true if the eSE answered, or was never checked.
+ *
+ ******************************************************************************/
+bool StEse_isAlive(void) {
+  pthread_mutex_lock(&livenessMutex);
+  bool alive = livenessAlive;
+  bool fresh = (livenessCheckNs != 0) &&
+               (StEseLatency_now() - livenessCheckNs < livenessTtlNs);
+  pthread_mutex_unlock(&livenessMutex);
+
+  // Busy bus: the APDUs in progress will refresh the result.
+  if (fresh || (ESE_STATUS_CLOSE == ese_ctxt.EseLibStatus) ||
+      !StEseScheduler_tryAcquire()) {
+    BusCounters_add(BUS_COUNTER_LIVENESS_CACHED, 1);
+    return alive;
+  }
+
+  // Closed by another thread in between.
+  if (ESE_STATUS_CLOSE == ese_ctxt.EseLibStatus) {
+    StEseScheduler_release();
+    return alive;
+  }
+
+  BusCounters_add(BUS_COUNTER_LIVENESS_PROBES, 1);
+  alive = (T1protocol_checkAlive() == 0);
+  StEse_setAlive(alive);
+  StEseScheduler_release();
+  if (!alive) {
+    STLOG_HAL_W("%s : the eSE does not answer", __func__);
+  }
+  return alive;
+}
+
+/******************************************************************************
+ * Function         StEse_setFaultInjection
+ *
+ * Description      This function sets the rates of the faults injected on
+ *                  the bus, between two APDUs.
+ *
+ * Returns          ESESTATUS_SUCCESS On Success, else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_setFaultInjection(const StEse_faultRates* rates,
+                                  uint32_t seed) {
+  if (NULL == rates) {
+    return ESESTATUS_INVALID_PARAMETER;
+  } else if (ESE_STATUS_CLOSE == ese_ctxt.EseLibStatus) {
+    return ESESTATUS_NOT_INITIALISED;
+  }
+
+  StEseScheduler_acquire(ESE_PRIORITY_HIGH);
+  SpiLayerFaults_setRates(rates, seed);
+  StEseScheduler_release();
+  return ESESTATUS_SUCCESS;
+}
+
+/******************************************************************************
+ * Function         StEse_getLatencyStats
+ *
+ * Description      This function gets the latency distribution of a phase of
+ *                  the transceive, for a class of APDUs.
+ *
+ * Returns          ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER
+ *                  otherwise
+ *
+ ******************************************************************************/
+ESESTATUS StEse_getLatencyStats(StEse_latencyPhase phase,
+                                StEse_apduClass apduClass,
+                                StEse_latencyStats* stats) {
+  if ((phase >= ESE_LATENCY_PHASE_COUNT) ||
+      (apduClass >= ESE_APDU_CLASS_COUNT) || (NULL == stats)) {
+    return ESESTATUS_INVALID_PARAMETER;
+  }
+  StEseLatency_getStats(phase, apduClass, stats);
+  return ESESTATUS_SUCCESS;
+}
+
+/******************************************************************************
+ * Function         StEse_resetLatencyStats
+ *
+ * Description      This function clears the latency histograms.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+void StEse_resetLatencyStats(void) { StEseLatency_reset(); }
+
+/******************************************************************************
+ * Function         StEse_dumpLatencyStats
+ *
+ * Description      This function writes the latency distributions in text
+ *                  form.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+void StEse_dumpLatencyStats(int fd) { StEseLatency_dump(fd); }
+
+/******************************************************************************
+ * Function         StEse_resetStateStats
+ *
+ * Description      This function clears the time spent in the states of the
+ *                  T=1 engine and its transition counters.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+void StEse_resetStateStats(void) { T1protocol_resetStateStats(); }
+
+/******************************************************************************
+ * Function         StEse_dumpStateStats
+ *
+ * Description      This function writes the time spent in each state of the
+ *                  T=1 engine, and the transitions taken out of it, in text
+ *                  form.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+void StEse_dumpStateStats(int fd) {
+  uint64_t timeNs[T1_STATE_COUNT];
+  uint64_t transitions[T1_STATE_COUNT * T1_EVENT_COUNT];
+
+  T1protocol_getStateStats(timeNs, transitions);
+  dprintf(fd, "T=1 states:\n");
+  for (unsigned int state = 0; state < T1_STATE_COUNT; state++) {
+    const uint64_t* counts = &transitions[state * T1_EVENT_COUNT];
+    uint64_t taken = 0;
+    for (unsigned int event = 0; event < T1_EVENT_COUNT; event++) {
+      taken += counts[event];
+    }
+    if ((taken == 0) && (timeNs[state] == 0)) {
+      continue;
+    }
+
+    dprintf(fd, "  %-14s %llu us\n", T1protocol_getStateName(state),
+            (unsigned long long)(timeNs[state] / 1000));
+    for (unsigned int event = 0; event < T1_EVENT_COUNT; event++) {
+      if (counts[event] != 0) {
+        dprintf(fd, "    %-20s -> %-14s %llu\n",
+                T1protocol_getEventName(event),
+                T1protocol_getStateName(
+                    T1protocol_getNextState(state, event)),
+                (unsigned long long)counts[event]);
+      }
+    }
+  }
+}
+
+/******************************************************************************
+ * Function         StEse_resetClockStats
+ *
+ * Description      This function clears the bytes clocked and the time spent
+ *                  at each SPI clock frequency.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+void StEse_resetClockStats(void) { SpiLayerClock_resetStats(); }
+
+/******************************************************************************
+ * Function         StEse_dumpClockStats
+ *
+ * Description      This function writes the throughput of the bus at each
+ *                  SPI clock frequency used, in text form. The current one
+ *                  is marked with a '*'.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+void StEse_dumpClockStats(int fd) {
+  SpiClockStats stats[SPI_CLOCK_STEPS];
+  int step = SpiLayerClock_getStats(stats);
+
+  dprintf(fd, "SPI clock:\n");
+  if (step < 0) {
+    dprintf(fd, "  not set from the ATP\n");
+    return;
+  }
+  for (int i = 0; i < SPI_CLOCK_STEPS; i++) {
+    if ((i != step) && (stats[i].bytes == 0)) {
+      continue;
+    }
+    dprintf(fd, " %c%8u kHz %12llu bytes %10llu us", (i == step) ? '*' : ' ',
+            stats[i].speedHz / KHZ_TO_HZ, (unsigned long long)stats[i].bytes,
+            (unsigned long long)(stats[i].busyNs / 1000));
+    if (stats[i].busyNs != 0) {
+      // bytes per ns to kB per s
+      dprintf(fd, " %10.1f kB/s", stats[i].bytes * 1e6 / stats[i].busyNs);
+    }
+    dprintf(fd, "\n");
+  }
+}
+
+/******************************************************************************
+ * Function         StEse_waitRecovery
+ *
+ * Description      This function waits for the recovery in progress, if any,
+ *                  to complete.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+static void StEse_waitRecovery(void) {
+  pthread_mutex_lock(&recoveryMutex);
+  while (recoveryRunning) {
+    pthread_cond_wait(&recoveryCond, &recoveryMutex);
+  }
+  pthread_mutex_unlock(&recoveryMutex);
+}
+
 /******************************************************************************
  * Function         StEse_close
  *
@@ -208,14 +983,23 @@ ESESTATUS StEse_close(void) {
     return ESESTATUS_NOT_INITIALISED;
   }
 
+  /* Let a recovery in progress complete before the device goes away */
+  StEse_waitRecovery();
+
+  /* Other binder threads may have APDUs in progress or queued: close the
+   * device once the one in progress completes, before the queued ones */
+  StEseScheduler_reserve();
+  StEseScheduler_acquireReserved();
   if (NULL != ese_ctxt.pDevHandle) {
+    // Closed first: the threads still queued see it once granted.
+    ese_ctxt.EseLibStatus = ESE_STATUS_CLOSE;
     SpiLayerInterface_close(ese_ctxt.pDevHandle);
-    memset(&ese_ctxt, 0x00, sizeof(ese_ctxt));
+    ese_ctxt.pDevHandle = NULL;
     STLOG_HAL_D("StEse_close - ESE Context deinit completed");
-    ese_ctxt.EseLibStatus = ESE_STATUS_CLOSE;
   }
+  StEseScheduler_release();
 
-  pthread_mutex_destroy(&mutex);
+  StEseScheduler_deinit();
   /* Return success always */
   return status;
 }
@@ -234,20 +1018,179 @@ uint8_t* StEse_getAtr(void) {
   return nullptr;
 }
 
+/******************************************************************************
+ * Function         StEse_resetDone
+ *
+ * Description      This function is the recovery callback of StEse_Reset(),
+ *                  it gives the recovery status back to it.
+ *
+ * Returns          None
+ *
+ ******************************************************************************/
+static void StEse_resetDone(StEse_recoveryLevel level, ESESTATUS status,
+                            void* context) {
+  (void)level;
+  *(ESESTATUS*)context = status;
+}
+
 /******************************************************************************
  * Function         StEse_Reset
  *
- * Description      This function resets the eSE SPI interface by sending a
- *                  SE reset and negotiating the ifs.
+ * Description      This function recovers the eSE SPI interface and waits
+ *                  for it. It goes through the recovery tiers, like
+ *                  StEse_startRecovery(), so that the APDUs in progress or
+ *                  queued on other threads get the device before or after
+ *                  it, never during it.
  *
- * Returns          ESESTATUS_SUCCESS is successful, ESESTATUS_SUCCESS otherwise
+ * Returns          ESESTATUS_SUCCESS is successful, else proper error code
  *
  ******************************************************************************/
 ESESTATUS StEse_Reset(void) {
+  ESESTATUS recoveryStatus = ESESTATUS_FAILED;
+  ESESTATUS status;
+
   STLOG_HAL_D("%s : Enter", __func__);
-  if (SpiLayerInterface_setup() != 0) {
+  /* A recovery already in progress may have started before the failure the
+   * caller saw: wait for it and start a new one */
+  while ((status = StEse_startRecovery(StEse_resetDone, &recoveryStatus)) ==
+         ESESTATUS_BUSY) {
+    StEse_waitRecovery();
+  }
+  if (status != ESESTATUS_SUCCESS) {
+    return status;
+  }
+  StEse_waitRecovery();
+  return recoveryStatus;
+}
+
+/******************************************************************************
+ * Function         StEse_recoveryThread
+ *
+ * Description      This function escalates the recovery, from the cheapest
+ *                  tier to the most expensive one, once the device is
+ *                  granted to it. The callback is notified before the
+ *                  APDUs queued meanwhile get the device.
+ *
+ * Returns          NULL
+ *
+ ******************************************************************************/
+static void* StEse_recoveryThread(void* arg) {
+  StEse_recoveryLevel level = ESE_RECOVERY_RESYNC;
+  ESESTATUS status = ESESTATUS_SUCCESS;
+  (void)arg;
+
+  StEseScheduler_acquireReserved();
+  uint64_t startNs = StEseLatency_now();
+  BusCounters_add(BUS_COUNTER_RECOVERY_RESYNCS, 1);
+  if (T1protocol_resync() != 0) {
+    level = ESE_RECOVERY_SOFT_RESET;
+    BusCounters_add(BUS_COUNTER_RECOVERY_SWRESETS, 1);
+    if (T1protocol_softReset() != 0) {
+      level = ESE_RECOVERY_HARD_RESET;
+      if (SpiLayerInterface_setup() != 0) {
+        status = ESESTATUS_FAILED;
+      }
+    } else {
+      StEseJournal_recordReset();
+    }
+  } else {
+    StEseJournal_recordLink();
+  }
+  StEse_setAlive(status == ESESTATUS_SUCCESS);
+  STLOG_HAL_W("%s : level %d, status %d after %llu us", __func__, level,
+              status,
+              (unsigned long long)(StEseLatency_now() - startNs) / 1000);
+
+  if (recoveryCallback != NULL) {
+    recoveryOwnsDevice = true;
+    recoveryCallback(level, status, recoveryContext);
+    recoveryOwnsDevice = false;
+  }
+  StEseScheduler_release();
+
+  pthread_mutex_lock(&recoveryMutex);
+  recoveryRunning = false;
+  pthread_cond_broadcast(&recoveryCond);
+  pthread_mutex_unlock(&recoveryMutex);
+  return NULL;
+}
+
+/******************************************************************************
+ * Function         StEse_startRecovery
+ *
+ * Description      This function starts recovering the link in the
+ *                  background. The device is reserved right away, so that
+ *                  no APDU queued or sent meanwhile gets it first.
+ *
+ * Returns          ESESTATUS_SUCCESS if started, else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_startRecovery(StEse_recoveryCallback callback, void* context) {
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if (ESE_STATUS_CLOSE == ese_ctxt.EseLibStatus) {
+    return ESESTATUS_NOT_INITIALISED;
+  }
+
+  pthread_mutex_lock(&recoveryMutex);
+  if (recoveryRunning) {
+    pthread_mutex_unlock(&recoveryMutex);
+    STLOG_HAL_D("%s : recovery already in progress", __func__);
+    return ESESTATUS_BUSY;
+  }
+  recoveryRunning = true;
+  recoveryCallback = callback;
+  recoveryContext = context;
+  StEseScheduler_reserve();
+  pthread_mutex_unlock(&recoveryMutex);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, StEse_recoveryThread, NULL) != 0) {
+    STLOG_HAL_E("%s : cannot start the recovery thread, recovering now",
+                __func__);
+    StEse_recoveryThread(NULL);
+  }
+  pthread_attr_destroy(&attr);
+  return ESESTATUS_SUCCESS;
+}
+
+/******************************************************************************
+ * Function         StEse_journalChannel
+ *
+ * Description      This function records a logical channel opened or closed
+ *                  in the state journal.
+ *
+ * Returns          ESESTATUS_SUCCESS if recorded, else proper error code
+ *
+ ******************************************************************************/
+ESESTATUS StEse_journalChannel(uint8_t channel,
+                               const StEse_channelState* state) {
+  if ((channel >= ESE_MAX_LOGICAL_CHANNELS) ||
+      ((state != NULL) && (state->aidLength > ESE_JOURNAL_MAX_AID_LENGTH))) {
+    return ESESTATUS_INVALID_PARAMETER;
+  }
+  if (StEseJournal_recordChannel(channel, state) != 0) {
     return ESESTATUS_FAILED;
   }
+  return ESESTATUS_SUCCESS;
+}
 
+/******************************************************************************
+ * Function         StEse_getJournaledChannel
+ *
+ * Description      This function gets a logical channel recorded open in the
+ *                  state journal.
+ *
+ * Returns          ESESTATUS_SUCCESS if the channel is open, else
+ *                  ESESTATUS_FAILED
+ *
+ ******************************************************************************/
+ESESTATUS StEse_getJournaledChannel(uint8_t channel,
+                                    StEse_channelState* state) {
+  if (StEseJournal_getChannel(channel, state) != 0) {
+    return ESESTATUS_FAILED;
+  }
   return ESESTATUS_SUCCESS;
 }
@@ -21,9 +21,13 @@
 #define _STESEAPI_H_
 
 #include <stdint.h>
+#include <atomic>
+
+/* Basic channel + 3 standard + 16 further logical channels (ISO 7816-4) */
+#define ESE_MAX_LOGICAL_CHANNELS 20
 
 typedef struct StEse_data {
-  uint16_t len;    /*!< length of the buffer */
+  uint32_t len;    /*!< length of the buffer (extended APDUs exceed 64KB) */
   uint8_t* p_data; /*!< pointer to a buffer */
 } StEse_data;
 
@@ -38,6 +42,7 @@ typedef enum {
   ESESTATUS_CONNECTION_FAILED,
   ESESTATUS_BUSY,
   ESESTATUS_UNKNOWN_ERROR,
+  ESESTATUS_ABORTED,
 } ESESTATUS;
 
 typedef enum {
@@ -45,9 +50,145 @@ typedef enum {
   ESE_STATUS_OPEN,
 } SpiEse_status;
 
+/* Tiers of the recovery started with StEse_startRecovery(), by cost */
+typedef enum {
+  ESE_RECOVERY_RESYNC = 0,  /* S(RESYNCH): channels kept */
+  ESE_RECOVERY_SOFT_RESET,  /* S(SWReset): channels closed */
+  ESE_RECOVERY_HARD_RESET,  /* reset pulse, ATP and IFS: channels closed */
+} StEse_recoveryLevel;
+
+/*
+ * Called once the recovery is over, with the tier that restored the link (or
+ * ESE_RECOVERY_HARD_RESET and ESESTATUS_FAILED if none did). The device is
+ * still held during the call: the APDUs the callback sends, e.g. to restore
+ * the logical channels, go before any APDU queued. It must not call
+ * StEse_close().
+ */
+typedef void (*StEse_recoveryCallback)(StEse_recoveryLevel level,
+                                       ESESTATUS status, void* context);
+
+/*
+ * Cancels the APDU it is given to, see StEse_TransceiveCancellable(). Must be
+ * zero-initialized and kept by the caller until the transceive returns; a
+ * token only applies to a single APDU.
+ */
+typedef struct StEse_cancelToken {
+  std::atomic<bool> cancelled;
+} StEse_cancelToken;
+
+/* Priority classes of the transceive scheduler */
+typedef enum {
+  ESE_PRIORITY_HIGH = 0, /* latency critical, e.g. contactless payment */
+  ESE_PRIORITY_NORMAL,
+  ESE_PRIORITY_LOW, /* background bulk jobs, e.g. applet update */
+  ESE_PRIORITY_COUNT,
+} StEse_priority;
+
+/*
+ * Receives the response of a streamed APDU, one INF field at a time. The data
+ * is only valid during the call. isLast is set for the last part, which holds
+ * the status word.
+ */
+typedef void (*StEse_responseSink)(uint8_t* data, uint16_t len, bool isLast,
+                                   void* context);
+
+/*
+ * Completes a command once the device is granted to it, right before it is
+ * sent, with state a recovery may change while the command is queued (e.g.
+ * the eSE channel behind a client channel). It may point cmd->p_data to
+ * another buffer of the same length, valid until the transceive returns.
+ * Returns false to drop the command.
+ */
+typedef bool (*StEse_commandMapper)(StEse_data* cmd, void* context);
+
+/* Queueing delay statistics of a priority class */
+typedef struct StEse_queueStats {
+  uint64_t count;       /*!< number of APDUs granted */
+  uint64_t totalWaitUs; /*!< sum of the queueing delays in us */
+  uint32_t maxWaitUs;   /*!< worst queueing delay in us */
+} StEse_queueStats;
+
+/* Bus efficiency counters, since the last reset */
+typedef struct StEse_busCounters {
+  uint64_t polls;               /*!< reads done while polling for the NAD */
+  uint64_t wastedReads;         /*!< polling reads that returned no NAD */
+  uint64_t readRetries;         /*!< failed SPI reads retried */
+  uint64_t writeRetries;        /*!< failed SPI writes retried */
+  uint64_t modeSwitchWaits;     /*!< guard time waits before a TX/RX switch */
+  uint64_t modeSwitchWaitUs;    /*!< time spent in these waits */
+  uint64_t bytesRead;           /*!< bytes clocked in */
+  uint64_t bytesWritten;        /*!< bytes clocked out */
+  uint64_t payloadBytesRead;    /*!< APDU bytes received (I-block INF) */
+  uint64_t payloadBytesWritten; /*!< APDU bytes sent (I-block INF) */
+  uint64_t faultsInjected;      /*!< faults injected, all kinds */
+  uint64_t recoveries;          /*!< recoveries started */
+  uint64_t recoveriesFailed;    /*!< recoveries that ended in an error */
+  uint64_t recoveryResends;     /*!< R(NAK) sent by the recovery */
+  uint64_t recoveryResyncs;     /*!< S(RESYNCH) sent by the recovery */
+  uint64_t recoverySwResets;    /*!< S(SWReset) sent by the recovery */
+  uint64_t livenessProbes;      /*!< S(IFS) sent to check the eSE answers */
+  uint64_t livenessCached;      /*!< liveness answered without probing */
+} StEse_busCounters;
+
+/* Rates of the faults injected on the bus, per 1000 frames received */
+typedef struct StEse_faultRates {
+  uint16_t crcError;       /*!< a bit of the INF or EDC flipped */
+  uint16_t droppedNad;     /*!< the NAD read as an idle byte */
+  uint16_t truncatedFrame; /*!< LEN shortened, the end of the frame unread */
+  uint16_t spuriousWtx;    /*!< a S(WTX) request the eSE did not send */
+  uint16_t timeout;        /*!< the response held back beyond the BWT */
+} StEse_faultRates;
+
+/* Phases of a transceive whose latency is measured */
+typedef enum {
+  ESE_LATENCY_WRITE = 0,     /* writing a frame, mode switch guard included */
+  ESE_LATENCY_MODE_SWITCH,   /* guard time between a TX and a RX, or back */
+  ESE_LATENCY_TIME_TO_NAD,   /* polling until the NAD of the response */
+  ESE_LATENCY_BODY_READ,     /* reading the INF and EDC of a frame */
+  ESE_LATENCY_CRC_CHECK,     /* checking the EDC of a frame */
+  ESE_LATENCY_RS_ROUND_TRIP, /* sending a R or S-block up to its response */
+  ESE_LATENCY_RECOVERY,      /* first error up to the next valid frame */
+  ESE_LATENCY_APDU,          /* whole APDU, once the device is granted */
+  ESE_LATENCY_PHASE_COUNT,
+} StEse_latencyPhase;
+
+/* Classes of APDUs the latencies are kept apart for, from the CLA/INS */
+typedef enum {
+  ESE_APDU_CLASS_SELECT = 0,
+  ESE_APDU_CLASS_MANAGE_CHANNEL,
+  ESE_APDU_CLASS_GET_RESPONSE,
+  ESE_APDU_CLASS_PROPRIETARY, /* CLA with b8 set */
+  ESE_APDU_CLASS_OTHER,
+  ESE_APDU_CLASS_COUNT,
+} StEse_apduClass;
+
+/* Latency distribution of a phase for a class of APDUs, in ns */
+typedef struct StEse_latencyStats {
+  uint64_t count;
+  uint64_t minNs;
+  uint64_t maxNs;
+  uint64_t meanNs;
+  uint64_t p50Ns;
+  uint64_t p90Ns;
+  uint64_t p99Ns;
+  uint64_t p999Ns;
+} StEse_latencyStats;
+
+/* Longest AID (ISO 7816-4) the state journal keeps for a logical channel */
+#define ESE_JOURNAL_MAX_AID_LENGTH 16
+
+/* How a logical channel was opened, as recorded in the state journal */
+typedef struct StEse_channelState {
+  uint8_t seChannel; /*!< channel number on the eSE */
+  uint8_t p2;        /*!< P2 of the SELECT */
+  uint8_t aidLength;
+  uint8_t aid[ESE_JOURNAL_MAX_AID_LENGTH];
+} StEse_channelState;
+
 /* SPI Control structure */
 typedef struct ese_Context {
-  SpiEse_status EseLibStatus; /* Indicate if Ese Lib is open or closed */
+  /* Indicate if Ese Lib is open or closed, read by any binder thread */
+  std::atomic<SpiEse_status> EseLibStatus;
   void* pDevHandle;
 } ese_Context_t;
 
@@ -79,10 +220,322 @@ ESESTATUS StEse_init();
  */
 ESESTATUS StEse_Transceive(StEse_data* pCmd, StEse_data* pRsp);
 
+/**
+ * StEse_TransceivePriority
+ *
+ * Same as StEse_Transceive but the APDU is queued with the given priority
+ * instead of the priority of its logical channel.
+ *
+ * @param pCmd: Command to eSE
+ * @param pRsp: Response from eSE (Returned data to be freed
+ *  after copying)
+ * @param priority: Priority class of the APDU
+ *
+ * @return ESESTATUS_SUCCESS On Success ESESTATUS_SUCCESS else proper error code
+ *
+ */
+ESESTATUS StEse_TransceivePriority(StEse_data* pCmd, StEse_data* pRsp,
+                                   StEse_priority priority);
+
+/**
+ * StEse_TransceiveWithDeadline
+ *
+ * Same as StEse_Transceive but the APDU is aborted if no response is
+ * received within the given time, including the time spent queued. The eSE
+ * is brought back in a known state (S(ABORT) and resync) before the device is
+ * released.
+ *
+ * @param pCmd: Command to eSE
+ * @param pRsp: Response from eSE (Returned data to be freed
+ *  after copying)
+ * @param timeoutMs: Maximum time to get the response in ms, 0 for no limit
+ *
+ * @return ESESTATUS_SUCCESS On Success, ESESTATUS_ABORTED if the timeout
+ *  expired, else proper error code
+ *
+ */
+ESESTATUS StEse_TransceiveWithDeadline(StEse_data* pCmd, StEse_data* pRsp,
+                                       uint32_t timeoutMs);
+
+/**
+ * StEse_TransceiveStreaming
+ *
+ * Same as StEse_Transceive but the response is not collected: each part of
+ * a chained response is given to the sink as soon as the next one has been
+ * requested, so that its processing overlaps with the SPI transfer.
+ *
+ * @param pCmd: Command to eSE
+ * @param sink: Function receiving the response parts
+ * @param context: Opaque pointer given back to the sink
+ *
+ * @return ESESTATUS_SUCCESS On Success, else proper error code. On error, the
+ *  parts already given to the sink must be discarded.
+ *
+ */
+ESESTATUS StEse_TransceiveStreaming(StEse_data* pCmd, StEse_responseSink sink,
+                                    void* context);
+
+/**
+ * StEse_TransceiveMapped
+ *
+ * Same as StEse_Transceive but the command is given to the mapper once the
+ * device is granted, before it is sent: a recovery running while the APDU is
+ * queued cannot make it go out with the state it replaced.
+ *
+ * @param pCmd: Command to eSE, as given to the mapper
+ * @param pRsp: Response from eSE (Returned data to be freed
+ *  after copying)
+ * @param mapper: Function completing the command
+ * @param context: Opaque pointer given back to the mapper
+ *
+ * @return ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER if the
+ *  mapper dropped the command, else proper error code
+ *
+ */
+ESESTATUS StEse_TransceiveMapped(StEse_data* pCmd, StEse_data* pRsp,
+                                 StEse_commandMapper mapper, void* context);
+
+/**
+ * StEse_TransceiveCancellable
+ *
+ * Same as StEse_Transceive but the APDU can be cancelled with StEse_Cancel()
+ * on the given token. Cancelling it never affects the APDUs of other clients.
+ *
+ * @param pCmd: Command to eSE
+ * @param pRsp: Response from eSE (Returned data to be freed
+ *  after copying)
+ * @param token: Token of this APDU
+ *
+ * @return ESESTATUS_SUCCESS On Success, ESESTATUS_ABORTED if the APDU was
+ *  cancelled, else proper error code
+ *
+ */
+ESESTATUS StEse_TransceiveCancellable(StEse_data* pCmd, StEse_data* pRsp,
+                                      StEse_cancelToken* token);
+
+/**
+ * StEse_Cancel
+ *
+ * This function cancels the APDU sent with the given token. If it is being
+ * exchanged, the exchange is aborted; if it is still queued, it is never
+ * sent. Its transceive call returns ESESTATUS_ABORTED. May be called from any
+ * thread.
+ *
+ * @param token: Token given to StEse_TransceiveCancellable()
+ *
+ * @return ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER if the
+ *  token is NULL.
+ *
+ */
+ESESTATUS StEse_Cancel(StEse_cancelToken* token);
+
+/**
+ * StEse_setChannelPriority
+ *
+ * This function sets the priority used to schedule the APDUs sent on a
+ * logical channel.
+ *
+ * @param channel: Logical channel number (0 to ESE_MAX_LOGICAL_CHANNELS - 1)
+ * @param priority: Priority class of the channel
+ *
+ * @return ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER otherwise
+ *
+ */
+ESESTATUS StEse_setChannelPriority(uint8_t channel, StEse_priority priority);
+
+/**
+ * StEse_setIfsd
+ *
+ * This function renegotiates the IFSD (maximum size of the blocks sent by the
+ * eSE) with the eSE. The IFSC used to send is not affected.
+ *
+ * @param ifsd: IFSD to request, 1 to 254
+ *
+ * @return ESESTATUS_SUCCESS On Success, else proper error code
+ *
+ */
+ESESTATUS StEse_setIfsd(uint8_t ifsd);
+
+/**
+ * StEse_dumpTrace
+ *
+ * This function writes the last TPDUs exchanged with the eSE (binary trace
+ * ring) to a file, to be decoded offline by ese_st_tpdu_trace_decoder.
+ *
+ * @param path: File to create
+ *
+ * @return ESESTATUS_SUCCESS On Success, else proper error code
+ *
+ */
+ESESTATUS StEse_dumpTrace(const char* path);
+
+/**
+ * StEse_getQueueStats
+ *
+ * This function gets the queueing delay statistics of each priority class.
+ *
+ * @param stats: Array of ESE_PRIORITY_COUNT elements, indexed by priority
+ * @param reset: if true, the statistics are cleared after being read
+ *
+ * @return void
+ *
+ */
+void StEse_getQueueStats(StEse_queueStats* stats, bool reset);
+
+/**
+ * StEse_getBusCounters
+ *
+ * This function gets the bus efficiency counters: NAD polling, retries,
+ * guard time waits, and bytes clocked versus APDU bytes.
+ *
+ * @param counters: Where to store the counters
+ * @param reset: if true, the counters are cleared after being read
+ *
+ * @return ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER otherwise
+ *
+ */
+ESESTATUS StEse_getBusCounters(StEse_busCounters* counters, bool reset);
+
+/**
+ * StEse_isAlive
+ *
+ * This function tells whether the eSE answers. The result of the last check,
+ * or of the last APDU, is reused for ST_ESE_LIVENESS_TTL_MS. Past that, the
+ * eSE is probed with a S-block exchange, only if the bus is idle: while
+ * APDUs are exchanged, they keep the result fresh. Never waits for the bus.
+ *
+ * @return true if the eSE answered, or if it was never checked
+ *
+ */
+bool StEse_isAlive(void);
+
+/**
+ * StEse_dumpBusCounters
+ *
+ * This function writes the bus efficiency counters in text form, e.g. for
+ * the debug dump of the HAL.
+ *
+ * @param fd: File descriptor to write to
+ *
+ * @return void
+ *
+ */
+void StEse_dumpBusCounters(int fd);
+
+/**
+ * StEse_setFaultInjection
+ *
+ * This function sets the rates of the faults injected on the bus, to
+ * measure the cost of the recovery paths. The recoveries are then reported
+ * by StEse_getBusCounters() and the ESE_LATENCY_RECOVERY latencies. For
+ * testing only: APDUs fail when the recovery does.
+ *
+ * @param rates: Faults per 1000 frames received, all 0 to stop injecting
+ * @param seed: Seed of the pseudo random sequence deciding which frames are
+ *              hit, the same seed hits the same frames
+ *
+ * @return ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER otherwise
+ *
+ */
+ESESTATUS StEse_setFaultInjection(const StEse_faultRates* rates, uint32_t seed);
+
+/**
+ * StEse_getLatencyStats
+ *
+ * This function gets the latency distribution of a phase of the transceive,
+ * for a class of APDUs. Percentiles are accurate to 1/8th of the value.
+ *
+ * @param phase: Phase of the transceive
+ * @param apduClass: Class of the APDUs
+ * @param stats: Where to store the distribution
+ *
+ * @return ESESTATUS_SUCCESS On Success, ESESTATUS_INVALID_PARAMETER otherwise
+ *
+ */
+ESESTATUS StEse_getLatencyStats(StEse_latencyPhase phase,
+                                StEse_apduClass apduClass,
+                                StEse_latencyStats* stats);
+
+/**
+ * StEse_resetLatencyStats
+ *
+ * This function clears the latency histograms. It does not depend on their
+ * size, so it can be called after each periodic sample.
+ *
+ * @return void
+ *
+ */
+void StEse_resetLatencyStats(void);
+
+/**
+ * StEse_dumpLatencyStats
+ *
+ * This function writes the latency distributions in text form, e.g. for the
+ * debug dump of the HAL.
+ *
+ * @param fd: File descriptor to write to
+ *
+ * @return void
+ *
+ */
+void StEse_dumpLatencyStats(int fd);
+
+/**
+ * StEse_resetStateStats
+ *
+ * This function clears the time spent in the states of the T=1 engine and
+ * its transition counters.
+ *
+ * @return void
+ *
+ */
+void StEse_resetStateStats(void);
+
+/**
+ * StEse_dumpStateStats
+ *
+ * This function writes the time spent in each state of the T=1 engine, and
+ * how many times each transition out of it was taken, in text form, e.g.
+ * for the debug dump of the HAL.
+ *
+ * @param fd: File descriptor to write to
+ *
+ * @return void
+ *
+ */
+void StEse_dumpStateStats(int fd);
+
+/**
+ * StEse_resetClockStats
+ *
+ * This function clears the bytes clocked and the time spent at each SPI
+ * clock frequency.
+ *
+ * @return void
+ *
+ */
+void StEse_resetClockStats(void);
+
+/**
+ * StEse_dumpClockStats
+ *
+ * This function writes the throughput of the bus at each SPI clock
+ * frequency used, in text form, e.g. to tune the clock of a board from the
+ * debug dump of the HAL.
+ *
+ * @param fd: File descriptor to write to
+ *
+ * @return void
+ *
+ */
+void StEse_dumpClockStats(int fd);
+
 /**
  * StEse_close
  *
  * This function close the ESE interface and free all resources.
+ * It waits for the APDU in progress, if any; the APDUs other threads queued
+ * then fail with ESESTATUS_NOT_INITIALISED.
  *
  * @param      void
  *
@@ -119,13 +572,68 @@ uint8_t* StEse_getAtr(void);
 /**
  * StEse_Reset
  *
- * This function get the last ATR received.
+ * This function recovers the link, as StEse_startRecovery() does, and waits
+ * for the recovery to complete. It must not be called from a recovery
+ * callback. The logical channels the eSE closes meanwhile are not restored.
  *
  * @param    void
  *
- * @return   ESESTATUS_SUCCESS is successful, ESESTATUS_SUCCESS otherwise
+ * @return   ESESTATUS_SUCCESS is successful, ESESTATUS_FAILED if no tier
+ *           restored the link, ESESTATUS_NOT_INITIALISED if the eSE is not
+ *           opened
  *
  */
 ESESTATUS StEse_Reset(void);
 
+/**
+ * StEse_startRecovery
+ *
+ * This function starts recovering the link after an APDU failed, and
+ * returns without waiting. The recovery escalates in the background from a
+ * resync to a soft reset, then to a hard reset, stopping at the first tier
+ * that succeeds. It gets the device before any APDU waiting, and the APDUs
+ * sent meanwhile are queued until it completes.
+ *
+ * @param callback: Called when the recovery is over, NULL if not needed
+ * @param context: Opaque pointer given back to the callback
+ *
+ * @return ESESTATUS_SUCCESS if the recovery was started, ESESTATUS_BUSY if
+ *         one is already in progress, ESESTATUS_NOT_INITIALISED if the eSE
+ *         is not opened
+ *
+ */
+ESESTATUS StEse_startRecovery(StEse_recoveryCallback callback, void* context);
+
+/**
+ * StEse_journalChannel
+ *
+ * This function records a logical channel opened or closed in the state
+ * journal (see ST_ESE_STATE_JOURNAL), so that a restarted service can take
+ * it over. The channels are forgotten whenever the eSE is reset.
+ *
+ * @param channel: Logical channel number, as known by the clients
+ * @param state: How the channel was opened, NULL if it is closed
+ *
+ * @return ESESTATUS_SUCCESS if recorded, ESESTATUS_FAILED if there is no
+ *         journal, ESESTATUS_INVALID_PARAMETER otherwise
+ *
+ */
+ESESTATUS StEse_journalChannel(uint8_t channel,
+                               const StEse_channelState* state);
+
+/**
+ * StEse_getJournaledChannel
+ *
+ * This function gets a logical channel recorded open in the state journal,
+ * by this service or by the previous one if StEse_init() resumed its link.
+ *
+ * @param channel: Logical channel number, as known by the clients
+ * @param state: Where to store how the channel was opened
+ *
+ * @return ESESTATUS_SUCCESS if the channel is open, ESESTATUS_FAILED
+ *         otherwise
+ *
+ */
+ESESTATUS StEse_getJournaledChannel(uint8_t channel, StEse_channelState* state);
+
 #endif /* _STESEAPI_H_ */
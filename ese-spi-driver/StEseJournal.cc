@@ -0,0 +1,341 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-Journal"
+#include "StEseJournal.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "T1protocol.h"
+#include "android_logmsg.h"
+#include "utils-lib/Atp.h"
+#include "utils-lib/Iso13239CRC.h"
+
+#define JOURNAL_MAGIC 0x4A455453 /* "STEJ" */
+#define JOURNAL_VERSION 2
+
+// Changes at every boot of the kernel: a journal kept in /data outlives it.
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_LENGTH 36 /* a UUID, without the trailing new line */
+
+// The records only hold bytes: no padding before their CRC, which
+// computeCrc() stores right after the data it covers.
+typedef struct {
+  uint8_t atp[LEN_LENGTH_IN_ATP + ATP_MAX_ALLOWED_LENGTH];
+  uint8_t ifsd;
+  uint8_t bootId[BOOT_ID_LENGTH];
+  uint8_t crc[CRC_LENGTH_IN_ATP];
+} JournalLink;
+
+typedef struct {
+  struct {
+    uint8_t open;
+    StEse_channelState state;
+  } channels[ESE_MAX_LOGICAL_CHANNELS];
+  uint8_t crc[CRC_LENGTH_IN_ATP];
+} JournalChannels;
+
+// Updated at every APDU boundary for the link, only when a channel is opened
+// or closed for the channels.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  JournalLink link;
+  JournalChannels channels;
+} Journal;
+
+static pthread_mutex_t journalMutex = PTHREAD_MUTEX_INITIALIZER;
+static Journal* journal = NULL;
+// Of the current boot, all zeroes if unknown: never matches a journal then.
+static uint8_t bootId[BOOT_ID_LENGTH];
+
+/*******************************************************************************
+**
+** Function         StEseJournal_seal
+**
+** Description      Stores the CRC of a record, right after its data.
+**
+** Parameters       record - the record.
+**                  length - length of the data covered by the CRC.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void StEseJournal_seal(void* record, size_t length) {
+  computeCrc((uint8_t*)record, length);
+}
+
+/*******************************************************************************
+**
+** Function         StEseJournal_isSealed
+**
+** Description      Checks the CRC of a record, a record torn by a crash in
+**                  the middle of its update does not match it.
+**
+** Parameters       record - the record.
+**                  length - length of the data covered by the CRC.
+**
+** Returns          true if the record is intact.
+**
+*******************************************************************************/
+static bool StEseJournal_isSealed(const void* record, size_t length) {
+  uint8_t copy[sizeof(Journal)];
+
+  memcpy(copy, record, length);
+  computeCrc(copy, length);
+  return memcmp(copy + length, (const uint8_t*)record + length,
+                CRC_LENGTH_IN_ATP) == 0;
+}
+
+/*******************************************************************************
+**
+** Function         StEseJournal_readBootId
+**
+** Description      Reads the id of the current boot of the kernel.
+**
+** Parameters       id - where to store the id.
+**
+** Returns          0 if read, -1 otherwise.
+**
+*******************************************************************************/
+static int StEseJournal_readBootId(uint8_t* id) {
+  int fd = open(BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t bytesRead = read(fd, id, BOOT_ID_LENGTH);
+  close(fd);
+  return (bytesRead == BOOT_ID_LENGTH) ? 0 : -1;
+}
+
+/*******************************************************************************
+**
+** Function         StEseJournal_open
+**
+** Description      Maps the journal, once per process, created empty if it
+**                  does not exist or was written by another version.
+**
+** Parameters       path - file of the journal.
+**
+** Returns          0 if the journal is mapped, -1 otherwise.
+**
+*******************************************************************************/
+int StEseJournal_open(const char* path) {
+  int result = -1;
+
+  pthread_mutex_lock(&journalMutex);
+  if (journal != NULL) {
+    pthread_mutex_unlock(&journalMutex);
+    return 0;
+  }
+
+  if (StEseJournal_readBootId(bootId) != 0) {
+    STLOG_HAL_W("%s : cannot read the boot id, the link will not be resumed",
+                __func__);
+    memset(bootId, 0x00, sizeof(bootId));
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    STLOG_HAL_E("%s : cannot open %s", __func__, path);
+  } else if (ftruncate(fd, sizeof(Journal)) != 0) {
+    STLOG_HAL_E("%s : cannot size %s", __func__, path);
+  } else {
+    void* mapping = mmap(NULL, sizeof(Journal), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      STLOG_HAL_E("%s : cannot map %s", __func__, path);
+    } else {
+      journal = (Journal*)mapping;
+      if ((journal->magic != JOURNAL_MAGIC) ||
+          (journal->version != JOURNAL_VERSION)) {
+        // Both records are left without a valid CRC.
+        memset(journal, 0x00, sizeof(Journal));
+        journal->magic = JOURNAL_MAGIC;
+        journal->version = JOURNAL_VERSION;
+      }
+      result = 0;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  pthread_mutex_unlock(&journalMutex);
+  return result;
+}
+
+/*******************************************************************************
+**
+** Function         StEseJournal_resume
+**
+** Description      Resumes the link recorded by a previous service of the
+**                  same boot, if the eSE still answers.
+**
+** Returns          0 if the link was resumed, -1 if the eSE must be reset.
+**
+*******************************************************************************/
+int StEseJournal_resume() {
+  JournalLink link;
+
+  pthread_mutex_lock(&journalMutex);
+  bool recorded = (journal != NULL) &&
+                  StEseJournal_isSealed(&journal->link,
+                                        offsetof(JournalLink, crc));
+  if (recorded) {
+    link = journal->link;
+  }
+  pthread_mutex_unlock(&journalMutex);
+  if (!recorded) {
+    return -1;
+  }
+  // The eSE was powered off since: its channels are gone, even if it answers.
+  static const uint8_t unknownBootId[BOOT_ID_LENGTH] = {0};
+  if ((memcmp(bootId, unknownBootId, BOOT_ID_LENGTH) == 0) ||
+      (memcmp(link.bootId, bootId, BOOT_ID_LENGTH) != 0)) {
+    STLOG_HAL_D("%s : journal of another boot, resetting the eSE", __func__);
+    return -1;
+  }
+
+  // The exchanges must not be made with the default ATP values.
+  if ((Atp_setAtp(link.atp) != 0) ||
+      (T1protocol_resumeLink(link.ifsd) != 0)) {
+    STLOG_HAL_W("%s : the eSE does not answer, resetting it", __func__);
+    return -1;
+  }
+  STLOG_HAL_D("%s : link resumed", __func__);
+  StEseJournal_recordLink();
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         StEseJournal_recordLink
+**
+** Description      Records the state of the link, at an APDU boundary.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseJournal_recordLink() {
+  pthread_mutex_lock(&journalMutex);
+  if (journal != NULL) {
+    JournalLink* link = &journal->link;
+    uint8_t* atp = Atp_getAtp();
+
+    memcpy(link->atp, atp, LEN_LENGTH_IN_ATP + atp[LEN_OFFSET_IN_ATP]);
+    link->ifsd = T1protocol_getIfsd();
+    memcpy(link->bootId, bootId, BOOT_ID_LENGTH);
+    StEseJournal_seal(link, offsetof(JournalLink, crc));
+  }
+  pthread_mutex_unlock(&journalMutex);
+}
+
+/*******************************************************************************
+**
+** Function         StEseJournal_recordReset
+**
+** Description      Records a link restarted from a new ATP, without any
+**                  logical channel open.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseJournal_recordReset() {
+  StEseJournal_recordLink();
+
+  pthread_mutex_lock(&journalMutex);
+  if (journal != NULL) {
+    memset(journal->channels.channels, 0x00,
+           sizeof(journal->channels.channels));
+    StEseJournal_seal(&journal->channels, offsetof(JournalChannels, crc));
+  }
+  pthread_mutex_unlock(&journalMutex);
+}
+
+/*******************************************************************************
+**
+** Function         StEseJournal_recordChannel
+**
+** Description      Records a logical channel opened or closed.
+**
+** Parameters       channel - logical channel number.
+**                  state   - how the channel was opened, NULL if closed.
+**
+** Returns          0 if recorded, -1 otherwise.
+**
+*******************************************************************************/
+int StEseJournal_recordChannel(uint8_t channel,
+                               const StEse_channelState* state) {
+  int result = -1;
+
+  if ((channel >= ESE_MAX_LOGICAL_CHANNELS) ||
+      ((state != NULL) && (state->aidLength > ESE_JOURNAL_MAX_AID_LENGTH))) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&journalMutex);
+  if (journal != NULL) {
+    JournalChannels* channels = &journal->channels;
+    // A table torn by a crash restarts empty.
+    if (!StEseJournal_isSealed(channels, offsetof(JournalChannels, crc))) {
+      memset(channels->channels, 0x00, sizeof(channels->channels));
+    }
+    channels->channels[channel].open = (state != NULL) ? 1 : 0;
+    if (state != NULL) {
+      channels->channels[channel].state = *state;
+    }
+    StEseJournal_seal(channels, offsetof(JournalChannels, crc));
+    result = 0;
+  }
+  pthread_mutex_unlock(&journalMutex);
+  return result;
+}
+
+/*******************************************************************************
+**
+** Function         StEseJournal_getChannel
+**
+** Description      Gets a logical channel recorded.
+**
+** Parameters       channel - logical channel number.
+**                  state   - where to store how the channel was opened.
+**
+** Returns          0 if the channel is recorded open, -1 otherwise.
+**
+*******************************************************************************/
+int StEseJournal_getChannel(uint8_t channel, StEse_channelState* state) {
+  int result = -1;
+
+  if (channel >= ESE_MAX_LOGICAL_CHANNELS) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&journalMutex);
+  if ((journal != NULL) &&
+      StEseJournal_isSealed(&journal->channels,
+                            offsetof(JournalChannels, crc)) &&
+      (journal->channels.channels[channel].open != 0)) {
+    *state = journal->channels.channels[channel].state;
+    result = 0;
+  }
+  pthread_mutex_unlock(&journalMutex);
+  return result;
+}
@@ -0,0 +1,87 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef _STESEJOURNAL_H_
+#define _STESEJOURNAL_H_
+
+/*
+ * State journal: a small memory-mapped file holding what a restarted HAL
+ * service needs to carry on with the eSE where the previous one stopped,
+ * instead of resetting it: the ATP and the IFSD of the link, and the logical
+ * channels open. It only applies to the boot it was written in, as the eSE
+ * is powered off in between. The pages of a
+ * MAP_SHARED file outlive the process, so updating them costs no system call;
+ * each record carries a CRC so that a record torn by a crash is ignored.
+ */
+
+#include <stdint.h>
+#include "StEseApi.h"
+
+/**
+ * Maps the journal, created if it does not exist yet, for the lifetime of
+ * the process: the channels are still recorded closed after the device is.
+ * Without it, all the other functions do nothing.
+ *
+ * @param path File of the journal.
+ *
+ * @return 0 if the journal is mapped, -1 otherwise.
+ */
+int StEseJournal_open(const char* path);
+
+/**
+ * Resumes the link recorded by a previous service of the same boot: takes
+ * its ATP and IFSD, and resynchronizes the link, whatever sequence numbers
+ * or APDU in progress it was left with.
+ *
+ * @return 0 if the link was resumed, -1 if the eSE must be reset.
+ */
+int StEseJournal_resume();
+
+/**
+ * Records the state of the link, at an APDU boundary.
+ */
+void StEseJournal_recordLink();
+
+/**
+ * Records a link restarted from a new ATP: the eSE closed all the logical
+ * channels.
+ */
+void StEseJournal_recordReset();
+
+/**
+ * Records a logical channel opened or closed.
+ *
+ * @param channel Logical channel number, as known by the clients.
+ * @param state How the channel was opened, NULL if it is closed.
+ *
+ * @return 0 if recorded, -1 otherwise.
+ */
+int StEseJournal_recordChannel(uint8_t channel,
+                               const StEse_channelState* state);
+
+/**
+ * Gets a logical channel recorded.
+ *
+ * @param channel Logical channel number, as known by the clients.
+ * @param state Where to store how the channel was opened.
+ *
+ * @return 0 if the channel is recorded open, -1 otherwise.
+ */
+int StEseJournal_getChannel(uint8_t channel, StEse_channelState* state);
+
+#endif /* _STESEJOURNAL_H_ */
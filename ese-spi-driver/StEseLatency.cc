@@ -0,0 +1,306 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-Latency"
+#include "StEseLatency.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include "android_logmsg.h"
+
+#define INS_SELECT 0xA4
+#define INS_MANAGE_CHANNEL 0x70
+#define INS_GET_RESPONSE 0xC0
+
+// The phases are recorded by the thread the scheduler granted the device to,
+// so there is a single writer at a time. Atomics only let the stats be read
+// from any thread.
+typedef struct {
+  // Histogram contents are stale if this differs from currentGeneration.
+  std::atomic<uint32_t> generation;
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sumNs;
+  std::atomic<uint64_t> minNs;
+  std::atomic<uint64_t> maxNs;
+  std::atomic<uint32_t> buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+static LatencyHistogram histograms[ESE_LATENCY_PHASE_COUNT]
+                                  [ESE_APDU_CLASS_COUNT];
+static std::atomic<uint32_t> currentGeneration(1);
+static std::atomic<uint8_t> currentClass(ESE_APDU_CLASS_OTHER);
+
+static const char* phaseNames[ESE_LATENCY_PHASE_COUNT] = {
+    "write",     "mode-switch",   "time-to-nad", "body-read",
+    "crc-check", "rs-round-trip", "recovery",    "apdu"};
+static const char* classNames[ESE_APDU_CLASS_COUNT] = {
+    "select", "manage-channel", "get-response", "proprietary", "other"};
+
+/*******************************************************************************
+**
+** Function         StEseLatency_getBucket
+**
+** Description      Gets the bucket a value falls in.
+**
+** Parameters       valueNs - the value.
+**
+** Returns          Index of the bucket.
+**
+*******************************************************************************/
+static unsigned int StEseLatency_getBucket(uint64_t valueNs) {
+  if (valueNs < LATENCY_SUB_BUCKETS) {
+    return (unsigned int)valueNs;
+  }
+  int exponent = 63 - __builtin_clzll(valueNs);
+  if (exponent > LATENCY_MAX_EXPONENT) {
+    return LATENCY_BUCKETS - 1;
+  }
+  int shift = exponent - LATENCY_SUB_BUCKET_BITS;
+  return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+         (unsigned int)((valueNs >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/*******************************************************************************
+**
+** Function         StEseLatency_getBucketMax
+**
+** Description      Gets the highest value of a bucket.
+**
+** Parameters       bucket - index of the bucket.
+**
+** Returns          The value, in ns.
+**
+*******************************************************************************/
+static uint64_t StEseLatency_getBucketMax(unsigned int bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  uint64_t sub = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+/*******************************************************************************
+**
+** Function         StEseLatency_isCurrent
+**
+** Description      Checks if a histogram was recorded into since the last
+**                  reset.
+**
+** Parameters       histogram - the histogram.
+**
+** Returns          true if its contents are valid.
+**
+*******************************************************************************/
+static bool StEseLatency_isCurrent(LatencyHistogram* histogram) {
+  return histogram->generation.load(std::memory_order_acquire) ==
+         currentGeneration.load(std::memory_order_relaxed);
+}
+
+/*******************************************************************************
+**
+** Function         StEseLatency_now
+**
+** Description      Gets the monotonic time the latencies are measured with.
+**
+** Returns          Current time in ns.
+**
+*******************************************************************************/
+uint64_t StEseLatency_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*******************************************************************************
+**
+** Function         StEseLatency_setApduClass
+**
+** Description      Sets the class the next latencies are accounted to.
+**
+** Parameters       cla - CLA byte of the APDU.
+**                  ins - INS byte of the APDU.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseLatency_setApduClass(uint8_t cla, uint8_t ins) {
+  StEse_apduClass apduClass;
+
+  if (((cla & 0x80) != 0) && (cla != 0xFF)) {
+    apduClass = ESE_APDU_CLASS_PROPRIETARY;
+  } else if (ins == INS_SELECT) {
+    apduClass = ESE_APDU_CLASS_SELECT;
+  } else if (ins == INS_MANAGE_CHANNEL) {
+    apduClass = ESE_APDU_CLASS_MANAGE_CHANNEL;
+  } else if (ins == INS_GET_RESPONSE) {
+    apduClass = ESE_APDU_CLASS_GET_RESPONSE;
+  } else {
+    apduClass = ESE_APDU_CLASS_OTHER;
+  }
+  currentClass.store(apduClass, std::memory_order_relaxed);
+}
+
+/*******************************************************************************
+**
+** Function         StEseLatency_record
+**
+** Description      Records the duration of a phase for the current class.
+**
+** Parameters       phase   - phase of the transceive.
+**                  startNs - start of the phase.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseLatency_record(StEse_latencyPhase phase, uint64_t startNs) {
+  uint64_t valueNs = StEseLatency_now() - startNs;
+  LatencyHistogram* histogram =
+      &histograms[phase][currentClass.load(std::memory_order_relaxed)];
+  uint32_t generation = currentGeneration.load(std::memory_order_relaxed);
+
+  // First record since the last reset: empty the histogram now.
+  if (histogram->generation.load(std::memory_order_relaxed) != generation) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      histogram->buckets[i].store(0, std::memory_order_relaxed);
+    }
+    histogram->count.store(0, std::memory_order_relaxed);
+    histogram->sumNs.store(0, std::memory_order_relaxed);
+    histogram->minNs.store(UINT64_MAX, std::memory_order_relaxed);
+    histogram->maxNs.store(0, std::memory_order_relaxed);
+    histogram->generation.store(generation, std::memory_order_release);
+  }
+
+  histogram->buckets[StEseLatency_getBucket(valueNs)].fetch_add(
+      1, std::memory_order_relaxed);
+  histogram->count.fetch_add(1, std::memory_order_relaxed);
+  histogram->sumNs.fetch_add(valueNs, std::memory_order_relaxed);
+  if (valueNs < histogram->minNs.load(std::memory_order_relaxed)) {
+    histogram->minNs.store(valueNs, std::memory_order_relaxed);
+  }
+  if (valueNs > histogram->maxNs.load(std::memory_order_relaxed)) {
+    histogram->maxNs.store(valueNs, std::memory_order_relaxed);
+  }
+}
+
+/*******************************************************************************
+**
+** Function         StEseLatency_getStats
+**
+** Description      Computes the latency distribution of a phase for a class
+**                  of APDUs. Percentiles are the highest value of the bucket
+**                  they fall in, capped to the maximum.
+**
+** Parameters       phase     - phase of the transceive.
+**                  apduClass - class of the APDUs.
+**                  stats     - where to store the distribution.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseLatency_getStats(StEse_latencyPhase phase, StEse_apduClass apduClass,
+                           StEse_latencyStats* stats) {
+  static const uint32_t permille[] = {500, 900, 990, 999};
+  uint64_t* percentiles[] = {&stats->p50Ns, &stats->p90Ns, &stats->p99Ns,
+                             &stats->p999Ns};
+  LatencyHistogram* histogram = &histograms[phase][apduClass];
+  uint32_t buckets[LATENCY_BUCKETS];
+  uint64_t count = 0;
+
+  memset(stats, 0, sizeof(StEse_latencyStats));
+  if (!StEseLatency_isCurrent(histogram)) {
+    return;
+  }
+
+  // Percentiles are computed on a copy, consistent with its own count.
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    buckets[i] = histogram->buckets[i].load(std::memory_order_relaxed);
+    count += buckets[i];
+  }
+  if (count == 0) {
+    return;
+  }
+  stats->count = count;
+  stats->minNs = histogram->minNs.load(std::memory_order_relaxed);
+  stats->maxNs = histogram->maxNs.load(std::memory_order_relaxed);
+  uint64_t recorded = histogram->count.load(std::memory_order_relaxed);
+  stats->meanNs = histogram->sumNs.load(std::memory_order_relaxed) /
+                  (recorded ? recorded : count);
+
+  unsigned int p = 0;
+  uint64_t cumulated = 0;
+  for (int i = 0; (i < LATENCY_BUCKETS) && (p < 4); i++) {
+    cumulated += buckets[i];
+    while ((p < 4) && (cumulated * 1000 >= count * permille[p])) {
+      uint64_t value = StEseLatency_getBucketMax(i);
+      *percentiles[p++] = (value < stats->maxNs) ? value : stats->maxNs;
+    }
+  }
+}
+
+/*******************************************************************************
+**
+** Function         StEseLatency_reset
+**
+** Description      Clears all the histograms. Only the generation changes, a
+**                  histogram is emptied when it is next recorded into.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseLatency_reset() {
+  currentGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*******************************************************************************
+**
+** Function         StEseLatency_dump
+**
+** Description      Writes the non empty distributions in text form, in us.
+**
+** Parameters       fd - file descriptor to write to.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseLatency_dump(int fd) {
+  StEse_latencyStats stats;
+
+  dprintf(fd, "Latencies (us):\n");
+  dprintf(fd, "  %-14s %-15s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+          "phase", "class", "count", "min", "mean", "p50", "p90", "p99",
+          "p99.9", "max");
+  for (int phase = 0; phase < ESE_LATENCY_PHASE_COUNT; phase++) {
+    for (int c = 0; c < ESE_APDU_CLASS_COUNT; c++) {
+      StEseLatency_getStats((StEse_latencyPhase)phase, (StEse_apduClass)c,
+                            &stats);
+      if (stats.count == 0) {
+        continue;
+      }
+      dprintf(fd,
+              "  %-14s %-15s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f "
+              "%10.1f\n",
+              phaseNames[phase], classNames[c],
+              (unsigned long long)stats.count, stats.minNs / 1000.0,
+              stats.meanNs / 1000.0, stats.p50Ns / 1000.0,
+              stats.p90Ns / 1000.0, stats.p99Ns / 1000.0,
+              stats.p999Ns / 1000.0, stats.maxNs / 1000.0);
+    }
+  }
+}
@@ -0,0 +1,81 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef _STESELATENCY_H_
+#define _STESELATENCY_H_
+
+#include <stdint.h>
+#include "StEseApi.h"
+
+// Log-linear buckets: each power of 2 is split in 2^LATENCY_SUB_BUCKET_BITS
+// buckets, so a value is known to 1/8th. Values from 2^(LATENCY_MAX_EXPONENT
+// + 1) ns (about 137 s) go to the last bucket.
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT 36
+#define LATENCY_BUCKETS \
+  ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+/**
+ * Gets the monotonic time the latencies are measured with.
+ *
+ * @return Current time in ns.
+ */
+uint64_t StEseLatency_now();
+
+/**
+ * Sets the class of the APDU being exchanged, the latencies recorded until
+ * the next call are accounted to it.
+ *
+ * @param cla CLA byte of the APDU.
+ * @param ins INS byte of the APDU.
+ */
+void StEseLatency_setApduClass(uint8_t cla, uint8_t ins);
+
+/**
+ * Records the duration of a phase for the current APDU class.
+ *
+ * @param phase Phase of the transceive.
+ * @param startNs Start of the phase, from StEseLatency_now().
+ */
+void StEseLatency_record(StEse_latencyPhase phase, uint64_t startNs);
+
+/**
+ * Computes the latency distribution of a phase for a class of APDUs.
+ *
+ * @param phase Phase of the transceive.
+ * @param apduClass Class of the APDUs.
+ * @param stats Where to store the distribution.
+ */
+void StEseLatency_getStats(StEse_latencyPhase phase, StEse_apduClass apduClass,
+                           StEse_latencyStats* stats);
+
+/**
+ * Clears all the histograms in constant time: they are only emptied when
+ * next recorded into.
+ */
+void StEseLatency_reset();
+
+/**
+ * Writes the non empty distributions in text form.
+ *
+ * @param fd File descriptor to write to.
+ */
+void StEseLatency_dump(int fd);
+
+#endif /* _STESELATENCY_H_ */
@@ -0,0 +1,328 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-Scheduler"
+#include "StEseScheduler.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "android_logmsg.h"
+
+#define NO_GRANT -1
+
+static pthread_mutex_t schedMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t schedCond = PTHREAD_COND_INITIALIZER;
+
+// True while an APDU owns the device (or the device is reserved for the
+// waiter designated by grantedClass).
+static bool busy = false;
+static int grantedClass = NO_GRANT;
+static unsigned int maxBypass = DEFAULT_STARVATION_LIMIT;
+// Reservations taking the device before any waiting class.
+static unsigned int reservations = 0;
+
+// Per class FIFO tickets, number of waiters and number of times the class was
+// bypassed while it had waiters.
+static uint32_t nextTicket[ESE_PRIORITY_COUNT];
+static uint32_t headTicket[ESE_PRIORITY_COUNT];
+static uint32_t waiting[ESE_PRIORITY_COUNT];
+static uint32_t bypassed[ESE_PRIORITY_COUNT];
+
+static StEse_queueStats queueStats[ESE_PRIORITY_COUNT];
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_nowUs
+**
+** Description      Gets the monotonic time in microseconds.
+**
+** Returns          Current time in us.
+**
+*******************************************************************************/
+static uint64_t StEseScheduler_nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_pickClass
+**
+** Description      Selects the class to be served next. The highest priority
+**                  class with waiters wins unless a lower class reached the
+**                  starvation limit. Must be called with schedMutex held.
+**
+** Returns          The selected class, NO_GRANT if nobody is waiting.
+**
+*******************************************************************************/
+static int StEseScheduler_pickClass() {
+  int top = NO_GRANT;
+  int starved = NO_GRANT;
+  int selected;
+  int c;
+
+  for (c = 0; c < ESE_PRIORITY_COUNT; c++) {
+    if (waiting[c] == 0) continue;
+    if (top == NO_GRANT) {
+      top = c;
+    } else if ((bypassed[c] >= maxBypass) &&
+               ((starved == NO_GRANT) || (bypassed[c] > bypassed[starved]))) {
+      // Starvation protection: serve the most starved lower class.
+      starved = c;
+    }
+  }
+  selected = (starved != NO_GRANT) ? starved : top;
+
+  if (selected == NO_GRANT) {
+    return NO_GRANT;
+  }
+
+  for (c = 0; c < ESE_PRIORITY_COUNT; c++) {
+    if ((c != selected) && (waiting[c] > 0)) {
+      bypassed[c]++;
+    }
+  }
+  bypassed[selected] = 0;
+  return selected;
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_init
+**
+** Description      Initializes the scheduler placed in front of the T=1
+**                  engine.
+**
+** Parameters       starvationLimit - number of times a waiting class can be
+**                                    bypassed before it is served.
+**
+** Returns          0 if everything went ok, -1 otherwise.
+**
+*******************************************************************************/
+int StEseScheduler_init(unsigned int starvationLimit) {
+  pthread_mutex_lock(&schedMutex);
+  if (busy) {
+    pthread_mutex_unlock(&schedMutex);
+    STLOG_HAL_E("%s : scheduler still in use", __func__);
+    return -1;
+  }
+  maxBypass = (starvationLimit > 0) ? starvationLimit : 1;
+  grantedClass = NO_GRANT;
+  memset(bypassed, 0, sizeof(bypassed));
+  memset(queueStats, 0, sizeof(queueStats));
+  pthread_mutex_unlock(&schedMutex);
+
+  STLOG_HAL_D("%s : starvation limit = %u", __func__, maxBypass);
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_deinit
+**
+** Description      Releases the resources of the scheduler.
+**
+** Parameters       none
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseScheduler_deinit() {
+  pthread_mutex_lock(&schedMutex);
+  if (busy || (grantedClass != NO_GRANT)) {
+    STLOG_HAL_W("%s : APDUs still queued", __func__);
+  }
+  pthread_mutex_unlock(&schedMutex);
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_acquire
+**
+** Description      Waits until the device is granted to the caller.
+**
+** Parameters       priority - priority class of the APDU.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseScheduler_acquire(StEse_priority priority) {
+  int c = (int)priority;
+  if ((c < 0) || (c >= ESE_PRIORITY_COUNT)) {
+    c = ESE_PRIORITY_NORMAL;
+  }
+
+  uint64_t start = StEseScheduler_nowUs();
+
+  pthread_mutex_lock(&schedMutex);
+  uint32_t ticket = nextTicket[c]++;
+  waiting[c]++;
+
+  if (!busy && (reservations == 0)) {
+    // Device idle and nobody reserved: grant right away.
+    grantedClass = StEseScheduler_pickClass();
+    busy = true;
+  }
+
+  while ((grantedClass != c) || (headTicket[c] != ticket)) {
+    pthread_cond_wait(&schedCond, &schedMutex);
+  }
+
+  // Take the grant
+  grantedClass = NO_GRANT;
+  headTicket[c]++;
+  waiting[c]--;
+
+  uint64_t waitUs = StEseScheduler_nowUs() - start;
+  queueStats[c].count++;
+  queueStats[c].totalWaitUs += waitUs;
+  if (waitUs > queueStats[c].maxWaitUs) {
+    queueStats[c].maxWaitUs = (uint32_t)waitUs;
+  }
+  pthread_mutex_unlock(&schedMutex);
+
+  STLOG_HAL_V("%s : class %d granted after %llu us", __func__, c,
+              (unsigned long long)waitUs);
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_release
+**
+** Description      Gives the device back and grants it to the next waiting
+**                  APDU, if any.
+**
+** Parameters       none
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseScheduler_release() {
+  pthread_mutex_lock(&schedMutex);
+  if (reservations > 0) {
+    // Left free for the reservation, the waiting classes keep waiting.
+    grantedClass = NO_GRANT;
+    busy = false;
+    pthread_cond_broadcast(&schedCond);
+  } else {
+    grantedClass = StEseScheduler_pickClass();
+    busy = (grantedClass != NO_GRANT);
+    if (busy) {
+      pthread_cond_broadcast(&schedCond);
+    }
+  }
+  pthread_mutex_unlock(&schedMutex);
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_tryAcquire
+**
+** Description      Takes the device if it is idle, without waiting.
+**
+** Parameters       none
+**
+** Returns          true if the device was granted.
+**
+*******************************************************************************/
+bool StEseScheduler_tryAcquire() {
+  bool granted = false;
+
+  pthread_mutex_lock(&schedMutex);
+  // Nobody waits while the device is not busy.
+  if (!busy && (reservations == 0)) {
+    busy = true;
+    granted = true;
+  }
+  pthread_mutex_unlock(&schedMutex);
+  return granted;
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_reserve
+**
+** Description      Reserves the device ahead of all the waiting APDUs.
+**
+** Parameters       none
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseScheduler_reserve() {
+  pthread_mutex_lock(&schedMutex);
+  reservations++;
+  pthread_mutex_unlock(&schedMutex);
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_acquireReserved
+**
+** Description      Waits until the reserved device is granted to the caller.
+**
+** Parameters       none
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseScheduler_acquireReserved() {
+  pthread_mutex_lock(&schedMutex);
+  while (busy) {
+    pthread_cond_wait(&schedCond, &schedMutex);
+  }
+  busy = true;
+  reservations--;
+  pthread_mutex_unlock(&schedMutex);
+  STLOG_HAL_V("%s : reservation granted", __func__);
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_getStats
+**
+** Description      Gets the queueing delay statistics of each priority class.
+**
+** Parameters       stats - array of ESE_PRIORITY_COUNT elements.
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseScheduler_getStats(StEse_queueStats* stats) {
+  pthread_mutex_lock(&schedMutex);
+  memcpy(stats, queueStats, sizeof(queueStats));
+  pthread_mutex_unlock(&schedMutex);
+}
+
+/*******************************************************************************
+**
+** Function         StEseScheduler_resetStats
+**
+** Description      Clears the queueing delay statistics.
+**
+** Parameters       none
+**
+** Returns          void
+**
+*******************************************************************************/
+void StEseScheduler_resetStats() {
+  pthread_mutex_lock(&schedMutex);
+  memset(queueStats, 0, sizeof(queueStats));
+  pthread_mutex_unlock(&schedMutex);
+}
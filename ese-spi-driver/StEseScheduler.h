@@ -0,0 +1,97 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef _STESESCHEDULER_H_
+#define _STESESCHEDULER_H_
+
+#include <stdint.h>
+#include "StEseApi.h"
+
+// Number of grants a waiting class may be bypassed by higher priority classes
+// before it is served anyway.
+#define DEFAULT_STARVATION_LIMIT 4
+
+/**
+ * Initializes the scheduler placed in front of the T=1 engine.
+ *
+ * @param starvationLimit Number of times a waiting priority class can be
+ *        bypassed before it is granted the device.
+ *
+ * @return 0 if everything went ok, -1 otherwise.
+ */
+int StEseScheduler_init(unsigned int starvationLimit);
+
+/**
+ * Releases the resources of the scheduler.
+ */
+void StEseScheduler_deinit();
+
+/**
+ * Waits until the device is granted to the caller. Requests of the same
+ * priority are served in FIFO order, higher priorities are served first
+ * unless a lower priority class has been bypassed too many times.
+ *
+ * Must be called once per APDU so that the scheduling only happens at APDU
+ * boundaries, never in the middle of a chain.
+ *
+ * @param priority Priority class of the APDU.
+ */
+void StEseScheduler_acquire(StEse_priority priority);
+
+/**
+ * Gives the device back and grants it to the next waiting APDU, if any, or
+ * to the reservation made with StEseScheduler_reserve().
+ */
+void StEseScheduler_release();
+
+/**
+ * Takes the device only if it is idle: nothing in progress, waiting or
+ * reserved. Does not wait. On success, the caller calls
+ * StEseScheduler_release() as usual.
+ *
+ * @return true if the device was granted.
+ */
+bool StEseScheduler_tryAcquire();
+
+/**
+ * Reserves the device ahead of all the APDUs waiting, e.g. for a recovery:
+ * it is granted to StEseScheduler_acquireReserved() as soon as the APDU in
+ * progress, if any, releases it. Does not wait.
+ */
+void StEseScheduler_reserve();
+
+/**
+ * Waits until the device reserved with StEseScheduler_reserve() is granted
+ * to the caller, which then calls StEseScheduler_release() as usual.
+ */
+void StEseScheduler_acquireReserved();
+
+/**
+ * Gets the queueing delay statistics of each priority class.
+ *
+ * @param stats Array of ESE_PRIORITY_COUNT elements where to store the
+ *        statistics.
+ */
+void StEseScheduler_getStats(StEse_queueStats* stats);
+
+/**
+ * Clears the queueing delay statistics.
+ */
+void StEseScheduler_resetStats();
+
+#endif /* _STESESCHEDULER_H_ */
@@ -20,18 +20,165 @@
 #include "T1protocol.h"
 #include <errno.h>
 #include <string.h>
+#include <atomic>
+#include "SpiLayerClock.h"
 #include "SpiLayerComm.h"
 #include "SpiLayerDriver.h"
 #include "SpiLayerInterface.h"
+#include "StEseLatency.h"
+#include "T1protocolFrames.h"
 #include "android_logmsg.h"
+#include "utils-lib/BusCounters.h"
 #include "utils-lib/DataMgmt.h"
 #include "utils-lib/Iso13239CRC.h"
 #include "utils-lib/Tpdu.h"
+#include "utils-lib/Utils.h"
 
 uint8_t SEQ_NUM_MASTER;
 uint8_t SEQ_NUM_SLAVE;
 uint8_t recoveryStatus;
 T1TProtocol_TransceiveState gNextCmd = Idle;
+// IFSD in use (size of the INF field the eSE may send), and the value to
+// negotiate. Both are independent from the IFSC (ATP.ifsc) used to send.
+static uint8_t IFSD = DEFAULT_IFSD;
+static uint8_t gIfsdTarget = MAX_IFSD;
+static bool gIfsdNegotiationNeeded = false;
+// Deadline of the APDU part being exchanged, NULL if there is none.
+static const struct timeval* gDeadline = NULL;
+// Sink the response is streamed to, NULL to collect it in DataMgmt. The INF
+// field of a chained I-block is pending until the R(ACK) for the next block
+// has been sent.
+static StEse_responseSink gSink = NULL;
+static void* gSinkContext = NULL;
+static uint8_t* gPendingInf = NULL;
+static uint8_t gPendingInfLen = 0;
+// Time of the error that started the ongoing recovery.
+static uint64_t gRecoveryStartNs = 0;
+// Time spent in each state and transitions taken, for the benchmarks and the
+// debug dump. Written by the thread the scheduler granted the device to.
+static std::atomic<uint64_t> stateTimeNs[T1_STATE_COUNT];
+static std::atomic<uint64_t> transitionCounts[T1_STATE_COUNT][T1_EVENT_COUNT];
+
+static const char* stateNames[T1_STATE_COUNT] = {
+    "Idle",          "I_block",       "R_ACK",
+    "R_CRC_Error",   "R_Other_Error", "S_Resync_REQ",
+    "S_Resync_RES",  "S_IFS_REQ",     "S_IFS_RES",
+    "S_WTX_RES",     "S_SWReset_REQ", "S_Abort_RES"};
+
+static const char* eventNames[T1_EVENT_COUNT] = {
+    "none",
+    "send",
+    "i-block",
+    "i-block-chained",
+    "r-block-ack",
+    "r-block-resend",
+    "r-block-unexpected",
+    "wtx-request",
+    "ifs-request",
+    "resynch-request",
+    "resynch-response",
+    "abort-request",
+    "s-block-no-answer",
+    "recovery-resend",
+    "recovery-resynch",
+    "recovery-swreset",
+    "aborted"};
+
+typedef struct {
+  uint8_t next[T1_STATE_COUNT][T1_EVENT_COUNT];
+} TransitionTable;
+
+/*******************************************************************************
+**
+** Function         T1protocol_nextState
+**
+** Description      Gets the state the T=1 engine goes to on an event, at
+**                  compile time.
+**
+** Parameters       state - current state.
+**                  event - the event.
+**
+** Returns          The next state.
+**
+*******************************************************************************/
+static constexpr T1TProtocol_TransceiveState T1protocol_nextState(
+    T1TProtocol_TransceiveState state, T1TProtocol_Event event) {
+  switch (event) {
+    case T1_EVENT_SEND:
+    case T1_EVENT_R_BLOCK_RESEND:
+    case T1_EVENT_RESYNCH_RESPONSE:
+      return I_block;
+    case T1_EVENT_I_BLOCK:
+    case T1_EVENT_R_BLOCK_ACK:
+    case T1_EVENT_ABORTED:
+      return Idle;
+    case T1_EVENT_I_BLOCK_CHAINED:
+      return R_ACK;
+    case T1_EVENT_R_BLOCK_UNEXPECTED:
+    case T1_EVENT_RECOVERY_RESYNCH:
+      return S_Resync_REQ;
+    case T1_EVENT_WTX_REQUEST:
+      return S_WTX_RES;
+    case T1_EVENT_IFS_REQUEST:
+      return S_IFS_RES;
+    case T1_EVENT_RESYNCH_REQUEST:
+      return S_Resync_RES;
+    case T1_EVENT_ABORT_REQUEST:
+      return S_Abort_RES;
+    case T1_EVENT_RECOVERY_RESEND:
+      return R_Other_Error;
+    case T1_EVENT_RECOVERY_SWRESET:
+      return S_SWReset_REQ;
+    default:
+      // The block received needs no answer, the exchange goes on.
+      return state;
+  }
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_makeTransitionTable
+**
+** Description      Computes the next state of all the states and events, at
+**                  compile time.
+**
+** Returns          The table, indexed by state and event.
+**
+*******************************************************************************/
+static constexpr TransitionTable T1protocol_makeTransitionTable() {
+  TransitionTable table = {};
+  for (int state = 0; state < T1_STATE_COUNT; state++) {
+    for (int event = 0; event < T1_EVENT_COUNT; event++) {
+      table.next[state][event] =
+          T1protocol_nextState((T1TProtocol_TransceiveState)state,
+                               (T1TProtocol_Event)event);
+    }
+  }
+  return table;
+}
+
+static constexpr TransitionTable transitionTable =
+    T1protocol_makeTransitionTable();
+
+/*******************************************************************************
+**
+** Function         T1protocol_transition
+**
+** Description      Moves the T=1 engine to its next state, and accounts the
+**                  transition.
+**
+** Parameters       event - the event.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void T1protocol_transition(T1TProtocol_Event event) {
+  if (event == T1_EVENT_NONE) {
+    return;
+  }
+  transitionCounts[gNextCmd][event].fetch_add(1, std::memory_order_relaxed);
+  gNextCmd = (T1TProtocol_TransceiveState)transitionTable.next[gNextCmd][event];
+}
 
 /*******************************************************************************
 **
@@ -103,260 +250,204 @@ uint8_t T1protocol_getValidPcb(TpduType type, RBlockType subtype,
 ** Returns          0 If checksum is ok, -1 otherwise.
 **
 *******************************************************************************/
-int T1protocol_checkResponseTpduChecksum(Tpdu* respTpdu) {
-  if (ATP.checksumType == CRC) {
-    // Check CRC
-    uint8_t arrayTpdu[TPDU_PROLOGUE_LENGTH + respTpdu->len + TPDU_CRC_LENGTH];
-    Tpdu_toByteArray(respTpdu, arrayTpdu);
-    if (computeCrc(arrayTpdu, TPDU_PROLOGUE_LENGTH + respTpdu->len) !=
-        respTpdu->checksum) {
-      return -1;
-    }
-  } else if (ATP.checksumType == LRC) {
-    // Check LRC
-    // char arrayTpdu[TPDU_PROLOGUE_LENGTH + respTpdu->len + TPDU_LRC_LENGTH];
-    // TODO: implement compute LRC
+int T1protocol_checkResponseTpduChecksum(const Tpdu* respTpdu) {
+  // Check the EDC, with the codec of the ATP checksum type
+  uint64_t startNs = StEseLatency_now();
+  bool checksumOk = Tpdu_isChecksumOk(respTpdu);
+  StEseLatency_record(ESE_LATENCY_CRC_CHECK, startNs);
+  SpiLayerClock_recordFrame(checksumOk);
+  if (!checksumOk) {
     return -1;
   }
 
   return 0;
 }
 
+// Length a response TPDU must have, given its PCB.
+typedef enum {
+  LenUpToIfsd, /* I-block */
+  LenZero,     /* R-block, S(ABORT...) and S(RESYNCH...) */
+  LenOne,      /* S(WTX...) and S(IFS...) */
+  LenAny       /* any other S-block */
+} PcbLenRule;
+
+// What a PCB tells about a response TPDU. The verdict error is
+// ResponsePcbError if a bit that must be 0 is set.
+typedef struct {
+  ResponseVerdict verdict;
+  uint8_t lenRule;
+} PcbClass;
+
+typedef struct {
+  PcbClass classes[UINT8_MAX + 1];
+} PcbTable;
+
 /*******************************************************************************
 **
-** Function         T1protocol_checkResponsePcbConsistency
+** Function         T1protocol_classifySBlock
 **
-** Description      Check if the pcb of a given tpdu is valid.
+** Description      Gets the kind of an S-block, at compile time.
 **
-** Parameters       cmdTpdu    -The TPDU to check
+** Parameters       pcb - PCB of the S-block.
 **
-** Returns          0 If checksum is ok, -1 otherwise.
+** Returns          The SBlockKind, SBlockOther if the PCB is none of the
+**                  S-block requests or responses.
 **
 *******************************************************************************/
-int T1protocol_checkResponsePcbConsistency(Tpdu* tpdu) {
-  // Get the type of the incoming tpdu
-  TpduType type = Tpdu_getType(tpdu);
-
-  switch (type) {
-    case IBlock:
-      // Match the IBlock pcb received with the bits that must be 0. If
-      // the result is higher than 0, means some of these bits was set to 1.
-      if ((tpdu->pcb & 0b00011111)) {
-        return -1;
-      }
-      break;
-
-    case RBlock:
-      // Match the RBlock pcb received with the bits that must be 0. If
-      // the result is higher than 0, means some of these bits was set to 1.
-      if ((tpdu->pcb & 0b01101100)) {
-        return -1;
-      }
-      break;
-
-    case SBlock:
-      // Match the SBlock pcb received with the bits that must be 0. If
-      // the result is higher than 0, means some of these bits was set to 1.
-      if ((tpdu->pcb & 0b00010000)) {
-        return -1;
-      }
-      break;
-
+static constexpr SBlockKind T1protocol_classifySBlock(uint8_t pcb) {
+  switch (pcb & (uint8_t)~0b00100000) {
+    case SBLOCK_RESYNCH_REQUEST_MASK:
+      return SBlockResynch;
+    case SBLOCK_IFS_REQUEST_MASK:
+      return SBlockIfs;
+    case SBLOCK_ABORT_REQUEST_MASK:
+      return SBlockAbort;
+    case SBLOCK_WTX_REQUEST_MASK:
+      return SBlockWtx;
+    case SBLOCK_SWRESET_REQUEST_MASK:
+      return SBlockSwReset;
     default:
-      break;
+      return SBlockOther;
   }
-
-  return 0;
 }
 
 /*******************************************************************************
 **
-** Function         T1protocol_checkResponseLenConsistency
+** Function         T1protocol_classifyPcb
 **
-** Description      Check if the length field of a given tpdu is valid.
+** Description      Classifies the PCB of a response TPDU, at compile time.
 **
-** Parameters       cmdTpdu    -The TPDU to check
+** Parameters       pcb - the PCB.
 **
-** Returns          0 If checksum is ok, -1 otherwise.
+** Returns          Its PcbClass.
 **
 *******************************************************************************/
-int T1protocol_checkResponseLenConsistency(Tpdu* tpdu) {
-  // Check the length consistency according to the block type
-  TpduType type = Tpdu_getType(tpdu);
-
-  switch (type) {
-    case IBlock:
-      // If the last Tpdu received was an IBlock, the len must be lower or
-      // equal than the ATP ifsd field.
-      if (tpdu->len > ATP.ifsc) {
-        return -1;
-      }
-      break;
-
-    case RBlock:
-      // If the last Tpdu received was an RBlock, the len must be 0.
-      if (tpdu->len > 0) {
-        return -1;
-      }
-      break;
-
-    case SBlock:
-      // If the last Tpdu received was an SBlock WTX... or IFS..., the length
-      // must be 1. If the last Tpdu received was an SBlock
-      // ABORT... or RESYNCH... the length must be 0.
-      if ((tpdu->pcb == (uint8_t)SBLOCK_WTX_REQUEST_MASK) ||
-          (tpdu->pcb == (uint8_t)SBLOCK_WTX_RESPONSE_MASK) ||
-          (tpdu->pcb == (uint8_t)SBLOCK_IFS_REQUEST_MASK) ||
-          (tpdu->pcb == (uint8_t)SBLOCK_IFS_RESPONSE_MASK)) {
-        if (tpdu->len != 1) {
-          return -1;
-        }
-      } else if ((tpdu->pcb == (uint8_t)SBLOCK_ABORT_REQUEST_MASK) ||
-                 (tpdu->pcb == (uint8_t)SBLOCK_ABORT_RESPONSE_MASK) ||
-                 (tpdu->pcb == (uint8_t)SBLOCK_RESYNCH_REQUEST_MASK) ||
-                 (tpdu->pcb == (uint8_t)SBLOCK_RESYNCH_RESPONSE_MASK)) {
-        if (tpdu->len != 0) {
-          return -1;
-        }
-      }
-      break;
+static constexpr PcbClass T1protocol_classifyPcb(uint8_t pcb) {
+  PcbClass pcbClass = {};
+  ResponseVerdict& verdict = pcbClass.verdict;
+
+  if ((pcb & 0x80) == 0x00) {
+    verdict.type = IBlock;
+    verdict.seqNumber = (pcb & IBLOCK_NS_BIT_MASK) ? 1 : 0;
+    verdict.more = (pcb & IBLOCK_M_BIT_MASK) ? 1 : 0;
+    // Bits 5 to 1 must be 0
+    verdict.error = (pcb & 0b00011111) ? ResponsePcbError : ResponseOk;
+    pcbClass.lenRule = LenUpToIfsd;
+  } else if ((pcb & 0xC0) == 0x80) {
+    verdict.type = RBlock;
+    verdict.seqNumber = (pcb & 0b00010000) ? 1 : 0;
+    // Bits 7, 6, 4 and 3 must be 0
+    verdict.error = (pcb & 0b01101100) ? ResponsePcbError : ResponseOk;
+    pcbClass.lenRule = LenZero;
+  } else {
+    verdict.type = SBlock;
+    verdict.sBlockKind = T1protocol_classifySBlock(pcb);
+    verdict.isResponse = (pcb & 0b00100000) ? 1 : 0;
+    // Bit 5 must be 0
+    verdict.error = (pcb & 0b00010000) ? ResponsePcbError : ResponseOk;
+    switch (verdict.sBlockKind) {
+      case SBlockWtx:
+      case SBlockIfs:
+        pcbClass.lenRule = LenOne;
+        break;
+      case SBlockAbort:
+      case SBlockResynch:
+        pcbClass.lenRule = LenZero;
+        break;
+      default:
+        pcbClass.lenRule = LenAny;
+        break;
+    }
   }
-
-  return 0;
+  return pcbClass;
 }
 
 /*******************************************************************************
 **
-** Function         T1protocol_checkResponseSeqNumberConsistency
-**
-** Description      Check if the sequence number of a given tpdu is valid.
+** Function         T1protocol_makePcbTable
 **
-** Parameters       cmdTpdu    -The TPDU to check
+** Description      Classifies all the PCBs, at compile time.
 **
-** Returns          0 If checksum is ok, -1 otherwise.
+** Returns          The table, indexed by PCB.
 **
 *******************************************************************************/
-int T1protocol_checkResponseSeqNumberConsistency(Tpdu* tpdu) {
-  // Check the length consistency according to the block type
-  TpduType type = Tpdu_getType(tpdu);
-
-  uint8_t seqNumber;
-
-  switch (type) {
-    case IBlock:
-      // CHeck if the sequence number received in the last IBlock matches the
-      // expected.
-      seqNumber = (tpdu->pcb & 0b01000000) >> 6;
-      if (seqNumber != SEQ_NUM_SLAVE) {
-        return -1;
-      }
-      break;
-
-    case RBlock:
-      // TODO
-      // If the original command Tpdu was Iblock chained, both sequence
-      // numbers are expected. If the original command Tpdu was Iblock
-      // without chaining an Rblock with sequence number different than the
-      // actual master sequence number is considered as invalid.
-      /*if ((cmdTpdu->pcb & IBLOCK_M_BIT_MASK) == 0) {
-          // Original Iblock without chaining
-          if (T1protocol_isSequenceNumberOk(
-                  cmdTpdu,
-                  respTpdu) == false) {
-              // Sequence number different from actual master sequence number
-              return -1;
-          }
-      }*/
-      break;
-
-    default:
-      break;
+static constexpr PcbTable T1protocol_makePcbTable() {
+  PcbTable table = {};
+  for (int pcb = 0; pcb <= UINT8_MAX; pcb++) {
+    table.classes[pcb] = T1protocol_classifyPcb(pcb);
   }
-
-  return 0;
+  return table;
 }
 
-/*******************************************************************************
-**
-** Function         T1protocol_checkSBlockResponseConsistency
-**
-** Description      Check if an SBlock response was received after having
-**                  transmitted a SBlock request.
-**
-** Parameters       lastCmdTpduSent      - Last Tpdu sent.
-**                  lastRespTpduReceived - Response received.
-**
-** Returns          0 If checksum is ok, -1 otherwise.
-**
-*******************************************************************************/
-int T1protocol_checkSBlockResponseConsistency(Tpdu* lastCmdTpduSent,
-                                              Tpdu* lastRespTpduReceived) {
-  // Check if last Tpdu received was an SBlock(...response) after having
-  // transmitted a SBlock(...request).
-
-  if ((lastCmdTpduSent->pcb == (uint8_t)SBLOCK_WTX_REQUEST_MASK) ||
-      (lastCmdTpduSent->pcb == (uint8_t)SBLOCK_ABORT_REQUEST_MASK) ||
-      (lastCmdTpduSent->pcb == (uint8_t)SBLOCK_IFS_REQUEST_MASK) ||
-      (lastCmdTpduSent->pcb == (uint8_t)SBLOCK_RESYNCH_REQUEST_MASK) ||
-      (lastCmdTpduSent->pcb == (uint8_t)SBLOCK_SWRESET_REQUEST_MASK)) {
-    uint8_t expectedPcbResponse;
-    // Calculate the expected response according to the SBlock request
-    // previously sent.
-    expectedPcbResponse = lastCmdTpduSent->pcb | 0b00100000;
-
-    if (expectedPcbResponse != lastRespTpduReceived->pcb) {
-      return -1;
-    }
-  }
-
-  return 0;
-}
+static constexpr PcbTable pcbTable = T1protocol_makePcbTable();
 
 /*******************************************************************************
 **
-** Function         T1protocol_checkTpduConsistency
+** Function         T1protocol_validateResponse
 **
-** Description      Check if the response TPDU is consistent
-**                  (check the checksum, check if the pcb is valid and the
-**                  expected one and check the len consistency).
+** Description      Validates a response TPDU in one pass: checksum, PCB,
+**                  length, sequence number, and S-block response to the
+**                  S-block request sent.
 **
 ** Parameters       lastCmdTpduSent       - Last Tpdu sent.
 **                  lastRespTpduReceived  - Last response from the slave.
 **
-** Returns          0 If checksum is ok, -1 otherwise.
+** Returns          The verdict, its error is ResponseOk if the TPDU is
+**                  consistent.
 **
 *******************************************************************************/
-int T1protocol_checkTpduConsistency(Tpdu* lastCmdTpduSent,
-                                    Tpdu* lastRespTpduReceived) {
-  // Check checksum
-  if (T1protocol_checkResponseTpduChecksum(lastRespTpduReceived) == -1) {
-    return -1;
+ResponseVerdict T1protocol_validateResponse(const Tpdu* lastCmdTpduSent,
+                                            const Tpdu* lastRespTpduReceived) {
+  const PcbClass* pcbClass = &pcbTable.classes[lastRespTpduReceived->pcb];
+  ResponseVerdict verdict = pcbClass->verdict;
+  uint8_t len = lastRespTpduReceived->len;
+
+  if (T1protocol_checkResponseTpduChecksum(lastRespTpduReceived) != 0) {
+    verdict.error = ResponseChecksumError;
+    return verdict;
   }
-
-  // Check pcb consistency
-  if (T1protocol_checkResponsePcbConsistency(lastRespTpduReceived) == -1) {
-    return -1;
+  if (verdict.error != ResponseOk) {
+    return verdict;
   }
 
-  // Check len consistency
-  if (T1protocol_checkResponseLenConsistency(lastRespTpduReceived) == -1) {
-    return -1;
+  switch (pcbClass->lenRule) {
+    case LenUpToIfsd:
+      // The len must be lower or equal than the negotiated IFSD.
+      if (len > IFSD) {
+        verdict.error = ResponseLenError;
+      }
+      break;
+    case LenZero:
+      if (len != 0) {
+        verdict.error = ResponseLenError;
+      }
+      break;
+    case LenOne:
+      if (len != 1) {
+        verdict.error = ResponseLenError;
+      }
+      break;
+  }
+  if (verdict.error != ResponseOk) {
+    return verdict;
   }
 
-  // Check sequence number consistency
-  if (T1protocol_checkResponseSeqNumberConsistency(lastRespTpduReceived) ==
-      -1) {
-    return -1;
+  // The sequence number of an IBlock must match the expected one. Those of
+  // the RBlocks are checked when they are processed.
+  if ((verdict.type == IBlock) && (verdict.seqNumber != SEQ_NUM_SLAVE)) {
+    verdict.error = ResponseSeqNumberError;
+    return verdict;
   }
 
-  // Check if a valid sBlock response has been received after having
-  // transmitted an sBlock request
-  if (T1protocol_checkSBlockResponseConsistency(lastCmdTpduSent,
-                                                lastRespTpduReceived) == -1) {
-    return -1;
+  // After a SBlock request, only the matching SBlock response is expected.
+  const ResponseVerdict* cmd = &pcbTable.classes[lastCmdTpduSent->pcb].verdict;
+  if ((cmd->type == SBlock) && (cmd->sBlockKind != SBlockOther) &&
+      !cmd->isResponse &&
+      (lastRespTpduReceived->pcb != (lastCmdTpduSent->pcb | 0b00100000))) {
+    verdict.error = ResponseUnexpectedSBlock;
   }
 
-  return 0;
+  return verdict;
 }
 
 /*******************************************************************************
@@ -418,28 +509,40 @@ void T1protocol_updateSlaveSequenceNumber() {
 **
 ** Parameters       originalCmdTpdu       - Original Tpdu sent.
 **                  lastRespTpduReceived  - Last response from the slave.
+**                  verdict               - Verdict of its validation.
+**                  event                 - Event for the T=1 engine.
 **
 ** Returns          0 If all went is ok, -1 otherwise.
 **
 *******************************************************************************/
-int T1protocol_processIBlock(Tpdu* originalCmdTpdu,
-                             Tpdu* lastRespTpduReceived) {
+int T1protocol_processIBlock(Tpdu* originalCmdTpdu, Tpdu* lastRespTpduReceived,
+                             ResponseVerdict verdict,
+                             T1TProtocol_Event* event) {
   // The last IBlock received was the good one. Update the sequence
   // numbers needed.
   int rc = 0;
   TpduType type = Tpdu_getType(originalCmdTpdu);
 
   T1protocol_updateSlaveSequenceNumber();
-  rc = DataMgmt_StoreDataInList(lastRespTpduReceived->len,
-                                lastRespTpduReceived->data);
+  if (gSink == NULL) {
+    rc = DataMgmt_StoreDataInList(lastRespTpduReceived->len,
+                                  lastRespTpduReceived->data);
+  } else if (verdict.more) {
+    // Delivered by T1protocol_sendRBlock once the R(ACK) is on the bus
+    gPendingInf = lastRespTpduReceived->data;
+    gPendingInfLen = lastRespTpduReceived->len;
+  } else {
+    gSink(lastRespTpduReceived->data, lastRespTpduReceived->len, true,
+          gSinkContext);
+  }
 
-  if ((lastRespTpduReceived->pcb & IBLOCK_M_BIT_MASK) > 0) {
-    gNextCmd = R_ACK;
+  if (verdict.more) {
+    *event = T1_EVENT_I_BLOCK_CHAINED;
   } else {
     if (type == IBlock) {
       T1protocol_updateMasterSequenceNumber();
     }
-    gNextCmd = Idle;
+    *event = T1_EVENT_I_BLOCK;
   }
   return rc;
 }
@@ -451,36 +554,31 @@ int T1protocol_processIBlock(Tpdu* originalCmdTpdu,
 ** Description      Process the last RBlock received from the slave.
 **
 ** Parameters       originalCmdTpdu      - Original Tpdu sent.
-**                  lastRespTpduReceived - Last response from the slave.
+**                  verdict              - Verdict of the validation of the
+**                                         last response from the slave.
 **
-** Returns          -1 if the retransmission needed fails, 0 if no more
-**                  retransmission were needed and 1 if extra retransmission
-**                  success.
+** Returns          The event for the T=1 engine.
 **
 *******************************************************************************/
-void T1protocol_processRBlock(Tpdu* originalCmdTpdu,
-                              Tpdu* lastRespTpduReceived) {
+T1TProtocol_Event T1protocol_processRBlock(Tpdu* originalCmdTpdu,
+                                           ResponseVerdict verdict) {
   if ((originalCmdTpdu->pcb & IBLOCK_M_BIT_MASK) > 0) {
     // Last IBlock sent was chained. Expected RBlock(NS+1) for error free
     // operation and RBlock(NS) if something well bad.
-    if (T1protocol_isSequenceNumberOk(originalCmdTpdu, lastRespTpduReceived) ==
-        false) {
+    if (verdict.seqNumber != ((SEQ_NUM_MASTER + 1) % 2)) {
       STLOG_HAL_E("Wrong Seq number. Send again ");
-      gNextCmd = I_block;
-    } else {
-      T1protocol_updateMasterSequenceNumber();
-      gNextCmd = Idle;
+      return T1_EVENT_R_BLOCK_RESEND;
     }
+    T1protocol_updateMasterSequenceNumber();
+    return T1_EVENT_R_BLOCK_ACK;
   } else {
     // Last IBlock sent wasn't chained. If we receive an RBlock(NS) means
     // retransmission of the original IBlock, otherwise do resend request.
-    if (T1protocol_isSequenceNumberOk(originalCmdTpdu, lastRespTpduReceived) ==
-        true) {
+    if (verdict.seqNumber == SEQ_NUM_MASTER) {
       STLOG_HAL_D("%s : Need retransmissiom :", __func__);
-      gNextCmd = I_block;
-    } else {
-      gNextCmd = S_Resync_REQ;
+      return T1_EVENT_R_BLOCK_RESEND;
     }
+    return T1_EVENT_R_BLOCK_UNEXPECTED;
   }
 }
 
@@ -494,33 +592,35 @@ void T1protocol_processRBlock(Tpdu* originalCmdTpdu,
 **                  lastRespTpduReceived - Last response from the slave.
 **
 ** Returns          bytesRead if data was read, 0 if timeout expired with
-**                  no response, -1 otherwise
+**                  no response, -2 if the deadline expired, -1 otherwise
 **
 *******************************************************************************/
 int T1protocol_sendRBlock(int rack, Tpdu* lastRespTpduReceived) {
   int result = 0;
-  Tpdu* TempTpdu = (Tpdu*)malloc(sizeof(Tpdu));
-  TempTpdu->data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
+  Tpdu TempTpdu;
 
-  result = Tpdu_formTpdu(
-      NAD_HOST_TO_SLAVE,
+  const Tpdu* rBlock = T1protocolFrames_get(
       T1protocol_getValidPcb(RBlock, rack ? ErrorFree : OtherErrors, 0,
                              SEQ_NUM_SLAVE, 0),
-      0, NULL, TempTpdu);
-  if (result == -1) {
-    free(TempTpdu->data);
-    free(TempTpdu);
+      0, NULL, &TempTpdu);
+  if (rBlock == NULL) {
     return -1;
   }
-  result = SpiLayerInterface_transcieveTpdu(TempTpdu, lastRespTpduReceived,
-                                            DEFAULT_NBWT);
-  if (result < 0) {
-    free(TempTpdu->data);
-    free(TempTpdu);
-    return -1;
+  if (rack && (gPendingInf != NULL)) {
+    // Streaming: hand the INF field received to the sink while the eSE
+    // prepares the next block.
+    if (SpiLayerComm_writeTpdu(rBlock) < 0) {
+      result = -1;
+    } else {
+      gSink(gPendingInf, gPendingInfLen, false, gSinkContext);
+      gPendingInf = NULL;
+      result = SpiLayerInterface_receiveTpdu(lastRespTpduReceived,
+                                             DEFAULT_NBWT, gDeadline);
+    }
+  } else {
+    result = SpiLayerInterface_transcieveTpdu(
+        rBlock, lastRespTpduReceived, DEFAULT_NBWT, gDeadline);
   }
-  free(TempTpdu->data);
-  free(TempTpdu);
   return result;
 }
 /*******************************************************************************
@@ -538,25 +638,10 @@ int T1protocol_sendRBlock(int rack, Tpdu* lastRespTpduReceived) {
 **
 *******************************************************************************/
 int T1protocol_formSblockResponse(Tpdu* responseTpdu, Tpdu* requestTpdu) {
-  uint8_t i;
-
-  responseTpdu->nad = NAD_HOST_TO_SLAVE;
-  responseTpdu->pcb = requestTpdu->pcb | 0b00100000;
-  responseTpdu->len = requestTpdu->len;
-  for (i = 0; i < requestTpdu->len; i++) {
-    responseTpdu->data[i] = requestTpdu->data[i];
-  }
-  responseTpdu->checksum = 0x0000;
-
-  if (ATP.checksumType == CRC) {
-    uint8_t buffer[TPDU_PROLOGUE_LENGTH + responseTpdu->len + TPDU_CRC_LENGTH];
-    Tpdu_toByteArray(responseTpdu, buffer);
-    responseTpdu->checksum =
-        computeCrc(buffer, (TPDU_PROLOGUE_LENGTH + responseTpdu->len));
-  } else if (ATP.checksumType == LRC) {
-    // char buffer[TPDU_PROLOGUE_LENGTH + responseTpdu->len + TPDU_LRC_LENGTH];
-    // TODO
-    STLOG_HAL_E("LRC still not implemented.");
+  // The response echoes the INF field of the request
+  if (Tpdu_formTpdu(NAD_HOST_TO_SLAVE, requestTpdu->pcb | 0b00100000,
+                    requestTpdu->len, requestTpdu->data, responseTpdu) != 0) {
+    STLOG_HAL_E("Error forming the SBlock response.");
     return -1;
   }
 
@@ -565,125 +650,120 @@ int T1protocol_formSblockResponse(Tpdu* responseTpdu, Tpdu* requestTpdu) {
 
 /*******************************************************************************
 **
-** Function         T1protocol_processSBlock
+** Function         T1protocol_applySoftReset
 **
-** Description      Process the last SBlock received from the slave.
+** Description      Takes the new ATP of the S(SWReset response) received,
+**                  and resets the T=1 state accordingly.
 **
-** Parameters       originalCmdTpdu      - Original Tpdu sent.
-**                  lastCmdTpduSent      - Last Tpdu sent.
-**                  lastRespTpduReceived - Last response from the slave.
+** Parameters       swResetTpdu - the S(SWReset response).
 **
 ** Returns          0 If all went is ok, -1 otherwise.
 **
 *******************************************************************************/
-int T1protocol_processSBlock(Tpdu* originalCmdTpdu, Tpdu* lastCmdTpduSent,
-                             Tpdu* lastRespTpduReceived) {
-  int rc;
-  if (lastRespTpduReceived->pcb == (uint8_t)SBLOCK_WTX_REQUEST_MASK) {
-    gNextCmd = S_WTX_RES;
-  } else if (lastRespTpduReceived->pcb == (uint8_t)SBLOCK_IFS_REQUEST_MASK) {
-    gNextCmd = S_IFS_RES;
-  } else if (lastRespTpduReceived->pcb == (uint8_t)SBLOCK_IFS_RESPONSE_MASK) {
-    ATP.ifsc = (uint8_t)lastRespTpduReceived->data[0];
-    return 0;
-  } else if (lastRespTpduReceived->pcb ==
-             (uint8_t)SBLOCK_RESYNCH_REQUEST_MASK) {
-    T1protocol_resetSequenceNumbers();
-    gNextCmd = S_Resync_RES;
-  } else if (lastRespTpduReceived->pcb ==
-             (uint8_t)SBLOCK_RESYNCH_RESPONSE_MASK) {
-    T1protocol_resetSequenceNumbers();
-    // Reset the sequence number of the original Tpdu if needed
-    if ((originalCmdTpdu->pcb & IBLOCK_NS_BIT_MASK) > 0) {
-      originalCmdTpdu->pcb &= ~IBLOCK_NS_BIT_MASK;
-
-      rc = Tpdu_formTpdu(originalCmdTpdu->nad, originalCmdTpdu->pcb,
-                         originalCmdTpdu->len, originalCmdTpdu->data,
-                         originalCmdTpdu);
-      if (rc < 0) {
-        return rc;
-      }
-    }
-
-    Tpdu_copy(lastCmdTpduSent, originalCmdTpdu);
-    gNextCmd = I_block;
-
-  } else if (lastRespTpduReceived->pcb == (uint8_t)SBLOCK_ABORT_REQUEST_MASK) {
-    // TODO
-    STLOG_HAL_E("ABORT request received still not supported.");
-    return -1;
-  } else if (lastRespTpduReceived->pcb ==
-             (uint8_t)SBLOCK_SWRESET_RESPONSE_MASK) {
-    if (Atp_setAtp(lastRespTpduReceived->data) != 0) {
-      STLOG_HAL_E("Error setting ATP");
-      return -1;
-    }
-
-    T1protocol_resetSequenceNumbers();
-    // SW Reset done
+static int T1protocol_applySoftReset(Tpdu* swResetTpdu) {
+  if (Atp_setAtp(swResetTpdu->data) != 0) {
+    STLOG_HAL_E("Error setting ATP");
     return -1;
   }
+
+  T1protocol_resetSequenceNumbers();
+  // The IFSD is back to its default value, negotiate it again before the
+  // next APDU.
+  IFSD = DEFAULT_IFSD;
+  gIfsdNegotiationNeeded = true;
   return 0;
 }
 
 /*******************************************************************************
 **
-** Function         T1protocol_isSequenceNumberOk
+** Function         T1protocol_processSBlock
 **
-** Description      Check if the sequence number of the response TPDU is the
-**                   expected one.
+** Description      Process the last SBlock received from the slave.
 **
-** Parameters       originalTpdu - Original tpdu sent.
-**                  respTpdu     - The last response received from the slave.
+** Parameters       originalCmdTpdu      - Original Tpdu sent.
+**                  lastCmdTpduSent      - Last Tpdu sent.
+**                  lastRespTpduReceived - Last response from the slave.
+**                  verdict              - Verdict of its validation.
+**                  event                - Event for the T=1 engine.
 **
-** Returns          true If sequence number is ok, false otherwise.
+** Returns          0 If all went is ok, -1 otherwise.
 **
 *******************************************************************************/
-bool T1protocol_isSequenceNumberOk(Tpdu* originalTpdu, Tpdu* respTpdu) {
-  int seqNumber;
+int T1protocol_processSBlock(Tpdu* originalCmdTpdu, Tpdu* lastCmdTpduSent,
+                             Tpdu* lastRespTpduReceived,
+                             ResponseVerdict verdict,
+                             T1TProtocol_Event* event) {
+  int rc;
 
-  // Get the type of the TPDU and act consequently
-  TpduType tpduType = Tpdu_getType(respTpdu);
+  *event = T1_EVENT_S_BLOCK_NO_ANSWER;
 
-  switch (tpduType) {
-    case IBlock:
-      seqNumber = (respTpdu->pcb & 0b01000000) >> 6;
-      if (seqNumber == SEQ_NUM_SLAVE) {
-        return true;
-      } else {
-        return false;
+  switch (verdict.sBlockKind) {
+    case SBlockWtx:
+      if (!verdict.isResponse) {
+        *event = T1_EVENT_WTX_REQUEST;
       }
       break;
 
-    case RBlock:
-      // If the original Tpdu sent was chained, the expected sequence number
-      // inside the RBlock i the next master sequence number.
-      // If the original Tpdu sent wans't chained, no RBlock expected. If an
-      // RBlock with sequence number equal to the master sequence number is
-      // received, retransmission is needed, otherwise retransmission request
-      // is needed.
-      // TODO
-      if ((originalTpdu->pcb & IBLOCK_M_BIT_MASK) > 0) {
-        seqNumber = (respTpdu->pcb & 0x10) >> 4;
-        if (seqNumber == ((SEQ_NUM_MASTER + 1) % 2)) {
-          return true;
-        } else {
-          return false;
-        }
-      } else {
-        seqNumber = (respTpdu->pcb & 0x10) >> 4;
-        if (seqNumber == SEQ_NUM_MASTER) {
-          return true;
-        } else {
-          return false;
+    case SBlockIfs:
+      if (verdict.isResponse) {
+        // The eSE accepted the size of the blocks the host can receive (IFSD)
+        IFSD = (uint8_t)lastRespTpduReceived->data[0];
+        STLOG_HAL_D("IFSD = %d, IFSC = %d", IFSD, ATP.ifsc);
+        break;
+      }
+      // The eSE changes the size of the blocks it can receive (IFSC)
+      if ((lastRespTpduReceived->data[0] == 0) ||
+          (lastRespTpduReceived->data[0] > TPDU_MAX_DATA_LENGTH)) {
+        STLOG_HAL_E("Invalid IFSC requested: %d",
+                    lastRespTpduReceived->data[0]);
+        return -1;
+      }
+      ATP.ifsc = (uint8_t)lastRespTpduReceived->data[0];
+      *event = T1_EVENT_IFS_REQUEST;
+      break;
+
+    case SBlockResynch:
+      T1protocol_resetSequenceNumbers();
+      if (!verdict.isResponse) {
+        *event = T1_EVENT_RESYNCH_REQUEST;
+        break;
+      }
+      // Reset the sequence number of the original Tpdu if needed
+      if ((originalCmdTpdu->pcb & IBLOCK_NS_BIT_MASK) > 0) {
+        originalCmdTpdu->pcb &= ~IBLOCK_NS_BIT_MASK;
+
+        rc = Tpdu_formTpdu(originalCmdTpdu->nad, originalCmdTpdu->pcb,
+                           originalCmdTpdu->len, originalCmdTpdu->data,
+                           originalCmdTpdu);
+        if (rc < 0) {
+          return rc;
         }
       }
+
+      Tpdu_copy(lastCmdTpduSent, originalCmdTpdu);
+      *event = T1_EVENT_RESYNCH_RESPONSE;
+      break;
+
+    case SBlockAbort:
+      if (!verdict.isResponse) {
+        // The eSE aborts the chain in progress
+        STLOG_HAL_W("ABORT request received.");
+        *event = T1_EVENT_ABORT_REQUEST;
+      }
+      break;
+
+    case SBlockSwReset:
+      if (verdict.isResponse) {
+        T1protocol_applySoftReset(lastRespTpduReceived);
+        // SW Reset done
+        return -1;
+      }
       break;
 
     default:
       break;
   }
-  return false;
+  return 0;
 }
 
 /*******************************************************************************
@@ -755,71 +835,52 @@ uint8_t T1protocol_setRespApduData(Tpdu* respTpdu, uint8_t** respApduBuffer) {
 ** Parameters       lastRespTpduReceived - Last response received.
 **
 ** Returns          bytesRead if data was read, 0 if timeout expired with
-**                  no response, -1 otherwise
+**                  no response, -2 if the deadline expired, -1 otherwise
 **
 *******************************************************************************/
 int T1protocol_doWTXResponse(Tpdu* lastRespTpduReceived) {
-  Tpdu* TempTpdu = (Tpdu*)malloc(sizeof(Tpdu));
-  TempTpdu->data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
-  // Form a SBlock Resynch request Tpdu to sent.
-  int result = Tpdu_formTpdu(NAD_HOST_TO_SLAVE, SBLOCK_WTX_RESPONSE_MASK, 0,
-                             NULL, TempTpdu);
-  T1protocol_formSblockResponse(TempTpdu, lastRespTpduReceived);
-  if (result == -1) {
-    free(TempTpdu->data);
-    free(TempTpdu);
+  Tpdu TempTpdu;
+  // The SBlock WTX response echoes the multiplier requested.
+  const Tpdu* sBlock = T1protocolFrames_get(
+      SBLOCK_WTX_RESPONSE_MASK, lastRespTpduReceived->len,
+      lastRespTpduReceived->data, &TempTpdu);
+  if (sBlock == NULL) {
     return -1;
   }
 
   // Send the SBlock and read the response from the slave.
-  result = SpiLayerInterface_transcieveTpdu(TempTpdu, lastRespTpduReceived,
-                                            DEFAULT_NBWT);
-  if (result < 0) {
-    free(TempTpdu->data);
-    free(TempTpdu);
-    return -1;
-  }
-  free(TempTpdu->data);
-  free(TempTpdu);
+  int result = SpiLayerInterface_transcieveTpdu(
+      sBlock, lastRespTpduReceived, DEFAULT_NBWT, gDeadline);
   return result;
 }
 
 /*******************************************************************************
 **
-** Function         T1protocol_doResendRequest
+** Function         T1protocol_doIFSResponse
 **
-** Description      First thing to do in the recovery mechanism is to ask
-**                  for a retransmission.
+** Description      If the eSE send a S(IFS request), acknowledge it by sending
+**                  a S(IFS response)
 **
-** Parameters       lastCmdTpduSent      - Last Tpdu sent
-**                  lastRespTpduReceived - Last response received.
-**                  bytesRead            - If a retransmission occurs, this
-**                  field contains the amount of bytes read from the slave
-**                  in the new transaction.
+** Parameters       lastRespTpduReceived - Last response received.
 **
-** Returns          0 if everything went fine, -1 if something failed.
+** Returns          bytesRead if data was read, 0 if timeout expired with
+**                  no response, -2 if the deadline expired, -1 otherwise
 **
 *******************************************************************************/
-int T1protocol_doResendRequest(Tpdu* lastCmdTpduSent,
-                               Tpdu* lastRespTpduReceived, int* bytesRead) {
-  // Form a RBlock - other errors tpdu with the expected sequence number to
-  // receive.
-  int result = Tpdu_formTpdu(
-      NAD_HOST_TO_SLAVE,
-      T1protocol_getValidPcb(RBlock, OtherErrors, 0, SEQ_NUM_SLAVE, 0), 0, NULL,
-      lastCmdTpduSent);
-  if (result == -1) {
+int T1protocol_doIFSResponse(Tpdu* lastRespTpduReceived) {
+  Tpdu TempTpdu;
+  // The SBlock IFS response echoes the IFSC requested.
+  const Tpdu* sBlock = T1protocolFrames_get(
+      SBLOCK_IFS_RESPONSE_MASK, lastRespTpduReceived->len,
+      lastRespTpduReceived->data, &TempTpdu);
+  if (sBlock == NULL) {
     return -1;
   }
 
-  // Send the RBlock an read the response
-  result = SpiLayerInterface_transcieveTpdu(lastCmdTpduSent,
-                                            lastRespTpduReceived, DEFAULT_NBWT);
-  if (result < 0) {
-    return -1;
-  }
-  *bytesRead = result;
-  return 1;
+  // Send the SBlock and read the response from the slave.
+  int result = SpiLayerInterface_transcieveTpdu(
+      sBlock, lastRespTpduReceived, DEFAULT_NBWT, gDeadline);
+  return result;
 }
 
 /*******************************************************************************
@@ -839,27 +900,16 @@ int T1protocol_doResendRequest(Tpdu* lastCmdTpduSent,
 **
 *******************************************************************************/
 int T1protocol_doResyncRequest(Tpdu* lastRespTpduReceived) {
-  Tpdu* TempTpdu = (Tpdu*)malloc(sizeof(Tpdu));
-  TempTpdu->data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
-  // Form a SBlock Resynch request Tpdu to sent.
-  int result = Tpdu_formTpdu(NAD_HOST_TO_SLAVE, SBLOCK_RESYNCH_REQUEST_MASK, 0,
-                             NULL, TempTpdu);
-  if (result == -1) {
-    free(TempTpdu->data);
-    free(TempTpdu);
+  Tpdu TempTpdu;
+  const Tpdu* sBlock =
+      T1protocolFrames_get(SBLOCK_RESYNCH_REQUEST_MASK, 0, NULL, &TempTpdu);
+  if (sBlock == NULL) {
     return -1;
   }
 
   // Send the SBlock and read the response from the slave.
-  result = SpiLayerInterface_transcieveTpdu(TempTpdu, lastRespTpduReceived,
-                                            DEFAULT_NBWT);
-  if (result < 0) {
-    free(TempTpdu->data);
-    free(TempTpdu);
-    return -1;
-  }
-  free(TempTpdu->data);
-  free(TempTpdu);
+  int result = SpiLayerInterface_transcieveTpdu(
+      sBlock, lastRespTpduReceived, DEFAULT_NBWT, gDeadline);
   return result;
 }
 
@@ -877,27 +927,101 @@ int T1protocol_doResyncRequest(Tpdu* lastRespTpduReceived) {
 **
 *******************************************************************************/
 int T1protocol_doSoftReset(Tpdu* lastRespTpduReceived) {
-  Tpdu* TempTpdu = (Tpdu*)malloc(sizeof(Tpdu));
-  TempTpdu->data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
-  // Form a SBlock Resynch request Tpdu to sent.
-  int result = Tpdu_formTpdu(NAD_HOST_TO_SLAVE, SBLOCK_SWRESET_REQUEST_MASK, 0,
-                             NULL, TempTpdu);
-  if (result == -1) {
-    free(TempTpdu->data);
-    free(TempTpdu);
+  Tpdu TempTpdu;
+  const Tpdu* sBlock =
+      T1protocolFrames_get(SBLOCK_SWRESET_REQUEST_MASK, 0, NULL, &TempTpdu);
+  if (sBlock == NULL) {
     return -1;
   }
 
   // Send the SBlock and read the response from the slave.
-  result = SpiLayerInterface_transcieveTpdu(TempTpdu, lastRespTpduReceived,
-                                            DEFAULT_NBWT);
-  if (result < 0) {
-    free(TempTpdu->data);
-    free(TempTpdu);
+  int result = SpiLayerInterface_transcieveTpdu(
+      sBlock, lastRespTpduReceived, DEFAULT_NBWT, gDeadline);
+  return result;
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_doAbort
+**
+** Description      Ends the exchange in progress once its deadline expired or
+**                  it was cancelled. A chain in progress is aborted with a
+**                  S(ABORT request), then a resync is done to bring the
+**                  sequence numbers back in line whatever the eSE received.
+**
+** Parameters       originalCmdTpdu      - Original Tpdu sent.
+**                  lastRespTpduReceived - memory position whre to store the
+**                  response.
+**
+** Returns          0 if the eSE is in a known state again, -1 otherwise.
+**
+*******************************************************************************/
+int T1protocol_doAbort(Tpdu* originalCmdTpdu, Tpdu* lastRespTpduReceived) {
+  struct timeval guardTime;
+  int result;
+
+  STLOG_HAL_W("%s : deadline expired or exchange cancelled", __func__);
+
+  // Drop the response parts already received, and make sure the abort
+  // sequence itself is not cancelled. It has its own short deadline.
+  DataMgmt_Flush();
+  gPendingInf = NULL;
+  SpiLayerComm_setCancelFlag(NULL);
+  gDeadline = &guardTime;
+
+  if (((originalCmdTpdu->pcb & IBLOCK_M_BIT_MASK) > 0) ||
+      (gNextCmd == R_ACK)) {
+    Tpdu TempTpdu;
+    const Tpdu* sBlock = T1protocolFrames_get(SBLOCK_ABORT_REQUEST_MASK, 0,
+                                              NULL, &TempTpdu);
+    if (sBlock != NULL) {
+      Utils_setDeadline(&guardTime, ABORT_TIMEOUT_MS);
+      result = SpiLayerInterface_transcieveTpdu(
+          sBlock, lastRespTpduReceived, DEFAULT_NBWT, gDeadline);
+      if ((result > 0) && (lastRespTpduReceived->pcb ==
+                           (uint8_t)SBLOCK_ABORT_RESPONSE_MASK)) {
+        STLOG_HAL_D("%s : chain aborted", __func__);
+      }
+    }
+  }
+
+  Utils_setDeadline(&guardTime, ABORT_TIMEOUT_MS);
+  result = T1protocol_doResyncRequest(lastRespTpduReceived);
+  gDeadline = NULL;
+  if ((result <= 0) || (lastRespTpduReceived->pcb !=
+                        (uint8_t)SBLOCK_RESYNCH_RESPONSE_MASK)) {
+    STLOG_HAL_E("%s : no resync response, eSE state unknown", __func__);
     return -1;
   }
-  free(TempTpdu->data);
-  free(TempTpdu);
+  T1protocol_resetSequenceNumbers();
+  T1protocol_transition(T1_EVENT_ABORTED);
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_doAbortResponse
+**
+** Description      Acknowledge a S(ABORT request) received from the eSE by
+**                  sending a S(ABORT response). The chain in progress is
+**                  terminated.
+**
+** Parameters       none
+**
+** Returns          0 if everything went fine, -1 if something failed.
+**
+*******************************************************************************/
+int T1protocol_doAbortResponse() {
+  Tpdu TempTpdu;
+  int result = -1;
+  const Tpdu* sBlock = T1protocolFrames_get(SBLOCK_ABORT_RESPONSE_MASK, 0,
+                                            NULL, &TempTpdu);
+  if (sBlock != NULL) {
+    result = SpiLayerComm_writeTpdu(sBlock) < 0 ? -1 : 0;
+  }
+  DataMgmt_Flush();
+  gPendingInf = NULL;
+  T1protocol_transition(T1_EVENT_ABORTED);
   return result;
 }
 
@@ -909,17 +1033,17 @@ int T1protocol_doSoftReset(Tpdu* lastRespTpduReceived) {
 **                  TPDU has been received or no response has been received
 **                  before the timeout.
 **
-** Parameters       lastCmdTpduSent      - Last Tpdu sent
-**                  lastRespTpduReceived - Last response received.
-**                  bytesRead            - If a retransmission occurs, this
-**                  field contains the amount of bytes read from the slave
-**                  in the new transaction.
+** Parameters       event - Event for the T=1 engine, the recovery step to take.
 **
 ** Returns          0 if everything went fine, -1 if something failed.
 **
 *******************************************************************************/
-int T1protocol_doRecovery() {
+int T1protocol_doRecovery(T1TProtocol_Event* event) {
   STLOG_HAL_W("Entering recovery");
+  if (recoveryStatus == RECOVERY_STATUS_OK) {
+    gRecoveryStartNs = StEseLatency_now();
+    BusCounters_add(BUS_COUNTER_RECOVERIES, 1);
+  }
 
   // Update the recovery status
   T1protocol_updateRecoveryStatus();
@@ -929,20 +1053,26 @@ int T1protocol_doRecovery() {
   switch (recoveryStatus) {
     case RECOVERY_STATUS_RESEND_1:
     case RECOVERY_STATUS_RESEND_2:
-      gNextCmd = R_Other_Error;
+      *event = T1_EVENT_RECOVERY_RESEND;
+      BusCounters_add(BUS_COUNTER_RECOVERY_RESENDS, 1);
       break;
     case RECOVERY_STATUS_RESYNC_1:
     case RECOVERY_STATUS_RESYNC_2:
     case RECOVERY_STATUS_RESYNC_3:
-      gNextCmd = S_Resync_REQ;
+      *event = T1_EVENT_RECOVERY_RESYNCH;
+      BusCounters_add(BUS_COUNTER_RECOVERY_RESYNCS, 1);
       break;
     case RECOVERY_STATUS_WARM_RESET:
 
       // At this point, we consider that SE is dead and a reboot is requried
-      gNextCmd = S_SWReset_REQ;
+      *event = T1_EVENT_RECOVERY_SWRESET;
+      BusCounters_add(BUS_COUNTER_RECOVERY_SWRESETS, 1);
       break;
     case RECOVERY_STATUS_KO:
     default:
+      // Failed recoveries are accounted too, they are the worst cases.
+      StEseLatency_record(ESE_LATENCY_RECOVERY, gRecoveryStartNs);
+      BusCounters_add(BUS_COUNTER_RECOVERIES_FAILED, 1);
       return -1;
       break;
   }
@@ -969,47 +1099,54 @@ int T1protocol_doRecovery() {
 int T1protocol_handleTpduResponse(Tpdu* originalCmdTpdu, Tpdu* lastCmdTpduSent,
                                   Tpdu* lastRespTpduReceived, int* bytesRead) {
   int rc = 0;
+  T1TProtocol_Event event = T1_EVENT_NONE;
   STLOG_HAL_D("%s : Enter :", __func__);
 
   // If the last transmission ends without response from the slave, do
   // recovery mechanism.
   if (*bytesRead == 0) {
     STLOG_HAL_D("bytesRead = 0 -> Going into recovery.");
-    rc = T1protocol_doRecovery();
+    rc = T1protocol_doRecovery(&event);
+    T1protocol_transition(event);
     return rc;
   }
 
   // Check the consistency of the last received tpdu
-  rc = T1protocol_checkTpduConsistency(lastCmdTpduSent, lastRespTpduReceived);
-  if (rc < 0) {
-    STLOG_HAL_D("%s : TPDU consistency check failed -> Going into recovery.",
-                __func__);
-    rc = T1protocol_doRecovery();
+  ResponseVerdict verdict =
+      T1protocol_validateResponse(lastCmdTpduSent, lastRespTpduReceived);
+  if (verdict.error != ResponseOk) {
+    STLOG_HAL_D("%s : TPDU consistency check failed (%d) -> Going into "
+                "recovery.",
+                __func__, verdict.error);
+    rc = T1protocol_doRecovery(&event);
+    T1protocol_transition(event);
     return rc;
   }
 
   // Reset the recovery if a valid Tpdu has been received from the slave
   if (recoveryStatus != RECOVERY_STATUS_OK) {
     recoveryStatus = RECOVERY_STATUS_OK;
+    StEseLatency_record(ESE_LATENCY_RECOVERY, gRecoveryStartNs);
   }
 
   // If all went OK, process the last tpdu received
-  TpduType type = Tpdu_getType(lastRespTpduReceived);
-  switch (type) {
+  switch (verdict.type) {
     case IBlock:
-      rc = T1protocol_processIBlock(originalCmdTpdu, lastRespTpduReceived);
+      rc = T1protocol_processIBlock(originalCmdTpdu, lastRespTpduReceived,
+                                    verdict, &event);
       break;
 
     case RBlock:
-      T1protocol_processRBlock(originalCmdTpdu, lastRespTpduReceived);
+      event = T1protocol_processRBlock(originalCmdTpdu, verdict);
       break;
 
     case SBlock:
       rc = T1protocol_processSBlock(originalCmdTpdu, lastCmdTpduSent,
-                                    lastRespTpduReceived);
+                                    lastRespTpduReceived, verdict, &event);
       break;
   }
 
+  T1protocol_transition(event);
   return rc;
 }
 
@@ -1058,8 +1195,9 @@ int T1protocol_formCommandTpduToSend(uint8_t* cmdApduPart, uint8_t cmdLength,
 **
 ** Function         T1protocol_doRequestIFS
 **
-** Description      Send a IFS request to negotiate the IFSD value. Use the same
-**                  value for IFSD than the IFSC received in the ATP.
+** Description      Send a IFS request to negotiate the IFSD value. The value
+**                  requested is the configured one (up to 254), independently
+**                  of the IFSC received in the ATP.
 **
 ** Parameters      None
 **
@@ -1068,14 +1206,12 @@ int T1protocol_formCommandTpduToSend(uint8_t* cmdApduPart, uint8_t cmdLength,
 *******************************************************************************/
 int T1protocol_doRequestIFS() {
   Tpdu originalCmdTpdu, lastCmdTpduSent, lastRespTpduReceived;
-  originalCmdTpdu.data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
-  lastCmdTpduSent.data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
-  lastRespTpduReceived.data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
 
-  STLOG_HAL_D("%s : Enter ", __func__);
-  // Form a SBlock Resynch request Tpdu to sent.
+  STLOG_HAL_D("%s : Enter, IFSD requested = %d", __func__, gIfsdTarget);
+  gIfsdNegotiationNeeded = false;
+  // Form a SBlock IFS request Tpdu to sent.
   int result = Tpdu_formTpdu(NAD_HOST_TO_SLAVE, SBLOCK_IFS_REQUEST_MASK, 1,
-                             &ATP.ifsc, &originalCmdTpdu);
+                             &gIfsdTarget, &originalCmdTpdu);
   if (result) {
     return result;
   }
@@ -1084,7 +1220,7 @@ int T1protocol_doRequestIFS() {
 
   // Send the SBlock and read the response from the slave.
   result = SpiLayerInterface_transcieveTpdu(
-      &lastCmdTpduSent, &lastRespTpduReceived, DEFAULT_NBWT);
+      &lastCmdTpduSent, &lastRespTpduReceived, DEFAULT_NBWT, NULL);
   if (result <= 0) {
     return -1;
   }
@@ -1092,15 +1228,126 @@ int T1protocol_doRequestIFS() {
   result = T1protocol_handleTpduResponse(&originalCmdTpdu, &lastCmdTpduSent,
                                          &lastRespTpduReceived, &result);
 
-  free(originalCmdTpdu.data);
-  originalCmdTpdu.data = NULL;
-  free(lastCmdTpduSent.data);
-  lastCmdTpduSent.data = NULL;
-  free(lastRespTpduReceived.data);
-  lastRespTpduReceived.data = NULL;
   return result;
 }
 
+/*******************************************************************************
+**
+** Function         T1protocol_isSBlockResponseOk
+**
+** Description      Checks the answer to a S-block request sent outside of an
+**                  APDU exchange.
+**
+** Parameters       respTpdu    - the answer received.
+**                  responsePcb - PCB of the expected S-block response.
+**                  bytesRead   - result of the exchange.
+**
+** Returns          true if the expected response was received intact.
+**
+*******************************************************************************/
+static bool T1protocol_isSBlockResponseOk(Tpdu* respTpdu, uint8_t responsePcb,
+                                          int bytesRead) {
+  if (bytesRead <= 0) {
+    STLOG_HAL_E("No response to the S-block request");
+    return false;
+  }
+  if ((respTpdu->pcb != responsePcb) ||
+      (T1protocol_checkResponseTpduChecksum(respTpdu) != 0)) {
+    STLOG_HAL_E("Invalid response to the S-block request: pcb 0x%02X",
+                respTpdu->pcb);
+    return false;
+  }
+  return true;
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_resync
+**
+** Description      Resynchronizes the link outside of an APDU exchange: the
+**                  sequence numbers of both sides are reset, the eSE state
+**                  (and its logical channels) are kept.
+**
+** Parameters       none
+**
+** Returns          0 if the eSE acknowledged it, -1 otherwise.
+**
+*******************************************************************************/
+int T1protocol_resync() {
+  Tpdu lastRespTpduReceived;
+
+  STLOG_HAL_D("%s : Enter", __func__);
+  int result = T1protocol_doResyncRequest(&lastRespTpduReceived);
+  if (!T1protocol_isSBlockResponseOk(&lastRespTpduReceived,
+                                     SBLOCK_RESYNCH_RESPONSE_MASK, result)) {
+    return -1;
+  }
+
+  T1protocol_resetSequenceNumbers();
+  recoveryStatus = RECOVERY_STATUS_OK;
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_softReset
+**
+** Description      Resets the eSE with a S(SWReset request) outside of an
+**                  APDU exchange, and takes the ATP it answers with. The
+**                  logical channels of the eSE are closed.
+**
+** Parameters       none
+**
+** Returns          0 if the eSE was reset, -1 otherwise.
+**
+*******************************************************************************/
+int T1protocol_softReset() {
+  Tpdu lastRespTpduReceived;
+
+  STLOG_HAL_D("%s : Enter", __func__);
+  int result = T1protocol_doSoftReset(&lastRespTpduReceived);
+  if (!T1protocol_isSBlockResponseOk(&lastRespTpduReceived,
+                                     SBLOCK_SWRESET_RESPONSE_MASK, result) ||
+      (T1protocol_applySoftReset(&lastRespTpduReceived) != 0)) {
+    return -1;
+  }
+
+  recoveryStatus = RECOVERY_STATUS_OK;
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_checkAlive
+**
+** Description      Checks that the eSE answers a S(IFS request) for the IFSD
+**                  in use, outside of an APDU exchange. Neither the IFSD nor
+**                  the sequence numbers change, and nothing is retried.
+**
+** Parameters       none
+**
+** Returns          0 if the eSE answered, -1 otherwise.
+**
+*******************************************************************************/
+int T1protocol_checkAlive() {
+  Tpdu TempTpdu, respTpdu;
+  uint8_t ifsd = IFSD;
+
+  const Tpdu* sBlock =
+      T1protocolFrames_get(SBLOCK_IFS_REQUEST_MASK, 1, &ifsd, &TempTpdu);
+  if (sBlock == NULL) {
+    return -1;
+  }
+  int result = SpiLayerInterface_transcieveTpdu(sBlock, &respTpdu,
+                                                DEFAULT_NBWT, NULL);
+  if (!T1protocol_isSBlockResponseOk(&respTpdu, SBLOCK_IFS_RESPONSE_MASK,
+                                     result) ||
+      (respTpdu.len != 1) || (respTpdu.data[0] != ifsd)) {
+    return -1;
+  }
+  return 0;
+}
+
 /*******************************************************************************
 **
 ** Function         T1protocol_init
@@ -1114,6 +1361,9 @@ int T1protocol_doRequestIFS() {
 *******************************************************************************/
 int T1protocol_init(SpiDriver_config_t* tSpiDriver) {
   STLOG_HAL_D("%s : Enter ", __func__);
+  if ((tSpiDriver->ifsd > 0) && (tSpiDriver->ifsd <= MAX_IFSD)) {
+    gIfsdTarget = tSpiDriver->ifsd;
+  }
   if (SpiLayerInterface_init(tSpiDriver) != 0) {
     return -1;
   }
@@ -1121,6 +1371,249 @@ int T1protocol_init(SpiDriver_config_t* tSpiDriver) {
   return 0;
 }
 
+/*******************************************************************************
+**
+** Function         T1protocol_setIfsd
+**
+** Description      Renegotiates the IFSD with the eSE, e.g. before large
+**                  responses are expected.
+**
+** Parameters       ifsd - IFSD to request, 1 to MAX_IFSD.
+**
+** Returns          0 if everything went fine, -1 if something failed.
+**
+*******************************************************************************/
+int T1protocol_setIfsd(uint8_t ifsd) {
+  if ((ifsd == 0) || (ifsd > MAX_IFSD)) {
+    return -1;
+  }
+  gIfsdTarget = ifsd;
+  if (IFSD == gIfsdTarget) {
+    return 0;
+  }
+  return T1protocol_doRequestIFS();
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_getIfsd
+**
+** Description      Gets the IFSD currently in use.
+**
+** Returns          The IFSD.
+**
+*******************************************************************************/
+uint8_t T1protocol_getIfsd() { return IFSD; }
+
+/*******************************************************************************
+**
+** Function         T1protocol_getState
+**
+** Description      Gets the next action of the T=1 engine, for the traces.
+**
+** Returns          The state of the T=1 engine.
+**
+*******************************************************************************/
+uint8_t T1protocol_getState() { return (uint8_t)gNextCmd; }
+
+/*******************************************************************************
+**
+** Function         T1protocol_getNextState
+**
+** Description      Gets the state the T=1 engine goes to on an event.
+**
+** Parameters       state - a state.
+**                  event - an event.
+**
+** Returns          The next state.
+**
+*******************************************************************************/
+uint8_t T1protocol_getNextState(uint8_t state, uint8_t event) {
+  if ((state >= T1_STATE_COUNT) || (event >= T1_EVENT_COUNT)) {
+    return state;
+  }
+  return transitionTable.next[state][event];
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_getStateStats
+**
+** Description      Gets the time spent in the states and the transition
+**                  counters.
+**
+** Parameters       timeNs      - array of T1_STATE_COUNT elements.
+**                  transitions - array of T1_STATE_COUNT * T1_EVENT_COUNT
+**                                elements.
+**
+** Returns          void
+**
+*******************************************************************************/
+void T1protocol_getStateStats(uint64_t* timeNs, uint64_t* transitions) {
+  for (int state = 0; state < T1_STATE_COUNT; state++) {
+    timeNs[state] = stateTimeNs[state].load(std::memory_order_relaxed);
+    for (int event = 0; event < T1_EVENT_COUNT; event++) {
+      transitions[state * T1_EVENT_COUNT + event] =
+          transitionCounts[state][event].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_resetStateStats
+**
+** Description      Clears the time spent in the states and the transition
+**                  counters.
+**
+** Returns          void
+**
+*******************************************************************************/
+void T1protocol_resetStateStats() {
+  for (int state = 0; state < T1_STATE_COUNT; state++) {
+    stateTimeNs[state].store(0, std::memory_order_relaxed);
+    for (int event = 0; event < T1_EVENT_COUNT; event++) {
+      transitionCounts[state][event].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_getStateName
+**
+** Description      Gets the name of a state.
+**
+** Parameters       state - the state.
+**
+** Returns          Its name.
+**
+*******************************************************************************/
+const char* T1protocol_getStateName(unsigned int state) {
+  return (state < T1_STATE_COUNT) ? stateNames[state] : "unknown";
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_getEventName
+**
+** Description      Gets the name of an event.
+**
+** Parameters       event - the event.
+**
+** Returns          Its name.
+**
+*******************************************************************************/
+const char* T1protocol_getEventName(unsigned int event) {
+  return (event < T1_EVENT_COUNT) ? eventNames[event] : "unknown";
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_resumeLink
+**
+** Description      Resumes a link left by a previous service, without
+**                  resetting the eSE. The previous service may have stopped
+**                  at any point of an exchange: a S(RESYNCH request) restarts
+**                  the sequence numbers of both sides, and checks that the
+**                  eSE still answers. The IFSD is then negotiated again, as
+**                  the resync may have restored the default one.
+**
+** Parameters       ifsd - IFSD in use on the link.
+**
+** Returns          0 if the eSE answered, -1 otherwise.
+**
+*******************************************************************************/
+int T1protocol_resumeLink(uint8_t ifsd) {
+  STLOG_HAL_D("%s : IFSD %d", __func__, ifsd);
+  IFSD = ifsd;
+  if (T1protocol_resync() != 0) {
+    return -1;
+  }
+  return T1protocol_doRequestIFS();
+}
+
+/*******************************************************************************
+**
+** Function         T1protocol_setResponseSink
+**
+** Description      Sets the sink the response of the next APDU parts is
+**                  streamed to, block after block.
+**
+** Parameters       sink    - function called with each INF field received,
+**                            NULL to collect the whole response instead.
+**                  context - opaque pointer given back to the sink.
+**
+** Returns          void
+**
+*******************************************************************************/
+void T1protocol_setResponseSink(StEse_responseSink sink, void* context) {
+  gSink = sink;
+  gSinkContext = context;
+  gPendingInf = NULL;
+}
+
+// Tpdus of the APDU part being exchanged, for the actions of the states.
+typedef struct {
+  Tpdu* originalCmdTpdu;
+  Tpdu* lastRespTpduReceived;
+} T1Exchange;
+
+// Sends the block of a state and reads the response. Returns what
+// SpiLayerInterface_transcieveTpdu() does.
+typedef int (*T1Action)(T1Exchange* exchange);
+
+static int T1protocol_sendIBlock(T1Exchange* exchange) {
+  return SpiLayerInterface_transcieveTpdu(exchange->originalCmdTpdu,
+                                          exchange->lastRespTpduReceived,
+                                          DEFAULT_NBWT, gDeadline);
+}
+
+static int T1protocol_sendRAck(T1Exchange* exchange) {
+  return T1protocol_sendRBlock(true, exchange->lastRespTpduReceived);
+}
+
+static int T1protocol_sendRNak(T1Exchange* exchange) {
+  return T1protocol_sendRBlock(false, exchange->lastRespTpduReceived);
+}
+
+static int T1protocol_sendResync(T1Exchange* exchange) {
+  return T1protocol_doResyncRequest(exchange->lastRespTpduReceived);
+}
+
+static int T1protocol_sendIfsResponse(T1Exchange* exchange) {
+  return T1protocol_doIFSResponse(exchange->lastRespTpduReceived);
+}
+
+static int T1protocol_sendWtxResponse(T1Exchange* exchange) {
+  return T1protocol_doWTXResponse(exchange->lastRespTpduReceived);
+}
+
+static int T1protocol_sendSoftReset(T1Exchange* exchange) {
+  return T1protocol_doSoftReset(exchange->lastRespTpduReceived);
+}
+
+static int T1protocol_sendAbortResponse(T1Exchange*) {
+  // The chain is terminated, and the APDU part with it.
+  T1protocol_doAbortResponse();
+  return -1;
+}
+
+// Action of each state, NULL for the states the exchange cannot go on from.
+static const T1Action stateActions[T1_STATE_COUNT] = {
+    NULL,                          /* Idle */
+    T1protocol_sendIBlock,         /* I_block */
+    T1protocol_sendRAck,           /* R_ACK */
+    NULL,                          /* R_CRC_Error */
+    T1protocol_sendRNak,           /* R_Other_Error */
+    T1protocol_sendResync,         /* S_Resync_REQ */
+    NULL,                          /* S_Resync_RES */
+    NULL,                          /* S_IFS_REQ */
+    T1protocol_sendIfsResponse,    /* S_IFS_RES */
+    T1protocol_sendWtxResponse,    /* S_WTX_RES */
+    T1protocol_sendSoftReset,      /* S_SWReset_REQ */
+    T1protocol_sendAbortResponse}; /* S_Abort_RES */
+
 /*******************************************************************************
 **
 ** Function         T1protocol_transcieveApduPart
@@ -1131,21 +1624,27 @@ int T1protocol_init(SpiDriver_config_t* tSpiDriver) {
 **                  cmdLength    - Length of the cmdApduPart to be sent.
 **                  isLast       - APDU_PART_IS_NOT_LAST/APDU_PART_IS_LAST
 **                  pRsp         - Structure to the response buffer and length.
+**                  deadline     - Absolute time after which the exchange is
+**                                 aborted, NULL if there is none.
 **
-** Returns          0 if everything went fine, -1 if something failed.
+** Returns          0 if everything went fine, -1 if something failed, -2 if
+**                  the deadline expired or the exchange was cancelled.
 **
 *******************************************************************************/
 int T1protocol_transcieveApduPart(uint8_t* cmdApduPart, uint8_t cmdLength,
-                                  bool isLast, StEse_data* pRsp) {
+                                  bool isLast, StEse_data* pRsp,
+                                  const struct timeval* deadline) {
   Tpdu originalCmdTpdu, lastCmdTpduSent, lastRespTpduReceived;
-  originalCmdTpdu.data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
-  lastCmdTpduSent.data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
-  lastRespTpduReceived.data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
   StEse_data pRes;
 
   memset(&pRes, 0x00, sizeof(StEse_data));
   STLOG_HAL_D("%s : Enter", __func__);
 
+  // After a soft reset, get back the configured IFSD first.
+  if (gIfsdNegotiationNeeded && (T1protocol_doRequestIFS() != 0)) {
+    STLOG_HAL_W("%s : IFSD renegotiation failed, IFSD = %d", __func__, IFSD);
+  }
+
   // Form the cmdTpdu according to the cmdApduPart, cmdLength and isLast
   // fields.
   if (T1protocol_formCommandTpduToSend(cmdApduPart, cmdLength, isLast,
@@ -1155,81 +1654,55 @@ int T1protocol_transcieveApduPart(uint8_t* cmdApduPart, uint8_t cmdLength,
 
   // Send the command Tpdu and receive the response.
   int rc;
+  T1Exchange exchange = {&originalCmdTpdu, &lastRespTpduReceived};
   recoveryStatus = RECOVERY_STATUS_OK;
   Tpdu_copy(&lastCmdTpduSent, &originalCmdTpdu);
 
-  gNextCmd = I_block;
-  while (gNextCmd != 0) {
-    switch (gNextCmd) {
-      case I_block:
-        rc = SpiLayerInterface_transcieveTpdu(
-            &originalCmdTpdu, &lastRespTpduReceived, DEFAULT_NBWT);
-        if (rc < 0) {
-          return rc;
-        }
-        break;
+  T1protocol_transition(T1_EVENT_SEND);
+  gDeadline = deadline;
+  gPendingInf = NULL;
+  while (gNextCmd != Idle) {
+    T1TProtocol_TransceiveState state = gNextCmd;
+    T1Action action = stateActions[state];
+    uint64_t startNs = StEseLatency_now();
 
-      case R_ACK:
-        rc = T1protocol_sendRBlock(true, &lastRespTpduReceived);
-        if (rc < 0) {
-          return rc;
-        }
-        break;
-      case R_Other_Error:
-        rc = T1protocol_sendRBlock(false, &lastRespTpduReceived);
-        if (rc < 0) {
-          return rc;
-        }
-        break;
-
-      case S_Resync_REQ:
-        rc = T1protocol_doResyncRequest(&lastRespTpduReceived);
-        if (rc < 0) {
-          return rc;
-        }
-        break;
-
-      case S_SWReset_REQ:
-        rc = T1protocol_doSoftReset(&lastRespTpduReceived);
-        if (rc < 0) {
-          return rc;
-        }
-        break;
-
-      case S_WTX_RES:
-        rc = T1protocol_doWTXResponse(&lastRespTpduReceived);
-        if (rc < 0) {
-          return rc;
-        }
-        break;
+    if (action == NULL) {
+      gDeadline = NULL;
+      return -1;
+    }
+    rc = action(&exchange);
 
-      default:
-        return -1;
-        break;
+    if ((state != I_block) && (rc >= 0)) {
+      StEseLatency_record(ESE_LATENCY_RS_ROUND_TRIP, startNs);
     }
 
-    rc = T1protocol_handleTpduResponse(&originalCmdTpdu, &lastCmdTpduSent,
-                                       &lastRespTpduReceived, &rc);
+    if (rc >= 0) {
+      rc = T1protocol_handleTpduResponse(&originalCmdTpdu, &lastCmdTpduSent,
+                                         &lastRespTpduReceived, &rc);
+    } else if (rc == -2) {
+      // Deadline expired or cancelled: release the eSE in a known state.
+      T1protocol_doAbort(&originalCmdTpdu, &lastRespTpduReceived);
+    }
+    stateTimeNs[state].fetch_add(StEseLatency_now() - startNs,
+                                 std::memory_order_relaxed);
 
     if (rc < 0) {
+      gDeadline = NULL;
       return rc;
     }
   }
+  gDeadline = NULL;
   TpduType type = Tpdu_getType(&lastRespTpduReceived);
 
-  if ((type == IBlock) && (DataMgmt_GetData(&pRes.len, &pRes.p_data) != 0)) {
+  // When streaming, the whole response already went to the sink.
+  if ((type == IBlock) && (gSink == NULL) &&
+      (DataMgmt_GetData(&pRes.len, &pRes.p_data) != 0)) {
     return -1;
   }
 
   pRsp->len = pRes.len;
   pRsp->p_data = pRes.p_data;
 
-  free(originalCmdTpdu.data);
-  originalCmdTpdu.data = NULL;
-  free(lastCmdTpduSent.data);
-  lastCmdTpduSent.data = NULL;
-  free(lastRespTpduReceived.data);
-  lastRespTpduReceived.data = NULL;
 
   if ((lastRespTpduReceived.pcb & IBLOCK_M_BIT_MASK) > 0) {
     return 1;
@@ -58,13 +58,20 @@
 
 #define DEFAULT_NBWT 1
 
+// Time given to the eSE to answer the S(ABORT) or S(RESYNCH) sent when the
+// deadline of an exchange expired.
+#define ABORT_TIMEOUT_MS 200
+
+// IFSD of the host until it is negotiated (ISO 7816-3), and maximum one.
+#define DEFAULT_IFSD 32
+#define MAX_IFSD TPDU_MAX_DATA_LENGTH
+
 // Global variables
 // uint8_t SEQ_NUM_MASTER;
 // uint8_t SEQ_NUM_SLAVE;
 // bool firstTransmission;
 // uint8_t recoveryStatus;
 // bool aborted;
-// uint8_t IFSD;
 
 typedef enum {
   Idle = 0,
@@ -77,8 +84,66 @@ typedef enum {
   S_IFS_REQ,
   S_IFS_RES,
   S_WTX_RES,
-  S_SWReset_REQ
+  S_SWReset_REQ,
+  S_Abort_RES
 } T1TProtocol_TransceiveState;
+
+#define T1_STATE_COUNT (S_Abort_RES + 1)
+
+// What moves the T=1 engine from a state to the next one: a response
+// received, a recovery step, or the start and end of an exchange. The next
+// state is looked up in a table indexed by state and event.
+typedef enum {
+  T1_EVENT_NONE = 0,           /* no transition, the state is kept */
+  T1_EVENT_SEND,               /* APDU part to send */
+  T1_EVENT_I_BLOCK,            /* last I-block of the response */
+  T1_EVENT_I_BLOCK_CHAINED,    /* I-block with more to come */
+  T1_EVENT_R_BLOCK_ACK,        /* R-block for the next chained I-block */
+  T1_EVENT_R_BLOCK_RESEND,     /* R-block asking for the I-block again */
+  T1_EVENT_R_BLOCK_UNEXPECTED, /* R-block after the last I-block */
+  T1_EVENT_WTX_REQUEST,
+  T1_EVENT_IFS_REQUEST,
+  T1_EVENT_RESYNCH_REQUEST,
+  T1_EVENT_RESYNCH_RESPONSE,
+  T1_EVENT_ABORT_REQUEST,
+  T1_EVENT_S_BLOCK_NO_ANSWER, /* any other S-block, nothing to send back */
+  T1_EVENT_RECOVERY_RESEND,
+  T1_EVENT_RECOVERY_RESYNCH,
+  T1_EVENT_RECOVERY_SWRESET,
+  T1_EVENT_ABORTED, /* exchange ended by an abort, either side */
+  T1_EVENT_COUNT
+} T1TProtocol_Event;
+
+// S-block kinds, from the PCB. SBlockOther for any other S-block PCB.
+typedef enum {
+  SBlockOther = 0,
+  SBlockResynch,
+  SBlockIfs,
+  SBlockAbort,
+  SBlockWtx,
+  SBlockSwReset
+} SBlockKind;
+
+// Why a response TPDU is not consistent, in the order of the checks.
+typedef enum {
+  ResponseOk = 0,
+  ResponseChecksumError,
+  ResponsePcbError,
+  ResponseLenError,
+  ResponseSeqNumberError,
+  ResponseUnexpectedSBlock
+} ResponseError;
+
+// Verdict of the validation of a response TPDU, with what the handlers need
+// from its PCB.
+typedef struct {
+  uint8_t type : 2;       /* TpduType */
+  uint8_t seqNumber : 1;  /* N(S) of an I-block, N(R) of an R-block */
+  uint8_t more : 1;       /* M bit of an I-block */
+  uint8_t sBlockKind : 3; /* SBlockKind of an S-block */
+  uint8_t isResponse : 1; /* S-block response rather than request */
+  uint8_t error;          /* ResponseError */
+} ResponseVerdict;
 /**
  * Form a valid pcb according to the Tpdu type, subtype, master sequence number,
  * slave sequence number and isLast.
@@ -103,59 +168,21 @@ uint8_t T1protocol_getValidPcb(TpduType type, RBlockType subtype,
  *
  * @return 0 If checksum is ok, -1 otherwise.
  */
-int T1protocol_checkResponseTpduChecksum(Tpdu *tpdu);
-
-/**
- * Check if the pcb of a given tpdu is valid.
- *
- * @param tpdu Tpdu to check.
- *
- * @return 0 If checksum is ok, -1 otherwise.
- */
-int T1protocol_checkResponsePcbConsistency(Tpdu *tpdu);
-
-/**
- * Check if the length field of a given tpdu is valid.
- *
- * @param tpdu Tpdu to check.
- *
- * @return 0 If checksum is ok, -1 otherwise.
- */
-int T1protocol_checkResponseLenConsistency(Tpdu *tpdu);
-
-/**
- * Check if the sequence number of a given tpdu is valid.
- *
- * @param tpdu Tpdu to check.
- *
- * @return 0 If checksum is ok, -1 otherwise.
- */
-int T1protocol_checkResponseSeqNumberConsistency(Tpdu *tpdu);
-
-/**
- * Check if an SBlock response was received after having transmitted a SBlock
- * request.
- *
- * @param lastCmdTpduSent Last Tpdu sent.
- * @param lastRespTpduReceived Response received.
- *
- * @return 0 If checksum is ok, -1 otherwise.
- */
-int T1protocol_checkSBlockResponseConsistency(Tpdu *lastCmdTpduSent,
-                                              Tpdu *lastRespTpduReceived);
+int T1protocol_checkResponseTpduChecksum(const Tpdu *tpdu);
 
 /**
- * Check if the response TPDU is consistent (check the checksum, check if the
- * pcb is valid and the expected one and check the len consistency).
+ * Validates a response TPDU in one pass: checksum, PCB, length, sequence
+ * number, and S-block response to the S-block request sent. All that is
+ * needed from the PCB is taken from a table indexed by it.
  *
  * @param lastCmdTpduSent Last Tpdu sent, could be different than the
  * originalCmdTpdu if there was retransmissions request or SBlocks.
  * @param lastRespTpduReceived Last response received from the slave.
  *
- * @return 0 If consistency is ok, -1 otherwise.
+ * @return The verdict, its error is ResponseOk if the TPDU is consistent.
  */
-int T1protocol_checkTpduConsistency(Tpdu *lastCmdTpduSent,
-                                    Tpdu *lastRespTpduReceived);
+ResponseVerdict T1protocol_validateResponse(const Tpdu *lastCmdTpduSent,
+                                            const Tpdu *lastRespTpduReceived);
 
 /**
  * Set the sequence numbers to it's initial values.
@@ -179,20 +206,24 @@ void T1protocol_updateSlaveSequenceNumber();
  *
  * @param originalCmdTpdu Original Tpdu sent.
  * @param lastRespTpduReceived Last response received from the slave.
+ * @param verdict Verdict of its validation.
+ * @param event Where to store the event for the T=1 engine.
  *
  * @return 0 If all went is ok, -1 otherwise.
  */
-int T1protocol_processIBlock(Tpdu* originalCmdTpdu, Tpdu* lastRespTpduReceived);
+int T1protocol_processIBlock(Tpdu *originalCmdTpdu, Tpdu *lastRespTpduReceived,
+                             ResponseVerdict verdict, T1TProtocol_Event *event);
 
 /**
  * Process the last RBlock received from the slave.
  *
  * @param originalCmdTpdu Original Tpdu sent.
- * @param lastRespTpduReceived Last response received from the slave.
+ * @param verdict Verdict of the validation of the last response received.
  *
+ * @return The event for the T=1 engine.
  */
-void T1protocol_processRBlock(Tpdu *originalCmdTpdu,
-                              Tpdu *lastRespTpduReceived);
+T1TProtocol_Event T1protocol_processRBlock(Tpdu *originalCmdTpdu,
+                                           ResponseVerdict verdict);
 
 /**
  * Process the last RBlock received from the slave.
@@ -223,22 +254,15 @@ int T1protocol_formSblockResponse(Tpdu *responseTpdu, Tpdu *requestTpdu);
  * @param lastCmdTpduSent Last Tpdu sent, could be different than the
  * originalCmdTpdu if there was retransmissions request or SBlocks.
  * @param lastRespTpduReceived Last response received from the slave.
+ * @param verdict Verdict of its validation.
+ * @param event Where to store the event for the T=1 engine.
  *
  * @return -1 if the extra retransmission needed fails or  1 if extra
  * retransmission success.
  */
 int T1protocol_processSBlock(Tpdu *originalCmdTpdu, Tpdu *lastCmdTpduSent,
-                             Tpdu *lastRespTpduReceived);
-
-/**
- * Check if the sequence number of the response TPDU is the expected one.
- *
- * @param originalTpdu The original tpdu sent.
- * @param respTpdu The last response received from the slave.
- *
- * @return true If sequence number is ok, false otherwise.
- */
-bool T1protocol_isSequenceNumberOk(Tpdu *originalTpdu, Tpdu *respTpdu);
+                             Tpdu *lastRespTpduReceived,
+                             ResponseVerdict verdict, T1TProtocol_Event *event);
 
 /**
  * Updates the recovery state to the following step.
@@ -268,19 +292,15 @@ uint8_t T1protocol_setRespApduData(Tpdu *respTpdu, uint8_t *respApduBuffer);
 int T1protocol_doWTXResponse(Tpdu *lastRespTpduReceived);
 
 /**
- * The first thing to do in the recovery mechanism is to ask for a
- * retransmission.
+ * If the eSE send a S(IFS request), acknowledge it by sending
+ * a S(IFS response). The new IFSC is already applied.
  *
- * @param lastCmdTpduSent Last Tpdu sent, could be different than the
- * originalCmdTpdu if there was retransmissions request or SBlocks.
  * @param lastRespTpduReceived Last response received from the slave.
- * @param bytesRead If a retransmission occurs, this field contains the amout of
- * bytes read from the slave in the new transaction.
  *
- * @return 0 if everything went fine, -1 if something failed.
+ * @return bytesRead if data was read, 0 if timeout expired with
+ *         no response, -1 otherwise
  */
-int T1protocol_doResendRequest(Tpdu *lastCmdTpduSent,
-                               Tpdu *lastRespTpduReceived, int *bytesRead);
+int T1protocol_doIFSResponse(Tpdu *lastRespTpduReceived);
 
 /**
  * The second thing to do in the recovery mechanism if the resend fails
@@ -312,8 +332,11 @@ int T1protocol_doResyncRequest(Tpdu *lastRespTpduReceived);
  *       TODO: If a warm reset needs to be performed, the service will die
  *       and the user will need do the reset manually, as Power Manager is not
  *       yet implemented.
+ *
+ * @param event Where to store the event for the T=1 engine, the recovery
+ * step to take.
  */
-int T1protocol_doRecovery();
+int T1protocol_doRecovery(T1TProtocol_Event *event);
 
 /**
  * Send a soft reset (S-Block)
@@ -325,7 +348,39 @@ int T1protocol_doRecovery();
 int T1protocol_doSoftReset(Tpdu* lastRespTpduReceived);
 
 /**
- * Send IFS request(S-Block)
+ * Ends the exchange in progress once its deadline expired or it was
+ * cancelled. A chain in progress is aborted with a S(ABORT request), then a
+ * resync is done to bring the sequence numbers back in line.
+ *
+ * @param originalCmdTpdu Original Tpdu sent.
+ * @param lastRespTpduReceived Memory position where to store the response.
+ *
+ * @return 0 if the eSE is in a known state again, -1 otherwise.
+ */
+int T1protocol_doAbort(Tpdu *originalCmdTpdu, Tpdu *lastRespTpduReceived);
+
+/**
+ * Acknowledge a S(ABORT request) received from the eSE by sending a
+ * S(ABORT response).
+ *
+ * @return 0 if everything went fine, -1 if an error occurred.
+ */
+int T1protocol_doAbortResponse();
+
+/**
+ * Sets the sink the response of the next APDU parts is streamed to. Each INF
+ * field received is given to the sink as soon as the R(ACK) asking for the
+ * next block has been sent, so that the caller processes it while the eSE
+ * sends the next one. Nothing is stored in DataMgmt then.
+ *
+ * @param sink Function called with each INF field received, NULL to collect
+ *      the whole response instead.
+ * @param context Opaque pointer given back to the sink.
+ */
+void T1protocol_setResponseSink(StEse_responseSink sink, void *context);
+
+/**
+ * Send IFS request(S-Block) with the configured IFSD.
  *
  * @param  None.
  *
@@ -333,6 +388,110 @@ int T1protocol_doSoftReset(Tpdu* lastRespTpduReceived);
  */
 int T1protocol_doRequestIFS();
 
+/**
+ * Renegotiates the IFSD with the eSE if it differs from the one in use.
+ * Larger blocks mean fewer R(ACK) round trips for large responses.
+ *
+ * @param ifsd IFSD to request, 1 to MAX_IFSD.
+ *
+ * @return 0 if everything went fine, -1 if an error occurred.
+ */
+int T1protocol_setIfsd(uint8_t ifsd);
+
+/**
+ * Resynchronizes the link with a S(RESYNCH request), outside of an APDU
+ * exchange. The eSE state, and its logical channels, are kept.
+ *
+ * @return 0 if the eSE acknowledged it, -1 otherwise.
+ */
+int T1protocol_resync();
+
+/**
+ * Resets the eSE with a S(SWReset request), outside of an APDU exchange, and
+ * takes the ATP it answers with. The logical channels are closed.
+ *
+ * @return 0 if the eSE was reset, -1 otherwise.
+ */
+int T1protocol_softReset();
+
+/**
+ * Checks that the eSE answers, with a S(IFS request) for the IFSD in use,
+ * outside of an APDU exchange. Nothing is recovered if it does not.
+ *
+ * @return 0 if the eSE answered, -1 otherwise.
+ */
+int T1protocol_checkAlive();
+
+/**
+ * Gets the next action of the T=1 engine, recorded in the TPDU traces.
+ *
+ * @return The current T1TProtocol_TransceiveState.
+ */
+uint8_t T1protocol_getState();
+
+/**
+ * Gets the state the T=1 engine goes to from a state on an event.
+ *
+ * @param state A T1TProtocol_TransceiveState.
+ * @param event A T1TProtocol_Event.
+ *
+ * @return The next state.
+ */
+uint8_t T1protocol_getNextState(uint8_t state, uint8_t event);
+
+/**
+ * Gets the time spent in each state of the T=1 engine, and how many times
+ * each transition was taken. Lock-free, can be called from any thread.
+ *
+ * @param timeNs Array of T1_STATE_COUNT elements, time spent in each state
+ *      sending its block and handling the response, in ns.
+ * @param transitions Array of T1_STATE_COUNT * T1_EVENT_COUNT elements,
+ *      indexed by state * T1_EVENT_COUNT + event.
+ */
+void T1protocol_getStateStats(uint64_t *timeNs, uint64_t *transitions);
+
+/**
+ * Clears the time spent in the states and the transition counters.
+ */
+void T1protocol_resetStateStats();
+
+/**
+ * Gets the name of a state of the T=1 engine, for the dumps.
+ *
+ * @param state A T1TProtocol_TransceiveState.
+ *
+ * @return Its name, "unknown" if it is out of range.
+ */
+const char *T1protocol_getStateName(unsigned int state);
+
+/**
+ * Gets the name of an event of the T=1 engine, for the dumps.
+ *
+ * @param event A T1TProtocol_Event.
+ *
+ * @return Its name, "unknown" if it is out of range.
+ */
+const char *T1protocol_getEventName(unsigned int event);
+
+/**
+ * Gets the IFSD currently in use.
+ *
+ * @return The IFSD.
+ */
+uint8_t T1protocol_getIfsd();
+
+/**
+ * Resumes a link left by a previous service, without resetting the eSE (the
+ * ATP must be set already). The eSE must answer a S(RESYNCH request), which
+ * restarts the sequence numbers of both sides wherever the previous service
+ * left them, and the IFSD is negotiated again.
+ *
+ * @param ifsd IFSD in use on the link.
+ *
+ * @return 0 if the eSE answered, -1 otherwise.
+ */
+int T1protocol_resumeLink(uint8_t ifsd);
+
 /**
  * Handles any TPDU response iteratively.
  *
@@ -387,6 +546,8 @@ int T1protocol_init(SpiDriver_config_t *tSpiDriver);
  * @param isLast Either APDU_PART_IS_NOT_LAST or APDU_PART_IS_LAST (or null).
  * @param pRsp Structure to the response buffer and length.
  *      (or null).
+ * @param deadline Absolute time after which the exchange is aborted, NULL if
+ *      there is none.
  *
  * @return If no response is expected:
  *          - 0 if everything was ok
@@ -395,8 +556,11 @@ int T1protocol_init(SpiDriver_config_t *tSpiDriver);
  *          - 0 if it is the last response part
  *          - 1 if there are more response parts
  *          - -1 if an error occurred.
+ *         In both cases, -2 if the deadline expired or the exchange was
+ *         cancelled.
  */
 int T1protocol_transcieveApduPart(uint8_t *cmdApduPart, uint8_t cmdLength,
-                                  bool isLast, StEse_data *pRsp);
+                                  bool isLast, StEse_data *pRsp,
+                                  const struct timeval *deadline);
 
 #endif /* _T1PROTOCOL_H_ */
@@ -0,0 +1,215 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-T1protocolFrames"
+#include "T1protocolFrames.h"
+#include "SpiLayerComm.h"
+#include "T1protocol.h"
+#include "utils-lib/Atp.h"
+#include "utils-lib/Iso13239CRC.h"
+#include "utils-lib/Iso7816LRC.h"
+
+// R-block PCB: 10 0 N(R) 00 error bits (RBlockType)
+#define RBLOCK_PCB 0x80
+#define RBLOCK_PCB_FIXED_MASK 0xEC
+#define RBLOCK_NR_SHIFT 4
+#define RBLOCK_ERROR_MASK 0x03
+
+/*******************************************************************************
+**
+** Function         T1protocolFrames_form
+**
+** Description      Forms the frame of a block sent by the host, with its EDC,
+**                  at compile time.
+**
+** Parameters       type - EDC kind.
+**                  pcb  - PCB of the block.
+**                  len  - length of the INF field, 0 or 1.
+**                  inf  - INF byte, ignored if len is 0.
+**
+** Returns          The frame.
+**
+*******************************************************************************/
+static constexpr Tpdu T1protocolFrames_form(ChecksumType type, uint8_t pcb,
+                                            uint8_t len, uint8_t inf) {
+  Tpdu tpdu = {};
+
+  tpdu.nad = NAD_HOST_TO_SLAVE;
+  tpdu.pcb = pcb;
+  tpdu.len = len;
+  if (len == 1) {
+    tpdu.data[0] = inf;
+  }
+
+  if (type == LRC) {
+    uint8_t lrc = 0;
+    lrc = updateLrc(lrc, tpdu.nad);
+    lrc = updateLrc(lrc, tpdu.pcb);
+    lrc = updateLrc(lrc, tpdu.len);
+    if (len == 1) {
+      lrc = updateLrc(lrc, inf);
+    }
+    tpdu.data[len] = lrc;
+  } else {
+    uint16_t crc = CRC_PRESET;
+    crc = updateCrc(crc, tpdu.nad);
+    crc = updateCrc(crc, tpdu.pcb);
+    crc = updateCrc(crc, tpdu.len);
+    if (len == 1) {
+      crc = updateCrc(crc, inf);
+    }
+    crc = ~crc;
+    tpdu.data[len] = (uint8_t)crc;
+    tpdu.data[len + 1] = (uint8_t)(crc >> 8);
+  }
+  return tpdu;
+}
+
+#define RBLOCK(type, error, nr)                                         \
+  T1protocolFrames_form(type,                                           \
+                        RBLOCK_PCB | ((nr) << RBLOCK_NR_SHIFT) | (error), \
+                        0, 0)
+#define RBLOCKS(type)                                                     \
+  {                                                                       \
+    {RBLOCK(type, ErrorFree, 0), RBLOCK(type, ErrorFree, 1)},             \
+        {RBLOCK(type, ChecksumError, 0), RBLOCK(type, ChecksumError, 1)}, \
+        {RBLOCK(type, OtherErrors, 0), RBLOCK(type, OtherErrors, 1)},     \
+  }
+
+// R-blocks, by EDC kind, error bits and N(R)
+static constexpr Tpdu rBlocks[][3][2] = {RBLOCKS(LRC), RBLOCKS(CRC)};
+
+typedef struct {
+  Tpdu frames[T1_FRAMES_MAX_WTX_MULTIPLIER];
+} WtxResponses;
+
+/*******************************************************************************
+**
+** Function         T1protocolFrames_formWtxResponses
+**
+** Description      Forms the S(WTX response) frames, by multiplier - 1, at
+**                  compile time.
+**
+** Parameters       type - EDC kind.
+**
+** Returns          The frames.
+**
+*******************************************************************************/
+static constexpr WtxResponses T1protocolFrames_formWtxResponses(
+    ChecksumType type) {
+  WtxResponses responses = {};
+  for (int i = 0; i < T1_FRAMES_MAX_WTX_MULTIPLIER; i++) {
+    responses.frames[i] =
+        T1protocolFrames_form(type, SBLOCK_WTX_RESPONSE_MASK, 1, i + 1);
+  }
+  return responses;
+}
+
+// S(WTX response), by EDC kind
+static constexpr WtxResponses wtxResponses[] = {
+    T1protocolFrames_formWtxResponses(LRC),
+    T1protocolFrames_formWtxResponses(CRC),
+};
+
+#define SBLOCKS(type)                                                   \
+  {                                                                     \
+    T1protocolFrames_form(type, SBLOCK_RESYNCH_REQUEST_MASK, 0, 0),     \
+        T1protocolFrames_form(type, SBLOCK_SWRESET_REQUEST_MASK, 0, 0), \
+        T1protocolFrames_form(type, SBLOCK_ABORT_REQUEST_MASK, 0, 0),   \
+        T1protocolFrames_form(type, SBLOCK_ABORT_RESPONSE_MASK, 0, 0),  \
+        T1protocolFrames_form(type, SBLOCK_IFS_REQUEST_MASK, 1,         \
+                              DEFAULT_IFSD),                            \
+        T1protocolFrames_form(type, SBLOCK_IFS_REQUEST_MASK, 1, MAX_IFSD), \
+        T1protocolFrames_form(type, SBLOCK_IFS_RESPONSE_MASK, 1,        \
+                              DEFAULT_IFSD),                            \
+        T1protocolFrames_form(type, SBLOCK_IFS_RESPONSE_MASK, 1,        \
+                              MAX_IFSD),                                \
+  }
+
+// The other S-blocks sent by the host, by EDC kind. The IFS ones are there
+// for the default and the maximum sizes only.
+static constexpr Tpdu sBlocks[][8] = {SBLOCKS(LRC), SBLOCKS(CRC)};
+
+/*******************************************************************************
+**
+** Function         T1protocolFrames_find
+**
+** Description      Looks for the precomputed frame of a control block.
+**
+** Parameters       type - EDC kind.
+**                  pcb  - PCB of the block.
+**                  len  - length of the INF field.
+**                  inf  - INF field, NULL if len is 0.
+**
+** Returns          The frame, NULL if it is not precomputed.
+**
+*******************************************************************************/
+static const Tpdu* T1protocolFrames_find(ChecksumType type, uint8_t pcb,
+                                         uint8_t len, const uint8_t* inf) {
+  if ((pcb & RBLOCK_PCB_FIXED_MASK) == RBLOCK_PCB) {
+    uint8_t error = pcb & RBLOCK_ERROR_MASK;
+    if ((len != 0) || (error > OtherErrors)) {
+      return NULL;
+    }
+    return &rBlocks[type][error][(pcb >> RBLOCK_NR_SHIFT) & 1];
+  }
+
+  if ((pcb == SBLOCK_WTX_RESPONSE_MASK) && (len == 1)) {
+    if ((inf[0] == 0) || (inf[0] > T1_FRAMES_MAX_WTX_MULTIPLIER)) {
+      return NULL;
+    }
+    return &wtxResponses[type].frames[inf[0] - 1];
+  }
+
+  for (const Tpdu& sBlock : sBlocks[type]) {
+    if ((sBlock.pcb == pcb) && (sBlock.len == len) &&
+        ((len == 0) || (sBlock.data[0] == inf[0]))) {
+      return &sBlock;
+    }
+  }
+  return NULL;
+}
+
+/*******************************************************************************
+**
+** Function         T1protocolFrames_get
+**
+** Description      Gets the frame of a control block to send: the precomputed
+**                  one if there is one, otherwise it is
+**                  formed in tpdu.
+**
+** Parameters       pcb  - PCB of the R-block or S-block.
+**                  len  - length of the INF field, 0 or 1.
+**                  inf  - INF field, NULL if len is 0.
+**                  tpdu - where to form the frame if it is not precomputed.
+**
+** Returns          The frame, NULL if it could not be formed.
+**
+*******************************************************************************/
+const Tpdu* T1protocolFrames_get(uint8_t pcb, uint8_t len, const uint8_t* inf,
+                                 Tpdu* tpdu) {
+  const Tpdu* frame = T1protocolFrames_find(ATP.checksumType, pcb, len, inf);
+  if (frame != NULL) {
+    return frame;
+  }
+
+  if (Tpdu_formTpdu(NAD_HOST_TO_SLAVE, pcb, len, inf, tpdu) != 0) {
+    return NULL;
+  }
+  return tpdu;
+}
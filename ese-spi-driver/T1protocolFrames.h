@@ -0,0 +1,48 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef _T1PROTOCOLFRAMES_H_
+#define _T1PROTOCOLFRAMES_H_
+
+/*
+ * Control frames sent by the host: R-blocks and S-blocks have a fixed NAD, a
+ * handful of PCBs and at most one INF byte. The common ones are built at
+ * compile time for both EDC kinds, and sent straight from static storage.
+ */
+
+#include <stdint.h>
+#include "utils-lib/Tpdu.h"
+
+// S(WTX response) frames are precomputed for multipliers 1 up to this one.
+#define T1_FRAMES_MAX_WTX_MULTIPLIER 4
+
+/**
+ * Gets the frame of a control block to send: the precomputed one if there
+ * is one for the EDC in use, otherwise it is formed in tpdu.
+ *
+ * @param pcb The PCB of the R-block or S-block.
+ * @param len The length of the INF field, 0 or 1.
+ * @param inf The INF field, NULL if len is 0.
+ * @param tpdu Where to form the frame if it is not precomputed.
+ *
+ * @return The frame, NULL if it could not be formed.
+ */
+const Tpdu* T1protocolFrames_get(uint8_t pcb, uint8_t len, const uint8_t* inf,
+                                 Tpdu* tpdu);
+
+#endif /* _T1PROTOCOLFRAMES_H_ */
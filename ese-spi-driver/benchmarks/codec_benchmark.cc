@@ -0,0 +1,110 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+// Microbenchmarks of the frame codec: the EDC computed and checked for every
+// frame exchanged, and the frames formed with either EDC.
+#include <benchmark/benchmark.h>
+#include <string.h>
+#include "Iso13239CRC.h"
+#include "Iso7816LRC.h"
+#include "SpiLayerComm.h"
+#include "Tpdu.h"
+
+// Frame lengths, EDC excluded: prologue only, a short APDU, a full block.
+static void frameLengths(benchmark::internal::Benchmark* benchmark) {
+  benchmark->Arg(TPDU_PROLOGUE_LENGTH)
+      ->Arg(TPDU_PROLOGUE_LENGTH + 32)
+      ->Arg(TPDU_PROLOGUE_LENGTH + TPDU_MAX_DATA_LENGTH);
+}
+
+static void fillFrame(uint8_t* frame, int length) {
+  for (int i = 0; i < length; i++) {
+    frame[i] = (uint8_t)(i * 7 + 3);
+  }
+}
+
+static void BM_computeLrc(benchmark::State& state) {
+  uint8_t frame[TPDU_MAX_LENGTH + TPDU_CRC_LENGTH];
+  int length = state.range(0);
+
+  fillFrame(frame, length);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(computeLrc(frame, length));
+  }
+  state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_computeLrc)->Apply(frameLengths);
+
+static void BM_isLrcOk(benchmark::State& state) {
+  uint8_t frame[TPDU_MAX_LENGTH + TPDU_CRC_LENGTH];
+  int length = state.range(0);
+
+  fillFrame(frame, length);
+  computeLrc(frame, length);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(isLrcOk(frame, length));
+  }
+  state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_isLrcOk)->Apply(frameLengths);
+
+static void BM_computeCrc(benchmark::State& state) {
+  uint8_t frame[TPDU_MAX_LENGTH + TPDU_CRC_LENGTH];
+  int length = state.range(0);
+
+  fillFrame(frame, length);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(computeCrc(frame, length));
+  }
+  state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_computeCrc)->Apply(frameLengths);
+
+static void BM_isCrcOk(benchmark::State& state) {
+  uint8_t frame[TPDU_MAX_LENGTH + TPDU_CRC_LENGTH];
+  int length = state.range(0);
+
+  fillFrame(frame, length);
+  computeCrc(frame, length);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(isCrcOk(frame, length));
+  }
+  state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_isCrcOk)->Apply(frameLengths);
+
+// Arguments: INF length, then the EDC (LRC or CRC).
+static void BM_formTpdu(benchmark::State& state) {
+  uint8_t inf[TPDU_MAX_DATA_LENGTH];
+  Tpdu tpdu;
+  uint8_t length = state.range(0);
+
+  fillFrame(inf, length);
+  Tpdu_setChecksumType((ChecksumType)state.range(1));
+  for (auto _ : state) {
+    Tpdu_formTpdu(NAD_HOST_TO_SLAVE, 0x00, length, inf, &tpdu);
+    benchmark::DoNotOptimize(tpdu);
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          (TPDU_PROLOGUE_LENGTH + length));
+  Tpdu_setChecksumType(CRC);
+}
+BENCHMARK(BM_formTpdu)
+    ->ArgsProduct({{0, 32, TPDU_MAX_DATA_LENGTH}, {LRC, CRC}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,108 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+// Cost of the recovery paths: whole APDU exchanges through the stack, on a
+// scripted capture replayed on the host, with all the kinds of faults
+// injected at the same rate. Reports the ESE_LATENCY_RECOVERY percentiles
+// and the share of the recoveries that restored the link.
+#include <benchmark/benchmark.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "SpiLayerDriverReplay.h"
+#include "StEseApi.h"
+#include "tests/ScriptedCapture.h"
+
+// The same seed hits the same frames from one run to the next.
+#define FAULT_SEED 1
+// Length of the response data, status word excluded
+#define FAULT_RESPONSE_LENGTH 32
+
+// Shared by the runs: the stack keeps the link over StEse_close().
+static ScriptedLink scriptedLink;
+
+static std::string capturePath() {
+  const char* dir = getenv("TMPDIR");
+  return std::string((dir != NULL) ? dir : "/tmp") + "/fault_benchmark.cap";
+}
+
+// Fault rates per 1000 frames received: none, then noisier and noisier.
+static void faultRates(benchmark::internal::Benchmark* benchmark) {
+  benchmark->Arg(0)->Arg(10)->Arg(50)->Arg(100);
+}
+
+static void BM_transceiveWithFaults(benchmark::State& state) {
+  uint16_t rate = state.range(0);
+  StEse_faultRates rates = {rate, rate, rate, rate, rate};
+  StEse_faultRates noFaults = {0, 0, 0, 0, 0};
+  ScriptedExchange exchange = {
+      {0x80, 0xCA, 0x00, 0x00, 0x00},
+      std::vector<uint8_t>(FAULT_RESPONSE_LENGTH, 0x5A)};
+  StEse_busCounters counters;
+  StEse_latencyStats recovery;
+  uint64_t failed = 0;
+
+  exchange.response.push_back(0x90);
+  exchange.response.push_back(0x00);
+  std::vector<ScriptedExchange> exchanges(state.max_iterations, exchange);
+  std::string path = capturePath();
+  if ((ScriptedCapture_write(path.c_str(), &scriptedLink, exchanges) != 0) ||
+      (SpiLayerDriverReplay_load(path.c_str(), false) != 0) ||
+      (StEse_init() != ESESTATUS_SUCCESS)) {
+    state.SkipWithError("cannot replay the capture");
+    return;
+  }
+  StEse_setFaultInjection(&rates, FAULT_SEED);
+  StEse_getBusCounters(&counters, true);
+  StEse_resetLatencyStats();
+
+  for (auto _ : state) {
+    std::vector<uint8_t> command = exchange.command;
+    StEse_data cmd = {(uint32_t)command.size(), command.data()};
+    StEse_data rsp = {0, NULL};
+
+    if (StEse_Transceive(&cmd, &rsp) == ESESTATUS_SUCCESS) {
+      free(rsp.p_data);
+    } else {
+      failed++;
+    }
+  }
+
+  StEse_getBusCounters(&counters, true);
+  StEse_getLatencyStats(ESE_LATENCY_RECOVERY, ESE_APDU_CLASS_PROPRIETARY,
+                        &recovery);
+  StEse_setFaultInjection(&noFaults, FAULT_SEED);
+  StEse_close();
+
+  state.counters["faults"] = counters.faultsInjected;
+  state.counters["recoveries"] = counters.recoveries;
+  state.counters["recovered_ratio"] =
+      (counters.recoveries == 0)
+          ? 1.0
+          : (double)(counters.recoveries - counters.recoveriesFailed) /
+                counters.recoveries;
+  state.counters["recovery_p50_us"] = recovery.p50Ns / 1000.0;
+  state.counters["recovery_p90_us"] = recovery.p90Ns / 1000.0;
+  state.counters["recovery_p99_us"] = recovery.p99Ns / 1000.0;
+  state.counters["apdus_failed"] = failed;
+}
+BENCHMARK(BM_transceiveWithFaults)
+    ->Apply(faultRates)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
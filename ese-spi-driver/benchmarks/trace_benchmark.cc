@@ -0,0 +1,115 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+// Benchmarks of the traces: the hex strings of the frames, the dumps skipped
+// below the debug level, and what the traces of each level add to a whole
+// APDU exchange, replayed on the host.
+#include <benchmark/benchmark.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "SpiLayerDriverReplay.h"
+#include "StEseApi.h"
+#include "Utils.h"
+#include "android_logmsg.h"
+#include "tests/ScriptedCapture.h"
+
+#define FRAME_MAX_LENGTH 259
+// Length of the response data, status word excluded
+#define TRACE_RESPONSE_LENGTH 64
+
+// Shared by the runs: the stack keeps the link over StEse_close().
+static ScriptedLink scriptedLink;
+
+static void BM_charArrayToHexString(benchmark::State& state) {
+  char frame[FRAME_MAX_LENGTH];
+  char hexString[FRAME_MAX_LENGTH * 3 + 1];
+  int length = state.range(0);
+
+  for (int i = 0; i < length; i++) {
+    frame[i] = (char)(i * 7 + 0x80);
+  }
+  for (auto _ : state) {
+    Utils_charArrayToHexString(frame, length, hexString);
+    benchmark::DoNotOptimize(hexString);
+  }
+  state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_charArrayToHexString)->Arg(4)->Arg(36)->Arg(FRAME_MAX_LENGTH);
+
+// What a dump costs when the debug traces are off.
+static void BM_dumpBelowLevel(benchmark::State& state) {
+  uint8_t frame[FRAME_MAX_LENGTH] = {0};
+  unsigned char level = hal_trace_level;
+
+  hal_trace_level = STESE_TRACE_LEVEL_WARNING;
+  for (auto _ : state) {
+    STLOG_HAL_DUMP("Rx", frame, sizeof(frame));
+    benchmark::ClobberMemory();
+  }
+  hal_trace_level = level;
+}
+BENCHMARK(BM_dumpBelowLevel);
+
+static std::string capturePath() {
+  const char* dir = getenv("TMPDIR");
+  return std::string((dir != NULL) ? dir : "/tmp") + "/trace_benchmark.cap";
+}
+
+// One APDU exchanged per iteration, from StEse_Transceive() down to the
+// replay transport, with the traces of the level given on.
+static void BM_transceiveAtTraceLevel(benchmark::State& state) {
+  unsigned char level = hal_trace_level;
+  ScriptedExchange exchange = {
+      {0x80, 0xCA, 0x00, 0x00, 0x00},
+      std::vector<uint8_t>(TRACE_RESPONSE_LENGTH, 0x5A)};
+
+  exchange.response.push_back(0x90);
+  exchange.response.push_back(0x00);
+  std::vector<ScriptedExchange> exchanges(state.max_iterations, exchange);
+  std::string path = capturePath();
+  if ((ScriptedCapture_write(path.c_str(), &scriptedLink, exchanges) != 0) ||
+      (SpiLayerDriverReplay_load(path.c_str(), false) != 0) ||
+      (StEse_init() != ESESTATUS_SUCCESS)) {
+    state.SkipWithError("cannot replay the capture");
+    return;
+  }
+  // Set after the init, which takes the level of the configuration.
+  hal_trace_level = state.range(0);
+
+  for (auto _ : state) {
+    std::vector<uint8_t> command = exchange.command;
+    StEse_data cmd = {(uint32_t)command.size(), command.data()};
+    StEse_data rsp = {0, NULL};
+
+    if (StEse_Transceive(&cmd, &rsp) != ESESTATUS_SUCCESS) {
+      state.SkipWithError("transceive failed");
+      break;
+    }
+    free(rsp.p_data);
+  }
+
+  hal_trace_level = level;
+  StEse_close();
+  state.counters["divergences"] = SpiLayerDriverReplay_getDivergences();
+}
+BENCHMARK(BM_transceiveAtTraceLevel)
+    ->DenseRange(STESE_TRACE_LEVEL_ERROR, STESE_TRACE_LEVEL_VERBOSE)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,298 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#include "ScriptedCapture.h"
+#include <stdio.h>
+#include <string.h>
+#include "SpiLayerComm.h"
+#include "T1protocol.h"
+#include "utils-lib/Atp.h"
+#include "utils-lib/Iso13239CRC.h"
+#include "utils-lib/SpiCapture.h"
+#include "utils-lib/Tpdu.h"
+
+// Time the scripted eSE takes to answer a frame
+#define SCRIPTED_RESPONSE_DELAY_NS 100000
+// BWT (ms) and maximum SPI clock (kHz) announced in the ATP
+#define SCRIPTED_BWT_MS 100
+#define SCRIPTED_MSF_KHZ 10000
+// R-block acknowledging a chained I-block, N(R) not set
+#define SCRIPTED_RBLOCK_PCB 0x80
+#define SCRIPTED_RBLOCK_NR_BIT_MASK 0x10
+
+typedef struct {
+  FILE* file;
+  uint64_t timestampNs;
+  ScriptedLink* link;
+} ScriptedSession;
+
+/*******************************************************************************
+**
+** Function         ScriptedCapture_record
+**
+** Description      Appends a SPI access to the capture.
+**
+** Parameters       session - the session being written.
+**                  type    - the kind of access.
+**                  data    - the bytes transferred.
+**                  length  - the number of bytes transferred.
+**
+** Returns          0 if the access could be written, -1 otherwise.
+**
+*******************************************************************************/
+static int ScriptedCapture_record(ScriptedSession* session,
+                                  SpiCaptureEventType type,
+                                  const uint8_t* data, uint16_t length) {
+  SpiCaptureEvent event;
+
+  session->timestampNs += SCRIPTED_RESPONSE_DELAY_NS;
+  memset(&event, 0, sizeof(event));
+  event.timestampNs = session->timestampNs;
+  event.type = type;
+  event.length = length;
+  event.result = length;
+  if ((fwrite(&event, sizeof(event), 1, session->file) != 1) ||
+      ((length > 0) && (fwrite(data, 1, length, session->file) != length))) {
+    return -1;
+  }
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         ScriptedCapture_frame
+**
+** Description      Forms a T=1 frame with its CRC, least significant byte
+**                  first.
+**
+** Parameters       nad - NAD of the frame.
+**                  pcb - PCB of the frame.
+**                  inf - INF field, may be NULL if len is 0.
+**                  len - length of the INF field.
+**
+** Returns          The frame.
+**
+*******************************************************************************/
+static std::vector<uint8_t> ScriptedCapture_frame(uint8_t nad, uint8_t pcb,
+                                                  const uint8_t* inf,
+                                                  uint8_t len) {
+  std::vector<uint8_t> frame(TPDU_PROLOGUE_LENGTH + len + TPDU_CRC_LENGTH);
+
+  frame[NAD_OFFSET_IN_TPDU] = nad;
+  frame[PCB_OFFSET_IN_TPDU] = pcb;
+  frame[LEN_OFFSET_IN_TPDU] = len;
+  if (len > 0) {
+    memcpy(&frame[DATA_OFFSET_IN_TPDU], inf, len);
+  }
+  uint16_t crc = computeCrc(frame.data(), TPDU_PROLOGUE_LENGTH + len);
+  frame[TPDU_PROLOGUE_LENGTH + len] = (uint8_t)crc;
+  frame[TPDU_PROLOGUE_LENGTH + len + 1] = (uint8_t)(crc >> 8);
+  return frame;
+}
+
+/*******************************************************************************
+**
+** Function         ScriptedCapture_exchange
+**
+** Description      Records a frame written by the host and the frame the eSE
+**                  answers: the poll that gets the NAD, then the rest.
+**
+** Parameters       session  - the session being written.
+**                  hostPcb  - PCB of the frame of the host.
+**                  hostInf  - its INF field.
+**                  hostLen  - its length.
+**                  esePcb   - PCB of the frame of the eSE.
+**                  eseInf   - its INF field.
+**                  eseLen   - its length.
+**
+** Returns          0 if the frames could be written, -1 otherwise.
+**
+*******************************************************************************/
+static int ScriptedCapture_exchange(ScriptedSession* session, uint8_t hostPcb,
+                                    const uint8_t* hostInf, uint8_t hostLen,
+                                    uint8_t esePcb, const uint8_t* eseInf,
+                                    uint8_t eseLen) {
+  std::vector<uint8_t> hostFrame =
+      ScriptedCapture_frame(NAD_HOST_TO_SLAVE, hostPcb, hostInf, hostLen);
+  std::vector<uint8_t> eseFrame =
+      ScriptedCapture_frame(NAD_SLAVE_TO_HOST, esePcb, eseInf, eseLen);
+
+  if ((ScriptedCapture_record(session, SPI_CAPTURE_WRITE, hostFrame.data(),
+                              hostFrame.size()) != 0) ||
+      (ScriptedCapture_record(session, SPI_CAPTURE_READ, eseFrame.data(), 1) !=
+       0) ||
+      (ScriptedCapture_record(session, SPI_CAPTURE_READ, eseFrame.data() + 1,
+                              eseFrame.size() - 1) != 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         ScriptedCapture_writeInit
+**
+** Description      Records the reset of the first StEse_init(), the ATP,
+**                  and the negotiation of the IFSD.
+**
+** Parameters       session - the session being written.
+**
+** Returns          0 if the accesses could be written, -1 otherwise.
+**
+*******************************************************************************/
+static int ScriptedCapture_writeInit(ScriptedSession* session) {
+  uint8_t atp[LEN_LENGTH_IN_ATP + EXPECTED_ATP_LENGTH];
+  uint8_t ifsd = MAX_IFSD;
+
+  memset(atp, 0, sizeof(atp));
+  atp[LEN_OFFSET_IN_ATP] = EXPECTED_ATP_LENGTH;
+  memcpy(&atp[VENDOR_ID_OFFSET_IN_ATP], "\x02\x00\x00\x00\x01",
+         VENDOR_ID_LENGTH_IN_ATP);
+  atp[BWT_OFFSET_IN_ATP] = (uint8_t)(SCRIPTED_BWT_MS >> 8);
+  atp[BWT_OFFSET_IN_ATP + 1] = (uint8_t)SCRIPTED_BWT_MS;
+  atp[CWT_OFFSET_IN_ATP] = 0x01;
+  atp[PWT_OFFSET_IN_ATP] = 0x01;
+  atp[MSF_OFFSET_IN_ATP] = (uint8_t)(SCRIPTED_MSF_KHZ >> 8);
+  atp[MSF_OFFSET_IN_ATP + 1] = (uint8_t)SCRIPTED_MSF_KHZ;
+  atp[CHECKSUM_TYPE_OFFSET_IN_ATP] = CRC;
+  atp[IFSC_OFFSET_IN_ATP] = TPDU_MAX_DATA_LENGTH;
+  uint16_t crc = computeCrc(atp, CHECKSUM_OFFSET_IN_ATP);
+  atp[CHECKSUM_OFFSET_IN_ATP] = (uint8_t)crc;
+  atp[CHECKSUM_OFFSET_IN_ATP + 1] = (uint8_t)(crc >> 8);
+
+  if ((ScriptedCapture_record(session, SPI_CAPTURE_RESET, NULL, 0) != 0) ||
+      (ScriptedCapture_record(session, SPI_CAPTURE_READ, atp, sizeof(atp)) !=
+       0)) {
+    return -1;
+  }
+  session->link->activated = true;
+  session->link->hostSequence = false;
+  session->link->eseSequence = false;
+  return ScriptedCapture_exchange(session, SBLOCK_IFS_REQUEST_MASK, &ifsd, 1,
+                                  SBLOCK_IFS_RESPONSE_MASK, &ifsd, 1);
+}
+
+/*******************************************************************************
+**
+** Function         ScriptedCapture_writeExchange
+**
+** Description      Records an APDU exchange: the command chained in I-blocks
+**                  the eSE acknowledges, then the response chained in
+**                  I-blocks the host acknowledges.
+**
+** Parameters       session  - the session being written.
+**                  exchange - the APDU and its response.
+**
+** Returns          0 if the accesses could be written, -1 otherwise.
+**
+*******************************************************************************/
+static int ScriptedCapture_writeExchange(ScriptedSession* session,
+                                         const ScriptedExchange& exchange) {
+  const std::vector<uint8_t>& command = exchange.command;
+  const std::vector<uint8_t>& response = exchange.response;
+  size_t commandOffset = 0;
+  size_t responseOffset = 0;
+  uint8_t hostPcb = 0;
+  const uint8_t* hostInf = NULL;
+  uint8_t hostLen = 0;
+
+  // All the parts of the command but the last one are acknowledged.
+  while (command.size() - commandOffset > TPDU_MAX_DATA_LENGTH) {
+    hostPcb = (session->link->hostSequence ? IBLOCK_NS_BIT_MASK : 0) |
+              IBLOCK_M_BIT_MASK;
+    session->link->hostSequence = !session->link->hostSequence;
+    uint8_t ackPcb = SCRIPTED_RBLOCK_PCB | (session->link->hostSequence
+                                                ? SCRIPTED_RBLOCK_NR_BIT_MASK
+                                                : 0);
+    if (ScriptedCapture_exchange(session, hostPcb,
+                                 command.data() + commandOffset,
+                                 TPDU_MAX_DATA_LENGTH, ackPcb, NULL,
+                                 0) != 0) {
+      return -1;
+    }
+    commandOffset += TPDU_MAX_DATA_LENGTH;
+  }
+  hostPcb = session->link->hostSequence ? IBLOCK_NS_BIT_MASK : 0;
+  hostInf = command.data() + commandOffset;
+  hostLen = command.size() - commandOffset;
+  session->link->hostSequence = !session->link->hostSequence;
+
+  // Each part of the response answers the frame before it.
+  do {
+    size_t length = response.size() - responseOffset;
+    uint8_t esePcb = session->link->eseSequence ? IBLOCK_NS_BIT_MASK : 0;
+    if (length > TPDU_MAX_DATA_LENGTH) {
+      length = TPDU_MAX_DATA_LENGTH;
+      esePcb |= IBLOCK_M_BIT_MASK;
+    }
+    session->link->eseSequence = !session->link->eseSequence;
+    if (ScriptedCapture_exchange(session, hostPcb, hostInf, hostLen, esePcb,
+                                 response.data() + responseOffset,
+                                 length) != 0) {
+      return -1;
+    }
+    responseOffset += length;
+    hostPcb = SCRIPTED_RBLOCK_PCB |
+              (session->link->eseSequence ? SCRIPTED_RBLOCK_NR_BIT_MASK : 0);
+    hostInf = NULL;
+    hostLen = 0;
+  } while (responseOffset < response.size());
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function         ScriptedCapture_write
+**
+** Description      Writes the capture of StEse_init() followed by the
+**                  exchanges.
+**
+** Parameters       path      - the capture file.
+**                  link      - the state of the link, updated.
+**                  exchanges - the APDUs and the responses of the eSE.
+**
+** Returns          0 if the capture could be written, -1 otherwise.
+**
+*******************************************************************************/
+int ScriptedCapture_write(const char* path, ScriptedLink* link,
+                          const std::vector<ScriptedExchange>& exchanges) {
+  SpiCaptureFileHeader header;
+  ScriptedSession session;
+  int rc = 0;
+
+  memset(&session, 0, sizeof(session));
+  session.link = link;
+  session.file = fopen(path, "wbe");
+  if (session.file == NULL) {
+    return -1;
+  }
+  header.magic = SPI_CAPTURE_MAGIC;
+  header.version = SPI_CAPTURE_VERSION;
+  header.reserved = 0;
+  if ((fwrite(&header, sizeof(header), 1, session.file) != 1) ||
+      (!link->activated && (ScriptedCapture_writeInit(&session) != 0))) {
+    rc = -1;
+  }
+  for (size_t i = 0; (rc == 0) && (i < exchanges.size()); i++) {
+    rc = ScriptedCapture_writeExchange(&session, exchanges[i]);
+  }
+  if (fclose(session.file) != 0) {
+    rc = -1;
+  }
+  return rc;
+}
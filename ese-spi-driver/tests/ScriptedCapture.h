@@ -0,0 +1,61 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef SCRIPTEDCAPTURE_H_
+#define SCRIPTEDCAPTURE_H_
+
+/*
+ * Writes the SPI capture of a scripted session with an eSE, for the tests
+ * and benchmarks driven by the replay transport (SpiLayerDriverReplay.h):
+ * StEse_init() with the default configuration, then APDU exchanges. The
+ * frames are the ones the stack writes and an eSE answers, with a CRC and
+ * IFSC = IFSD = MAX_IFSD.
+ */
+
+#include <stdint.h>
+#include <vector>
+
+// State of the link between the stack and the scripted eSE. It outlives the
+// captures: the stack only resets the eSE at the first StEse_init() of the
+// process, and keeps the sequence numbers over StEse_close().
+typedef struct {
+  bool activated;    /* the eSE was reset and the IFSD negotiated */
+  bool hostSequence; /* N(S) of the next I-block of the host */
+  bool eseSequence;  /* N(S) of the next I-block of the eSE */
+} ScriptedLink;
+
+typedef struct {
+  std::vector<uint8_t> command;
+  std::vector<uint8_t> response; /* status word included */
+} ScriptedExchange;
+
+/**
+ * Writes the capture of StEse_init() followed by the exchanges.
+ *
+ * @param path The capture file to create (or truncate).
+ * @param link The state of the link before StEse_init(), zeroed for the
+ *        first one of the process. Updated to the state after the
+ *        exchanges.
+ * @param exchanges The APDUs sent and the responses of the eSE, in order.
+ *
+ * @return 0 if the capture could be written, -1 otherwise.
+ */
+int ScriptedCapture_write(const char* path, ScriptedLink* link,
+                          const std::vector<ScriptedExchange>& exchanges);
+
+#endif /* SCRIPTEDCAPTURE_H_ */
@@ -0,0 +1,68 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#include <gtest/gtest.h>
+#include <string.h>
+#include "Iso13239CRC.h"
+#include "Iso7816LRC.h"
+#include "SpiLayerComm.h"
+#include "Tpdu.h"
+
+#define MAX_LRC_DATA_LENGTH 260
+
+// The LRC is computed a word at a time: it must match the bytewise LRC for
+// every length, whatever the alignment of the data.
+TEST(CodecTest, LrcMatchesBytewiseLrc) {
+  uint8_t buffer[sizeof(uint64_t) + MAX_LRC_DATA_LENGTH + 1];
+
+  for (size_t offset = 0; offset < sizeof(uint64_t); offset++) {
+    uint8_t* data = buffer + offset;
+    for (int length = 0; length <= MAX_LRC_DATA_LENGTH; length++) {
+      uint8_t expected = 0;
+      for (int i = 0; i < length; i++) {
+        data[i] = (uint8_t)(i * 37 + length);
+        expected = updateLrc(expected, data[i]);
+      }
+      EXPECT_EQ(expected, computeLrc(data, length))
+          << "length " << length << ", offset " << offset;
+      EXPECT_EQ(expected, data[length]);
+      EXPECT_TRUE(isLrcOk(data, length));
+      data[length] ^= 0x01;
+      EXPECT_FALSE(isLrcOk(data, length));
+    }
+  }
+}
+
+// A formed TPDU carries the EDC of the selected codec.
+TEST(CodecTest, FormTpduAppendsEdc) {
+  uint8_t inf[TPDU_MAX_DATA_LENGTH];
+  Tpdu tpdu;
+
+  for (int i = 0; i < TPDU_MAX_DATA_LENGTH; i++) {
+    inf[i] = (uint8_t)i;
+  }
+  for (int length : {0, 1, 32, TPDU_MAX_DATA_LENGTH}) {
+    Tpdu_setChecksumType(LRC);
+    ASSERT_EQ(0, Tpdu_formTpdu(NAD_HOST_TO_SLAVE, 0x00, length, inf, &tpdu));
+    EXPECT_TRUE(isLrcOk((uint8_t*)&tpdu, TPDU_PROLOGUE_LENGTH + length));
+
+    Tpdu_setChecksumType(CRC);
+    ASSERT_EQ(0, Tpdu_formTpdu(NAD_HOST_TO_SLAVE, 0x00, length, inf, &tpdu));
+    EXPECT_TRUE(isCrcOk((uint8_t*)&tpdu, TPDU_PROLOGUE_LENGTH + length));
+  }
+}
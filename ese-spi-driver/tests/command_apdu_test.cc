@@ -0,0 +1,217 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+// The HALs send the APDUs built here as they are: their bytes must be the
+// ISO 7816-4 encoding, short or extended.
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+#include "CommandApdu.h"
+
+#define CLA_CHANNEL_2 0x02
+
+template <int length>
+static std::vector<uint8_t> bytesOf(const FixedCommandApdu<length>& apdu) {
+  return std::vector<uint8_t>(apdu.bytes, apdu.bytes + length);
+}
+
+TEST(CommandApduTest, ManageChannelOpen) {
+  EXPECT_EQ(std::vector<uint8_t>({0x00, 0x70, 0x00, 0x00, 0x01}),
+            bytesOf(CommandApdu_manageChannelOpen()));
+}
+
+TEST(CommandApduTest, ManageChannelClose) {
+  for (uint8_t channel = 1; channel <= 3; channel++) {
+    EXPECT_EQ(std::vector<uint8_t>({channel, 0x70, 0x80, channel, 0x00}),
+              bytesOf(CommandApdu_manageChannelClose(channel)));
+  }
+}
+
+TEST(CommandApduTest, GetResponseShort) {
+  EXPECT_EQ(std::vector<uint8_t>({CLA_CHANNEL_2, 0xC0, 0x00, 0x00, 0x01}),
+            bytesOf(CommandApdu_getResponse(CLA_CHANNEL_2, 1)));
+  EXPECT_EQ(std::vector<uint8_t>({CLA_CHANNEL_2, 0xC0, 0x00, 0x00, 0xFF}),
+            bytesOf(CommandApdu_getResponse(CLA_CHANNEL_2, 255)));
+  // 256 is encoded as 0
+  EXPECT_EQ(std::vector<uint8_t>({CLA_CHANNEL_2, 0xC0, 0x00, 0x00, 0x00}),
+            bytesOf(CommandApdu_getResponse(CLA_CHANNEL_2,
+                                            MAX_RSP_APDU_DATA_LENGTH)));
+}
+
+TEST(CommandApduTest, GetResponseExtended) {
+  EXPECT_EQ(std::vector<uint8_t>(
+                {CLA_CHANNEL_2, 0xC0, 0x00, 0x00, 0x00, 0x01, 0x01}),
+            bytesOf(CommandApdu_getResponseExtended(CLA_CHANNEL_2, 257)));
+  EXPECT_EQ(std::vector<uint8_t>(
+                {CLA_CHANNEL_2, 0xC0, 0x00, 0x00, 0x00, 0xFF, 0xFF}),
+            bytesOf(CommandApdu_getResponseExtended(CLA_CHANNEL_2, 65535)));
+  // 65536 is encoded as 0
+  EXPECT_EQ(std::vector<uint8_t>(
+                {CLA_CHANNEL_2, 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00}),
+            bytesOf(CommandApdu_getResponseExtended(
+                CLA_CHANNEL_2, MAX_EXT_RSP_APDU_DATA_LENGTH)));
+}
+
+TEST(CommandApduTest, WriteSelect) {
+  const uint8_t aid[] = {0xA0, 0x00, 0x00, 0x01, 0x51, 0x00, 0x00};
+  uint8_t buffer[CMD_APDU_SELECT_MAX_LENGTH];
+
+  ASSERT_EQ((int)(6 + sizeof(aid)),
+            CommandApdu_writeSelect(CLA_CHANNEL_2, 0x0C, aid, sizeof(aid),
+                                    buffer));
+  EXPECT_EQ(std::vector<uint8_t>({CLA_CHANNEL_2, 0xA4, 0x04, 0x0C,
+                                  sizeof(aid), 0xA0, 0x00, 0x00, 0x01, 0x51,
+                                  0x00, 0x00, 0x00}),
+            std::vector<uint8_t>(buffer, buffer + 6 + sizeof(aid)));
+}
+
+// Lc = 0 is not a valid encoding: the default applet is selected without Lc.
+TEST(CommandApduTest, WriteSelectWithoutAid) {
+  uint8_t buffer[CMD_APDU_SELECT_MAX_LENGTH];
+
+  ASSERT_EQ(5, CommandApdu_writeSelect(0x00, 0x00, NULL, 0, buffer));
+  EXPECT_EQ(std::vector<uint8_t>({0x00, 0xA4, 0x04, 0x00, 0x00}),
+            std::vector<uint8_t>(buffer, buffer + 5));
+}
+
+TEST(CommandApduTest, WriteSelectLongestAid) {
+  uint8_t aid[MAX_CMD_APDU_DATA_LENGTH + 1];
+  uint8_t buffer[CMD_APDU_SELECT_MAX_LENGTH];
+
+  memset(aid, 0x5A, sizeof(aid));
+  ASSERT_EQ(CMD_APDU_SELECT_MAX_LENGTH,
+            CommandApdu_writeSelect(0x00, 0x00, aid, MAX_CMD_APDU_DATA_LENGTH,
+                                    buffer));
+  EXPECT_EQ(MAX_CMD_APDU_DATA_LENGTH, buffer[4]);
+  EXPECT_EQ(0, memcmp(aid, buffer + 5, MAX_CMD_APDU_DATA_LENGTH));
+  EXPECT_EQ(0x00, buffer[CMD_APDU_SELECT_MAX_LENGTH - 1]);
+
+  // A SELECT has no extended encoding here.
+  EXPECT_EQ(-1, CommandApdu_writeSelect(0x00, 0x00, aid, sizeof(aid), buffer));
+  EXPECT_EQ(-1, CommandApdu_writeSelect(0x00, 0x00, NULL, 1, buffer));
+}
+
+static std::vector<uint8_t> serialize(const CommandApdu* cmdApdu) {
+  std::vector<uint8_t> bytes(MAX_EXT_CMD_APDU_LENGTH);
+  int size = CommandApdu_toByteArray(cmdApdu, bytes.data());
+  EXPECT_EQ(CommandApdu_getSize(cmdApdu), size);
+  bytes.resize((size > 0) ? size : 0);
+  return bytes;
+}
+
+TEST(CommandApduTest, ToByteArrayShort) {
+  char data[] = {0x01, 0x02, 0x03};
+  CommandApdu cmdApdu;
+
+  // Case 1, no Lc nor Le
+  CommandApdu_formApduType4(0x80, 0x10, 0x01, 0x02, 0, NULL, CMD_APDU_NO_LE,
+                            &cmdApdu);
+  EXPECT_EQ(std::vector<uint8_t>({0x80, 0x10, 0x01, 0x02}),
+            serialize(&cmdApdu));
+
+  // Case 2, 256 is encoded as 0
+  CommandApdu_formApduType2(0x80, 0x10, 0x01, 0x02, MAX_RSP_APDU_DATA_LENGTH,
+                            &cmdApdu);
+  EXPECT_FALSE(CommandApdu_isExtended(&cmdApdu));
+  EXPECT_EQ(std::vector<uint8_t>({0x80, 0x10, 0x01, 0x02, 0x00}),
+            serialize(&cmdApdu));
+
+  // Case 3
+  CommandApdu_formApduType4(0x80, 0x10, 0x01, 0x02, sizeof(data), data,
+                            CMD_APDU_NO_LE, &cmdApdu);
+  EXPECT_EQ(std::vector<uint8_t>({0x80, 0x10, 0x01, 0x02, 0x03, 0x01, 0x02,
+                                  0x03}),
+            serialize(&cmdApdu));
+
+  // Case 4
+  CommandApdu_formApduType4(0x80, 0x10, 0x01, 0x02, sizeof(data), data, 0x10,
+                            &cmdApdu);
+  EXPECT_FALSE(CommandApdu_isExtended(&cmdApdu));
+  EXPECT_EQ(std::vector<uint8_t>({0x80, 0x10, 0x01, 0x02, 0x03, 0x01, 0x02,
+                                  0x03, 0x10}),
+            serialize(&cmdApdu));
+}
+
+TEST(CommandApduTest, ToByteArrayExtendedLcOnly) {
+  char data[MAX_CMD_APDU_DATA_LENGTH + 1];
+  CommandApdu cmdApdu;
+
+  memset(data, 0x5A, sizeof(data));
+  CommandApdu_formApduType4(0x80, 0x10, 0x01, 0x02, sizeof(data), data,
+                            CMD_APDU_NO_LE, &cmdApdu);
+  EXPECT_TRUE(CommandApdu_isExtended(&cmdApdu));
+
+  std::vector<uint8_t> bytes = serialize(&cmdApdu);
+  ASSERT_EQ(4 + 3 + sizeof(data), bytes.size());
+  EXPECT_EQ(std::vector<uint8_t>({0x00, 0x01, 0x00}),
+            std::vector<uint8_t>(bytes.begin() + 4, bytes.begin() + 7));
+  EXPECT_EQ(0, memcmp(data, bytes.data() + 7, sizeof(data)));
+}
+
+TEST(CommandApduTest, ToByteArrayExtendedLeOnly) {
+  CommandApdu cmdApdu;
+
+  CommandApdu_formApduType2(0x80, 0x10, 0x01, 0x02,
+                            MAX_RSP_APDU_DATA_LENGTH + 1, &cmdApdu);
+  EXPECT_TRUE(CommandApdu_isExtended(&cmdApdu));
+  // Without Lc, the extended Le takes 3 bytes
+  EXPECT_EQ(std::vector<uint8_t>({0x80, 0x10, 0x01, 0x02, 0x00, 0x01, 0x01}),
+            serialize(&cmdApdu));
+}
+
+TEST(CommandApduTest, ToByteArrayExtendedLcAndLe) {
+  char data[] = {0x01, 0x02, 0x03};
+  CommandApdu cmdApdu;
+
+  // The Le alone makes the Lc extended too
+  CommandApdu_formApduType4(0x80, 0x10, 0x01, 0x02, sizeof(data), data, 0x1234,
+                            &cmdApdu);
+  EXPECT_TRUE(CommandApdu_isExtended(&cmdApdu));
+  EXPECT_EQ(std::vector<uint8_t>({0x80, 0x10, 0x01, 0x02, 0x00, 0x00, 0x03,
+                                  0x01, 0x02, 0x03, 0x12, 0x34}),
+            serialize(&cmdApdu));
+}
+
+TEST(CommandApduTest, ToByteArrayLongestLeAndLc) {
+  std::vector<char> data(MAX_EXT_CMD_APDU_DATA_LENGTH);
+  CommandApdu cmdApdu;
+
+  // 65536 is encoded as 0
+  CommandApdu_formApduType2(0x80, 0x10, 0x01, 0x02,
+                            MAX_EXT_RSP_APDU_DATA_LENGTH, &cmdApdu);
+  EXPECT_EQ(std::vector<uint8_t>({0x80, 0x10, 0x01, 0x02, 0x00, 0x00, 0x00}),
+            serialize(&cmdApdu));
+
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = (char)i;
+  }
+  CommandApdu_formApduType4(0x80, 0x10, 0x01, 0x02,
+                            MAX_EXT_CMD_APDU_DATA_LENGTH, data.data(),
+                            MAX_EXT_RSP_APDU_DATA_LENGTH, &cmdApdu);
+  std::vector<uint8_t> bytes = serialize(&cmdApdu);
+  ASSERT_EQ((size_t)MAX_EXT_CMD_APDU_LENGTH, bytes.size());
+  EXPECT_EQ(std::vector<uint8_t>({0x00, 0xFF, 0xFF}),
+            std::vector<uint8_t>(bytes.begin() + 4, bytes.begin() + 7));
+  EXPECT_EQ(0, memcmp(data.data(), bytes.data() + 7, data.size()));
+  EXPECT_EQ(std::vector<uint8_t>({0x00, 0x00}),
+            std::vector<uint8_t>(bytes.end() - 2, bytes.end()));
+
+  // Beyond 65536, there is no encoding
+  cmdApdu.le = MAX_EXT_RSP_APDU_DATA_LENGTH + 1;
+  EXPECT_EQ(-1, CommandApdu_toByteArray(&cmdApdu, bytes.data()));
+}
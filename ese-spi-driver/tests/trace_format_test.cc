@@ -0,0 +1,67 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+// The trace dumps format the bytes with lookup tables: their output must
+// stay the one of the sprintf() they replaced, for every byte value.
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <string>
+#include "Utils.h"
+#include "android_logmsg.h"
+
+#define BYTE_VALUES 256
+#define DUMP_BYTES_PER_LINE 32
+
+TEST(TraceFormatTest, HexStringMatchesSprintf) {
+  char bytes[BYTE_VALUES];
+  char hexString[BYTE_VALUES * 3 + 1];
+  char expected[BYTE_VALUES * 3 + 1];
+
+  for (int i = 0; i < BYTE_VALUES; i++) {
+    bytes[i] = (char)i;
+    // Bytes from 0x80 are negative chars: no sign extension expected.
+    sprintf(&expected[i * 3], "%02X ", (uint8_t)i);
+  }
+  ASSERT_EQ(0, Utils_charArrayToHexString(bytes, BYTE_VALUES, hexString));
+  EXPECT_STREQ(expected, hexString);
+}
+
+TEST(TraceFormatTest, DumpMatchesSprintf) {
+  uint8_t bytes[BYTE_VALUES];
+  unsigned char level = hal_trace_level;
+
+  for (int i = 0; i < BYTE_VALUES; i++) {
+    bytes[i] = (uint8_t)i;
+  }
+  hal_trace_level = STESE_TRACE_LEVEL_DEBUG;
+  testing::internal::CaptureStderr();
+  DispHal("Rx", bytes, BYTE_VALUES);
+  std::string output = testing::internal::GetCapturedStderr();
+  hal_trace_level = level;
+
+  for (int line = 0; line < BYTE_VALUES / DUMP_BYTES_PER_LINE; line++) {
+    std::string expected = (line == 0) ? "spiRx " : "";
+    for (int i = 0; i < DUMP_BYTES_PER_LINE; i++) {
+      char hex[4];
+      sprintf(hex, "%02x ", bytes[line * DUMP_BYTES_PER_LINE + i]);
+      expected += hex;
+    }
+    EXPECT_NE(std::string::npos, output.find(expected + "\n"))
+        << "line " << line;
+  }
+}
@@ -0,0 +1,156 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+// Whole transceives, from StEse_Transceive() down to the replay transport:
+// the eSE is a scripted capture, and the frames the stack writes must be
+// the ones of the capture.
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "CommandApdu.h"
+#include "SpiLayerDriverReplay.h"
+#include "StEseApi.h"
+#include "tests/ScriptedCapture.h"
+
+class TransceiveTest : public testing::Test {
+ protected:
+  void TearDown() override { StEse_close(); }
+
+  // Starts the stack on a capture of the exchanges.
+  void init(const std::vector<ScriptedExchange>& exchanges) {
+    std::string path = testing::TempDir() + "transceive_test.cap";
+    ASSERT_EQ(0, ScriptedCapture_write(path.c_str(), &link, exchanges));
+    ASSERT_EQ(0, SpiLayerDriverReplay_load(path.c_str(), false));
+    ASSERT_EQ(ESESTATUS_SUCCESS, StEse_init());
+  }
+
+  // Sends an APDU, and checks the response is the one of the capture.
+  void transceive(const ScriptedExchange& exchange) {
+    StEse_data cmd;
+    StEse_data rsp;
+    std::vector<uint8_t> command = exchange.command;
+
+    cmd.len = command.size();
+    cmd.p_data = command.data();
+    rsp.len = 0;
+    rsp.p_data = NULL;
+    ASSERT_EQ(ESESTATUS_SUCCESS, StEse_Transceive(&cmd, &rsp));
+    EXPECT_EQ(exchange.response,
+              std::vector<uint8_t>(rsp.p_data, rsp.p_data + rsp.len));
+    free(rsp.p_data);
+  }
+
+  // Shared by the tests: the stack keeps the link over StEse_close().
+  static ScriptedLink link;
+};
+
+ScriptedLink TransceiveTest::link;
+
+TEST_F(TransceiveTest, ShortApdu) {
+  ScriptedExchange select = {
+      {0x00, 0xA4, 0x04, 0x00, 0x02, 0xA0, 0x00, 0x00},
+      {0x6F, 0x00, 0x90, 0x00}};
+  ScriptedExchange getData = {{0x80, 0xCA, 0x00, 0x00, 0x00},
+                              std::vector<uint8_t>(256 + 2, 0x5A)};
+
+  init({select, getData});
+  transceive(select);
+  transceive(getData);
+  EXPECT_EQ(0u, SpiLayerDriverReplay_getDivergences());
+}
+
+// The longest extended APDU, Lc = 65535, and the longest response,
+// Le = 65536: both are chained over 259 I-blocks.
+TEST_F(TransceiveTest, ExtendedApdu64K) {
+  std::vector<char> data(MAX_EXT_CMD_APDU_DATA_LENGTH);
+  CommandApdu cmdApdu;
+  ScriptedExchange exchange;
+
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = (char)i;
+  }
+  ASSERT_EQ(MAX_EXT_CMD_APDU_LENGTH,
+            CommandApdu_formApduType4(0x80, 0x10, 0x00, 0x00,
+                                      MAX_EXT_CMD_APDU_DATA_LENGTH,
+                                      data.data(),
+                                      MAX_EXT_RSP_APDU_DATA_LENGTH, &cmdApdu));
+  exchange.command.resize(MAX_EXT_CMD_APDU_LENGTH);
+  CommandApdu_toByteArray(&cmdApdu, exchange.command.data());
+  for (int i = 0; i < MAX_EXT_RSP_APDU_DATA_LENGTH; i++) {
+    exchange.response.push_back((uint8_t)(i * 7));
+  }
+  exchange.response.push_back(0x90);
+  exchange.response.push_back(0x00);
+
+  init({exchange});
+  transceive(exchange);
+  EXPECT_EQ(0u, SpiLayerDriverReplay_getDivergences());
+}
+
+// A corrupted response is sent again by the eSE: the replay answers the
+// R-blocks of the recovery, which the capture does not hold.
+TEST_F(TransceiveTest, RecoversFromCrcErrors) {
+  ScriptedExchange getData = {{0x80, 0xCA, 0x00, 0x00, 0x00},
+                              std::vector<uint8_t>(32 + 2, 0x5A)};
+  StEse_faultRates rates = {};
+  StEse_busCounters counters;
+
+  init(std::vector<ScriptedExchange>(20, getData));
+  rates.crcError = 200;
+  ASSERT_EQ(ESESTATUS_SUCCESS, StEse_setFaultInjection(&rates, 1));
+  StEse_getBusCounters(&counters, true);
+  for (int i = 0; i < 20; i++) {
+    transceive(getData);
+  }
+  rates.crcError = 0;
+  StEse_setFaultInjection(&rates, 1);
+
+  StEse_getBusCounters(&counters, true);
+  EXPECT_LT(0u, counters.recoveries);
+  EXPECT_EQ(0u, counters.recoveriesFailed);
+}
+
+// A cancel only aborts the APDU of its own token: a cancelled APDU is never
+// sent, the other ones are exchanged.
+TEST_F(TransceiveTest, CancelIsScopedToItsToken) {
+  ScriptedExchange select = {
+      {0x00, 0xA4, 0x04, 0x00, 0x02, 0xA0, 0x00, 0x00},
+      {0x6F, 0x00, 0x90, 0x00}};
+  StEse_cancelToken mine = {};
+  StEse_cancelToken other = {};
+  std::vector<uint8_t> command = select.command;
+  StEse_data cmd;
+  StEse_data rsp;
+
+  init({select});
+  ASSERT_EQ(ESESTATUS_INVALID_PARAMETER, StEse_Cancel(NULL));
+  ASSERT_EQ(ESESTATUS_SUCCESS, StEse_Cancel(&other));
+
+  cmd.len = command.size();
+  cmd.p_data = command.data();
+  rsp.len = 0;
+  rsp.p_data = NULL;
+  ASSERT_EQ(ESESTATUS_ABORTED,
+            StEse_TransceiveCancellable(&cmd, &rsp, &other));
+  ASSERT_EQ(ESESTATUS_SUCCESS, StEse_TransceiveCancellable(&cmd, &rsp, &mine));
+  EXPECT_EQ(select.response,
+            std::vector<uint8_t>(rsp.p_data, rsp.p_data + rsp.len));
+  free(rsp.p_data);
+  EXPECT_EQ(0u, SpiLayerDriverReplay_getDivergences());
+}
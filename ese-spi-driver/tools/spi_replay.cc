@@ -0,0 +1,111 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+
+// Host tool replaying a SPI capture (see ST_ESE_SPI_CAPTURE_FILE) through the
+// whole stack, from StEse_Transceive down to the replay transport. The APDUs
+// of the capture are sent again and the latency and CPU time of each one are
+// printed, so that builds of the T=1 engine can be compared without an eSE.
+//
+// Usage: ese_st_spi_replay <capture file> [--timed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "SpiLayerDriverReplay.h"
+#include "StEseApi.h"
+
+/*******************************************************************************
+**
+** Function         getTimeUs
+**
+** Description      Gets the time of a clock.
+**
+** Parameters       clock - CLOCK_MONOTONIC or CLOCK_PROCESS_CPUTIME_ID.
+**
+** Returns          The time in us.
+**
+*******************************************************************************/
+static uint64_t getTimeUs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::vector<uint8_t>> apdus;
+  bool timed = false;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <capture file> [--timed]\n", argv[0]);
+    return 1;
+  }
+  if ((argc > 2) && (strcmp(argv[2], "--timed") == 0)) {
+    timed = true;
+  }
+
+  if (SpiLayerDriverReplay_load(argv[1], timed) != 0) {
+    fprintf(stderr, "%s: cannot load the capture\n", argv[1]);
+    return 1;
+  }
+  SpiLayerDriverReplay_getApdus(&apdus);
+
+  uint64_t startUs = getTimeUs(CLOCK_MONOTONIC);
+  uint64_t startCpuUs = getTimeUs(CLOCK_PROCESS_CPUTIME_ID);
+  if (StEse_init() != ESESTATUS_SUCCESS) {
+    fprintf(stderr, "StEse_init failed\n");
+    return 1;
+  }
+  printf("init: %llu us, cpu %llu us\n",
+         (unsigned long long)(getTimeUs(CLOCK_MONOTONIC) - startUs),
+         (unsigned long long)(getTimeUs(CLOCK_PROCESS_CPUTIME_ID) -
+                              startCpuUs));
+
+  printf("%6s %6s %6s %8s %12s %10s\n", "apdu", "cmd", "rsp", "status",
+         "latency(us)", "cpu(us)");
+  uint64_t totalUs = 0;
+  uint64_t totalCpuUs = 0;
+  for (size_t i = 0; i < apdus.size(); i++) {
+    StEse_data cmd;
+    StEse_data rsp;
+
+    cmd.len = apdus[i].size();
+    cmd.p_data = apdus[i].data();
+    memset(&rsp, 0, sizeof(rsp));
+
+    startUs = getTimeUs(CLOCK_MONOTONIC);
+    startCpuUs = getTimeUs(CLOCK_PROCESS_CPUTIME_ID);
+    ESESTATUS status = StEse_Transceive(&cmd, &rsp);
+    uint64_t latencyUs = getTimeUs(CLOCK_MONOTONIC) - startUs;
+    uint64_t cpuUs = getTimeUs(CLOCK_PROCESS_CPUTIME_ID) - startCpuUs;
+    totalUs += latencyUs;
+    totalCpuUs += cpuUs;
+
+    printf("%6zu %6u %6u %8d %12llu %10llu\n", i, cmd.len, rsp.len, status,
+           (unsigned long long)latencyUs, (unsigned long long)cpuUs);
+    free(rsp.p_data);
+  }
+  StEse_close();
+
+  printf("%zu APDUs: latency %llu us, cpu %llu us, %u divergences\n",
+         apdus.size(), (unsigned long long)totalUs,
+         (unsigned long long)totalCpuUs, SpiLayerDriverReplay_getDivergences());
+  return (SpiLayerDriverReplay_getDivergences() == 0) ? 0 : 2;
+}
@@ -0,0 +1,185 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+
+// Host tool decoding the TPDU trace dumped by StEse_dumpTrace (or on error,
+// see ST_ESE_TRACE_FILE), one line per frame, with the gap since the previous
+// frame to spot the stalls.
+//
+// Usage: ese_st_tpdu_trace_decoder <trace file> [gap threshold in us]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "BusCounters.h"
+#include "TpduTrace.h"
+
+// Same order as T1TProtocol_TransceiveState
+static const char* stateNames[] = {
+    "Idle",          "I_block",       "R_ACK",
+    "R_CRC_Error",   "R_Other_Error", "S_Resync_REQ",
+    "S_Resync_RES",  "S_IFS_REQ",     "S_IFS_RES",
+    "S_WTX_RES",     "S_SWReset_REQ", "S_Abort_RES"};
+
+static const char* sBlockNames[] = {"RESYNCH", "IFS", "ABORT", "WTX"};
+
+/*******************************************************************************
+**
+** Function         decodePcb
+**
+** Description      Describes the block type carried by a PCB.
+**
+** Parameters       pcb    - the PCB.
+**                  buffer - where to write the description.
+**                  size   - size of buffer.
+**
+** Returns          void
+**
+*******************************************************************************/
+static void decodePcb(uint8_t pcb, char* buffer, size_t size) {
+  if ((pcb & 0x80) == 0x00) {
+    snprintf(buffer, size, "I(%d,%d)", (pcb >> 6) & 0x01, (pcb >> 5) & 0x01);
+  } else if ((pcb & 0xC0) == 0x80) {
+    const char* error = "";
+    if ((pcb & 0x03) == 0x01) {
+      error = " EDC error";
+    } else if ((pcb & 0x03) == 0x02) {
+      error = " other error";
+    }
+    snprintf(buffer, size, "R(%d)%s", (pcb >> 4) & 0x01, error);
+  } else if ((pcb & 0x0F) == 0x0F) {
+    snprintf(buffer, size, "S(SWReset %s)", (pcb & 0x20) ? "resp" : "req");
+  } else if ((pcb & 0x0F) < 4) {
+    snprintf(buffer, size, "S(%s %s)", sBlockNames[pcb & 0x0F],
+             (pcb & 0x20) ? "resp" : "req");
+  } else {
+    snprintf(buffer, size, "S(0x%02X)", pcb);
+  }
+}
+
+int main(int argc, char** argv) {
+  TpduTraceFileHeader header;
+  TpduTraceRecord record;
+  uint64_t gapThresholdUs = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <trace file> [gap threshold in us]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2) {
+    gapThresholdUs = strtoull(argv[2], NULL, 0);
+  }
+
+  FILE* file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  if ((fread(&header, sizeof(header), 1, file) != 1) ||
+      (header.magic != TPDU_TRACE_MAGIC)) {
+    fprintf(stderr, "%s: not a TPDU trace\n", argv[1]);
+    fclose(file);
+    return 1;
+  }
+  if ((header.version > TPDU_TRACE_VERSION) ||
+      (header.recordSize != sizeof(TpduTraceRecord))) {
+    fprintf(stderr, "%s: unsupported trace version %u (record size %u)\n",
+            argv[1], header.version, header.recordSize);
+    fclose(file);
+    return 1;
+  }
+
+  printf("%u frames\n", header.recordCount);
+  printf("%8s %12s %10s %3s %-14s %4s %4s %4s %-22s %s\n", "seq", "time(us)",
+         "gap(us)", "dir", "state", "nad", "pcb", "len", "block", "inf");
+
+  uint64_t firstNs = 0;
+  uint64_t previousNs = 0;
+  uint64_t maxGapUs = 0;
+  uint64_t totalGapUs = 0;
+  uint32_t maxGapSeq = 0;
+  uint32_t count = 0;
+
+  while ((count < header.recordCount) &&
+         (fread(&record, sizeof(record), 1, file) == 1)) {
+    uint64_t gapUs = 0;
+    char block[32];
+    const char* state = "?";
+
+    if (count == 0) {
+      firstNs = record.timestampNs;
+    } else {
+      gapUs = (record.timestampNs - previousNs) / 1000;
+      totalGapUs += gapUs;
+      if (gapUs > maxGapUs) {
+        maxGapUs = gapUs;
+        maxGapSeq = record.seq;
+      }
+    }
+    previousNs = record.timestampNs;
+
+    if (record.state < sizeof(stateNames) / sizeof(stateNames[0])) {
+      state = stateNames[record.state];
+    }
+    decodePcb(record.pcb, block, sizeof(block));
+
+    printf("%8u %12llu %10llu %3s %-14s 0x%02X 0x%02X %4u %-22s", record.seq,
+           (unsigned long long)((record.timestampNs - firstNs) / 1000),
+           (unsigned long long)gapUs,
+           (record.direction == TPDU_TRACE_TX) ? "Tx" : "Rx", state,
+           record.nad, record.pcb, record.len, block);
+    for (int i = 0; i < record.payloadLength; i++) {
+      printf("%02X", record.payload[i]);
+    }
+    if (record.payloadLength < record.len) {
+      printf("...");
+    }
+    if ((gapThresholdUs != 0) && (gapUs >= gapThresholdUs)) {
+      printf("  <-- gap");
+    }
+    printf("\n");
+    count++;
+  }
+
+  if (count != header.recordCount) {
+    fprintf(stderr, "%s: truncated, %u of %u frames read\n", argv[1], count,
+            header.recordCount);
+  }
+  if (count > 1) {
+    printf("max gap %llu us before frame %u, average gap %llu us\n",
+           (unsigned long long)maxGapUs, maxGapSeq,
+           (unsigned long long)(totalGapUs / (count - 1)));
+  }
+
+  // Bus counters, since version 2. Counters unknown to this tool are shown
+  // by index.
+  uint64_t value;
+  for (uint32_t i = 0; (header.version >= 2) && (i < header.counterCount) &&
+                       (fread(&value, sizeof(value), 1, file) == 1);
+       i++) {
+    if (i < BUS_COUNTER_COUNT) {
+      printf("%-20s %llu\n", BusCounters_getName(i),
+             (unsigned long long)value);
+    } else {
+      printf("counter %-12u %llu\n", i, (unsigned long long)value);
+    }
+  }
+  fclose(file);
+  return 0;
+}
@@ -19,11 +19,12 @@
 #define LOG_TAG "Atp"
 #include "Atp.h"
 #include "Iso13239CRC.h"
+#include "Tpdu.h"
 #include "android_logmsg.h"
 
 Atp ATP = {.bwt = 0x0690, .checksumType = CRC, .ifsc = 0xFE};
 
-uint8_t gATP[ATP_MAX_ALLOWED_LENGTH];
+uint8_t gATP[LEN_LENGTH_IN_ATP + ATP_MAX_ALLOWED_LENGTH];
 //************************************ Functions *******************************
 
 /*******************************************************************************
@@ -64,7 +65,7 @@ int Atp_setAtp(uint8_t *baAtp) {
   if (tmpAtp.len > ATP_MAX_ALLOWED_LENGTH) {
     return -1;
   }
-  memcpy(gATP, baAtp, tmpAtp.len);
+  memcpy(gATP, baAtp, LEN_LENGTH_IN_ATP + tmpAtp.len);
   tmpAtp.checksum = Atp_getChecksumValue(baAtp, CHECKSUM_OFFSET_IN_ATP);
 
   // Check CRC
@@ -123,6 +124,7 @@ int Atp_setAtp(uint8_t *baAtp) {
 
   // Set the actual ATP and return with no error.
   ATP = tmpAtp;
+  Tpdu_setChecksumType(ATP.checksumType);
   return 0;
 }
 
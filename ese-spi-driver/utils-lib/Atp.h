@@ -91,7 +91,7 @@ int Atp_setAtp(uint8_t *baAtp);
  * Gets the ATP stored
  *
  *
- * @return pointer to the ATP array.
+ * @return pointer to the ATP array, length byte included.
  */
 uint8_t *Atp_getAtp();
 
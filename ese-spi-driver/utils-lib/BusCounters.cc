@@ -0,0 +1,115 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#include "BusCounters.h"
+
+#include <atomic>
+
+static std::atomic<uint64_t> counters[BUS_COUNTER_COUNT];
+
+static const char* counterNames[BUS_COUNTER_COUNT] = {
+    "polls",
+    "wasted-reads",
+    "read-retries",
+    "write-retries",
+    "mode-switch-waits",
+    "mode-switch-wait-us",
+    "bytes-read",
+    "bytes-written",
+    "payload-read",
+    "payload-written",
+    "faults-crc",
+    "faults-dropped-nad",
+    "faults-truncated",
+    "faults-spurious-wtx",
+    "faults-timeout",
+    "recoveries",
+    "recoveries-failed",
+    "recovery-resends",
+    "recovery-resyncs",
+    "recovery-swresets",
+    "liveness-probes",
+    "liveness-cached",
+    "clock-steps-down",
+    "clock-steps-up"};
+
+/*******************************************************************************
+**
+** Function        BusCounters_add
+**
+** Description     Adds to a counter.
+**
+** Parameters      counter - the counter.
+**                 value   - the value to add.
+**
+** Returns         void
+**
+*******************************************************************************/
+void BusCounters_add(BusCounter counter, uint64_t value) {
+  counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+/*******************************************************************************
+**
+** Function        BusCounters_get
+**
+** Description     Reads all the counters.
+**
+** Parameters      values - array of BUS_COUNTER_COUNT elements.
+**
+** Returns         void
+**
+*******************************************************************************/
+void BusCounters_get(uint64_t* values) {
+  for (int i = 0; i < BUS_COUNTER_COUNT; i++) {
+    values[i] = counters[i].load(std::memory_order_relaxed);
+  }
+}
+
+/*******************************************************************************
+**
+** Function        BusCounters_reset
+**
+** Description     Clears all the counters.
+**
+** Returns         void
+**
+*******************************************************************************/
+void BusCounters_reset() {
+  for (int i = 0; i < BUS_COUNTER_COUNT; i++) {
+    counters[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+/*******************************************************************************
+**
+** Function        BusCounters_getName
+**
+** Description     Gets the name of a counter.
+**
+** Parameters      counter - the counter.
+**
+** Returns         Its name, "unknown" if it is out of range.
+**
+*******************************************************************************/
+const char* BusCounters_getName(unsigned int counter) {
+  if (counter >= BUS_COUNTER_COUNT) {
+    return "unknown";
+  }
+  return counterNames[counter];
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+
+#ifndef BUSCOUNTERS_H_
+#define BUSCOUNTERS_H_
+
+//*********************************** Includes *********************************
+
+#include <stdint.h>
+
+//************************************ Structs *********************************
+// The order is also the one of the counters in the TPDU trace dump: only
+// append new counters.
+typedef enum {
+  BUS_COUNTER_POLLS = 0,           /* reads done while polling for the NAD */
+  BUS_COUNTER_WASTED_READS,        /* polling reads that returned no NAD */
+  BUS_COUNTER_READ_RETRIES,        /* failed reads retried */
+  BUS_COUNTER_WRITE_RETRIES,       /* failed writes retried */
+  BUS_COUNTER_MODE_SWITCH_WAITS,   /* guard time waits before a TX/RX switch */
+  BUS_COUNTER_MODE_SWITCH_WAIT_US, /* time spent in these waits */
+  BUS_COUNTER_BYTES_READ,          /* bytes clocked in */
+  BUS_COUNTER_BYTES_WRITTEN,       /* bytes clocked out */
+  BUS_COUNTER_PAYLOAD_READ,        /* INF bytes of the I-blocks received */
+  BUS_COUNTER_PAYLOAD_WRITTEN,     /* INF bytes of the I-blocks sent */
+  BUS_COUNTER_FAULTS_CRC,          /* injected: corrupted INF or EDC */
+  BUS_COUNTER_FAULTS_DROPPED_NAD,  /* injected: NAD read as idle */
+  BUS_COUNTER_FAULTS_TRUNCATED,    /* injected: LEN shortened */
+  BUS_COUNTER_FAULTS_SPURIOUS_WTX, /* injected: S(WTX) never sent */
+  BUS_COUNTER_FAULTS_TIMEOUT,      /* injected: response after the BWT */
+  BUS_COUNTER_RECOVERIES,          /* recoveries started */
+  BUS_COUNTER_RECOVERIES_FAILED,   /* recoveries that ended in an error */
+  BUS_COUNTER_RECOVERY_RESENDS,    /* R(NAK) sent by the recovery */
+  BUS_COUNTER_RECOVERY_RESYNCS,    /* S(RESYNCH) sent by the recovery */
+  BUS_COUNTER_RECOVERY_SWRESETS,   /* S(SWReset) sent by the recovery */
+  BUS_COUNTER_LIVENESS_PROBES,     /* S(IFS) sent to check the eSE answers */
+  BUS_COUNTER_LIVENESS_CACHED,     /* liveness answered without probing */
+  BUS_COUNTER_CLOCK_STEPS_DOWN,    /* SPI clock lowered after CRC errors */
+  BUS_COUNTER_CLOCK_STEPS_UP,      /* SPI clock raised after clean traffic */
+  BUS_COUNTER_COUNT,
+} BusCounter;
+
+//************************************ Functions *******************************
+
+/**
+ * Adds to a counter. Lock-free, can be called from any thread.
+ *
+ * @param counter The counter.
+ * @param value The value to add.
+ */
+void BusCounters_add(BusCounter counter, uint64_t value);
+
+/**
+ * Reads all the counters.
+ *
+ * @param values Array of BUS_COUNTER_COUNT elements where to store them.
+ */
+void BusCounters_get(uint64_t* values);
+
+/**
+ * Clears all the counters.
+ */
+void BusCounters_reset();
+
+/**
+ * Gets the name of a counter, for the dumps.
+ *
+ * @param counter The counter.
+ *
+ * @return Its name, "unknown" if it is out of range.
+ */
+const char* BusCounters_getName(unsigned int counter);
+
+#endif /* BUSCOUNTERS_H_ */
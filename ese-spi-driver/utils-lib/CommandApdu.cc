@@ -28,28 +28,44 @@
 ** Parameters      cmdApdu          - input APDU struct.
 **                 commandApduArray - output array bytes.
 **
-** Returns         CommandApduArray size.
+** Returns         CommandApduArray size, -1 if error.
 **
 *******************************************************************************/
-int CommandApdu_toByteArray(CommandApdu cmdApdu, char* commandApduArray) {
+int CommandApdu_toByteArray(const CommandApdu* cmdApdu,
+                            uint8_t* commandApduArray) {
   int commandApduArraySize = CommandApdu_getSize(cmdApdu);
+  bool extended = CommandApdu_isExtended(cmdApdu);
+  int offset = 4;
 
-  if (cmdApdu.lc > MAX_CMD_APDU_DATA_LENGTH) {
+  if ((cmdApdu->le > MAX_EXT_RSP_APDU_DATA_LENGTH) ||
+      (cmdApdu->le < CMD_APDU_NO_LE)) {
     return -1;
   }
 
-  commandApduArray[0] = cmdApdu.cla;
-  commandApduArray[1] = cmdApdu.ins;
-  commandApduArray[2] = cmdApdu.p1;
-  commandApduArray[3] = cmdApdu.p2;
+  commandApduArray[0] = cmdApdu->cla;
+  commandApduArray[1] = cmdApdu->ins;
+  commandApduArray[2] = cmdApdu->p1;
+  commandApduArray[3] = cmdApdu->p2;
 
-  if (cmdApdu.lc > 0) {
-    commandApduArray[4] = cmdApdu.lc;
-    memcpy(commandApduArray + 5, cmdApdu.data, cmdApdu.lc);
+  if (cmdApdu->lc > 0) {
+    if (extended) {
+      commandApduArray[offset++] = 0x00;
+      commandApduArray[offset++] = (uint8_t)(cmdApdu->lc >> 8);
+    }
+    commandApduArray[offset++] = (uint8_t)cmdApdu->lc;
+    memcpy(commandApduArray + offset, cmdApdu->data, cmdApdu->lc);
+    offset += cmdApdu->lc;
   }
 
-  if (cmdApdu.le >= 0) {
-    commandApduArray[commandApduArraySize - 1] = cmdApdu.le;
+  if (cmdApdu->le != CMD_APDU_NO_LE) {
+    // The maximum length is encoded as 0 (256 short, 65536 extended)
+    if (extended) {
+      if (cmdApdu->lc == 0) {
+        commandApduArray[offset++] = 0x00;
+      }
+      commandApduArray[offset++] = (uint8_t)(cmdApdu->le >> 8);
+    }
+    commandApduArray[offset++] = (uint8_t)cmdApdu->le;
   }
 
   return commandApduArraySize;
@@ -66,22 +82,44 @@ int CommandApdu_toByteArray(CommandApdu cmdApdu, char* commandApduArray) {
 ** Returns         cmdApdu size.
 **
 *******************************************************************************/
-int CommandApdu_getSize(CommandApdu cmdApdu) {
+int CommandApdu_getSize(const CommandApdu* cmdApdu) {
   // There will be always cla+ins+p1+p2
   int size = 4;
+  bool extended = CommandApdu_isExtended(cmdApdu);
 
-  if (cmdApdu.lc > 0) {
+  if (cmdApdu->lc > 0) {
     // Size of lc + data
-    size += 1 + cmdApdu.lc;
+    size += (extended ? 3 : 1) + cmdApdu->lc;
   }
 
-  if (cmdApdu.le >= 0) {
-    size++;
+  if (cmdApdu->le != CMD_APDU_NO_LE) {
+    // An extended Le takes 3 bytes when there is no Lc, 2 otherwise
+    if (extended) {
+      size += (cmdApdu->lc > 0) ? 2 : 3;
+    } else {
+      size++;
+    }
   }
 
   return size;
 }
 
+/*******************************************************************************
+**
+** Function        CommandApdu_isExtended
+**
+** Description     Tells if the APDU needs the extended length encoding.
+**
+** Parameters      cmdApdu          - input APDU struct.
+**
+** Returns         true if lc or le do not fit in the short encoding.
+**
+*******************************************************************************/
+bool CommandApdu_isExtended(const CommandApdu* cmdApdu) {
+  return (cmdApdu->lc > MAX_CMD_APDU_DATA_LENGTH) ||
+         (cmdApdu->le > MAX_RSP_APDU_DATA_LENGTH);
+}
+
 /*******************************************************************************
 **
 ** Function        CommandApdu_formApduType4
@@ -90,12 +128,14 @@ int CommandApdu_getSize(CommandApdu cmdApdu) {
 **
 ** Parameters
 **
-** Returns         -1 if error 0 if ok
+** Returns         -1 if error, the size of the APDU otherwise
 **
 *******************************************************************************/
-int CommandApdu_formApduType4(char cla, char ins, char p1, char p2, char lc,
-                              char* cmdData, char le, CommandApdu* cmdApdu) {
-  if (lc > MAX_CMD_APDU_DATA_LENGTH) {
+int CommandApdu_formApduType4(char cla, char ins, char p1, char p2,
+                              uint16_t lc, char* cmdData, int32_t le,
+                              CommandApdu* cmdApdu) {
+  if ((le > MAX_EXT_RSP_APDU_DATA_LENGTH) || (le < CMD_APDU_NO_LE) ||
+      ((lc > 0) && (cmdData == NULL))) {
     return -1;
   }
 
@@ -104,12 +144,10 @@ int CommandApdu_formApduType4(char cla, char ins, char p1, char p2, char lc,
   cmdApdu->p1 = p1;
   cmdApdu->p2 = p2;
   cmdApdu->lc = lc;
-  if (lc > 0) {
-    memcpy(cmdApdu->data, cmdData, lc);
-  }
+  cmdApdu->data = cmdData;
   cmdApdu->le = le;
 
-  return CommandApdu_getSize(*cmdApdu);
+  return CommandApdu_getSize(cmdApdu);
 }
 
 /*******************************************************************************
@@ -120,17 +158,61 @@ int CommandApdu_formApduType4(char cla, char ins, char p1, char p2, char lc,
 **
 ** Parameters
 **
-** Returns         -1 if error 0 if ok
+** Returns         -1 if error, the size of the APDU otherwise
 **
 *******************************************************************************/
-int CommandApdu_formApduType2(char cla, char ins, char p1, char p2, char le,
+int CommandApdu_formApduType2(char cla, char ins, char p1, char p2, int32_t le,
                               CommandApdu* cmdApdu) {
+  if ((le > MAX_EXT_RSP_APDU_DATA_LENGTH) || (le < 0)) {
+    return -1;
+  }
+
   cmdApdu->cla = cla;
   cmdApdu->ins = ins;
   cmdApdu->p1 = p1;
   cmdApdu->p2 = p2;
   cmdApdu->le = le;
   cmdApdu->lc = 0;
+  cmdApdu->data = NULL;
+
+  return CommandApdu_getSize(cmdApdu);
+}
+
+/*******************************************************************************
+**
+** Function        CommandApdu_writeSelect
+**
+** Description     Writes a SELECT by AID, with Le = 0, in the buffer the APDU
+**                 is sent from. Without AID, the Lc field is omitted: the
+**                 default applet is selected.
+**
+** Parameters      cla       - class byte.
+**                 p2        - P2 requested by the client.
+**                 aid       - AID to select.
+**                 aidLength - length of the AID.
+**                 buffer    - where to write the APDU.
+**
+** Returns         -1 if error, the size of the APDU otherwise
+**
+*******************************************************************************/
+int CommandApdu_writeSelect(uint8_t cla, uint8_t p2, const uint8_t* aid,
+                            size_t aidLength, uint8_t* buffer) {
+  if ((aidLength > MAX_CMD_APDU_DATA_LENGTH) ||
+      ((aidLength > 0) && (aid == NULL))) {
+    return -1;
+  }
 
-  return CommandApdu_getSize(*cmdApdu);
+  buffer[0] = cla;
+  buffer[1] = CMD_APDU_INS_SELECT;
+  buffer[2] = CMD_APDU_P1_SELECT_BY_AID;
+  buffer[3] = p2;
+  // Lc = 0 is not a valid encoding: no data means no Lc.
+  if (aidLength == 0) {
+    buffer[4] = 0x00;  // Le
+    return 5;
+  }
+  buffer[4] = (uint8_t)aidLength;
+  memcpy(buffer + 5, aid, aidLength);
+  buffer[5 + aidLength] = 0x00;  // Le
+  return 6 + aidLength;
 }
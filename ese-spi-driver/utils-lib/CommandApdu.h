@@ -20,34 +20,136 @@
 #ifndef COMMANDAPDU_H_
 #define COMMANDAPDU_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define MAX_CMD_APDU_DATA_LENGTH 255
+#define MAX_RSP_APDU_DATA_LENGTH 256
+#define MAX_EXT_CMD_APDU_DATA_LENGTH 65535
+#define MAX_EXT_RSP_APDU_DATA_LENGTH 65536
+
+// Header + extended Lc (3 bytes) + extended Le (2 bytes)
+#define MAX_EXT_CMD_APDU_LENGTH (4 + 3 + MAX_EXT_CMD_APDU_DATA_LENGTH + 2)
+
+// Value of le when no response data is expected (no Le field)
+#define CMD_APDU_NO_LE -1
+
+// Commands the HALs send on their own
+#define CMD_APDU_INS_MANAGE_CHANNEL 0x70
+#define CMD_APDU_INS_SELECT 0xA4
+#define CMD_APDU_INS_GET_RESPONSE 0xC0
+#define CMD_APDU_P1_MANAGE_CHANNEL_OPEN 0x00
+#define CMD_APDU_P1_MANAGE_CHANNEL_CLOSE 0x80
+#define CMD_APDU_P1_SELECT_BY_AID 0x04
+
+// Longest SELECT by AID: header, Lc, AID and Le
+#define CMD_APDU_SELECT_MAX_LENGTH (4 + 1 + MAX_CMD_APDU_DATA_LENGTH + 1)
 
 typedef struct CommandApdu {
   char cla;
   char ins;
   char p1;
   char p2;
-  char lc;
-  char data[MAX_CMD_APDU_DATA_LENGTH];
-  char le;
+  uint16_t lc;
+  char* data; /* not copied, must stay valid until the APDU is serialized */
+  int32_t le; /* 0 to MAX_EXT_RSP_APDU_DATA_LENGTH, or CMD_APDU_NO_LE */
 } CommandApdu;
 
+// Command APDU of a fixed size, sent as it is. Formed at compile time when
+// the arguments are constants.
+template <int length>
+struct FixedCommandApdu {
+  uint8_t bytes[length];
+};
+
+/**
+ * Forms a MANAGE CHANNEL open, on the basic channel: the eSE chooses the
+ * channel and returns its number.
+ * @return The APDU
+ */
+constexpr FixedCommandApdu<5> CommandApdu_manageChannelOpen() {
+  return {{0x00, CMD_APDU_INS_MANAGE_CHANNEL, CMD_APDU_P1_MANAGE_CHANNEL_OPEN,
+           0x00, 0x01}};
+}
+
+/**
+ * Forms a MANAGE CHANNEL close, sent on the channel to close. It keeps the
+ * trailing 0x00 the HALs always sent.
+ * @param channel Channel to close, 1 to 3
+ * @return The APDU
+ */
+constexpr FixedCommandApdu<5> CommandApdu_manageChannelClose(uint8_t channel) {
+  return {{channel, CMD_APDU_INS_MANAGE_CHANNEL,
+           CMD_APDU_P1_MANAGE_CHANNEL_CLOSE, channel, 0x00}};
+}
+
+/**
+ * Forms a GET RESPONSE, short encoding.
+ * @param cla
+ * @param le 1 to MAX_RSP_APDU_DATA_LENGTH
+ * @return The APDU
+ */
+constexpr FixedCommandApdu<5> CommandApdu_getResponse(uint8_t cla,
+                                                      uint16_t le) {
+  // 256 is encoded as 0
+  return {{cla, CMD_APDU_INS_GET_RESPONSE, 0x00, 0x00, (uint8_t)le}};
+}
+
+/**
+ * Forms a GET RESPONSE, extended encoding.
+ * @param cla
+ * @param le 1 to MAX_EXT_RSP_APDU_DATA_LENGTH
+ * @return The APDU
+ */
+constexpr FixedCommandApdu<7> CommandApdu_getResponseExtended(uint8_t cla,
+                                                              uint32_t le) {
+  // 65536 is encoded as 0
+  return {{cla, CMD_APDU_INS_GET_RESPONSE, 0x00, 0x00, 0x00,
+           (uint8_t)(le >> 8), (uint8_t)le}};
+}
+
+/**
+ * Writes a SELECT by AID, with Le = 0, right into the buffer the APDU is
+ * sent from. An empty AID selects the default applet: the APDU has no Lc.
+ * @param cla
+ * @param p2 P2 requested by the client
+ * @param aid
+ * @param aidLength Up to MAX_CMD_APDU_DATA_LENGTH, 0 for the default applet
+ * @param buffer At least 6 + aidLength bytes long, CMD_APDU_SELECT_MAX_LENGTH
+ *        for any AID
+ * @return -1 if error, the size of the APDU otherwise
+ */
+int CommandApdu_writeSelect(uint8_t cla, uint8_t p2, const uint8_t* aid,
+                            size_t aidLength, uint8_t* buffer);
+
 /**
- * Transforms a CommandApdu into a byte array.
+ * Transforms a CommandApdu into a byte array. The short encoding is used
+ * unless lc or le do not fit in it, in which case both Lc and Le use the
+ * extended encoding (ISO 7816-4).
  *
  * @param cmdApdu:Apdu Structure (input)
- * @param CommandApduArray: Array of bytes (output)
+ * @param CommandApduArray: Array of bytes (output), at least
+ *        CommandApdu_getSize(cmdApdu) bytes long
  *
- * @return size of CommandApduArray
+ * @return size of CommandApduArray, -1 if error
  */
-int CommandApdu_toByteArray(CommandApdu cmdApdu, char* CommandApduArray);
+int CommandApdu_toByteArray(const CommandApdu* cmdApdu,
+                            uint8_t* CommandApduArray);
 
 /**
  * Get the size of a CommandApdu structure
  * @param comdApdu: Apdu Structure to get the size
  * @return Size of the CommandApdu
  */
-int CommandApdu_getSize(CommandApdu cmdApdu);
+int CommandApdu_getSize(const CommandApdu* cmdApdu);
+
+/**
+ * Tells if the APDU needs the extended length encoding.
+ * @param cmdApdu: Apdu Structure
+ * @return true if lc or le do not fit in the short encoding
+ */
+bool CommandApdu_isExtended(const CommandApdu* cmdApdu);
 
 /**
  * Forms an APDU
@@ -55,14 +157,15 @@ int CommandApdu_getSize(CommandApdu cmdApdu);
  * @param ins
  * @param p1
  * @param p2
- * @param cmdDataSize
- * @param cmdData
- * @param le
+ * @param lc Up to MAX_EXT_CMD_APDU_DATA_LENGTH
+ * @param cmdData Referenced by the APDU, not copied
+ * @param le Up to MAX_EXT_RSP_APDU_DATA_LENGTH, or CMD_APDU_NO_LE
  * @param cmdApdu
- * @return -1 if error 0 if ok
+ * @return -1 if error, the size of the APDU otherwise
  */
-int CommandApdu_formApduType4(char cla, char ins, char p1, char p2, char lc,
-                              char* cmdData, char le, CommandApdu* cmdApdu);
+int CommandApdu_formApduType4(char cla, char ins, char p1, char p2,
+                              uint16_t lc, char* cmdData, int32_t le,
+                              CommandApdu* cmdApdu);
 
 /**
  * Forms an APDU
@@ -70,11 +173,11 @@ int CommandApdu_formApduType4(char cla, char ins, char p1, char p2, char lc,
  * @param ins
  * @param p1
  * @param p2
- * @param le
+ * @param le Up to MAX_EXT_RSP_APDU_DATA_LENGTH
  * @param cmdApdu
- * @return -1 if error 0 if ok
+ * @return -1 if error, the size of the APDU otherwise
  */
-int CommandApdu_formApduType2(char cla, char ins, char p1, char p2, char le,
+int CommandApdu_formApduType2(char cla, char ins, char p1, char p2, int32_t le,
                               CommandApdu* cmdApdu);
 
 #endif /* COMMANDAPDU_H_ */
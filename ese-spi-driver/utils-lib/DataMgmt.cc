@@ -21,13 +21,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include "Atp.h"
+#include "Tpdu.h"
 #include "android_logmsg.h"
 
 static TpduRecvBuff_List_t *head = NULL, *current = NULL;
-static uint16_t total_len = 0;
+static uint32_t total_len = 0;
 
 static int DataMgmt_DeletList(TpduRecvBuff_List_t* head);
-static int DataMgmt_GetDataFromList(uint16_t* data_len, uint8_t* pbuff);
+static int DataMgmt_GetDataFromList(uint32_t* data_len, uint8_t* pbuff);
 /******************************************************************************
  * Function         DataMgmt_GetData
  *
@@ -36,12 +37,12 @@ static int DataMgmt_GetDataFromList(uint16_t* data_len, uint8_t* pbuff);
  * Returns          On Success ESESTATUS_SUCCESS else proper error code
  *
  ******************************************************************************/
-int DataMgmt_GetData(uint16_t* data_len, uint8_t** pbuffer) {
-  uint16_t total_data_len = 0;
+int DataMgmt_GetData(uint32_t* data_len, uint8_t** pbuffer) {
+  uint32_t total_data_len = 0;
   uint8_t* pbuff = NULL;
 
   if (total_len == 0) {
-    STLOG_HAL_E("%s total_len = %d", __FUNCTION__, total_len);
+    STLOG_HAL_E("%s total_len = %u", __FUNCTION__, total_len);
     return -1;
   }
   pbuff = (uint8_t*)malloc(total_len);
@@ -56,7 +57,7 @@ int DataMgmt_GetData(uint16_t* data_len, uint8_t** pbuffer) {
     return -1;
   }
   if (total_data_len != total_len) {
-    STLOG_HAL_E("%s Mismatch of len total_data_len %d total_len %d",
+    STLOG_HAL_E("%s Mismatch of len total_data_len %u total_len %u",
                 __FUNCTION__, total_data_len, total_len);
     free(pbuff);
     return -1;
@@ -83,7 +84,7 @@ int DataMgmt_GetData(uint16_t* data_len, uint8_t** pbuffer) {
 int DataMgmt_StoreDataInList(uint16_t data_len, uint8_t* pbuff) {
   TpduRecvBuff_List_t* newNode = NULL;
 
-  if (data_len > ATP.ifsc) {
+  if (data_len > TPDU_MAX_DATA_LENGTH) {
     return -1;
   }
   newNode = (TpduRecvBuff_List_t*)malloc(sizeof(TpduRecvBuff_List_t));
@@ -92,11 +93,6 @@ int DataMgmt_StoreDataInList(uint16_t data_len, uint8_t* pbuff) {
   }
   newNode->pNext = NULL;
   newNode->tData.len = data_len;
-  newNode->tData.data = (uint8_t*)malloc(ATP.ifsc * sizeof(uint8_t));
-  if (newNode->tData.data == NULL) {
-    free(newNode);
-    return -1;
-  }
   memcpy(newNode->tData.data, pbuff, data_len);
 
   total_len += data_len;
@@ -110,6 +106,19 @@ int DataMgmt_StoreDataInList(uint16_t data_len, uint8_t* pbuff) {
   return 0;
 }
 
+/******************************************************************************
+ * Function         DataMgmt_Flush
+ * Description      This function drops the data stored so far, e.g. when the
+ *                  exchange of a chained response is aborted
+ * Returns          None
+ ******************************************************************************/
+void DataMgmt_Flush() {
+  DataMgmt_DeletList(head);
+  total_len = 0;
+  head = NULL;
+  current = NULL;
+}
+
 /******************************************************************************
  * Function         DataMgmt_GetDataFromList
  *
@@ -118,16 +127,16 @@ int DataMgmt_StoreDataInList(uint16_t data_len, uint8_t* pbuff) {
  * Returns          On Success ESESTATUS_SUCCESS else proper error code
  *
  ******************************************************************************/
-static int DataMgmt_GetDataFromList(uint16_t* data_len, uint8_t* pbuff) {
+static int DataMgmt_GetDataFromList(uint32_t* data_len, uint8_t* pbuff) {
   TpduRecvBuff_List_t* new_node;
-  uint16_t offset = 0;
+  uint32_t offset = 0;
   if (head == NULL || pbuff == NULL) {
     return -1;
   }
 
   new_node = head;
   while (new_node != NULL) {
-    if (new_node->tData.len > ATP.ifsc) {
+    if (new_node->tData.len > TPDU_MAX_DATA_LENGTH) {
       return -1;
     }
     memcpy((pbuff + offset), new_node->tData.data, new_node->tData.len);
@@ -156,8 +165,6 @@ static int DataMgmt_DeletList(TpduRecvBuff_List_t* head) {
 
   while (current != NULL) {
     next = current->pNext;
-    free(current->tData.data);
-    current->tData.data = NULL;
     free(current);
     current = NULL;
     current = next;
@@ -27,7 +27,8 @@ typedef struct TpduRecvBuff_List {
   struct TpduRecvBuff_List* pNext;
 } TpduRecvBuff_List_t;
 
-int DataMgmt_GetData(uint16_t* data_len, uint8_t** pbuff);
+int DataMgmt_GetData(uint32_t* data_len, uint8_t** pbuff);
 int DataMgmt_StoreDataInList(uint16_t data_len, uint8_t* pbuff);
+void DataMgmt_Flush();
 
 #endif /* _DATAMGMT_H_ */
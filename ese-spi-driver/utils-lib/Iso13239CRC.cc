@@ -22,35 +22,64 @@
 
 /*******************************************************************************
 **
-** Function      computeCrc
+** Function      Iso13239CRC_compute
 **
-** Description   Computes the 16-bit CRC of the specified function.
+** Description   Computes the 16-bit CRC of the specified data.
 **
 ** Parameters    data - data to compute the CRC over.
 **               len  - data length.
 **
-** Returns       CRC of the data. -1 if something went wrong.
+** Returns       CRC of the data.
 **
 *******************************************************************************/
-uint16_t computeCrc(uint8_t *data, int len) {
+static uint16_t Iso13239CRC_compute(const uint8_t *data, int len) {
   uint16_t tempCrc;
 
   tempCrc = (unsigned short)CRC_PRESET;
 
-  int i, k;
+  int i;
   for (i = 0; i < len; i++) {
-    tempCrc = tempCrc ^ ((unsigned short)data[i]);
-    for (k = 0; k < 8; k++) {
-      if ((tempCrc & 0x0001) == 0x0001) {
-        tempCrc = (tempCrc >> 1) ^ CRC_POLYNOMIAL;
-      } else {
-        tempCrc = tempCrc >> 1;
-      }
-    }
+    tempCrc = updateCrc(tempCrc, data[i]);
   }
-  tempCrc = ~tempCrc;
+  return ~tempCrc;
+}
+
+/*******************************************************************************
+**
+** Function      computeCrc
+**
+** Description   Computes the 16-bit CRC of the specified function.
+**
+** Parameters    data - data to compute the CRC over.
+**               len  - data length.
+**
+** Returns       CRC of the data. -1 if something went wrong.
+**
+*******************************************************************************/
+uint16_t computeCrc(uint8_t *data, int len) {
+  uint16_t tempCrc = Iso13239CRC_compute(data, len);
+
   data[len] = (uint8_t)tempCrc;
   data[len + 1] = (uint8_t)(tempCrc >> 8);
 
   return tempCrc;
 }
+
+/*******************************************************************************
+**
+** Function      isCrcOk
+**
+** Description   Checks the 16-bit CRC stored right after the data.
+**
+** Parameters    data - data the CRC was computed over, followed by the CRC.
+**               len  - data length, CRC excluded.
+**
+** Returns       true if the CRC matches the data, false otherwise.
+**
+*******************************************************************************/
+bool isCrcOk(const uint8_t *data, int len) {
+  uint16_t tempCrc = Iso13239CRC_compute(data, len);
+
+  return (data[len] == (uint8_t)tempCrc) &&
+         (data[len + 1] == (uint8_t)(tempCrc >> 8));
+}
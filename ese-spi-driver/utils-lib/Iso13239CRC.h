@@ -23,12 +23,30 @@
 #define CRC_PRESET 0xFFFF
 #define CRC_POLYNOMIAL 0x8408
 
+#include <stdbool.h>
 #include <stdint.h>
 
 //************************************ Structs *********************************
 
 //************************************ Functions *******************************
 
+/**
+ * Updates the 16-bit CRC with one more byte. Usable at compile time, to get
+ * frames with their CRC already computed.
+ *
+ * @param crc The CRC of the previous bytes, CRC_PRESET for the first one.
+ * @param byte The byte.
+ *
+ * @return The updated CRC, still to be inverted once all the bytes are in.
+ */
+constexpr uint16_t updateCrc(uint16_t crc, uint8_t byte) {
+  crc ^= byte;
+  for (int k = 0; k < 8; k++) {
+    crc = ((crc & 0x0001) == 0x0001) ? (crc >> 1) ^ CRC_POLYNOMIAL : crc >> 1;
+  }
+  return crc;
+}
+
 /**
  * Computes the 16-bit CRC of the specified function.
  *
@@ -39,4 +57,15 @@
  */
 uint16_t computeCrc(uint8_t *data, int len);
 
+/**
+ * Checks the 16-bit CRC stored right after the data, as computeCrc() stores
+ * it. Nothing is written.
+ *
+ * @param data The data the CRC was computed over, followed by the CRC.
+ * @param len The length of the data, CRC excluded.
+ *
+ * @return true if the CRC matches the data, false otherwise.
+ */
+bool isCrcOk(const uint8_t *data, int len);
+
 #endif /* ISO13239CRC_H_ */
@@ -0,0 +1,92 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#include "Iso7816LRC.h"
+#include <string.h>
+
+//************************************ Functions *******************************
+
+/*******************************************************************************
+**
+** Function      Iso7816LRC_compute
+**
+** Description   Computes the LRC of the specified data, a word at a time:
+**               the words are XORed together, then the bytes of the result
+**               and the bytes left over.
+**
+** Parameters    data - data to compute the LRC over.
+**               len  - data length.
+**
+** Returns       LRC of the data.
+**
+*******************************************************************************/
+static uint8_t Iso7816LRC_compute(const uint8_t *data, int len) {
+  uint64_t word;
+  uint64_t acc = 0;
+  int i = 0;
+
+  // memcpy() leaves the alignment of the data to the compiler.
+  for (; i + (int)sizeof(word) <= len; i += sizeof(word)) {
+    memcpy(&word, data + i, sizeof(word));
+    acc ^= word;
+  }
+  acc ^= acc >> 32;
+  acc ^= acc >> 16;
+  acc ^= acc >> 8;
+
+  uint8_t lrc = (uint8_t)acc;
+  for (; i < len; i++) {
+    lrc = updateLrc(lrc, data[i]);
+  }
+  return lrc;
+}
+
+/*******************************************************************************
+**
+** Function      computeLrc
+**
+** Description   Computes the LRC of the specified data, and stores it right
+**               after them.
+**
+** Parameters    data - data to compute the LRC over.
+**               len  - data length.
+**
+** Returns       LRC of the data.
+**
+*******************************************************************************/
+uint8_t computeLrc(uint8_t *data, int len) {
+  data[len] = Iso7816LRC_compute(data, len);
+  return data[len];
+}
+
+/*******************************************************************************
+**
+** Function      isLrcOk
+**
+** Description   Checks the LRC stored right after the data.
+**
+** Parameters    data - data the LRC was computed over, followed by the LRC.
+**               len  - data length, LRC excluded.
+**
+** Returns       true if the LRC matches the data, false otherwise.
+**
+*******************************************************************************/
+bool isLrcOk(const uint8_t *data, int len) {
+  // The LRC of the data and their LRC is 0.
+  return Iso7816LRC_compute(data, len + 1) == 0;
+}
@@ -0,0 +1,60 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#ifndef ISO7816LRC_H_
+#define ISO7816LRC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//************************************ Functions *******************************
+
+/**
+ * Updates the LRC with one more byte. Usable at compile time, to get frames
+ * with their LRC already computed.
+ *
+ * @param lrc The LRC of the previous bytes, 0 for the first one.
+ * @param byte The byte.
+ *
+ * @return The updated LRC.
+ */
+constexpr uint8_t updateLrc(uint8_t lrc, uint8_t byte) { return lrc ^ byte; }
+
+/**
+ * Computes the LRC (exclusive-or of all the bytes) of the data, and stores
+ * it right after them.
+ *
+ * @param data The data to compute the LRC over.
+ * @param len The length of the data.
+ *
+ * @return The LRC of the data.
+ */
+uint8_t computeLrc(uint8_t *data, int len);
+
+/**
+ * Checks the LRC stored right after the data, as computeLrc() stores it.
+ * Nothing is written.
+ *
+ * @param data The data the LRC was computed over, followed by the LRC.
+ * @param len The length of the data, LRC excluded.
+ *
+ * @return true if the LRC matches the data, false otherwise.
+ */
+bool isLrcOk(const uint8_t *data, int len);
+
+#endif /* ISO7816LRC_H_ */
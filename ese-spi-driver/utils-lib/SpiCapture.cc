@@ -0,0 +1,119 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-SpiCapture"
+#include "SpiCapture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "android_logmsg.h"
+
+// Only accessed by the thread owning the device, or at open/close time.
+static FILE *captureFile = NULL;
+
+/*******************************************************************************
+**
+** Function        SpiCapture_start
+**
+** Description     Starts capturing the SPI accesses to a file.
+**
+** Parameters      path - the file to create.
+**
+** Returns         0 if the capture started, -1 otherwise.
+**
+*******************************************************************************/
+int SpiCapture_start(const char *path) {
+  SpiCaptureFileHeader header;
+
+  SpiCapture_stop();
+  captureFile = fopen(path, "wbe");
+  if (captureFile == NULL) {
+    STLOG_HAL_E("%s : cannot create %s", __func__, path);
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.magic = SPI_CAPTURE_MAGIC;
+  header.version = SPI_CAPTURE_VERSION;
+  if (fwrite(&header, sizeof(header), 1, captureFile) != 1) {
+    STLOG_HAL_E("%s : cannot write %s", __func__, path);
+    SpiCapture_stop();
+    return -1;
+  }
+  STLOG_HAL_W("%s : capturing the SPI traffic to %s", __func__, path);
+  return 0;
+}
+
+/*******************************************************************************
+**
+** Function        SpiCapture_stop
+**
+** Description     Stops the capture and closes the file.
+**
+** Returns         void
+**
+*******************************************************************************/
+void SpiCapture_stop() {
+  if (captureFile != NULL) {
+    fclose(captureFile);
+    captureFile = NULL;
+  }
+}
+
+/*******************************************************************************
+**
+** Function        SpiCapture_record
+**
+** Description     Records a SPI access if a capture is running. The file is
+**                 flushed after each access so that a capture survives a
+**                 crash of the HAL.
+**
+** Parameters      type   - the kind of access.
+**                 data   - the bytes transferred.
+**                 length - the number of bytes requested.
+**                 result - the value returned by the driver.
+**
+** Returns         void
+**
+*******************************************************************************/
+void SpiCapture_record(SpiCaptureEventType type, const uint8_t *data,
+                       uint16_t length, int32_t result) {
+  SpiCaptureEvent event;
+  struct timespec ts;
+
+  if (captureFile == NULL) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  memset(&event, 0, sizeof(event));
+  event.timestampNs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  event.type = (uint8_t)type;
+  event.length = length;
+  event.result = result;
+
+  size_t dataLength = ((data != NULL) && (result > 0)) ? result : 0;
+  if ((fwrite(&event, sizeof(event), 1, captureFile) != 1) ||
+      (fwrite(data, 1, dataLength, captureFile) != dataLength) ||
+      (fflush(captureFile) != 0)) {
+    STLOG_HAL_E("%s : capture write failed, stopping it", __func__);
+    SpiCapture_stop();
+  }
+}
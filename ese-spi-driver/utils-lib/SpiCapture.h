@@ -0,0 +1,85 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+
+#ifndef SPICAPTURE_H_
+#define SPICAPTURE_H_
+
+//*********************************** Includes *********************************
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//************************************ Defines *********************************
+#define SPI_CAPTURE_MAGIC 0x43495053 /* "SPIC" */
+#define SPI_CAPTURE_VERSION 1
+
+//************************************ Structs *********************************
+typedef enum {
+  SPI_CAPTURE_READ = 0,
+  SPI_CAPTURE_WRITE = 1,
+  SPI_CAPTURE_RESET = 2,
+} SpiCaptureEventType;
+
+typedef struct {
+  uint32_t magic;   /* SPI_CAPTURE_MAGIC */
+  uint16_t version; /* SPI_CAPTURE_VERSION */
+  uint16_t reserved;
+} SpiCaptureFileHeader;
+
+/*
+ * One SPI access, followed in the file by the bytes transferred (result
+ * bytes if result > 0, none otherwise).
+ */
+typedef struct {
+  uint64_t timestampNs; /* CLOCK_MONOTONIC, end of the access */
+  uint8_t type;         /* SpiCaptureEventType */
+  uint8_t reserved;
+  uint16_t length; /* bytes requested */
+  int32_t result;  /* value returned by the driver */
+} SpiCaptureEvent;
+
+//************************************ Functions *******************************
+
+/**
+ * Starts capturing the SPI accesses to a file.
+ *
+ * @param path The file to create (or truncate).
+ *
+ * @return 0 if the capture started, -1 otherwise.
+ */
+int SpiCapture_start(const char *path);
+
+/**
+ * Stops the capture and closes the file.
+ */
+void SpiCapture_stop();
+
+/**
+ * Records a SPI access if a capture is running. Only a flag is checked
+ * otherwise.
+ *
+ * @param type The kind of access.
+ * @param data The bytes transferred.
+ * @param length The number of bytes requested.
+ * @param result The value returned by the driver.
+ */
+void SpiCapture_record(SpiCaptureEventType type, const uint8_t *data,
+                       uint16_t length, int32_t result);
+
+#endif /* SPICAPTURE_H_ */
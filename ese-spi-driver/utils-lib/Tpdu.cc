@@ -20,57 +20,176 @@
 #include "Tpdu.h"
 
 #include "Iso13239CRC.h"
+#include "Iso7816LRC.h"
+#include "Utils.h"
+
+// Frame codec for one EDC kind. The one of the ATP is picked once it is
+// parsed, so that the frames go through no checksum type branch.
+typedef struct {
+  uint8_t checksumLength;
+  uint16_t (*getChecksum)(const Tpdu *tpdu);
+  bool (*isChecksumOk)(const Tpdu *tpdu);
+  int (*setChecksum)(Tpdu *tpdu);
+} TpduCodec;
 
 /*******************************************************************************
 **
-** Function        Tpdu_toByteArray
+** Function        Tpdu_readChecksum
 **
-** Description     Forms a byte array representing the given TPDU.
+** Description     Gets the value of the EDC field of the TPDU.
 **
-** Parameters      structTpdu - TPDU struct to be converted to byte array.
-**                 baTpdu     - Memory position where to store the formed
-**                              byte array.
+** Parameters      tpdu - the TPDU.
 **
-** Returns        length of the formed array, -1 if there is an error.
+** Returns         checksum value
 **
 *******************************************************************************/
-uint16_t Tpdu_toByteArray(Tpdu *structTpdu, uint8_t *baTpdu) {
-  // NAD - Copy the nad into the nad array position
-  baTpdu[NAD_OFFSET_IN_TPDU] = structTpdu->nad;
+template <ChecksumType type>
+static uint16_t Tpdu_readChecksum(const Tpdu *tpdu);
 
-  // PCB - Copy the pcb into the pcb array position
-  baTpdu[PCB_OFFSET_IN_TPDU] = structTpdu->pcb;
+template <>
+uint16_t Tpdu_readChecksum<LRC>(const Tpdu *tpdu) {
+  return tpdu->data[tpdu->len];
+}
 
-  // Length - Copy the length into the length array position
-  baTpdu[LEN_OFFSET_IN_TPDU] = structTpdu->len;
+template <>
+uint16_t Tpdu_readChecksum<CRC>(const Tpdu *tpdu) {
+  return (uint16_t)(tpdu->data[tpdu->len + 1] << 8) | tpdu->data[tpdu->len];
+}
 
-  // Data - Copy the data into the data array position
-  uint8_t i;
-  for (i = 0; i < structTpdu->len; i++) {
-    baTpdu[DATA_OFFSET_IN_TPDU + i] = structTpdu->data[i];
-  }
+/*******************************************************************************
+**
+** Function        Tpdu_checkChecksum
+**
+** Description     Checks the EDC field of the TPDU against its prologue and
+**                 INF fields.
+**
+** Parameters      tpdu - the TPDU.
+**
+** Returns         true if checksum is ok, false otherwise.
+**
+*******************************************************************************/
+template <ChecksumType type>
+static bool Tpdu_checkChecksum(const Tpdu *tpdu);
 
-  // Compute where the checksum shall be stored.
-  uint16_t checksumOffsetInTpdu = DATA_OFFSET_IN_TPDU + structTpdu->len;
+template <>
+bool Tpdu_checkChecksum<LRC>(const Tpdu *tpdu) {
+  return isLrcOk(Tpdu_getFrame(tpdu), TPDU_PROLOGUE_LENGTH + tpdu->len);
+}
 
-  uint16_t length;
-  uint8_t checksum[2];
-  switch (ATP.checksumType) {
-    case LRC:
-      Tpdu_getChecksumBytes(structTpdu, checksum);
-      baTpdu[checksumOffsetInTpdu] = checksum[0];
-      length = checksumOffsetInTpdu + 1;
-      break;
-    case CRC:
-    default:
-      Tpdu_getChecksumBytes(structTpdu, checksum);
-      baTpdu[checksumOffsetInTpdu] = checksum[0];
-      baTpdu[checksumOffsetInTpdu + 1] = checksum[1];
-      length = checksumOffsetInTpdu + 2;
-      break;
-  }
+template <>
+bool Tpdu_checkChecksum<CRC>(const Tpdu *tpdu) {
+  return isCrcOk(Tpdu_getFrame(tpdu), TPDU_PROLOGUE_LENGTH + tpdu->len);
+}
+
+/*******************************************************************************
+**
+** Function        Tpdu_writeChecksum
+**
+** Description     Computes the EDC field of the TPDU from its prologue and
+**                 INF fields, and stores it right after the INF field.
+**
+** Parameters      tpdu - the TPDU.
+**
+** Returns         0 if everything went ok, -1 otherwise.
+**
+*******************************************************************************/
+template <ChecksumType type>
+static int Tpdu_writeChecksum(Tpdu *tpdu);
+
+template <>
+int Tpdu_writeChecksum<LRC>(Tpdu *tpdu) {
+  computeLrc((uint8_t *)tpdu, TPDU_PROLOGUE_LENGTH + tpdu->len);
+  return 0;
+}
 
-  return length;
+template <>
+int Tpdu_writeChecksum<CRC>(Tpdu *tpdu) {
+  computeCrc((uint8_t *)tpdu, TPDU_PROLOGUE_LENGTH + tpdu->len);
+  return 0;
+}
+
+template <ChecksumType type>
+static constexpr TpduCodec Tpdu_makeCodec() {
+  return {(type == LRC) ? (uint8_t)TPDU_LRC_LENGTH : (uint8_t)TPDU_CRC_LENGTH,
+          Tpdu_readChecksum<type>, Tpdu_checkChecksum<type>,
+          Tpdu_writeChecksum<type>};
+}
+
+// Indexed by ChecksumType
+static_assert((LRC == 0) && (CRC == 1), "codecs indexed by ChecksumType");
+static constexpr TpduCodec codecs[] = {Tpdu_makeCodec<LRC>(),
+                                       Tpdu_makeCodec<CRC>()};
+// Codec of the EDC in use, CRC as the default ATP.
+static const TpduCodec *codec = &codecs[CRC];
+
+/*******************************************************************************
+**
+** Function        Tpdu_setChecksumType
+**
+** Description     Selects the frame codec of the EDC kind of the ATP.
+**
+** Parameters      type - checksum type of the ATP.
+**
+** Returns         void
+**
+*******************************************************************************/
+void Tpdu_setChecksumType(ChecksumType type) { codec = &codecs[type]; }
+
+/*******************************************************************************
+**
+** Function        Tpdu_getFrame
+**
+** Description     Gets the frame of the TPDU, as written to or read from the
+**                 SPI.
+**
+** Parameters      tpdu - the TPDU.
+**
+** Returns         first byte of the frame (the NAD).
+**
+*******************************************************************************/
+const uint8_t *Tpdu_getFrame(const Tpdu *tpdu) {
+  return (const uint8_t *)tpdu;
+}
+
+/*******************************************************************************
+**
+** Function        Tpdu_getFrameLength
+**
+** Description     Gets the length of the frame of the TPDU.
+**
+** Parameters      tpdu - the TPDU.
+**
+** Returns         length of the prologue, INF and EDC fields.
+**
+*******************************************************************************/
+uint16_t Tpdu_getFrameLength(const Tpdu *tpdu) {
+  return TPDU_PROLOGUE_LENGTH + tpdu->len + Tpdu_getChecksumLength();
+}
+
+/*******************************************************************************
+**
+** Function        Tpdu_getChecksumLength
+**
+** Description     Gets the length of the EDC field.
+**
+** Returns         TPDU_LRC_LENGTH or TPDU_CRC_LENGTH, according to the ATP.
+**
+*******************************************************************************/
+uint8_t Tpdu_getChecksumLength() { return codec->checksumLength; }
+
+/*******************************************************************************
+**
+** Function        Tpdu_getChecksum
+**
+** Description     Gets the value of the EDC field of the TPDU.
+**
+** Parameters      tpdu - the TPDU.
+**
+** Returns         checksum value
+**
+*******************************************************************************/
+uint16_t Tpdu_getChecksum(const Tpdu *tpdu) {
+  return codec->getChecksum(tpdu);
 }
 
 /*******************************************************************************
@@ -84,21 +203,8 @@ uint16_t Tpdu_toByteArray(Tpdu *structTpdu, uint8_t *baTpdu) {
 ** Returns        true if checksum is ok, false otherwise.
 **
 *******************************************************************************/
-bool Tpdu_isChecksumOk(Tpdu *tpdu) {
-  switch (ATP.checksumType) {
-    case LRC:
-      // TODO: implement
-      return false;
-    case CRC:;
-      uint8_t buffer[TPDU_MAX_LENGTH];
-      Tpdu_toByteArray(tpdu, buffer);
-      if (tpdu->checksum ==
-          computeCrc(buffer, (TPDU_PROLOGUE_LENGTH + tpdu->len))) {
-        return true;
-      } else {
-        return false;
-      }
-  }
+bool Tpdu_isChecksumOk(const Tpdu *tpdu) {
+  return codec->isChecksumOk(tpdu);
 }
 
 /*******************************************************************************
@@ -116,10 +222,8 @@ bool Tpdu_isChecksumOk(Tpdu *tpdu) {
 ** Returns         0 if everything went ok, -1 otherwise.
 **
 *******************************************************************************/
-int Tpdu_formTpdu(uint8_t nad, uint8_t pcb, uint8_t len, uint8_t *data,
-                  Tpdu *tpdu) {
-  uint8_t i;
-
+int Tpdu_formTpdu(uint8_t nad, uint8_t pcb, uint8_t len,
+                  const uint8_t *data, Tpdu *tpdu) {
   if (len > TPDU_MAX_DATA_LENGTH) {
     return -1;
   }
@@ -130,81 +234,14 @@ int Tpdu_formTpdu(uint8_t nad, uint8_t pcb, uint8_t len, uint8_t *data,
   // Length - Copy the incoming len into the tpdu len
   tpdu->len = len;
 
-  // Data - Copy the incoming data into the tpdu data
-  // TODO: check if it will ever be overwritten
-  for (i = 0; i < len; i++) {
-    tpdu->data[i] = data[i];
+  // Data - Copy the incoming data into the tpdu data, unless it is already
+  // there (the INF field of a TPDU formed again).
+  if ((len > 0) && (data != tpdu->data)) {
+    memmove(tpdu->data, data, len);
   }
-  // tpdu->data = data;
   // Checksum - Calculate the checksum according to the prologue + data fields
-  // and copy into the tpdu checksum
-  switch (ATP.checksumType) {
-    case LRC:
-      // TODO: implement
-      return -1;
-    case CRC:
-      // Set temporally checksum to 0 to be able to convert the tpdu struct
-      // to an array
-      tpdu->checksum = 0;
-
-      // Create a buffer to store the tpdu to compute the CRC.
-      uint8_t buffer[TPDU_MAX_LENGTH];
-      Tpdu_toByteArray(tpdu, buffer);
-
-      // Calculate the crc
-      tpdu->checksum = computeCrc(buffer, (TPDU_PROLOGUE_LENGTH + tpdu->len));
-      break;
-  }
-
-  return 0;
-}
-
-/*******************************************************************************
-**
-** Function        Tpdu_getChecksumBytes
-**
-** Description     Get the checksum value in the form of a byte array.
-**
-** Parameters      tpdu          - TPDU from where to get the checksum value.
-**                 checksumBytes - mem postion whre to store the result.
-**
-** Returns         void
-**
-*******************************************************************************/
-void Tpdu_getChecksumBytes(Tpdu *tpdu, uint8_t *checksumBytes) {
-  switch (ATP.checksumType) {
-    case LRC:
-      checksumBytes[0] = (uint8_t)tpdu->checksum;
-      break;
-    case CRC:
-      checksumBytes[0] = (uint8_t)tpdu->checksum;
-      checksumBytes[1] = (uint8_t)(tpdu->checksum >> 8);
-      break;
-  }
-}
-
-/*******************************************************************************
-**
-** Function        Tpdu_getChecksumValue
-**
-** Description     Gets the value of the checksum stored in the array.
-**
-** Parameters      array          - array that contains the checksum.
-**                 checksumStartPosition
-**                 checksumType  -Checksum type (LRC or CRC)
-**
-** Returns         checksum value
-**
-*******************************************************************************/
-uint16_t Tpdu_getChecksumValue(uint8_t *array, int checksumStartPosition,
-                               ChecksumType checksumType) {
-  switch (checksumType) {
-    case LRC:
-      return (uint16_t)array[checksumStartPosition];
-    case CRC:
-      return (uint16_t)(array[checksumStartPosition + 1] << 8) |
-             array[checksumStartPosition];
-  }
+  // and store it right after the data
+  return codec->setChecksum(tpdu);
 }
 
 /*******************************************************************************
@@ -218,7 +255,7 @@ uint16_t Tpdu_getChecksumValue(uint8_t *array, int checksumStartPosition,
 ** Returns         TPDU type (I-Block, R-Block or S-Block)
 **
 *******************************************************************************/
-TpduType Tpdu_getType(Tpdu *tpdu) {
+TpduType Tpdu_getType(const Tpdu *tpdu) {
   if ((tpdu->pcb & 0x80) == 0x00) {
     return IBlock;
   } else if ((tpdu->pcb & 0xC0) == 0x80) {
@@ -240,17 +277,8 @@ TpduType Tpdu_getType(Tpdu *tpdu) {
 ** Returns         void
 **
 *******************************************************************************/
-void Tpdu_copy(Tpdu *dest, Tpdu *src) {
-  dest->checksum = src->checksum;
-  dest->len = src->len;
-  dest->nad = src->nad;
-  dest->pcb = src->pcb;
-  if (dest->data == NULL) {
-    dest->data = (uint8_t *)malloc(ATP.ifsc * sizeof(uint8_t));
-  }
-  if (((src->len) > 0) && ((src->len) < ATP.ifsc)) {
-    memcpy(dest->data, src->data, src->len);
-  }
+void Tpdu_copy(Tpdu *dest, const Tpdu *src) {
+  memcpy(dest, src, Tpdu_getFrameLength(src));
 }
 
 /*******************************************************************************
@@ -267,11 +295,7 @@ void Tpdu_copy(Tpdu *dest, Tpdu *src) {
 **
 *******************************************************************************/
 void Tpdu_toHexString(Tpdu *tpdu, uint8_t *hexStringBuffer) {
-  uint8_t buffer[tpdu->len + 5];
-  uint16_t length = Tpdu_toByteArray(tpdu, buffer);
-  char *ptr = (char *)hexStringBuffer;
-  int i;
-  for (i = 0; i < length; i++) {
-    ptr += sprintf(ptr, "%02X ", (char)buffer[i]);
-  }
+  Utils_charArrayToHexString((char *)Tpdu_getFrame(tpdu),
+                             Tpdu_getFrameLength(tpdu),
+                             (char *)hexStringBuffer);
 }
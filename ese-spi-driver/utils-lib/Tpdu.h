@@ -23,6 +23,7 @@
 //*********************************** Includes *********************************
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,14 +44,20 @@
 #define TPDU_LRC_LENGTH 1
 
 //************************************ Structs *********************************
-typedef struct {
+// A TPDU is kept in its on-wire layout: the struct is the frame written to or
+// read from the SPI, the EDC (LRC or CRC) follows the INF field in data.
+// There is room for any LEN read from the bus, the consistency checks reject
+// the ones over TPDU_MAX_DATA_LENGTH.
+typedef struct __attribute__((aligned(4))) {
   uint8_t nad;
   uint8_t pcb;
   uint8_t len;
-  uint8_t *data;
-  uint16_t checksum;
+  uint8_t data[UINT8_MAX + TPDU_CRC_LENGTH];
 } Tpdu;
 
+static_assert(offsetof(Tpdu, data) == DATA_OFFSET_IN_TPDU,
+              "Tpdu must have the on-wire layout");
+
 typedef enum { IBlock, RBlock, SBlock } TpduType;
 
 typedef enum { ErrorFree, ChecksumError, OtherErrors } RBlockType;
@@ -58,56 +65,70 @@ typedef enum { ErrorFree, ChecksumError, OtherErrors } RBlockType;
 //************************************ Functions *******************************
 
 /**
- * Forms a byte array representing the given TPDU.
- *
- * @param structTpdu The TPDU struct to be converted to byte array.
- * @param baTpdu The memory position where to store the formed byte array.
+ * Selects the frame codec of the EDC kind the ATP announces. The frames are
+ * then formed, read and checked with no checksum type branch.
  *
- * @return The length of the formed array
+ * @param type The checksum type of the ATP.
  */
-uint16_t Tpdu_toByteArray(Tpdu *structTpdu, uint8_t *baTpdu);
+void Tpdu_setChecksumType(ChecksumType type);
 
 /**
- * Checks that the checksum in the TPDU is as expected.
+ * Gets the frame of the TPDU, as written to or read from the SPI.
  *
- * @param tpdu The TPDU whose checksum needs to be checked.
+ * @param tpdu The TPDU.
  *
- * @return true if checksum is ok, false otherwise.
+ * @return The first byte of the frame (the NAD).
  */
-bool Tpdu_isChecksumOk(Tpdu *tpdu);
+const uint8_t *Tpdu_getFrame(const Tpdu *tpdu);
 
 /**
- * Forms a TPDU with the specified fields.
+ * Gets the length of the frame of the TPDU: prologue, INF and EDC fields.
  *
- * @param nad The NAD byte of the TPDU.
- * @param pac The PCB byte of the TPDU.
- * @param len The length of the data.
- * @param data The data of the TPDU.
- * @pram tpdu The memory position where the formed TPDU will be stored.
+ * @param tpdu The TPDU.
  *
- * @return 0 if everything went ok, -1 otherwise.
+ * @return The length of the frame.
  */
-int Tpdu_formTpdu(uint8_t nad, uint8_t pcb, uint8_t len, uint8_t *data,
-                  Tpdu *tpdu);
+uint16_t Tpdu_getFrameLength(const Tpdu *tpdu);
 
 /**
- * Returns the checksum value in the form of a byte array.
+ * Gets the length of the EDC field, according to the checksum type of the
+ * ATP.
  *
- * @param tpdu The TPDU struct from where to get the checksum value.
- * @param checksumBytes The memory position where to store the result.
+ * @return TPDU_LRC_LENGTH or TPDU_CRC_LENGTH.
  */
-void Tpdu_getChecksumBytes(Tpdu *tpdu, uint8_t *checksumBytes);
+uint8_t Tpdu_getChecksumLength();
 
 /**
- * Gets the value of the checksum stored in the array.
+ * Gets the value of the EDC field of the TPDU.
  *
- * @param array The array that contains the checksum.
- * @param checksumStartPosition The position where the checksum starts in array.
+ * @param tpdu The TPDU.
  *
  * @return The value of the checksum.
  */
-uint16_t Tpdu_getChecksumValue(uint8_t *array, int checksumStartPosition,
-                               ChecksumType checksumType);
+uint16_t Tpdu_getChecksum(const Tpdu *tpdu);
+
+/**
+ * Checks that the checksum in the TPDU is as expected.
+ *
+ * @param tpdu The TPDU whose checksum needs to be checked.
+ *
+ * @return true if checksum is ok, false otherwise.
+ */
+bool Tpdu_isChecksumOk(const Tpdu *tpdu);
+
+/**
+ * Forms a TPDU with the specified fields.
+ *
+ * @param nad The NAD byte of the TPDU.
+ * @param pac The PCB byte of the TPDU.
+ * @param len The length of the data.
+ * @param data The data of the TPDU, it may be the INF field of tpdu itself.
+ * @pram tpdu The memory position where the formed TPDU will be stored.
+ *
+ * @return 0 if everything went ok, -1 otherwise.
+ */
+int Tpdu_formTpdu(uint8_t nad, uint8_t pcb, uint8_t len,
+                  const uint8_t *data, Tpdu *tpdu);
 
 /**
  * Returns the type of the TPDU.
@@ -116,7 +137,7 @@ uint16_t Tpdu_getChecksumValue(uint8_t *array, int checksumStartPosition,
  *
  * @return The TPDU type of the tpdu.
  */
-TpduType Tpdu_getType(Tpdu *tpdu);
+TpduType Tpdu_getType(const Tpdu *tpdu);
 
 /**
  * Copy Tpdu Struct.
@@ -126,7 +147,7 @@ TpduType Tpdu_getType(Tpdu *tpdu);
  *
  * @return void
  */
-void Tpdu_copy(Tpdu *dest, Tpdu *src);
+void Tpdu_copy(Tpdu *dest, const Tpdu *src);
 
 /**
  * Converts a TPDU into a hex string.
@@ -0,0 +1,143 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+#define LOG_TAG "StEse-TpduTrace"
+#include "TpduTrace.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "BusCounters.h"
+#include "android_logmsg.h"
+
+static_assert((TPDU_TRACE_RECORDS & (TPDU_TRACE_RECORDS - 1)) == 0,
+              "TPDU_TRACE_RECORDS must be a power of 2");
+
+static TpduTraceRecord ring[TPDU_TRACE_RECORDS];
+// Record number held by each slot, 0 while the slot is being written.
+static std::atomic<uint32_t> slotSeq[TPDU_TRACE_RECORDS];
+static std::atomic<uint32_t> lastSeq(0);
+
+/*******************************************************************************
+**
+** Function        TpduTrace_record
+**
+** Description     Records a frame in the trace ring. Each writer reserves its
+**                 own slot, and publishes it once filled, so no lock is taken.
+**
+** Parameters      direction - TPDU_TRACE_TX or TPDU_TRACE_RX.
+**                 state     - state of the T=1 engine.
+**                 tpdu      - the frame.
+**
+** Returns         void
+**
+*******************************************************************************/
+void TpduTrace_record(TpduTraceDirection direction, uint8_t state,
+                      const Tpdu *tpdu) {
+  struct timespec ts;
+  uint32_t seq = lastSeq.fetch_add(1, std::memory_order_relaxed) + 1;
+  uint32_t slot = (seq - 1) & (TPDU_TRACE_RECORDS - 1);
+  TpduTraceRecord *record = &ring[slot];
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  slotSeq[slot].store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  record->seq = seq;
+  record->direction = (uint8_t)direction;
+  record->state = state;
+  record->nad = tpdu->nad;
+  record->pcb = tpdu->pcb;
+  record->timestampNs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  record->len = tpdu->len;
+  record->payloadLength = (tpdu->len < TPDU_TRACE_PAYLOAD_LENGTH)
+                              ? tpdu->len
+                              : TPDU_TRACE_PAYLOAD_LENGTH;
+  record->checksum = Tpdu_getChecksum(tpdu);
+  memcpy(record->payload, tpdu->data, record->payloadLength);
+
+  slotSeq[slot].store(seq, std::memory_order_release);
+}
+
+/*******************************************************************************
+**
+** Function        TpduTrace_dump
+**
+** Description     Writes the records of the ring, oldest first, to a file,
+**                 then the bus counters. Records being written while the dump
+**                 is done are skipped.
+**
+** Parameters      path - the file to create.
+**
+** Returns         Number of records written, -1 if an error occurred.
+**
+*******************************************************************************/
+int TpduTrace_dump(const char *path) {
+  TpduTraceRecord records[TPDU_TRACE_RECORDS];
+  TpduTraceFileHeader header;
+  uint64_t counters[BUS_COUNTER_COUNT];
+  uint32_t last = lastSeq.load(std::memory_order_acquire);
+  uint32_t first = (last > TPDU_TRACE_RECORDS) ? last - TPDU_TRACE_RECORDS : 0;
+  uint32_t count = 0;
+  uint32_t seq;
+
+  for (seq = first + 1; seq <= last; seq++) {
+    uint32_t slot = (seq - 1) & (TPDU_TRACE_RECORDS - 1);
+    if (slotSeq[slot].load(std::memory_order_acquire) != seq) {
+      continue;
+    }
+    memcpy(&records[count], &ring[slot], sizeof(TpduTraceRecord));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Overwritten while copied
+    if (slotSeq[slot].load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    count++;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    STLOG_HAL_E("%s : cannot create %s", __func__, path);
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.magic = TPDU_TRACE_MAGIC;
+  header.version = TPDU_TRACE_VERSION;
+  header.recordSize = sizeof(TpduTraceRecord);
+  header.recordCount = count;
+  header.counterCount = BUS_COUNTER_COUNT;
+  BusCounters_get(counters);
+
+  size_t size = count * sizeof(TpduTraceRecord);
+  if ((write(fd, &header, sizeof(header)) != sizeof(header)) ||
+      (write(fd, records, size) != (ssize_t)size) ||
+      (write(fd, counters, sizeof(counters)) != sizeof(counters))) {
+    STLOG_HAL_E("%s : cannot write %s", __func__, path);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  STLOG_HAL_D("%s : %u records written to %s", __func__, count, path);
+  return count;
+}
@@ -0,0 +1,90 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *
+ ******************************************************************************/
+
+#ifndef TPDUTRACE_H_
+#define TPDUTRACE_H_
+
+//*********************************** Includes *********************************
+
+#include <stdint.h>
+
+#include "Tpdu.h"
+
+//************************************ Defines *********************************
+// Number of frames kept, must be a power of 2.
+#define TPDU_TRACE_RECORDS 256
+// Number of INF bytes kept for each frame.
+#define TPDU_TRACE_PAYLOAD_LENGTH 16
+
+#define TPDU_TRACE_MAGIC 0x54445054 /* "TPDT" */
+#define TPDU_TRACE_VERSION 2
+
+//************************************ Structs *********************************
+typedef enum { TPDU_TRACE_TX = 0, TPDU_TRACE_RX = 1 } TpduTraceDirection;
+
+/*
+ * One frame of the trace. This is also the layout of the records in the dump
+ * file, read back by tools/tpdu_trace_decoder.
+ */
+typedef struct {
+  uint32_t seq;          /* record number, starting at 1 */
+  uint8_t direction;     /* TpduTraceDirection */
+  uint8_t state;         /* T1TProtocol_TransceiveState of the T=1 engine */
+  uint8_t nad;
+  uint8_t pcb;
+  uint64_t timestampNs;  /* CLOCK_MONOTONIC */
+  uint8_t len;           /* LEN field of the frame */
+  uint8_t payloadLength; /* INF bytes kept in payload */
+  uint16_t checksum;
+  uint8_t payload[TPDU_TRACE_PAYLOAD_LENGTH];
+  uint8_t reserved[4];
+} TpduTraceRecord;
+
+typedef struct {
+  uint32_t magic;        /* TPDU_TRACE_MAGIC */
+  uint16_t version;      /* TPDU_TRACE_VERSION */
+  uint16_t recordSize;   /* sizeof(TpduTraceRecord) */
+  uint32_t recordCount;  /* number of records following the header */
+  uint32_t counterCount; /* BusCounters (uint64_t) following the records */
+} TpduTraceFileHeader;
+
+//************************************ Functions *******************************
+
+/**
+ * Records a frame in the trace ring. Lock-free and cheap enough to be always
+ * on: the oldest records are overwritten.
+ *
+ * @param direction TPDU_TRACE_TX or TPDU_TRACE_RX.
+ * @param state State of the T=1 engine when the frame went through.
+ * @param tpdu The frame.
+ */
+void TpduTrace_record(TpduTraceDirection direction, uint8_t state,
+                      const Tpdu *tpdu);
+
+/**
+ * Writes the records of the ring, oldest first, to a file, followed by the
+ * bus counters.
+ *
+ * @param path The file to create (or truncate).
+ *
+ * @return The number of records written, -1 if the file could not be written.
+ */
+int TpduTrace_dump(const char *path);
+
+#endif /* TPDUTRACE_H_ */
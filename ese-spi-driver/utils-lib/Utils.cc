@@ -36,11 +36,15 @@
 **
 *******************************************************************************/
 int Utils_charArrayToHexString(char* array, int length, char* hexString) {
+  static const char hexDigits[] = "0123456789ABCDEF";
   char* ptr = hexString;
   int i;
   for (i = 0; i < length; i++) {
-    ptr += sprintf(ptr, "%02X ", array[i]);
+    *ptr++ = hexDigits[(uint8_t)array[i] >> 4];
+    *ptr++ = hexDigits[array[i] & 0x0F];
+    *ptr++ = ' ';
   }
+  *ptr = 0;
   return 0;
 }
 
@@ -60,6 +64,49 @@ int Utils_getElapsedTimeInMs(struct timeval t1, struct timeval t2) {
   return (t2.tv_sec - t1.tv_sec) * 1000 + (t2.tv_usec - t1.tv_usec) / 1000;
 }
 
+/*******************************************************************************
+**
+** Function        Utils_setDeadline
+**
+** Description     Computes the absolute deadline located timeoutMs after now.
+**
+** Parameters      deadline  - Output deadline.
+**                 timeoutMs - Timeout in ms.
+**
+** Returns         void
+**
+*******************************************************************************/
+void Utils_setDeadline(struct timeval* deadline, unsigned int timeoutMs) {
+  struct timeval timeout;
+  struct timeval now;
+
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_usec = (timeoutMs % 1000) * 1000;
+  gettimeofday(&now, 0);
+  timeradd(&now, &timeout, deadline);
+}
+
+/*******************************************************************************
+**
+** Function        Utils_isDeadlineExpired
+**
+** Description     Checks if the given deadline is expired.
+**
+** Parameters      deadline - The deadline to check, NULL if there is none.
+**
+** Returns         true if the deadline is expired, false otherwise.
+**
+*******************************************************************************/
+bool Utils_isDeadlineExpired(const struct timeval* deadline) {
+  struct timeval now;
+
+  if (deadline == NULL) {
+    return false;
+  }
+  gettimeofday(&now, 0);
+  return !timercmp(&now, deadline, <);
+}
+
 /*******************************************************************************
 **
 ** Function        Utils_printCurrentTime
@@ -19,6 +19,7 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <stdint.h>
 #include <sys/time.h>
 
 /**
@@ -44,6 +45,23 @@ char* convert(uint8_t* buf);
  */
 int Utils_getElapsedTimeInMs(struct timeval t1, struct timeval t2);
 
+/**
+ * Computes the absolute deadline located timeoutMs after now.
+ *
+ * @param deadline Out param where the deadline will be stored.
+ * @param timeoutMs The timeout in ms.
+ */
+void Utils_setDeadline(struct timeval* deadline, unsigned int timeoutMs);
+
+/**
+ * Checks if the given deadline is expired.
+ *
+ * @param deadline The deadline to check, NULL if there is no deadline.
+ *
+ * @return true if the deadline is expired, false otherwise.
+ */
+bool Utils_isDeadlineExpired(const struct timeval* deadline);
+
 /**
  * Prints current time to standard log.
  *
@@ -19,7 +19,6 @@
 #define LOG_TAG "StEse-logmsg"
 #include "android_logmsg.h"
 #include <ese_config.h>
-#include <stdio.h>
 
 void DispHal(const char* title, const void* data, size_t length);
 unsigned char hal_trace_level = STESE_TRACE_LEVEL_DEBUG;
@@ -54,12 +53,28 @@ unsigned char InitializeSTLogLevel() {
   return hal_trace_level;
 }
 
+/*******************************************************************************
+**
+** Function:        DispHal
+**
+** Description:     Dumps a buffer in hex, 32 bytes per line. Callers should
+**                  use STLOG_HAL_DUMP so that nothing is done below the debug
+**                  level.
+**
+** Returns:         None
+**
+*******************************************************************************/
 void DispHal(const char* title, const void* data, size_t length) {
-  uint8_t* d = (uint8_t*)data;
+  static const char hexDigits[] = "0123456789abcdef";
+  const uint8_t* d = (const uint8_t*)data;
   char line[100];
   size_t i, k;
   bool first_line = true;
 
+  if (!STLOG_HAL_ENABLED(STESE_TRACE_LEVEL_DEBUG)) {
+    return;
+  }
+
   line[0] = 0;
   if (length == 0) {
     STLOG_HAL_D("%s", title);
@@ -82,7 +97,10 @@ void DispHal(const char* title, const void* data, size_t length) {
       }
       line[k] = 0;
     }
-    sprintf(&line[k * 3], "%02x ", d[i]);
+    line[k * 3] = hexDigits[d[i] >> 4];
+    line[k * 3 + 1] = hexDigits[d[i] & 0x0F];
+    line[k * 3 + 2] = ' ';
+    line[k * 3 + 3] = 0;
   }
 
   if (first_line == true) {
@@ -43,26 +43,50 @@ extern int GetStrValue(const char* name, char* pValue, unsigned long l);
 #define STESE_TRACE_LEVEL_DEBUG 0x03
 #define STESE_TRACE_LEVEL_VERBOSE 0x04
 
+/* Highest trace level built in. Verbose traces are only compiled in
+ * debuggable builds (see Android.bp), they are stripped from release builds.
+ */
+#ifndef STESE_TRACE_LEVEL_MAX
+#ifdef STESE_DEBUGGABLE
+#define STESE_TRACE_LEVEL_MAX STESE_TRACE_LEVEL_VERBOSE
+#else
+#define STESE_TRACE_LEVEL_MAX STESE_TRACE_LEVEL_DEBUG
+#endif
+#endif
+
+/* True if the traces of the given level are output. Must be checked before
+ * anything is formatted so that nothing is evaluated below the active level.
+ */
+#define STLOG_HAL_ENABLED(level) \
+  ((STESE_TRACE_LEVEL_MAX >= (level)) && (hal_trace_level >= (level)))
+
 #define STLOG_HAL_V(...)                                \
   {                                                     \
-    if (hal_trace_level >= STESE_TRACE_LEVEL_VERBOSE)   \
+    if (STLOG_HAL_ENABLED(STESE_TRACE_LEVEL_VERBOSE))   \
       LOG_PRI(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__); \
   }
 #define STLOG_HAL_D(...)                                \
   {                                                     \
-    if (hal_trace_level >= STESE_TRACE_LEVEL_DEBUG)     \
+    if (STLOG_HAL_ENABLED(STESE_TRACE_LEVEL_DEBUG))     \
       LOG_PRI(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__); \
   }
 #define STLOG_HAL_W(...)                               \
   {                                                    \
-    if (hal_trace_level >= STESE_TRACE_LEVEL_WARNING)  \
+    if (STLOG_HAL_ENABLED(STESE_TRACE_LEVEL_WARNING))  \
       LOG_PRI(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__); \
   }
 #define STLOG_HAL_E(...)                                \
   {                                                     \
-    if (hal_trace_level >= STESE_TRACE_LEVEL_ERROR)     \
+    if (STLOG_HAL_ENABLED(STESE_TRACE_LEVEL_ERROR))     \
       LOG_PRI(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__); \
   }
+
+/* Hex dump of a buffer, skipped below the debug level */
+#define STLOG_HAL_DUMP(title, data, length)         \
+  {                                                 \
+    if (STLOG_HAL_ENABLED(STESE_TRACE_LEVEL_DEBUG)) \
+      DispHal(title, data, length);                 \
+  }
 /*******************************************************************************
 **
 ** Function:        InitializeSTLogLevel
@@ -49,6 +49,10 @@ std::string findConfigPath() {
 
 EseConfig::EseConfig() {
   string config_path = findConfigPath();
+#if !defined(__ANDROID__)
+  // The host tools and tests run without any file: the defaults apply.
+  if (config_path == "") return;
+#endif
   CHECK(config_path != "");
   config_.parseFromFile(config_path);
 }
@@ -28,6 +28,24 @@
  * ########################## */
 #define NAME_STESE_HAL_LOGLEVEL "STESE_HAL_LOGLEVEL"
 #define NAME_ST_ESE_DEV_NODE "ST_ESE_DEV_NODE"
+#define NAME_ST_ESE_HIGH_PRIORITY_CHANNELS "ST_ESE_HIGH_PRIORITY_CHANNELS"
+#define NAME_ST_ESE_LOW_PRIORITY_CHANNELS "ST_ESE_LOW_PRIORITY_CHANNELS"
+#define NAME_ST_ESE_STARVATION_LIMIT "ST_ESE_STARVATION_LIMIT"
+#define NAME_ST_ESE_IFSD "ST_ESE_IFSD"
+#define NAME_ST_ESE_TRACE_FILE "ST_ESE_TRACE_FILE"
+#define NAME_ST_ESE_SPI_CAPTURE_FILE "ST_ESE_SPI_CAPTURE_FILE"
+#define NAME_ST_ESE_FAULT_CRC_ERROR "ST_ESE_FAULT_CRC_ERROR"
+#define NAME_ST_ESE_FAULT_DROPPED_NAD "ST_ESE_FAULT_DROPPED_NAD"
+#define NAME_ST_ESE_FAULT_TRUNCATED_FRAME "ST_ESE_FAULT_TRUNCATED_FRAME"
+#define NAME_ST_ESE_FAULT_SPURIOUS_WTX "ST_ESE_FAULT_SPURIOUS_WTX"
+#define NAME_ST_ESE_FAULT_TIMEOUT "ST_ESE_FAULT_TIMEOUT"
+#define NAME_ST_ESE_FAULT_SEED "ST_ESE_FAULT_SEED"
+#define NAME_ST_ESE_STATE_JOURNAL "ST_ESE_STATE_JOURNAL"
+#define NAME_ST_ESE_LIVENESS_TTL_MS "ST_ESE_LIVENESS_TTL_MS"
+#define NAME_ST_ESE_BINDER_THREADS "ST_ESE_BINDER_THREADS"
+#define NAME_ST_ESE_SPI_MAX_FREQ_KHZ "ST_ESE_SPI_MAX_FREQ_KHZ"
+#define NAME_ST_ESE_SPI_POLL_FREQ_KHZ "ST_ESE_SPI_POLL_FREQ_KHZ"
+#define NAME_ST_ESE_SPI_ADAPTIVE_CLOCK "ST_ESE_SPI_ADAPTIVE_CLOCK"
 
 class EseConfig {
  public: